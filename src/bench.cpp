@@ -0,0 +1,729 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include "jit.hpp"
+
+// deterministic pseudo-random expression, so runs are comparable
+static std::string generate_expression(size_t length, uint32_t seed)
+{
+    static const char* names[] = {"a", "b", "counter", "x_1", "div", "mod"};
+    static const char* operators[] = {" + ", " - ", "*", " * "};
+
+    std::string result;
+    result.reserve(length + 64);
+
+    uint32_t state = seed;
+    auto next = [&state]()
+    {
+        state = state * 1664525u + 1013904223u;
+        return state >> 16;
+    };
+
+    while (result.size() < length)
+    {
+        if (next() % 4 == 0)
+            result += std::to_string(next());
+        else
+            result += names[next() % 6];
+
+        result += operators[next() % 4];
+    }
+    result += "1";
+
+    return result;
+}
+
+// one JSON object per line, so runs can be diffed and plotted
+static void report(const char* bench, const std::string& name,
+    const char* metric, double value, const char* unit)
+{
+    printf("{\"bench\": \"%s\", \"case\": \"%s\", \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}\n",
+        bench, name.c_str(), metric, value, unit);
+}
+
+template<typename Function>
+static double measure_seconds(Function&& function)
+{
+    auto start = std::chrono::steady_clock::now();
+    function();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(finish - start).count();
+}
+
+static void bench_tokenizers(const std::string& expression, size_t repeats)
+{
+    size_t tokenizerTokens = 0;
+    double tokenizerSeconds = measure_seconds([&]()
+    {
+        for (size_t i = 0; i < repeats; ++i)
+        {
+            std::stringstream in(expression);
+            Tokenizer tokenizer(in);
+            while (!(*tokenizer.AdvanceSkipSpace()).empty())
+                ++tokenizerTokens;
+        }
+    });
+
+    size_t lexerTokens = 0;
+    double lexerSeconds = measure_seconds([&]()
+    {
+        for (size_t i = 0; i < repeats; ++i)
+        {
+            Lexer lexer(expression);
+            while (lexer.Advance().Current().kind != TokenKind::End)
+                ++lexerTokens;
+        }
+    });
+
+    if (tokenizerTokens != lexerTokens)
+    {
+        fprintf(stderr, "Token count mismatch: %zu vs %zu\n",
+            tokenizerTokens, lexerTokens);
+        exit(1);
+    }
+
+    report("tokenizers", "tokenizer", "throughput", tokenizerTokens / tokenizerSeconds, "tokens/s");
+    report("tokenizers", "lexer", "throughput", lexerTokens / lexerSeconds, "tokens/s");
+}
+
+extern "C"
+{
+    // defined for every divisor, the same way the inlined divisions are
+    static int bench_div(int a, int b) { return b == 0 ? 0 : b == -1 ? -static_cast<unsigned>(a) : a / b; }
+    static int bench_mod(int a, int b) { return b == 0 || b == -1 ? 0 : a % b; }
+    static int bench_inc(int a) { return static_cast<unsigned>(a) + 1; }
+    static int bench_mix(int a, int b, int c) { return static_cast<unsigned>(a) * 3 + b - c; }
+    static int bench_sum6(int a, int b, int c, int d, int e, int f)
+    {
+        return static_cast<unsigned>(a) + b + c + d + e + f;
+    }
+}
+
+struct BenchFunction
+{
+    const char* name;
+    void* pointer;
+    uint32_t arity;
+    symbol_semantics_t semantics;
+};
+
+static const BenchFunction bench_functions[] = {
+    {"div", reinterpret_cast<void*>(&bench_div), 2, SYMBOL_DIV},
+    {"mod", reinterpret_cast<void*>(&bench_mod), 2, SYMBOL_MOD},
+    {"inc", reinterpret_cast<void*>(&bench_inc), 1, SYMBOL_PLAIN},
+    {"mix", reinterpret_cast<void*>(&bench_mix), 3, SYMBOL_PURE},
+    {"sum", reinterpret_cast<void*>(&bench_sum6), 6, SYMBOL_PLAIN}};
+static const size_t bench_function_count = sizeof(bench_functions) / sizeof(bench_functions[0]);
+
+static const char* bench_variables[] = {"a", "b", "c", "d", "x", "y"};
+static const size_t bench_variable_count = sizeof(bench_variables) / sizeof(bench_variables[0]);
+
+// depth bounds the nesting, width the operands of an operator chain;
+// the densities are the chances of a subtree stopping early at a leaf,
+// of a leaf being a literal and of an inner node being a call
+struct ExpressionShape
+{
+    const char* name;
+    uint32_t depth;
+    uint32_t width;
+    double leafDensity;
+    double literalDensity;
+    double callDensity;
+};
+
+static const ExpressionShape bench_shapes[] = {
+    {"balanced", 10, 2, 0.25, 0.3, 0.1},
+    {"deep", 48, 2, 0.45, 0.3, 0.05},
+    {"wide", 3, 16, 0.25, 0.3, 0.1},
+    {"literals", 10, 2, 0.25, 0.9, 0.0},
+    {"calls", 8, 3, 0.25, 0.2, 0.6}};
+
+// past this the remaining subtrees are all leaves
+static const size_t bench_max_expression = 1 << 14;
+
+class ShapedGenerator
+{
+    const ExpressionShape& shape_;
+    uint32_t state_;
+    std::string result_;
+
+    uint32_t next()
+    {
+        state_ = state_ * 1664525u + 1013904223u;
+        return state_ >> 8;
+    }
+
+    bool chance(double probability)
+    {
+        return (next() & 0xffff) < probability * 0x10000;
+    }
+
+    void leaf()
+    {
+        if (chance(shape_.literalDensity))
+            result_ += std::to_string(next() % 4 == 0 ? next() : next() % 100);
+        else
+            result_ += bench_variables[next() % bench_variable_count];
+    }
+
+    void node(uint32_t depth)
+    {
+        if (depth == 0 || result_.size() > bench_max_expression || chance(shape_.leafDensity))
+            return leaf();
+
+        if (chance(shape_.callDensity))
+        {
+            const BenchFunction& function = bench_functions[next() % bench_function_count];
+            result_ += function.name;
+            result_ += '(';
+            for (uint32_t i = 0; i < function.arity; ++i)
+            {
+                if (i != 0)
+                    result_ += ", ";
+                node(depth - 1);
+            }
+            result_ += ')';
+            return;
+        }
+
+        static const char* operators[] = {" + ", " - ", " * "};
+        uint32_t operands = 2 + next() % (shape_.width - 1);
+        result_ += '(';
+        for (uint32_t i = 0; i < operands; ++i)
+        {
+            if (i != 0)
+                result_ += operators[next() % 3];
+            if (next() % 8 == 0)
+                result_ += '-';
+            node(depth - 1);
+        }
+        result_ += ')';
+    }
+
+public:
+    ShapedGenerator(const ExpressionShape& shape, uint32_t seed)
+        : shape_(shape), state_(seed)
+    {
+
+    }
+
+    std::string Generate()
+    {
+        result_.clear();
+        node(shape_.depth);
+        return result_;
+    }
+};
+
+// the bench functions, then the bench variables kept in values, then the terminator
+static std::vector<symbol_t> bench_symbols(int* values)
+{
+    std::vector<symbol_t> symbols;
+    for (const BenchFunction& function : bench_functions)
+        symbols.push_back({function.name, function.pointer, function.semantics, nullptr});
+    for (size_t i = 0; i < bench_variable_count; ++i)
+        symbols.push_back({bench_variables[i], &values[i], SYMBOL_PLAIN, nullptr});
+    symbols.push_back({nullptr, nullptr, SYMBOL_PLAIN, nullptr});
+    return symbols;
+}
+
+// count expressions taking every shape in turn
+static std::vector<std::string> generate_mixed(uint32_t seed, size_t count)
+{
+    std::vector<ShapedGenerator> generators;
+    for (const ExpressionShape& shape : bench_shapes)
+        generators.emplace_back(shape, seed);
+
+    std::vector<std::string> texts;
+    for (size_t i = 0; i < count; ++i)
+        texts.push_back(generators[i % generators.size()].Generate());
+    return texts;
+}
+
+// walks the unoptimized tree with plain C++ arithmetic, which is what
+// the compiled code has to agree with
+static uint32_t evaluate_reference(const AST& tree, uint32_t current,
+    const std::vector<const int*>& variables, const std::vector<const BenchFunction*>& functions)
+{
+    const ASTNode& node = tree[current];
+    switch (node.kind)
+    {
+        case ASTKind::Literal:
+            return node.value;
+        case ASTKind::Variable:
+            return *variables[node.value];
+        case ASTKind::Negate:
+            return 0 - evaluate_reference(tree, node.left, variables, functions);
+        case ASTKind::Add:
+            return evaluate_reference(tree, node.left, variables, functions)
+                + evaluate_reference(tree, node.right, variables, functions);
+        case ASTKind::Sub:
+            return evaluate_reference(tree, node.left, variables, functions)
+                - evaluate_reference(tree, node.right, variables, functions);
+        case ASTKind::Mul:
+            return evaluate_reference(tree, node.left, variables, functions)
+                * evaluate_reference(tree, node.right, variables, functions);
+        case ASTKind::Call:
+            break;
+    }
+
+    int arguments[6];
+    const uint32_t* argumentNodes = tree.Arguments(node);
+    for (uint32_t i = 0; i < node.right; ++i)
+        arguments[i] = evaluate_reference(tree, argumentNodes[i], variables, functions);
+
+    const BenchFunction& function = *functions[node.value];
+    switch (function.arity)
+    {
+        case 1:
+            return reinterpret_cast<int (*)(int)>(function.pointer)(arguments[0]);
+        case 2:
+            return reinterpret_cast<int (*)(int, int)>(function.pointer)(arguments[0], arguments[1]);
+        case 3:
+            return reinterpret_cast<int (*)(int, int, int)>(function.pointer)(
+                arguments[0], arguments[1], arguments[2]);
+        default:
+            return reinterpret_cast<int (*)(int, int, int, int, int, int)>(function.pointer)(
+                arguments[0], arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+    }
+}
+
+// every phase timed on its own over the same expressions of each shape,
+// then the ARM and Thumb code sizes, and on ARM the generated code against
+// the reference
+static void bench_phases(uint32_t seed, size_t count, size_t runs)
+{
+    static int values[bench_variable_count];
+    std::vector<symbol_t> symbols = bench_symbols(values);
+    SymbolTable symtable(symbols.data());
+
+    for (const ExpressionShape& shape : bench_shapes)
+    {
+        ShapedGenerator generator(shape, seed);
+        std::vector<std::string> texts;
+        size_t characters = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            texts.push_back(generator.Generate());
+            characters += texts.back().size();
+        }
+
+        size_t tokens = 0;
+        double tokenizeSeconds = measure_seconds([&]()
+        {
+            for (const std::string& text : texts)
+            {
+                Lexer lexer(text);
+                while (lexer.Advance().Current().kind != TokenKind::End)
+                    ++tokens;
+            }
+        });
+
+        std::vector<AST> trees;
+        size_t parsedNodes = 0;
+        double parseSeconds = measure_seconds([&]()
+        {
+            for (const std::string& text : texts)
+            {
+                Lexer lexer(text);
+                Parser parser(lexer);
+                trees.push_back(parser.Parse(text.size()));
+                parsedNodes += trees.back().Size();
+            }
+        });
+        std::vector<AST> references = trees;
+
+        size_t nodes = 0;
+        double optimizeSeconds = measure_seconds([&]()
+        {
+            for (AST& tree : trees)
+            {
+                Optimizer optimizer;
+                optimizer.Optimize(tree);
+                nodes += tree.Size();
+            }
+        });
+
+        std::vector<uint8_t> code(1 << 22);
+        std::vector<std::vector<uint8_t>> compiled;
+        size_t bytes = 0;
+        size_t rewrites = 0;
+        double codegenSeconds = measure_seconds([&]()
+        {
+            for (AST& tree : trees)
+            {
+                CodeBuffer buffer(code.data(), code.size());
+                Compiler compiler(tree);
+                compiler.Compile(buffer, symtable);
+                compiled.emplace_back(code.data(), code.data() + buffer.Position());
+                bytes += buffer.Position();
+                rewrites += compiler.PeepholeRewrites().size();
+            }
+        });
+
+        std::vector<std::vector<uint8_t>> thumbCompiled;
+        size_t thumbBytes = 0;
+        for (AST& tree : trees)
+        {
+            CodeBuffer buffer(code.data(), code.size());
+            Compiler compiler(tree, InstructionSet::Thumb);
+            compiler.Compile(buffer, symtable);
+            thumbCompiled.emplace_back(code.data(), code.data() + buffer.Position());
+            thumbBytes += buffer.Position();
+        }
+
+        std::vector<std::vector<uint8_t>> a64Compiled;
+        size_t a64Bytes = 0;
+        for (AST& tree : trees)
+        {
+            CodeBuffer buffer(code.data(), code.size());
+            A64Compiler compiler(tree);
+            compiler.Compile(buffer, symtable);
+            a64Compiled.emplace_back(code.data(), code.data() + buffer.Position());
+            a64Bytes += buffer.Position();
+        }
+
+        std::string name = shape.name;
+        report("phases", name, "tokenize", characters / tokenizeSeconds, "bytes/s");
+        report("phases", name, "tokenize", tokens / tokenizeSeconds, "tokens/s");
+        report("phases", name, "parse", parsedNodes / parseSeconds, "nodes/s");
+        report("phases", name, "optimize", parsedNodes / optimizeSeconds, "nodes/s");
+        report("phases", name, "codegen", nodes / codegenSeconds, "nodes/s");
+        report("phases", name, "nodes", static_cast<double>(parsedNodes) / count, "nodes/expression");
+        report("phases", name, "code size", static_cast<double>(bytes) / nodes, "bytes/node");
+        report("phases", name, "peephole", static_cast<double>(rewrites) / count, "rewrites/expression");
+        report("phases", name, "thumb code size", static_cast<double>(thumbBytes) / nodes, "bytes/node");
+        report("phases", name, "thumb/arm size", static_cast<double>(thumbBytes) / bytes, "ratio");
+        report("phases", name, "a64 code size", static_cast<double>(a64Bytes) / nodes, "bytes/node");
+        report("phases", name, "a64/arm size", static_cast<double>(a64Bytes) / bytes, "ratio");
+
+        std::vector<std::vector<const int*>> variables;
+        std::vector<std::vector<const BenchFunction*>> functions;
+        for (const AST& tree : references)
+        {
+            variables.emplace_back(tree.SymbolCount(), nullptr);
+            functions.emplace_back(tree.SymbolCount(), nullptr);
+            for (uint32_t i = 0; i < tree.SymbolCount(); ++i)
+            {
+                for (size_t j = 0; j < bench_variable_count; ++j)
+                    if (tree.SymbolName(i) == bench_variables[j])
+                        variables.back()[i] = &values[j];
+                for (const BenchFunction& function : bench_functions)
+                    if (tree.SymbolName(i) == function.name)
+                        functions.back()[i] = &function;
+            }
+        }
+
+        uint32_t valueState = seed;
+        auto shuffle_values = [&]()
+        {
+            for (int& value : values)
+            {
+                valueState = valueState * 1664525u + 1013904223u;
+                value = static_cast<int32_t>(valueState) >> (valueState % 24);
+            }
+        };
+
+        valueState = seed;
+        uint32_t referenceChecksum = 0;
+        double referenceSeconds = measure_seconds([&]()
+        {
+            for (size_t r = 0; r < runs; ++r)
+            {
+                shuffle_values();
+                for (size_t i = 0; i < references.size(); ++i)
+                    referenceChecksum += evaluate_reference(references[i],
+                        references[i].Root(), variables[i], functions[i]) * (i + 1);
+            }
+        });
+        report("execution", name, "reference", runs * count / referenceSeconds, "runs/s");
+
+        std::vector<Bytecode> bytecodes;
+        for (const AST& tree : trees)
+            bytecodes.emplace_back(tree, symtable);
+
+        valueState = seed;
+        uint32_t interpreterChecksum = 0;
+        double interpreterSeconds = measure_seconds([&]()
+        {
+            for (size_t r = 0; r < runs; ++r)
+            {
+                shuffle_values();
+                for (size_t i = 0; i < bytecodes.size(); ++i)
+                    interpreterChecksum += bytecodes[i].Run() * (i + 1);
+            }
+        });
+
+        if (interpreterChecksum != referenceChecksum)
+        {
+            fprintf(stderr, "Interpreter result mismatch for %s\n", shape.name);
+            exit(1);
+        }
+
+        report("execution", name, "interpreter", runs * count / interpreterSeconds, "runs/s");
+
+#if defined(__arm__)
+        CodeHeap heap;
+        std::vector<int (*)()> natives;
+        for (const std::vector<uint8_t>& function : compiled)
+            natives.push_back(reinterpret_cast<int (*)()>(
+                heap.Install(function.data(), function.size())));
+
+        valueState = seed;
+        uint32_t nativeChecksum = 0;
+        double nativeSeconds = measure_seconds([&]()
+        {
+            for (size_t r = 0; r < runs; ++r)
+            {
+                shuffle_values();
+                for (size_t i = 0; i < natives.size(); ++i)
+                    nativeChecksum += natives[i]() * (i + 1);
+            }
+        });
+
+        if (nativeChecksum != referenceChecksum)
+        {
+            fprintf(stderr, "Native result mismatch for %s\n", shape.name);
+            exit(1);
+        }
+
+        report("execution", name, "native", runs * count / nativeSeconds, "runs/s");
+        report("execution", name, "speedup", referenceSeconds / nativeSeconds, "x");
+
+        std::vector<int (*)()> thumbNatives;
+        for (const std::vector<uint8_t>& function : thumbCompiled)
+            thumbNatives.push_back(reinterpret_cast<int (*)()>(
+                heap.InstallThumb(function.data(), function.size())));
+
+        valueState = seed;
+        uint32_t thumbChecksum = 0;
+        double thumbSeconds = measure_seconds([&]()
+        {
+            for (size_t r = 0; r < runs; ++r)
+            {
+                shuffle_values();
+                for (size_t i = 0; i < thumbNatives.size(); ++i)
+                    thumbChecksum += thumbNatives[i]() * (i + 1);
+            }
+        });
+
+        if (thumbChecksum != referenceChecksum)
+        {
+            fprintf(stderr, "Thumb result mismatch for %s\n", shape.name);
+            exit(1);
+        }
+
+        report("execution", name, "thumb native", runs * count / thumbSeconds, "runs/s");
+#endif
+
+#if defined(__aarch64__)
+        CodeHeap heap;
+        std::vector<int (*)()> natives;
+        for (const std::vector<uint8_t>& function : a64Compiled)
+            natives.push_back(reinterpret_cast<int (*)()>(
+                heap.Install(function.data(), function.size())));
+
+        valueState = seed;
+        uint32_t nativeChecksum = 0;
+        double nativeSeconds = measure_seconds([&]()
+        {
+            for (size_t r = 0; r < runs; ++r)
+            {
+                shuffle_values();
+                for (size_t i = 0; i < natives.size(); ++i)
+                    nativeChecksum += natives[i]() * (i + 1);
+            }
+        });
+
+        if (nativeChecksum != referenceChecksum)
+        {
+            fprintf(stderr, "A64 result mismatch for %s\n", shape.name);
+            exit(1);
+        }
+
+        report("execution", name, "a64 native", runs * count / nativeSeconds, "runs/s");
+        report("execution", name, "speedup", referenceSeconds / nativeSeconds, "x");
+#endif
+    }
+}
+
+// compiles the same set of expressions with 1, 2, 4... threads
+static void bench_parallel(uint32_t seed, size_t count)
+{
+    static int values[bench_variable_count];
+    std::vector<symbol_t> symbols = bench_symbols(values);
+
+    std::vector<std::string> texts = generate_mixed(seed, count);
+    std::vector<const char*> expressions;
+    for (const std::string& text : texts)
+        expressions.push_back(text.c_str());
+
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    double baseline = 0;
+    for (size_t threads = 1; ; threads = std::min(2 * threads, cores))
+    {
+        CodeHeap heap;
+        size_t failed = 0;
+        double seconds = measure_seconds([&]()
+        {
+            for (const CompileResult& result : CompileParallel(heap,
+                    expressions.data(), count, symbols.data(), threads))
+                failed += !result.ok;
+        });
+        if (threads == 1)
+            baseline = seconds;
+
+        std::string name = std::to_string(threads) + " threads";
+        report("parallel", name, "throughput", count / seconds, "expressions/s");
+        report("parallel", name, "speedup", baseline / seconds, "x");
+        report("parallel", name, "failed", failed, "expressions");
+
+        if (threads == cores)
+            break;
+    }
+}
+
+// what an expression costs to lower and to interpret, against compiling it,
+// which is roughly where tiering should promote it
+static void bench_interpreter(uint32_t seed, size_t count, size_t runs)
+{
+    static int values[bench_variable_count] = {1, 2, 3, 4, 5, 6};
+    std::vector<symbol_t> symbols = bench_symbols(values);
+    SymbolTable symtable(symbols.data());
+
+    std::vector<AST> trees;
+    for (const std::string& text : generate_mixed(seed, count))
+    {
+        Lexer lexer(text);
+        Parser parser(lexer);
+        trees.push_back(parser.Parse(text.size()));
+        Optimizer optimizer;
+        optimizer.Optimize(trees.back());
+    }
+
+    std::vector<Bytecode> bytecodes;
+    bytecodes.reserve(count);
+    double lowerSeconds = measure_seconds([&]()
+    {
+        for (const AST& tree : trees)
+            bytecodes.emplace_back(tree, symtable);
+    });
+
+    std::vector<uint32_t> code(1 << 16);
+    double compileSeconds = measure_seconds([&]()
+    {
+        for (AST& tree : trees)
+        {
+            CodeBuffer buffer(code.data(), code.size() * sizeof(uint32_t));
+            Compiler compiler(tree);
+            compiler.Compile(buffer, symtable);
+        }
+    });
+
+    int32_t checksum = 0;
+    double runSeconds = measure_seconds([&]()
+    {
+        for (size_t i = 0; i < runs; ++i)
+            for (const Bytecode& bytecode : bytecodes)
+                checksum += bytecode.Run();
+    });
+
+    double perRun = runSeconds / (runs * count);
+    report("interpreter", "mixed", "lowering", count / lowerSeconds, "expressions/s");
+    report("interpreter", "mixed", "compiling", count / compileSeconds, "expressions/s");
+    report("interpreter", "mixed", "running", 1 / perRun, "runs/s");
+    report("interpreter", "mixed", "break-even", (compileSeconds - lowerSeconds) / count / perRun, "runs");
+    report("interpreter", "mixed", "checksum", checksum, "");
+}
+
+#if defined(__arm__)
+// the same expression compiled as a function called once per row
+// and as a batch kernel over whole columns
+static void bench_batch(size_t rows, size_t repeats)
+{
+    static const char* expression = "a * b + c * 7 - (a - b) * (c + 3)";
+    static const char* parameters[] = {"a", "b", "c"};
+    const size_t size = 1 << 16;
+
+    uint8_t* code = static_cast<uint8_t*>(mmap(0, 2 * size,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (code == MAP_FAILED)
+    {
+        perror("Can't mmap: ");
+        exit(2);
+    }
+
+    uint8_t* scalarCode = code;
+    uint8_t* batchCode = code + size;
+    jit_compile_function_to_arm(expression, parameters, 3, nullptr, scalarCode, size);
+    jit_compile_batch_to_arm(expression, parameters, 3, nullptr, batchCode, size);
+    __builtin___clear_cache(reinterpret_cast<char*>(code),
+        reinterpret_cast<char*>(code + 2 * size));
+
+    typedef int (*scalar_t)(int, int, int);
+    typedef void (*batch_t)(const int* const*, int*, size_t);
+    scalar_t scalar = reinterpret_cast<scalar_t>(scalarCode);
+    batch_t batch = reinterpret_cast<batch_t>(batchCode);
+
+    std::vector<int> a(rows), b(rows), c(rows);
+    for (size_t i = 0; i < rows; ++i)
+    {
+        a[i] = static_cast<int>(i * 7919);
+        b[i] = static_cast<int>(rows - i);
+        c[i] = static_cast<int>(i ^ 0x5a5a);
+    }
+    const int* columns[] = {a.data(), b.data(), c.data()};
+    std::vector<int> scalarOut(rows), batchOut(rows);
+
+    double scalarSeconds = measure_seconds([&]()
+    {
+        for (size_t r = 0; r < repeats; ++r)
+            for (size_t i = 0; i < rows; ++i)
+                scalarOut[i] = scalar(a[i], b[i], c[i]);
+    });
+
+    double batchSeconds = measure_seconds([&]()
+    {
+        for (size_t r = 0; r < repeats; ++r)
+            batch(columns, batchOut.data(), rows);
+    });
+
+    if (scalarOut != batchOut)
+    {
+        fprintf(stderr, "Batch result mismatch\n");
+        exit(1);
+    }
+
+    report("batch", "scalar", "throughput", rows * repeats / scalarSeconds, "rows/s");
+    report("batch", "batch", "throughput", rows * repeats / batchSeconds, "rows/s");
+    report("batch", "batch", "speedup", scalarSeconds / batchSeconds, "x");
+
+    munmap(code, 2 * size);
+}
+#endif
+
+// bench [length [repeats [seed]]], the same seed gives the same expressions
+int main(int argc, char** argv)
+{
+    size_t length = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1 << 16;
+    size_t repeats = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+    uint32_t seed = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1;
+
+    std::string expression = generate_expression(length, seed);
+    bench_tokenizers(expression, repeats);
+    bench_phases(seed, 256, repeats);
+    bench_parallel(seed, 4096);
+    bench_interpreter(seed, 1024, repeats);
+#if defined(__arm__)
+    bench_batch(1 << 16, repeats);
+#endif
+
+    return 0;
+}
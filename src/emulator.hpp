@@ -0,0 +1,1504 @@
+#pragma once
+#ifndef EMULATOR_HPP
+#define EMULATOR_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// runs the code the compilers emit where it cannot run natively, for the
+// tests: only the ARM, NEON, Thumb-2 and A64 instructions the backends use
+// are known, and any other encoding, or one the architecture leaves
+// unpredictable, stops the run with an error. 32-bit code sees host
+// memory at the low 32 bits of its address, A64 code at the whole address
+class Emulator
+{
+public:
+	enum class Mode
+	{
+		Arm,
+		Thumb,
+		A64
+	};
+
+	Emulator();
+
+	Emulator(const Emulator&) = delete;
+	Emulator& operator=(const Emulator&) = delete;
+
+	// lets the code read and write size bytes at memory
+	void Map(const void* memory, size_t size);
+
+	// a call from the code to function runs it on the host
+	template<typename... Args>
+	void Function(int (*function)(Args...));
+
+	// calls the code as int f(arguments...) under the procedure call
+	// standard of mode and returns its result
+	int32_t Run(Mode mode, const void* code, size_t size,
+		const std::vector<uint64_t>& arguments = {});
+
+	// where 32-bit code finds memory
+	static uint32_t Address(const void* memory);
+
+private:
+	struct Region
+	{
+		uint64_t address;
+		uint8_t* memory;
+		size_t size;
+	};
+
+	struct HostFunction
+	{
+		uint64_t address;
+		size_t arity;
+		std::function<int32_t(const int32_t*)> call;
+	};
+
+	std::vector<Region> regions_;
+	std::vector<HostFunction> functions_;
+	std::vector<uint8_t> stack_;
+
+	Mode mode_;
+	uint64_t code_;
+	size_t codeSize_;
+	size_t steps_;
+
+	// ARM and Thumb state, NEON q registers are pairs of d registers
+	uint32_t r_[16];
+	bool n_, z_, c_, v_;
+	uint64_t d_[32];
+	bool thumb_;
+	uint32_t itCondition_;
+	uint32_t itRemaining_;
+
+	// A64 state, x_[31] is sp
+	uint64_t x_[32];
+	uint64_t pc_;
+
+	template<typename... Args, size_t... Indices>
+	static int32_t call(int (*function)(Args...), const int32_t* arguments,
+		std::index_sequence<Indices...>);
+
+	[[noreturn]] void fail(const char* what, uint64_t value) const;
+	uint8_t* translate(uint64_t address, size_t size);
+	uint16_t load16(uint64_t address);
+	uint32_t load32(uint64_t address);
+	uint64_t load64(uint64_t address);
+	void store32(uint64_t address, uint32_t value);
+	void store64(uint64_t address, uint64_t value);
+	const HostFunction* host(uint64_t address) const;
+	void step();
+
+	bool passed(uint32_t condition) const;
+	uint32_t addWithCarry(uint32_t a, uint32_t b, bool carry, bool setFlags);
+	void branch(uint32_t target);
+	void callHost(const HostFunction& function);
+
+	uint32_t shifted(uint32_t value, uint32_t type, uint32_t amount, bool setCarry);
+	void executeArm(uint32_t word);
+	void executeNeon(uint32_t word);
+	void executeThumb16(uint16_t half, bool inside);
+	void executeThumb32(uint16_t first, uint16_t second, bool inside);
+	void executeA64(uint32_t word);
+
+	uint64_t a64Register(uint32_t n, bool sp, bool wide) const;
+	void setA64Register(uint32_t n, uint64_t value, bool sp, bool wide);
+	void branchA64(uint64_t target);
+	void callHostA64(const HostFunction& function);
+
+	// where lr points when the code is entered
+	static constexpr uint32_t RETURN = 0xfffffff0;
+	static constexpr size_t STEP_LIMIT = 1 << 24;
+};
+
+inline Emulator::Emulator()
+	: stack_(1 << 16),
+	mode_(Mode::Arm),
+	code_(0),
+	codeSize_(0),
+	steps_(0),
+	r_(),
+	n_(false), z_(false), c_(false), v_(false),
+	d_(),
+	thumb_(false),
+	itCondition_(0),
+	itRemaining_(0),
+	x_(),
+	pc_(0)
+{
+	Map(stack_.data(), stack_.size());
+}
+
+inline void Emulator::Map(const void* memory, size_t size)
+{
+	regions_.push_back(Region{reinterpret_cast<uintptr_t>(memory),
+		static_cast<uint8_t*>(const_cast<void*>(memory)), size});
+}
+
+template<typename... Args>
+void Emulator::Function(int (*function)(Args...))
+{
+	functions_.push_back(HostFunction{reinterpret_cast<uintptr_t>(function), sizeof...(Args),
+		[function](const int32_t* arguments)
+		{
+			return call(function, arguments, std::index_sequence_for<Args...>());
+		}});
+}
+
+template<typename... Args, size_t... Indices>
+int32_t Emulator::call(int (*function)(Args...), const int32_t* arguments,
+	std::index_sequence<Indices...>)
+{
+	return function(arguments[Indices]...);
+}
+
+inline uint32_t Emulator::Address(const void* memory)
+{
+	return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(memory));
+}
+
+inline void Emulator::fail(const char* what, uint64_t value) const
+{
+	char message[128];
+	uint64_t pc = mode_ == Mode::A64 ? pc_ : r_[15];
+	std::snprintf(message, sizeof(message), "%s: 0x%llx at 0x%llx", what,
+		static_cast<unsigned long long>(value), static_cast<unsigned long long>(pc));
+	throw std::runtime_error(message);
+}
+
+inline uint8_t* Emulator::translate(uint64_t address, size_t size)
+{
+	if (address % (size < 4 ? size : 4) != 0)
+		fail("misaligned access", address);
+
+	bool wide = mode_ == Mode::A64;
+	if (!wide)
+		address = static_cast<uint32_t>(address);
+
+	auto offset = [wide, address](uint64_t base)
+	{
+		return wide ? address - base : static_cast<uint32_t>(address - base);
+	};
+
+	if (offset(code_) < codeSize_ && size <= codeSize_ - offset(code_))
+		return reinterpret_cast<uint8_t*>(code_) + offset(code_);
+
+	for (const Region& region : regions_)
+	{
+		uint64_t at = offset(region.address);
+		if (at < region.size && size <= region.size - at)
+			return region.memory + at;
+	}
+
+	fail("unmapped access", address);
+}
+
+inline uint16_t Emulator::load16(uint64_t address)
+{
+	uint16_t value;
+	std::memcpy(&value, translate(address, sizeof(value)), sizeof(value));
+	return value;
+}
+
+inline uint32_t Emulator::load32(uint64_t address)
+{
+	uint32_t value;
+	std::memcpy(&value, translate(address, sizeof(value)), sizeof(value));
+	return value;
+}
+
+inline uint64_t Emulator::load64(uint64_t address)
+{
+	uint64_t value;
+	std::memcpy(&value, translate(address, sizeof(value)), sizeof(value));
+	return value;
+}
+
+inline void Emulator::store32(uint64_t address, uint32_t value)
+{
+	std::memcpy(translate(address, sizeof(value)), &value, sizeof(value));
+}
+
+inline void Emulator::store64(uint64_t address, uint64_t value)
+{
+	std::memcpy(translate(address, sizeof(value)), &value, sizeof(value));
+}
+
+inline const Emulator::HostFunction* Emulator::host(uint64_t address) const
+{
+	for (const HostFunction& function : functions_)
+	{
+		if (mode_ == Mode::A64 ? function.address == address
+			: static_cast<uint32_t>(function.address) == address)
+			return &function;
+	}
+
+	return nullptr;
+}
+
+inline int32_t Emulator::Run(Mode mode, const void* code, size_t size,
+	const std::vector<uint64_t>& arguments)
+{
+	mode_ = mode;
+	code_ = reinterpret_cast<uintptr_t>(code);
+	codeSize_ = size;
+	steps_ = 0;
+
+	uint64_t top = reinterpret_cast<uintptr_t>(stack_.data() + stack_.size()) & ~uint64_t(15);
+	size_t inRegisters = mode == Mode::A64 ? 8 : 4;
+	size_t slot = mode == Mode::A64 ? 8 : 4;
+	size_t onStack = arguments.size() > inRegisters ? arguments.size() - inRegisters : 0;
+	uint64_t sp = (top - slot * onStack) & ~uint64_t(15);
+
+	for (size_t i = 0; i < onStack; ++i)
+	{
+		if (mode == Mode::A64)
+			store64(sp + 8 * i, arguments[inRegisters + i]);
+		else
+			store32(sp + 4 * i, static_cast<uint32_t>(arguments[inRegisters + i]));
+	}
+
+	if (mode == Mode::A64)
+	{
+		for (uint64_t& x : x_)
+			x = 0xbad0bad0bad0bad0;
+		for (size_t i = 0; i < inRegisters && i < arguments.size(); ++i)
+			x_[i] = arguments[i];
+
+		x_[30] = RETURN;
+		x_[31] = sp;
+		pc_ = code_;
+		while (pc_ != RETURN)
+			step();
+
+		return static_cast<int32_t>(x_[0]);
+	}
+
+	for (uint32_t& r : r_)
+		r = 0xbad0bad0;
+	for (size_t i = 0; i < inRegisters && i < arguments.size(); ++i)
+		r_[i] = static_cast<uint32_t>(arguments[i]);
+
+	r_[13] = static_cast<uint32_t>(sp);
+	r_[14] = RETURN;
+	r_[15] = static_cast<uint32_t>(code_);
+	thumb_ = mode == Mode::Thumb;
+	itRemaining_ = 0;
+	while (r_[15] != RETURN)
+		step();
+
+	return static_cast<int32_t>(r_[0]);
+}
+
+inline void Emulator::step()
+{
+	if (++steps_ > STEP_LIMIT)
+		fail("too many steps", steps_);
+
+	if (mode_ == Mode::A64)
+	{
+		if (pc_ - code_ >= codeSize_)
+			fail("pc outside the code", pc_);
+
+		uint32_t word = load32(pc_);
+		pc_ += 4;
+		executeA64(word);
+		return;
+	}
+
+	uint32_t pc = r_[15];
+	if (static_cast<uint32_t>(pc - code_) >= codeSize_)
+		fail("pc outside the code", pc);
+
+	if (!thumb_)
+	{
+		executeArm(load32(pc));
+		return;
+	}
+
+	bool inside = itRemaining_ != 0;
+	bool active = !inside || passed(itCondition_);
+	if (inside)
+		--itRemaining_;
+
+	uint16_t first = load16(pc);
+	if ((first >> 11) == 0b11101 || (first >> 11) == 0b11110 || (first >> 11) == 0b11111)
+	{
+		uint16_t second = load16(pc + 2);
+		r_[15] = pc + 4;
+		if (active)
+			executeThumb32(first, second, inside);
+	}
+	else
+	{
+		r_[15] = pc + 2;
+		if (active)
+			executeThumb16(first, inside);
+	}
+}
+
+inline bool Emulator::passed(uint32_t condition) const
+{
+	switch (condition)
+	{
+		case 0x0: return z_;
+		case 0x1: return !z_;
+		case 0x2: return c_;
+		case 0x3: return !c_;
+		case 0x4: return n_;
+		case 0x5: return !n_;
+		case 0x6: return v_;
+		case 0x7: return !v_;
+		case 0x8: return c_ && !z_;
+		case 0x9: return !c_ || z_;
+		case 0xa: return n_ == v_;
+		case 0xb: return n_ != v_;
+		case 0xc: return !z_ && n_ == v_;
+		case 0xd: return z_ || n_ != v_;
+		case 0xe: return true;
+	}
+
+	fail("unexpected condition", condition);
+}
+
+inline uint32_t Emulator::addWithCarry(uint32_t a, uint32_t b, bool carry, bool setFlags)
+{
+	uint64_t unsignedSum = uint64_t(a) + b + carry;
+	uint32_t result = static_cast<uint32_t>(unsignedSum);
+
+	if (setFlags)
+	{
+		int64_t signedSum = int64_t(static_cast<int32_t>(a)) + static_cast<int32_t>(b) + carry;
+		n_ = result >> 31;
+		z_ = result == 0;
+		c_ = unsignedSum >> 32;
+		v_ = signedSum != static_cast<int32_t>(result);
+	}
+
+	return result;
+}
+
+inline void Emulator::branch(uint32_t target)
+{
+	// blx, bx and loads into pc switch to Thumb on an odd address
+	if (const HostFunction* function = host(target))
+	{
+		callHost(*function);
+		return;
+	}
+
+	thumb_ = target & 1;
+	r_[15] = target & ~1u;
+	if (!thumb_ && r_[15] % 4 != 0 && r_[15] != RETURN)
+		fail("misaligned ARM branch", target);
+}
+
+inline void Emulator::callHost(const HostFunction& function)
+{
+	if (r_[13] % 8 != 0)
+		fail("sp not 8-byte aligned at a call", r_[13]);
+
+	int32_t arguments[16];
+	if (function.arity > 16)
+		fail("too many arguments", function.arity);
+
+	for (size_t i = 0; i < function.arity; ++i)
+		arguments[i] = static_cast<int32_t>(i < 4 ? r_[i] : load32(r_[13] + 4 * (i - 4)));
+
+	r_[0] = static_cast<uint32_t>(function.call(arguments));
+
+	// whatever the procedure call standard lets the callee change
+	for (uint8_t reg : {1, 2, 3, 12})
+		r_[reg] = 0xbad00000 + reg;
+	for (uint8_t reg = 0; reg < 32; ++reg)
+	{
+		if (reg < 8 || reg >= 16)
+			d_[reg] = 0xbadd0000badd0000 + reg;
+	}
+
+	branch(r_[14]);
+}
+
+inline uint32_t Emulator::shifted(uint32_t value, uint32_t type, uint32_t amount, bool setCarry)
+{
+	// lsr and asr by 0 mean by 32, ror by 0 is rrx
+	bool carry = c_;
+	uint32_t result;
+
+	switch (type)
+	{
+		case 0:
+			result = amount == 0 ? value : value << amount;
+			if (amount != 0)
+				carry = (value >> (32 - amount)) & 1;
+			break;
+		case 1:
+			result = amount == 0 ? 0 : value >> amount;
+			carry = (value >> ((amount == 0 ? 32 : amount) - 1)) & 1;
+			break;
+		case 2:
+			result = static_cast<uint32_t>(static_cast<int32_t>(value) >> (amount == 0 ? 31 : amount));
+			carry = (static_cast<int32_t>(value) >> ((amount == 0 ? 32 : amount) - 1)) & 1;
+			break;
+		default:
+			fail("rotation", type);
+	}
+
+	if (setCarry)
+		c_ = carry;
+	return result;
+}
+
+inline void Emulator::executeArm(uint32_t word)
+{
+	uint32_t pc = r_[15];
+	r_[15] = pc + 4;
+
+	uint32_t condition = word >> 28;
+	if (condition == 0xf)
+	{
+		executeNeon(word);
+		return;
+	}
+
+	if (!passed(condition))
+		return;
+
+	auto reg = [this, pc](uint32_t n) { return n == 15 ? pc + 8 : r_[n]; };
+	uint32_t rn = (word >> 16) & 0xf;
+	uint32_t rd = (word >> 12) & 0xf;
+	uint32_t rs = (word >> 8) & 0xf;
+	uint32_t rm = word & 0xf;
+
+	if ((word & 0x0fffffd0) == 0x012fff10)
+	{
+		// bx and blx, a register
+		uint32_t target = reg(rm);
+		if (word & 0x20)
+			r_[14] = pc + 4;
+		branch(target);
+		return;
+	}
+
+	if ((word & 0x0e000000) == 0x0a000000)
+	{
+		// b and bl
+		if (word & 0x01000000)
+			r_[14] = pc + 4;
+		r_[15] = pc + 8 + 4 * (static_cast<int32_t>(word << 8) >> 8);
+		return;
+	}
+
+	if ((word & 0x0f0000f0) == 0x00000090)
+	{
+		if (word & 0x00100000)
+			fail("flag-setting multiply", word);
+		if (rd == 15 || rn == 15 || rs == 15 || rm == 15)
+			fail("multiply with pc", word);
+
+		switch ((word >> 21) & 7)
+		{
+			case 0b000: // mul, the destination in the Rn field
+			case 0b001: // mla
+				if (rd != 0 && !(word & 0x00200000))
+					fail("mul with a nonzero Ra", word);
+				if (rn == rm)
+					fail("mul with Rd = Rm, unpredictable before ARMv6", word);
+				r_[rn] = r_[rm] * r_[rs] + (word & 0x00200000 ? r_[rd] : 0);
+				return;
+			case 0b011: // mls
+				r_[rn] = r_[rd] - r_[rm] * r_[rs];
+				return;
+			case 0b110: // smull, RdHi in the Rn field
+			{
+				if (rn == rd || rn == rm || rd == rm)
+					fail("smull with overlapping registers, unpredictable before ARMv6", word);
+				int64_t product = int64_t(static_cast<int32_t>(r_[rm])) * static_cast<int32_t>(r_[rs]);
+				r_[rd] = static_cast<uint32_t>(product);
+				r_[rn] = static_cast<uint32_t>(static_cast<uint64_t>(product) >> 32);
+				return;
+			}
+		}
+
+		fail("unknown multiply", word);
+	}
+
+	if ((word & 0x0fb00000) == 0x03000000)
+	{
+		// movw and movt
+		if (rd == 15)
+			fail("movw into pc", word);
+		uint32_t value = ((word >> 4) & 0xf000) | (word & 0xfff);
+		r_[rd] = word & 0x00400000 ? (r_[rd] & 0xffff) | (value << 16) : value;
+		return;
+	}
+
+	if ((word & 0x0c000000) == 0)
+	{
+		uint32_t operation = (word >> 21) & 0xf;
+		bool setFlags = word & 0x00100000;
+		bool compare = operation >= 8 && operation <= 11;
+
+		if (!(word & 0x02000000) && (word & 0x10))
+			fail("register-shifted register", word);
+		if (compare != setFlags || (compare && operation != 10))
+			fail("unknown data processing", word);
+		if (compare ? rd != 0 : rd == 15)
+			fail("data processing Rd", word);
+		if ((operation == 13 || operation == 15) && rn != 0)
+			fail("mov or mvn with a nonzero Rn", word);
+
+		uint32_t operand;
+		if (word & 0x02000000)
+		{
+			uint32_t rotation = 2 * ((word >> 8) & 0xf);
+			operand = rotation == 0 ? word & 0xff
+				: ((word & 0xff) >> rotation) | ((word & 0xff) << (32 - rotation));
+		}
+		else
+		{
+			operand = shifted(reg(rm), (word >> 5) & 3, (word >> 7) & 0x1f, false);
+		}
+
+		uint32_t first = reg(rn);
+		switch (operation)
+		{
+			case 0: r_[rd] = first & operand; return;
+			case 1: r_[rd] = first ^ operand; return;
+			case 2: r_[rd] = first - operand; return;
+			case 3: r_[rd] = operand - first; return;
+			case 4: r_[rd] = first + operand; return;
+			case 10: addWithCarry(first, ~operand, true, true); return;
+			case 12: r_[rd] = first | operand; return;
+			case 13: r_[rd] = operand; return;
+			case 14: r_[rd] = first & ~operand; return;
+			case 15: r_[rd] = ~operand; return;
+		}
+
+		fail("unknown data processing", word);
+	}
+
+	if ((word & 0x0c000000) == 0x04000000)
+	{
+		// ldr and str of words, immediate or unshifted register offsets
+		bool pre = word & 0x01000000;
+		bool up = word & 0x00800000;
+		bool writeback = word & 0x00200000;
+		bool load = word & 0x00100000;
+
+		if (word & 0x00400000)
+			fail("byte access", word);
+		if ((word & 0x02000000) && (word & 0xff0))
+			fail("shifted register offset", word);
+		if (!pre && writeback)
+			fail("unprivileged access", word);
+		if ((!pre || writeback) && (rn == 15 || rn == rd))
+			fail("writeback with Rn = pc or Rn = Rt", word);
+		if (rd == 15 || (word & 0x02000000 && rm == 15))
+			fail("ldr or str with pc", word);
+
+		uint32_t offset = word & 0x02000000 ? r_[rm] : word & 0xfff;
+		uint32_t base = reg(rn);
+		uint32_t address = up ? base + offset : base - offset;
+		uint32_t effective = pre ? address : base;
+
+		if (load)
+			r_[rd] = load32(effective);
+		else
+			store32(effective, r_[rd]);
+
+		if (!pre || writeback)
+			r_[rn] = address;
+		return;
+	}
+
+	if ((word & 0x0e000000) == 0x08000000)
+	{
+		// ldm and stm
+		bool pre = word & 0x01000000;
+		bool up = word & 0x00800000;
+		bool writeback = word & 0x00200000;
+		bool load = word & 0x00100000;
+		uint32_t list = word & 0xffff;
+		uint32_t count = __builtin_popcount(list);
+
+		if (word & 0x00400000)
+			fail("user registers", word);
+		if (list == 0 || rn == 15 || (writeback && (list & (1u << rn))))
+			fail("unpredictable register list", word);
+		if (!load && (list & 0x8000))
+			fail("stm of pc", word);
+
+		uint32_t base = r_[rn];
+		uint32_t address = up ? base + (pre ? 4 : 0) : base - 4 * count + (pre ? 0 : 4);
+		uint32_t target = 0;
+		for (uint32_t i = 0; i < 16; ++i)
+		{
+			if (!(list & (1u << i)))
+				continue;
+
+			if (!load)
+				store32(address, r_[i]);
+			else if (i == 15)
+				target = load32(address);
+			else
+				r_[i] = load32(address);
+			address += 4;
+		}
+
+		if (writeback)
+			r_[rn] = up ? base + 4 * count : base - 4 * count;
+		if (load && (list & 0x8000))
+			branch(target);
+		return;
+	}
+
+	if ((word & 0x0ff00f7f) == 0x0ea00b10)
+	{
+		// vdup.32 q, r
+		uint32_t q = (((word >> 16) & 0xf) | ((word >> 3) & 0x10)) / 2;
+		uint64_t value = r_[rd] * 0x0000000100000001ull;
+		d_[2 * q] = d_[2 * q + 1] = value;
+		return;
+	}
+
+	if ((word & 0x0fbf0fff) == 0x0d2d0b04 || (word & 0x0fbf0fff) == 0x0cbd0b04)
+	{
+		// vpush and vpop of one q register
+		uint32_t first = rd | ((word >> 18) & 0x10);
+		if (first % 2 != 0)
+			fail("odd d register", word);
+
+		bool push = (word & 0x0fbf0fff) == 0x0d2d0b04;
+		if (push)
+			r_[13] -= 16;
+		for (uint32_t i = 0; i < 2; ++i)
+		{
+			if (push)
+				store64(r_[13] + 8 * i, d_[first + i]);
+			else
+				d_[first + i] = load64(r_[13] + 8 * i);
+		}
+		if (!push)
+			r_[13] += 16;
+		return;
+	}
+
+	fail("unknown instruction", word);
+}
+
+inline void Emulator::executeNeon(uint32_t word)
+{
+	// q registers: D:Vd, N:Vn, M:Vm, each naming the first of two d registers
+	uint32_t vd = ((word >> 12) & 0xf) | ((word >> 18) & 0x10);
+	uint32_t vn = ((word >> 16) & 0xf) | ((word >> 3) & 0x10);
+	uint32_t vm = (word & 0xf) | ((word >> 1) & 0x10);
+
+	auto lane = [this](uint32_t d, uint32_t i)
+	{
+		return static_cast<uint32_t>(d_[d + i / 2] >> (32 * (i % 2)));
+	};
+
+	uint32_t result[4];
+	auto write = [this, vd, &result]()
+	{
+		d_[vd] = uint64_t(result[0]) | uint64_t(result[1]) << 32;
+		d_[vd + 1] = uint64_t(result[2]) | uint64_t(result[3]) << 32;
+	};
+
+	uint32_t memory = word & ~0x004ff00fu;
+	if (memory == 0xf4200a80 || memory == 0xf4000a80)
+	{
+		// vld1.32 and vst1.32 of two d registers, Rm = 13 adds 16 to Rn
+		uint32_t rn = (word >> 16) & 0xf;
+		uint32_t rm = word & 0xf;
+		if (vd % 2 != 0 || vd > 30 || (rm != 13 && rm != 15) || rn == 15)
+			fail("unexpected vld1 or vst1", word);
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			if (memory == 0xf4200a80)
+				result[i] = load32(r_[rn] + 4 * i);
+			else
+				store32(r_[rn] + 4 * i, lane(vd, i));
+		}
+
+		if (memory == 0xf4200a80)
+			write();
+		if (rm == 13)
+			r_[rn] += 16;
+		return;
+	}
+
+	if (vd % 2 != 0 || vm % 2 != 0)
+		fail("odd d register", word);
+
+	uint32_t three = word & ~0x004ff0afu;
+	uint32_t two = word & ~0x0040f02fu;
+	uint32_t shift = word & ~0x007ff02fu;
+
+	if (three == 0xf2200840 || three == 0xf3200840 || three == 0xf2200950
+		|| three == 0xf2200640 || three == 0xf2200650)
+	{
+		if (vn % 2 != 0)
+			fail("odd d register", word);
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			uint32_t a = lane(vn, i);
+			uint32_t b = lane(vm, i);
+			int32_t sa = static_cast<int32_t>(a);
+			int32_t sb = static_cast<int32_t>(b);
+			switch (three)
+			{
+				case 0xf2200840: result[i] = a + b; break; // vadd.i32
+				case 0xf3200840: result[i] = a - b; break; // vsub.i32
+				case 0xf2200950: result[i] = a * b; break; // vmul.i32
+				case 0xf2200640: result[i] = static_cast<uint32_t>(sa > sb ? sa : sb); break; // vmax.s32
+				case 0xf2200650: result[i] = static_cast<uint32_t>(sa < sb ? sa : sb); break; // vmin.s32
+			}
+		}
+
+		write();
+		return;
+	}
+
+	if (two == 0xf3b903c0 || two == 0xf3b90340)
+	{
+		// vneg.s32 and vabs.s32
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			uint32_t a = lane(vm, i);
+			bool negate = two == 0xf3b903c0 || static_cast<int32_t>(a) < 0;
+			result[i] = negate ? 0 - a : a;
+		}
+
+		write();
+		return;
+	}
+
+	if (shift == 0xf2800550 || shift == 0xf2800050)
+	{
+		// vshl.i32 by 32 + imm6 and vshr.s32 by 64 - imm6
+		uint32_t field = (word >> 16) & 0x3f;
+		if (field < 32)
+			fail("not a 32-bit shift", word);
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			uint32_t a = lane(vm, i);
+			uint32_t right = 64 - field;
+			result[i] = shift == 0xf2800550 ? a << (field - 32)
+				: static_cast<uint32_t>(static_cast<int32_t>(a) >> (right == 32 ? 31 : right));
+		}
+
+		write();
+		return;
+	}
+
+	fail("unknown NEON instruction", word);
+}
+
+inline void Emulator::executeThumb16(uint16_t half, bool inside)
+{
+	// the 16-bit data processing encodings set the flags outside IT blocks
+	bool setFlags = !inside;
+	auto flags = [this, setFlags](uint32_t result)
+	{
+		if (setFlags)
+		{
+			n_ = result >> 31;
+			z_ = result == 0;
+		}
+		return result;
+	};
+
+	uint32_t low = half & 7;
+	uint32_t middle = (half >> 3) & 7;
+
+	if ((half >> 13) == 0 && (half >> 11) != 0b00011)
+	{
+		// lsls, lsrs and asrs by an immediate, movs between low registers
+		r_[low] = flags(shifted(r_[middle], (half >> 11) & 3, (half >> 6) & 0x1f, setFlags));
+		return;
+	}
+
+	if ((half >> 11) == 0b00011)
+	{
+		// adds and subs, a register or a 3-bit immediate
+		uint32_t operand = half & 0x0400 ? (half >> 6) & 7 : r_[(half >> 6) & 7];
+		bool subtract = half & 0x0200;
+		r_[low] = addWithCarry(r_[middle], subtract ? ~operand : operand, subtract, setFlags);
+		return;
+	}
+
+	if ((half >> 13) == 0b001)
+	{
+		// movs, cmp, adds and subs with an 8-bit immediate
+		uint32_t reg = (half >> 8) & 7;
+		uint32_t immediate = half & 0xff;
+		switch ((half >> 11) & 3)
+		{
+			case 0: r_[reg] = flags(immediate); return;
+			case 1: addWithCarry(r_[reg], ~immediate, true, true); return;
+			case 2: r_[reg] = addWithCarry(r_[reg], immediate, false, setFlags); return;
+			case 3: r_[reg] = addWithCarry(r_[reg], ~immediate, true, setFlags); return;
+		}
+	}
+
+	if ((half >> 10) == 0b010000)
+	{
+		switch ((half >> 6) & 0xf)
+		{
+			case 0b1001: r_[low] = addWithCarry(0, ~r_[middle], true, setFlags); return; // rsbs
+			case 0b1010: addWithCarry(r_[low], ~r_[middle], true, true); return;         // cmp
+			case 0b1101: r_[low] = flags(r_[low] * r_[middle]); return;                  // muls
+		}
+
+		fail("unknown Thumb data processing", half);
+	}
+
+	if ((half >> 10) == 0b010001)
+	{
+		// add, cmp and mov of any registers, bx and blx
+		uint32_t rm = (half >> 3) & 0xf;
+		uint32_t rdn = low | ((half >> 4) & 8);
+		switch ((half >> 8) & 3)
+		{
+			case 0:
+				if (rdn == 15 || rm == 15)
+					fail("add with pc", half);
+				r_[rdn] += r_[rm];
+				return;
+			case 1:
+				if (rdn == 15 || rm == 15)
+					fail("cmp with pc", half);
+				addWithCarry(r_[rdn], ~r_[rm], true, true);
+				return;
+			case 2:
+				if (rdn == 15 || rm == 15)
+					fail("mov with pc", half);
+				r_[rdn] = r_[rm];
+				return;
+			case 3:
+			{
+				if (low != 0 || rm == 15)
+					fail("unpredictable bx or blx", half);
+				uint32_t target = r_[rm];
+				if (half & 0x80)
+					r_[14] = r_[15] | 1;
+				branch(target);
+				return;
+			}
+		}
+	}
+
+	if ((half >> 12) == 0b0110 || (half >> 12) == 0b1001)
+	{
+		// ldr and str at a register plus imm5 * 4, or at sp plus imm8 * 4
+		bool stack = (half >> 12) == 0b1001;
+		uint32_t reg = stack ? (half >> 8) & 7 : low;
+		uint32_t address = stack ? r_[13] + 4 * (half & 0xff) : r_[middle] + 4 * ((half >> 6) & 0x1f);
+
+		if (half & 0x0800)
+			r_[reg] = load32(address);
+		else
+			store32(address, r_[reg]);
+		return;
+	}
+
+	if ((half & 0xff00) == 0xb000)
+	{
+		// add and sub sp, imm7 * 4
+		uint32_t immediate = 4 * (half & 0x7f);
+		r_[13] = half & 0x80 ? r_[13] - immediate : r_[13] + immediate;
+		return;
+	}
+
+	if ((half & 0xfe00) == 0xb400 || (half & 0xfe00) == 0xbc00)
+	{
+		// push with lr and pop with pc
+		bool push = (half & 0xfe00) == 0xb400;
+		uint32_t list = (half & 0xff) | (half & 0x100 ? (push ? 0x4000 : 0x8000) : 0);
+		uint32_t count = __builtin_popcount(list);
+		if (list == 0)
+			fail("empty register list", half);
+
+		uint32_t address = push ? r_[13] - 4 * count : r_[13];
+		uint32_t target = 0;
+		for (uint32_t i = 0; i < 16; ++i)
+		{
+			if (!(list & (1u << i)))
+				continue;
+
+			if (push)
+				store32(address, r_[i]);
+			else if (i == 15)
+				target = load32(address);
+			else
+				r_[i] = load32(address);
+			address += 4;
+		}
+
+		r_[13] = push ? r_[13] - 4 * count : r_[13] + 4 * count;
+		if (list & 0x8000)
+			branch(target);
+		return;
+	}
+
+	if ((half & 0xff00) == 0xbf00 && (half & 0xf) != 0)
+	{
+		// only IT blocks of one instruction
+		if ((half & 0xf) != 0b1000 || inside)
+			fail("unexpected IT block", half);
+
+		itCondition_ = (half >> 4) & 0xf;
+		itRemaining_ = 1;
+		return;
+	}
+
+	fail("unknown Thumb instruction", half);
+}
+
+inline void Emulator::executeThumb32(uint16_t first, uint16_t second, bool inside)
+{
+	uint32_t word = uint32_t(first) << 16 | second;
+	uint32_t rn = first & 0xf;
+	uint32_t rd = (second >> 8) & 0xf;
+	uint32_t rm = second & 0xf;
+	auto bad = [](uint32_t reg) { return reg == 13 || reg == 15; };
+
+	if (first == 0xe92d || first == 0xe8bd)
+	{
+		// push.w and pop.w
+		bool push = first == 0xe92d;
+		uint32_t list = second;
+		uint32_t count = __builtin_popcount(list);
+		if (count < 2 || (list & 0x2000) || (push && (list & 0x8000))
+			|| (!push && (list & 0xc000) == 0xc000))
+			fail("unpredictable register list", word);
+
+		uint32_t address = push ? r_[13] - 4 * count : r_[13];
+		uint32_t target = 0;
+		for (uint32_t i = 0; i < 16; ++i)
+		{
+			if (!(list & (1u << i)))
+				continue;
+
+			if (push)
+				store32(address, r_[i]);
+			else if (i == 15)
+				target = load32(address);
+			else
+				r_[i] = load32(address);
+			address += 4;
+		}
+
+		r_[13] = push ? r_[13] - 4 * count : r_[13] + 4 * count;
+		if (list & 0x8000)
+			branch(target);
+		return;
+	}
+
+	if ((first & 0xfe00) == 0xea00)
+	{
+		// data processing with a register shifted by an immediate
+		uint32_t operation = (first >> 5) & 0xf;
+		bool setFlags = first & 0x10;
+		uint32_t amount = ((second >> 10) & 0x1c) | ((second >> 6) & 3);
+		if ((second & 0x8000) || bad(rm))
+			fail("unexpected shifted register", word);
+
+		uint32_t operand = shifted(r_[rm], (second >> 4) & 3, amount, false);
+		if (operation == 0b0010 && rn == 15)
+		{
+			// mov, lsl, lsr and asr
+			if (bad(rd) || (setFlags && inside))
+				fail("unexpected mov.w", word);
+			r_[rd] = operand;
+			if (setFlags)
+			{
+				n_ = operand >> 31;
+				z_ = operand == 0;
+			}
+			return;
+		}
+
+		if (operation == 0b1101 && setFlags && rd == 15)
+		{
+			addWithCarry(r_[rn], ~operand, true, true); // cmp.w
+			return;
+		}
+
+		if (setFlags || rd == 15 || rn == 15)
+			fail("unexpected shifted register operation", word);
+
+		switch (operation)
+		{
+			case 0b1000: // add.w
+			case 0b1101: // sub.w
+				if ((rd == 13 || rn == 13) && (rd != 13 || rn != 13 || amount > 3 || (second & 0x30)))
+					fail("unexpected sp form", word);
+				r_[rd] = operation == 0b1000 ? r_[rn] + operand : r_[rn] - operand;
+				return;
+			case 0b1110: // rsb.w
+				if (bad(rd) || bad(rn))
+					fail("rsb with sp or pc", word);
+				r_[rd] = operand - r_[rn];
+				return;
+		}
+
+		fail("unknown shifted register operation", word);
+	}
+
+	if ((first >> 11) == 0b11110 && !(second & 0x8000))
+	{
+		uint32_t imm12 = ((first & 0x400) << 1) | ((second >> 4) & 0x700) | (second & 0xff);
+
+		if (first & 0x0200)
+		{
+			// addw, subw, movw and movt
+			uint32_t operation = (first >> 4) & 0x1f;
+			uint32_t imm16 = ((first & 0xf) << 12) | imm12;
+			switch (operation)
+			{
+				case 0b00000:
+				case 0b01010:
+					if (rd == 15 || rn == 15 || ((rd == 13 || rn == 13) && rd != rn))
+						fail("unexpected addw or subw", word);
+					r_[rd] = operation == 0 ? r_[rn] + imm12 : r_[rn] - imm12;
+					return;
+				case 0b00100:
+					if (bad(rd))
+						fail("movw into sp or pc", word);
+					r_[rd] = imm16;
+					return;
+				case 0b01100:
+					if (bad(rd))
+						fail("movt into sp or pc", word);
+					r_[rd] = (r_[rd] & 0xffff) | (imm16 << 16);
+					return;
+			}
+
+			fail("unknown plain immediate", word);
+		}
+
+		// ThumbExpandImm: a replicated byte or a rotated 1bcdefgh
+		uint32_t operand;
+		uint32_t byte = imm12 & 0xff;
+		if ((imm12 >> 10) == 0)
+		{
+			switch ((imm12 >> 8) & 3)
+			{
+				case 0: operand = byte; break;
+				case 1: operand = byte * 0x00010001u; break;
+				case 2: operand = byte * 0x01000100u; break;
+				default: operand = byte * 0x01010101u; break;
+			}
+
+			if (((imm12 >> 8) & 3) != 0 && byte == 0)
+				fail("unpredictable immediate", word);
+		}
+		else
+		{
+			uint32_t value = 0x80 | (imm12 & 0x7f);
+			uint32_t rotation = imm12 >> 7;
+			operand = (value >> rotation) | (value << (32 - rotation));
+		}
+
+		uint32_t operation = (first >> 5) & 0xf;
+		bool setFlags = first & 0x10;
+		if ((operation == 0b0010 || operation == 0b0011) && rn == 15)
+		{
+			// mov.w and mvn
+			if (bad(rd) || setFlags)
+				fail("unexpected mov.w or mvn", word);
+			r_[rd] = operation == 0b0010 ? operand : ~operand;
+			return;
+		}
+
+		if (operation == 0b1101 && setFlags && rd == 15)
+		{
+			addWithCarry(r_[rn], ~operand, true, true); // cmp.w
+			return;
+		}
+
+		if (setFlags || rd == 15 || rn == 15)
+			fail("unexpected immediate operation", word);
+
+		switch (operation)
+		{
+			case 0b1000: // add.w
+			case 0b1101: // sub.w
+				if ((rd == 13 || rn == 13) && rd != rn)
+					fail("unexpected sp form", word);
+				r_[rd] = operation == 0b1000 ? r_[rn] + operand : r_[rn] - operand;
+				return;
+			case 0b1110: // rsb.w
+				if (bad(rd) || bad(rn))
+					fail("rsb with sp or pc", word);
+				r_[rd] = operand - r_[rn];
+				return;
+		}
+
+		fail("unknown immediate operation", word);
+	}
+
+	if (first == (0xfb00 | rn) && (second & 0xf0f0) == 0xf000)
+	{
+		// mul.w
+		if (bad(rn) || bad(rd) || bad(rm))
+			fail("mul with sp or pc", word);
+		r_[rd] = r_[rn] * r_[rm];
+		return;
+	}
+
+	if (first == (0xfb80 | rn) && (second & 0xf0) == 0)
+	{
+		// smull
+		uint32_t rdLow = (second >> 12) & 0xf;
+		if (bad(rn) || bad(rd) || bad(rm) || bad(rdLow) || rd == rdLow)
+			fail("unpredictable smull", word);
+
+		int64_t product = int64_t(static_cast<int32_t>(r_[rn])) * static_cast<int32_t>(r_[rm]);
+		r_[rdLow] = static_cast<uint32_t>(product);
+		r_[rd] = static_cast<uint32_t>(static_cast<uint64_t>(product) >> 32);
+		return;
+	}
+
+	if ((first & 0xffe0) == 0xf8c0 || (first & 0xffe0) == 0xf840)
+	{
+		// ldr.w and str.w at imm12, or at imm8 with writeback
+		bool load = first & 0x10;
+		uint32_t rt = (second >> 12) & 0xf;
+		if (rn == 15 || rt == 15)
+			fail("ldr or str with pc", word);
+
+		uint32_t address = r_[rn] + (second & 0xfff);
+		bool writeback = false;
+		uint32_t updated = 0;
+		if (!(first & 0x80))
+		{
+			if (!(second & 0x800))
+				fail("register offset", word);
+
+			bool pre = second & 0x400;
+			bool up = second & 0x200;
+			writeback = (second & 0x100) || !pre;
+			updated = up ? r_[rn] + (second & 0xff) : r_[rn] - (second & 0xff);
+			address = pre ? updated : r_[rn];
+			if (writeback && rn == rt)
+				fail("writeback with Rn = Rt", word);
+		}
+
+		if (load)
+			r_[rt] = load32(address);
+		else
+			store32(address, r_[rt]);
+		if (writeback)
+			r_[rn] = updated;
+		return;
+	}
+
+	fail("unknown Thumb-2 instruction", word);
+}
+
+inline uint64_t Emulator::a64Register(uint32_t n, bool sp, bool wide) const
+{
+	uint64_t value = n == 31 && !sp ? 0 : x_[n];
+	return wide ? value : static_cast<uint32_t>(value);
+}
+
+inline void Emulator::setA64Register(uint32_t n, uint64_t value, bool sp, bool wide)
+{
+	// writes to w registers clear the upper half
+	if (n == 31 && !sp)
+		return;
+	x_[n] = wide ? value : static_cast<uint32_t>(value);
+}
+
+inline void Emulator::branchA64(uint64_t target)
+{
+	if (const HostFunction* function = host(target))
+	{
+		callHostA64(*function);
+		return;
+	}
+
+	if (target % 4 != 0)
+		fail("misaligned branch", target);
+	pc_ = target;
+}
+
+inline void Emulator::callHostA64(const HostFunction& function)
+{
+	if (x_[31] % 16 != 0)
+		fail("sp not 16-byte aligned at a call", x_[31]);
+
+	int32_t arguments[16];
+	if (function.arity > 16)
+		fail("too many arguments", function.arity);
+
+	for (size_t i = 0; i < function.arity; ++i)
+		arguments[i] = static_cast<int32_t>(i < 8 ? x_[i] : load64(x_[31] + 8 * (i - 8)));
+
+	// an int result leaves the upper half of x0 undefined
+	x_[0] = static_cast<uint32_t>(function.call(arguments)) | 0xbad1000000000000;
+	for (uint32_t reg = 1; reg < 18; ++reg)
+		x_[reg] = 0xbad0000000000000 + reg;
+
+	branchA64(x_[30]);
+}
+
+inline void Emulator::executeA64(uint32_t word)
+{
+	bool wide = word >> 31;
+	uint32_t bits = wide ? 64 : 32;
+	uint64_t mask = wide ? ~uint64_t(0) : 0xffffffff;
+	uint32_t rd = word & 31;
+	uint32_t rn = (word >> 5) & 31;
+	uint32_t rm = (word >> 16) & 31;
+
+	auto signExtend = [](uint64_t value, uint32_t width)
+	{
+		return width == 64 ? static_cast<int64_t>(value)
+			: static_cast<int64_t>(value << (64 - width)) >> (64 - width);
+	};
+
+	auto addSub = [this, bits, mask, &signExtend](uint64_t a, uint64_t b, bool subtract, bool setFlags)
+	{
+		if (subtract)
+			b = ~b & mask;
+		uint64_t result = (a + b + subtract) & mask;
+		if (setFlags)
+		{
+			n_ = (result >> (bits - 1)) & 1;
+			z_ = result == 0;
+			c_ = bits == 64 ? result < a || (subtract && result == a) : ((a + b + subtract) >> 32) != 0;
+			v_ = ((signExtend(a, bits) < 0) == (signExtend(b, bits) < 0))
+				&& ((signExtend(result, bits) < 0) != (signExtend(a, bits) < 0));
+		}
+		return result;
+	};
+
+	auto shift = [this, bits, mask, word, &signExtend](uint64_t value, uint32_t type, uint32_t amount)
+	{
+		if (amount >= bits)
+			fail("shift amount", word);
+		switch (type)
+		{
+			case 0: return (value << amount) & mask;
+			case 1: return (value & mask) >> amount;
+			case 2: return static_cast<uint64_t>(signExtend(value, bits) >> amount) & mask;
+		}
+		fail("rotation", word);
+	};
+
+	if (((word >> 23) & 0x3f) == 0b100101)
+	{
+		// movn, movz and movk
+		uint32_t operation = (word >> 29) & 3;
+		uint32_t hw = (word >> 21) & 3;
+		uint64_t immediate = uint64_t((word >> 5) & 0xffff) << (16 * hw);
+		if (operation == 1 || (!wide && hw > 1))
+			fail("unexpected move wide", word);
+
+		if (operation == 0)
+			setA64Register(rd, ~immediate & mask, false, wide);
+		else if (operation == 2)
+			setA64Register(rd, immediate, false, wide);
+		else
+			setA64Register(rd, (a64Register(rd, false, wide) & ~(uint64_t(0xffff) << (16 * hw))) | immediate,
+				false, wide);
+		return;
+	}
+
+	if (((word >> 23) & 0x3f) == 0b100010)
+	{
+		// add and sub with a 12-bit immediate, shifted left by 12 or not
+		bool subtract = word & 0x40000000;
+		bool setFlags = word & 0x20000000;
+		uint64_t immediate = uint64_t((word >> 10) & 0xfff) << (word & 0x00400000 ? 12 : 0);
+		uint64_t result = addSub(a64Register(rn, true, wide), immediate, subtract, setFlags);
+		setA64Register(rd, result, !setFlags, wide);
+		return;
+	}
+
+	if (((word >> 24) & 0x1f) == 0b01011 && !(word & 0x00200000))
+	{
+		// add and sub with a shifted register
+		bool subtract = word & 0x40000000;
+		bool setFlags = word & 0x20000000;
+		uint64_t operand = shift(a64Register(rm, false, wide), (word >> 22) & 3, (word >> 10) & 0x3f);
+		setA64Register(rd, addSub(a64Register(rn, false, wide), operand, subtract, setFlags), false, wide);
+		return;
+	}
+
+	if (((word >> 24) & 0x7f) == 0b0101010 && !(word & 0x00200000))
+	{
+		// orr with a shifted register, mov
+		uint64_t operand = shift(a64Register(rm, false, wide), (word >> 22) & 3, (word >> 10) & 0x3f);
+		setA64Register(rd, a64Register(rn, false, wide) | operand, false, wide);
+		return;
+	}
+
+	if (((word >> 21) & 0x3ff) == 0b0011011000)
+	{
+		// madd and msub
+		uint64_t addend = a64Register((word >> 10) & 31, false, wide);
+		uint64_t product = a64Register(rn, false, wide) * a64Register(rm, false, wide);
+		setA64Register(rd, word & 0x8000 ? addend - product : addend + product, false, wide);
+		return;
+	}
+
+	if ((word & 0x7fe0fc00) == 0x1ac00c00)
+	{
+		// sdiv rounds toward zero, x / 0 is 0 and the overflow wraps
+		int64_t a = signExtend(a64Register(rn, false, wide), bits);
+		int64_t b = signExtend(a64Register(rm, false, wide), bits);
+		uint64_t quotient = b == 0 ? 0 : b == -1 ? 0 - static_cast<uint64_t>(a) : static_cast<uint64_t>(a / b);
+		setA64Register(rd, quotient & mask, false, wide);
+		return;
+	}
+
+	if (((word >> 21) & 0xff) == 0b11010100)
+	{
+		// csel and csneg
+		uint32_t kind = ((word >> 29) & 2) | ((word >> 10) & 1);
+		if ((word & 0x20000000) || (kind != 0 && kind != 3) || (word & 0x800))
+			fail("unexpected conditional select", word);
+
+		uint32_t condition = (word >> 12) & 0xf;
+		uint64_t value;
+		if (condition == 0xe || passed(condition))
+			value = a64Register(rn, false, wide);
+		else
+			value = kind == 3 ? (0 - a64Register(rm, false, wide)) & mask : a64Register(rm, false, wide);
+		setA64Register(rd, value, false, wide);
+		return;
+	}
+
+	if (((word >> 23) & 0x3f) == 0b100110)
+	{
+		// ubfm and sbfm on w registers: lsl, lsr and asr
+		uint32_t operation = (word >> 29) & 3;
+		uint32_t immr = (word >> 16) & 0x3f;
+		uint32_t imms = (word >> 10) & 0x3f;
+		if (wide || (word & 0x00400000) || immr > 31 || imms > 31 || (operation != 0 && operation != 2))
+			fail("unexpected bitfield move", word);
+
+		uint32_t value = static_cast<uint32_t>(a64Register(rn, false, false));
+		uint32_t width = imms >= immr ? imms - immr + 1 : imms + 1;
+		uint64_t field = imms >= immr ? value >> immr : value;
+		field &= (uint64_t(1) << width) - 1;
+		if (operation == 0)
+			field = static_cast<uint64_t>(signExtend(field, width));
+		uint32_t result = static_cast<uint32_t>(imms >= immr ? field : field << (32 - immr));
+		setA64Register(rd, result, false, false);
+		return;
+	}
+
+	if ((word & 0xff800000) == 0xb9000000 || (word & 0xffe0fc00) == 0xb8206800
+		|| (word & 0xffe0fc00) == 0xb8606800)
+	{
+		// ldr and str of w registers at [xn, #imm12 * 4] or at [xn, xm]
+		bool load = word & 0x00400000;
+		uint64_t address = (word & 0x01000000)
+			? x_[rn] + 4 * ((word >> 10) & 0xfff)
+			: x_[rn] + a64Register(rm, false, true);
+		if (rn == 31 && x_[31] % 16 != 0)
+			fail("sp not 16-byte aligned", x_[31]);
+
+		if (load)
+			setA64Register(rd, load32(address), false, false);
+		else
+			store32(address, static_cast<uint32_t>(a64Register(rd, false, false)));
+		return;
+	}
+
+	if ((word & 0xffe00c00) == 0xf8000c00 || (word & 0xffe00c00) == 0xf8400400)
+	{
+		// str xt, [xn, #imm9]! and ldr xt, [xn], #imm9
+		int64_t offset = signExtend((word >> 12) & 0x1ff, 9);
+		bool load = word & 0x00400000;
+		if (rd == rn && rn != 31)
+			fail("writeback with Rn = Rt", word);
+
+		uint64_t base = x_[rn];
+		if (load)
+		{
+			setA64Register(rd, load64(base), false, true);
+			x_[rn] = base + offset;
+		}
+		else
+		{
+			x_[rn] = base + offset;
+			store64(x_[rn], a64Register(rd, false, true));
+		}
+
+		if (rn == 31 && x_[31] % 16 != 0)
+			fail("sp not 16-byte aligned", x_[31]);
+		return;
+	}
+
+	if (((word >> 25) & 0x7f) == 0b1010100 && (word >> 30) == 2 && ((word >> 23) & 3) != 0)
+	{
+		// stp and ldp of x registers: after, without and before writeback
+		uint32_t mode = (word >> 23) & 3;
+		bool load = word & 0x00400000;
+		int64_t offset = 8 * signExtend((word >> 15) & 0x7f, 7);
+		uint32_t second = (word >> 10) & 31;
+		if (load && rd == second)
+			fail("ldp into one register twice", word);
+		if (mode != 2 && (rn == rd || rn == second) && rn != 31)
+			fail("writeback with Rn = Rt", word);
+		if (rn == 31 && x_[31] % 16 != 0)
+			fail("sp not 16-byte aligned", x_[31]);
+
+		uint64_t base = x_[rn];
+		uint64_t address = mode == 1 ? base : base + offset;
+		if (load)
+		{
+			uint64_t a = load64(address);
+			uint64_t b = load64(address + 8);
+			setA64Register(rd, a, false, true);
+			setA64Register(second, b, false, true);
+		}
+		else
+		{
+			store64(address, a64Register(rd, false, true));
+			store64(address + 8, a64Register(second, false, true));
+		}
+
+		if (mode != 2)
+			x_[rn] = base + offset;
+		return;
+	}
+
+	if ((word & 0xfffffc1f) == 0xd63f0000)
+	{
+		// blr
+		uint64_t target = x_[rn];
+		x_[30] = pc_;
+		branchA64(target);
+		return;
+	}
+
+	if (word == 0xd65f03c0)
+	{
+		// ret
+		branchA64(x_[30]);
+		return;
+	}
+
+	fail("unknown A64 instruction", word);
+}
+
+#endif // EMULATOR_HPP
@@ -1,5 +1,16 @@
 #include "jit.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 
 bool Tokenizer::isLetter(char c)
 {
@@ -77,20 +88,20 @@ bool Tokenizer::CurrentIsNumber()
 
 Tokenizer& Tokenizer::Advance()
 {
-	if (finished_)
-		return *this;
-
 	currentToken_ = "";
 
-	if (iterator_ == std::istreambuf_iterator<char>())
-	{
-		currentToken_ = std::move(nextToken_);
-		finished_ = true;
+	if (finished_)
 		return *this;
-	}
 
 	while (currentToken_.size() == 0)
 	{
+		if (iterator_ == std::istreambuf_iterator<char>())
+		{
+			currentToken_ = std::move(nextToken_);
+			finished_ = true;
+			return *this;
+		}
+
 		char c = *iterator_;
 		++iterator_;
 
@@ -111,9 +122,6 @@ Tokenizer& Tokenizer::Advance()
 
 Tokenizer& Tokenizer::AdvanceSkipSpace()
 {
-	if (finished_)
-		return *this;
-
 	Advance();
 	while (isWhitespace(currentToken_[0]))
 		Advance();
@@ -125,316 +133,6160 @@ const std::string& Tokenizer::operator*()
 	return currentToken_;
 }
 
-std::unique_ptr<AST> Parser::parseProduct()
+namespace
 {
-	std::unique_ptr<AST> result = parseUnaryMinus();
-	while (**tokenizer_ == "*")
+	enum class CharClass : uint8_t
 	{
-		tokenizer_->AdvanceSkipSpace();
+		Other,
+		Whitespace,
+		Letter,
+		Digit,
+		Plus,
+		Minus,
+		Star,
+		LeftParenthesis,
+		RightParenthesis,
+		Comma
+	};
 
-		std::unique_ptr<ASTBinaryOperator> tmp
-			= std::make_unique<ASTBinaryOperator>();
-		tmp->left = std::move(result);
-		tmp->right = parseUnaryMinus();
-		tmp->operatorName = "*";
+	struct CharClassTable
+	{
+		CharClass classes[256];
 
-		result = std::move(tmp);
-	}
+		constexpr CharClassTable()
+			: classes()
+		{
+			for (int c = 'a'; c <= 'z'; ++c)
+				classes[c] = CharClass::Letter;
+			for (int c = 'A'; c <= 'Z'; ++c)
+				classes[c] = CharClass::Letter;
+			for (int c = '0'; c <= '9'; ++c)
+				classes[c] = CharClass::Digit;
 
-	return result;
+			classes[static_cast<uint8_t>('_')] = CharClass::Letter;
+			classes[static_cast<uint8_t>(' ')] = CharClass::Whitespace;
+			classes[static_cast<uint8_t>('\t')] = CharClass::Whitespace;
+			classes[static_cast<uint8_t>('\n')] = CharClass::Whitespace;
+			classes[static_cast<uint8_t>('\r')] = CharClass::Whitespace;
+			classes[static_cast<uint8_t>('+')] = CharClass::Plus;
+			classes[static_cast<uint8_t>('-')] = CharClass::Minus;
+			classes[static_cast<uint8_t>('*')] = CharClass::Star;
+			classes[static_cast<uint8_t>('(')] = CharClass::LeftParenthesis;
+			classes[static_cast<uint8_t>(')')] = CharClass::RightParenthesis;
+			classes[static_cast<uint8_t>(',')] = CharClass::Comma;
+		}
+
+		CharClass operator[](char c) const
+		{
+			return classes[static_cast<uint8_t>(c)];
+		}
+	};
+
+	constexpr CharClassTable CHAR_CLASSES;
 }
 
-std::unique_ptr<AST> Parser::parseSum()
+Lexer::Lexer(const char* begin, const char* end)
+	: position_(begin),
+	end_(end),
+	current_{TokenKind::End, std::string_view()}
 {
-	std::unique_ptr<AST> result = parseProduct();
-	while (**tokenizer_ == "-" || **tokenizer_ == "+")
-	{
-		std::string op = **tokenizer_;
-		tokenizer_->AdvanceSkipSpace();
 
-		std::unique_ptr<ASTBinaryOperator> tmp
-			= std::make_unique<ASTBinaryOperator>();
-		tmp->left = std::move(result);
-		tmp->right = parseProduct();
-		tmp->operatorName = op;
-
-		result = std::move(tmp);
-	}
-	return result;
 }
 
-std::unique_ptr<AST> Parser::parseUnaryMinus()
+Lexer::Lexer(std::string_view input)
+	: Lexer(input.data(), input.data() + input.size())
 {
-	if (**tokenizer_ == "-")
-	{
-		std::unique_ptr<ASTUnaryOperator> result =
-			std::make_unique<ASTUnaryOperator>();
-		result->operatorName = **tokenizer_;
-		tokenizer_->AdvanceSkipSpace();
-		result->argument = parseUnaryMinus();
 
-		return result;
-	}
-	else
-	{
-		return parseSimpleExpression();
-	}
 }
 
-std::unique_ptr<AST> Parser::parseSimpleExpression()
+const Token& Lexer::Current() const
+{
+	return current_;
+}
+
+Lexer& Lexer::Advance()
 {
-	if (**tokenizer_ == "(")
+	while (position_ != end_ && CHAR_CLASSES[*position_] == CharClass::Whitespace)
+		++position_;
+
+	const char* start = position_;
+	if (position_ == end_)
 	{
-		tokenizer_->AdvanceSkipSpace();
-		std::unique_ptr<AST> result = parseSum();
-		if (**tokenizer_ != ")")
-			throw 0;
-		tokenizer_->AdvanceSkipSpace();
-		return result;
+		current_ = Token{TokenKind::End, std::string_view(start, 0)};
+		return *this;
 	}
-	else if(tokenizer_->CurrentIsIdentifier())
-	{
-		std::string identifier = **tokenizer_;
-		tokenizer_->AdvanceSkipSpace();
 
-		std::unique_ptr<ASTFunction> result =
-			std::make_unique<ASTFunction>();
-		result->symbolName = identifier;
-		
-		if (**tokenizer_ == "(")
-		{
-			do
-			{
-				tokenizer_->AdvanceSkipSpace();
-				result->arguments.push_back(parseSum());
-			}
-			while (**tokenizer_ == ",");
+	TokenKind kind;
+	switch (CHAR_CLASSES[*position_++])
+	{
+		case CharClass::Letter:
+			while (position_ != end_ &&
+				(CHAR_CLASSES[*position_] == CharClass::Letter ||
+					CHAR_CLASSES[*position_] == CharClass::Digit))
+				++position_;
+			kind = TokenKind::Identifier;
+			break;
 
-			if (**tokenizer_ != ")")
-				throw 0;
+		case CharClass::Digit:
+			while (position_ != end_ && CHAR_CLASSES[*position_] == CharClass::Digit)
+				++position_;
+			kind = TokenKind::Number;
+			break;
 
-			tokenizer_->AdvanceSkipSpace();
-		}
+		case CharClass::Plus: kind = TokenKind::Plus; break;
+		case CharClass::Minus: kind = TokenKind::Minus; break;
+		case CharClass::Star: kind = TokenKind::Star; break;
+		case CharClass::LeftParenthesis: kind = TokenKind::LeftParenthesis; break;
+		case CharClass::RightParenthesis: kind = TokenKind::RightParenthesis; break;
+		case CharClass::Comma: kind = TokenKind::Comma; break;
 
-		return result;
+		default:
+			kind = TokenKind::Error;
+			break;
 	}
-	else if (tokenizer_->CurrentIsNumber())
-	{
-		std::unique_ptr<ASTLiteral> result =
-			std::make_unique<ASTLiteral>();
 
-		result->literal = **tokenizer_;
-		tokenizer_->AdvanceSkipSpace();
+	current_ = Token{kind, std::string_view(start, position_ - start)};
+	return *this;
+}
 
-		return result;
+namespace
+{
+	// FNV-1a
+	uint32_t hashName(std::string_view name)
+	{
+		uint32_t hash = 2166136261u;
+		for (char c : name)
+			hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+
+		return hash;
 	}
+}
 
+AST::AST()
+	: root_(0)
+{
 
-	throw 0;
 }
 
-
-Parser::Parser(Tokenizer& tokenizer)
-	: tokenizer_(&tokenizer)
+void AST::Reserve(size_t nodes)
 {
+	nodes_.reserve(nodes);
+	arguments_.reserve(nodes);
+}
 
+uint32_t AST::add(const ASTNode& node)
+{
+	nodes_.push_back(node);
+	return nodes_.size() - 1;
 }
 
-std::unique_ptr<AST> Parser::Parse()
+uint32_t AST::Literal(uint32_t value)
 {
-	tokenizer_->AdvanceSkipSpace();
-	return parseSum();
+	return add(ASTNode{ASTKind::Literal, 0, 0, value});
 }
 
+uint32_t AST::Variable(uint32_t symbol)
+{
+	return add(ASTNode{ASTKind::Variable, 0, 0, symbol});
+}
 
+uint32_t AST::Call(uint32_t symbol, const uint32_t* arguments, uint32_t count)
+{
+	uint32_t first = arguments_.size();
+	arguments_.insert(arguments_.end(), arguments, arguments + count);
+	return add(ASTNode{ASTKind::Call, first, count, symbol});
+}
 
+uint32_t AST::Negate(uint32_t operand)
+{
+	return add(ASTNode{ASTKind::Negate, operand, 0, 0});
+}
 
+uint32_t AST::Binary(ASTKind kind, uint32_t left, uint32_t right)
+{
+	return add(ASTNode{kind, left, right, 0});
+}
 
-Compiler::Compiler(AST& tree)
-	: treeDependency_(&tree)
+void AST::rehash(size_t slots)
 {
+	symbolSlots_.assign(slots, NO_SYMBOL);
+	for (uint32_t symbol = 0; symbol < symbols_.size(); ++symbol)
+	{
+		size_t slot = hashName(symbols_[symbol]) & (slots - 1);
+		while (symbolSlots_[slot] != NO_SYMBOL)
+			slot = (slot + 1) & (slots - 1);
 
+		symbolSlots_[slot] = symbol;
+	}
 }
 
-void Compiler::writeWord(uint32_t word)
+uint32_t AST::Intern(std::string_view name)
 {
-	streamDependency_->write((char*) &word, sizeof(uint32_t));
+	// at most half full
+	if (2 * (symbols_.size() + 1) > symbolSlots_.size())
+		rehash(std::max<size_t>(16, 2 * symbolSlots_.size()));
+
+	size_t mask = symbolSlots_.size() - 1;
+	size_t slot = hashName(name) & mask;
+	for (; symbolSlots_[slot] != NO_SYMBOL; slot = (slot + 1) & mask)
+	{
+		if (symbols_[symbolSlots_[slot]] == name)
+			return symbolSlots_[slot];
+	}
+
+	symbolSlots_[slot] = symbols_.size();
+	symbols_.emplace_back(name);
+	return symbolSlots_[slot];
 }
 
-void Compiler::pop(uint8_t reg)
+const std::string& AST::SymbolName(uint32_t symbol) const
 {
-	writeWord(POP_MASK | ((reg & 0xf) << 12));
+	return symbols_[symbol];
 }
 
-void Compiler::push(uint8_t reg)
+size_t AST::SymbolCount() const
 {
-	writeWord(PUSH_MASK | ((reg & 0xf) << 12));
+	return symbols_.size();
 }
 
-void Compiler::sum(uint8_t first, uint8_t second)
+const ASTNode& AST::operator[](uint32_t node) const
 {
-	writeWord(ADD_MASK | ((first & 0xf) << 16) | ((first & 0xf) << 12) | (second & 0xf));
+	return nodes_[node];
 }
 
-void Compiler::sub(uint8_t first, uint8_t second)
+const uint32_t* AST::Arguments(const ASTNode& call) const
 {
-	writeWord(SUB_MASK | ((first & 0xf) << 16) | ((first & 0xf) << 12) | (second & 0xf));
+	return arguments_.data() + call.left;
 }
 
-void Compiler::mul(uint8_t first, uint8_t second)
+size_t AST::Size() const
 {
-	writeWord(MUL_MASK | ((first & 0xf) << 16) | ((first & 0xf) << 8) | (second & 0xf));
+	return nodes_.size();
 }
 
-
-void Compiler::blx(uint8_t reg)
+uint32_t AST::Root() const
 {
-	writeWord(BLX_MASK | (reg & 0xf));
+	return root_;
 }
 
-void Compiler::constant(uint32_t constant, uint8_t reg)
+void AST::SetRoot(uint32_t node)
 {
-	writeWord(LDR_MASK | (0xf << 16) | ((reg & 0xf) << 12));
-	writeWord(ADD_MASK | (0xf << 16) | (0xf << 12) | (0x1 << 25));
-	writeWord(constant);
+	root_ = node;
 }
 
-void Compiler::loadConstant(uint32_t adress, uint8_t reg)
+void AST::Compact()
 {
-	constant(adress, reg);
-	writeWord(LDR_MASK | ((reg & 0xf) << 16) | ((reg & 0xf) << 12));
-}
+	if (nodes_.empty())
+		return;
 
+	// users come after their operands, so one backward scan marks everything
+	std::vector<uint32_t> remap(root_ + 1, 0);
+	remap[root_] = 1;
 
-void Compiler::compileTree(AST* current)
-{
-	if (ASTBinaryOperator* casted = dynamic_cast<ASTBinaryOperator*>(current))
+	for (uint32_t i = root_ + 1; i-- > 0;)
 	{
-		compileTree(casted->left.get());
-		compileTree(casted->right.get());
-		if (casted->operatorName == "+")
-		{
-			pop(1);
-			pop(0);
-			sum(0, 1);
-			push(0);
-		}
-		else if (casted->operatorName == "-")
-		{
-			pop(1);
-			pop(0);
-			sub(0, 1);
-			push(0);
-		}
-		else if (casted->operatorName == "*")
+		if (!remap[i])
+			continue;
+
+		const ASTNode& node = nodes_[i];
+		switch (node.kind)
 		{
-			pop(1);
-			pop(0);
-			mul(0, 1);
-			push(0);
+			case ASTKind::Call:
+				for (uint32_t j = 0; j < node.right; ++j)
+					remap[arguments_[node.left + j]] = 1;
+				break;
+
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+				remap[node.right] = 1;
+				// fallthrough
+			case ASTKind::Negate:
+				remap[node.left] = 1;
+				break;
+
+			default:
+				break;
 		}
-		else
+	}
+
+	std::vector<ASTNode> nodes;
+	std::vector<uint32_t> arguments;
+	nodes.reserve(root_ + 1);
+	arguments.reserve(arguments_.size());
+
+	for (uint32_t i = 0; i <= root_; ++i)
+	{
+		if (!remap[i])
+			continue;
+
+		ASTNode node = nodes_[i];
+		switch (node.kind)
 		{
-			throw 0;
+			case ASTKind::Call:
+			{
+				uint32_t first = arguments.size();
+				for (uint32_t j = 0; j < node.right; ++j)
+					arguments.push_back(remap[arguments_[node.left + j]]);
+				node.left = first;
+				break;
+			}
+
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+				node.right = remap[node.right];
+				// fallthrough
+			case ASTKind::Negate:
+				node.left = remap[node.left];
+				break;
+
+			default:
+				break;
 		}
+
+		remap[i] = nodes.size();
+		nodes.push_back(node);
+	}
+
+	nodes_ = std::move(nodes);
+	arguments_ = std::move(arguments);
+	root_ = nodes_.size() - 1;
+}
+
+uint32_t Parser::parseProduct()
+{
+	uint32_t result = parseUnaryMinus();
+	while (lexer_->Current().kind == TokenKind::Star)
+	{
+		lexer_->Advance();
+
+		uint32_t right = parseUnaryMinus();
+		result = tree_.Binary(ASTKind::Mul, result, right);
+	}
+
+	return result;
+}
+
+uint32_t Parser::parseSum()
+{
+	uint32_t result = parseProduct();
+	while (lexer_->Current().kind == TokenKind::Minus
+		|| lexer_->Current().kind == TokenKind::Plus)
+	{
+		ASTKind kind = lexer_->Current().kind == TokenKind::Plus
+			? ASTKind::Add : ASTKind::Sub;
+		lexer_->Advance();
+
+		uint32_t right = parseProduct();
+		result = tree_.Binary(kind, result, right);
+	}
+	return result;
+}
+
+uint32_t Parser::parseUnaryMinus()
+{
+	if (lexer_->Current().kind == TokenKind::Minus)
+	{
+		lexer_->Advance();
+		return tree_.Negate(parseUnaryMinus());
 	}
-	else if (ASTFunction* casted = dynamic_cast<ASTFunction*>(current))
+	else
+	{
+		return parseSimpleExpression();
+	}
+}
+
+uint32_t Parser::parseSimpleExpression()
+{
+	const Token& token = lexer_->Current();
+
+	if (token.kind == TokenKind::LeftParenthesis)
 	{
-		auto it = symtableDependency_->find(casted->symbolName);
-		
-		if (it == symtableDependency_->end())
+		lexer_->Advance();
+		uint32_t result = parseSum();
+		if (lexer_->Current().kind != TokenKind::RightParenthesis)
 			throw 0;
+		lexer_->Advance();
+		return result;
+	}
+	else if (token.kind == TokenKind::Identifier)
+	{
+		uint32_t symbol = tree_.Intern(token.text);
+		lexer_->Advance();
+
+		if (lexer_->Current().kind != TokenKind::LeftParenthesis)
+			return tree_.Variable(symbol);
 
-		if (casted->arguments.size() == 0)
+		// arguments of nested calls stack up in one shared scratch array
+		size_t first = pendingArguments_.size();
+		do
 		{
-			loadConstant(it->second, 0);
-			push(0);
+			lexer_->Advance();
+			uint32_t argument = parseSum();
+			pendingArguments_.push_back(argument);
 		}
-		else
-		{
-			for (size_t i = 0; i < casted->arguments.size(); ++i)
-			{
-				compileTree(casted->arguments[i].get());
-			}
+		while (lexer_->Current().kind == TokenKind::Comma);
 
-			//will break if there are a lot of arguments
-			for (size_t i = 0; i < casted->arguments.size(); ++i)
-			{
-				pop(casted->arguments.size() - 1 - i);
-			}
+		if (lexer_->Current().kind != TokenKind::RightParenthesis)
+			throw 0;
 
-			constant(it->second, 7);
-			blx(7);
-			push(0);
-		}
+		lexer_->Advance();
+
+		uint32_t result = tree_.Call(symbol, pendingArguments_.data() + first,
+			pendingArguments_.size() - first);
+		pendingArguments_.resize(first);
+		return result;
+	}
+	else if (token.kind == TokenKind::Number)
+	{
+		// literals wrap around modulo 2^32, like the arithmetic on them
+		uint32_t value = 0;
+		for (char c : token.text)
+			value = value * 10 + (c - '0');
+
+		lexer_->Advance();
+		return tree_.Literal(value);
+	}
+
+
+	throw 0;
+}
+
+
+Parser::Parser(Lexer& lexer)
+	: lexer_(&lexer)
+{
+
+}
+
+AST Parser::Parse(size_t sizeHint)
+{
+	tree_ = AST();
+	tree_.Reserve(sizeHint);
+	pendingArguments_.clear();
+
+	lexer_->Advance();
+	tree_.SetRoot(parseSum());
+	if (lexer_->Current().kind != TokenKind::End)
+		throw 0;
+
+	return std::move(tree_);
+}
+
+
+
+
+
+bool Optimizer::literalValue(uint32_t node, uint32_t& value) const
+{
+	const ASTNode& casted = (*tree_)[node];
+	if (casted.kind != ASTKind::Literal)
+		return false;
+
+	value = casted.value;
+	return true;
+}
+
+bool Optimizer::hasCalls(uint32_t node) const
+{
+	const ASTNode& casted = (*tree_)[node];
+	switch (casted.kind)
+	{
+		case ASTKind::Call:
+			return true;
+
+		case ASTKind::Negate:
+			return hasCalls(casted.left);
+
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+			return hasCalls(casted.left) || hasCalls(casted.right);
+
+		default:
+			return false;
+	}
+}
+
+uint32_t Optimizer::negation(uint32_t operand)
+{
+	uint32_t value;
+	if (literalValue(operand, value))
+		return tree_->Literal(0 - value);
+
+	const ASTNode& casted = (*tree_)[operand];
+
+	// -(-x) -> x
+	if (casted.kind == ASTKind::Negate)
+		return casted.left;
+
+	// -(x - y) -> y - x
+	if (casted.kind == ASTKind::Sub)
+		return tree_->Binary(ASTKind::Sub, casted.right, casted.left);
+
+	return tree_->Negate(operand);
+}
+
+uint32_t Optimizer::binary(ASTKind kind, uint32_t left, uint32_t right)
+{
+	uint32_t leftValue = 0;
+	uint32_t rightValue = 0;
+	bool leftLiteral = literalValue(left, leftValue);
+	bool rightLiteral = literalValue(right, rightValue);
+
+	if (leftLiteral && rightLiteral)
+	{
+		if (kind == ASTKind::Add)
+			return tree_->Literal(leftValue + rightValue);
+		if (kind == ASTKind::Sub)
+			return tree_->Literal(leftValue - rightValue);
+		return tree_->Literal(leftValue * rightValue);
 	}
-	else if (ASTUnaryOperator* casted = dynamic_cast<ASTUnaryOperator*>(current))
+
+	// subtracting a literal is adding its negation
+	if (rightLiteral && kind == ASTKind::Sub)
+		return binary(ASTKind::Add, left, tree_->Literal(0 - rightValue));
+
+	// commutative operators keep their literal on the right
+	if (leftLiteral && kind != ASTKind::Sub)
+		return binary(kind, right, left);
+
+	if (leftLiteral && leftValue == 0)
+		return negation(right);
+
+	// copies, since new nodes may reallocate the node array
+	ASTNode leftNode = (*tree_)[left];
+	ASTNode rightNode = (*tree_)[right];
+
+	if (rightLiteral)
 	{
-		compileTree(casted->argument.get());
+		if (kind == ASTKind::Add && rightValue == 0)
+			return left;
 
-		if (casted->operatorName == "-")
+		if (kind == ASTKind::Mul)
 		{
+			if (rightValue == 1)
+				return left;
+			// the operand is dropped only if it can't have side effects
+			if (rightValue == 0 && !hasCalls(left))
+				return right;
+			if (rightValue == 0xffffffff)
+				return negation(left);
 
-			pop(1);
-			constant(0, 0);
-			sub(0, 1);
-			push(0);
+			// -x * c -> x * -c
+			if (leftNode.kind == ASTKind::Negate)
+				return binary(kind, leftNode.left, tree_->Literal(0 - rightValue));
 		}
-		else
+
+		// (x op a) op b -> x op (a op b)
+		uint32_t inner;
+		if (leftNode.kind == kind && literalValue(leftNode.right, inner))
 		{
-			throw 0;
+			uint32_t folded = kind == ASTKind::Add ? inner + rightValue : inner * rightValue;
+			return binary(kind, leftNode.left, tree_->Literal(folded));
 		}
 	}
-	else if (ASTLiteral* casted = dynamic_cast<ASTLiteral*>(current))
+	else if (kind == ASTKind::Add || kind == ASTKind::Mul)
 	{
-		constant(stoul(casted->literal), 0);
-		push(0);
+		// literals bubble up: (x op c) op y -> (x op y) op c
+		uint32_t inner;
+		if (leftNode.kind == kind && literalValue(leftNode.right, inner))
+			return binary(kind, binary(kind, leftNode.left, right), leftNode.right);
+
+		// y op (x op c) -> (y op x) op c
+		if (rightNode.kind == kind && literalValue(rightNode.right, inner))
+			return binary(kind, binary(kind, left, rightNode.left), rightNode.right);
 	}
-	else
+
+	if (kind == ASTKind::Add || kind == ASTKind::Sub)
 	{
-		throw 0;
+		// x + -y -> x - y, x - -y -> x + y
+		if (rightNode.kind == ASTKind::Negate)
+		{
+			ASTKind flipped = kind == ASTKind::Add ? ASTKind::Sub : ASTKind::Add;
+			return binary(flipped, left, rightNode.left);
+		}
+
+		// -x + y -> y - x
+		if (leftNode.kind == ASTKind::Negate && kind == ASTKind::Add)
+			return binary(ASTKind::Sub, right, leftNode.left);
 	}
+
+	return tree_->Binary(kind, left, right);
 }
 
-void Compiler::Compile(std::ostream& stream, std::map<std::string, uint32_t>& symtable)
+void Optimizer::Optimize(AST& tree)
 {
-	streamDependency_ = &stream;
-	symtableDependency_ = &symtable;
-	// init code
+	tree_ = &tree;
 
-	writeWord(0xe92d43f0); // push {r4-r9, lr}
-	compileTree(treeDependency_);
-	pop(0);
-	writeWord(0xe8bd43f0); // pop {r4-r9, lr}
-	writeWord(0xe12fff1e); // bx lr
+	// rewritten nodes are appended, so a single forward scan
+	// sees every operand already simplified
+	size_t size = tree.Size();
+	std::vector<uint32_t> rewritten(size);
+	std::vector<uint32_t> arguments;
+
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		ASTNode node = tree[i];
+		switch (node.kind)
+		{
+			case ASTKind::Literal:
+			case ASTKind::Variable:
+				rewritten[i] = i;
+				break;
+
+			case ASTKind::Call:
+				arguments.clear();
+				for (uint32_t j = 0; j < node.right; ++j)
+					arguments.push_back(rewritten[tree.Arguments(node)[j]]);
+				rewritten[i] = tree.Call(node.value, arguments.data(), node.right);
+				break;
+
+			case ASTKind::Negate:
+				rewritten[i] = negation(rewritten[node.left]);
+				break;
+
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+				rewritten[i] = binary(node.kind, rewritten[node.left], rewritten[node.right]);
+				break;
+		}
+	}
+
+	tree.SetRoot(rewritten[tree.Root()]);
+	tree.Compact();
 }
 
-extern "C" void jit_compile_expression_to_arm(
-	const char* expression,
-	const symbol_t* externs,
-	void* out_buffer)
+
+
+
+CodeBuffer::CodeBuffer(void* memory, size_t capacity)
+	: memory_(reinterpret_cast<uint8_t*>(memory)),
+	capacity_(capacity),
+	size_(0)
 {
-	std::stringstream in(expression);
 
-	Tokenizer tokenizer(in);
-	Parser parser(tokenizer);
-	auto tree = parser.Parse();
-	Compiler compiler(*tree);
+}
 
+void CodeBuffer::Write(uint32_t word)
+{
+	if (capacity_ - size_ < sizeof(uint32_t))
+		throw 0;
 
-	std::map<std::string, uint32_t> symtable;
-	for (int i = 0; externs[i].name != 0 || externs[i].pointer != 0; ++i)
-	{
-		symtable[externs[i].name] = reinterpret_cast<uint32_t>(externs[i].pointer);
-	}
+	if (memory_ != nullptr)
+		std::memcpy(memory_ + size_, &word, sizeof(uint32_t));
+	size_ += sizeof(uint32_t);
+}
+
+void CodeBuffer::WriteHalf(uint16_t half)
+{
+	if (capacity_ - size_ < sizeof(uint16_t))
+		throw 0;
+
+	if (memory_ != nullptr)
+		std::memcpy(memory_ + size_, &half, sizeof(uint16_t));
+	size_ += sizeof(uint16_t);
+}
+
+void CodeBuffer::Write(uint32_t word, Label label, Fixup kind)
+{
+	size_t position = size_;
+	Write(word);
+
+	if (labels_[label] != UNBOUND)
+		resolve(position, labels_[label], kind);
+	else
+		fixups_.push_back(PendingFixup{position, label, kind});
+}
 
-	std::stringstream out;
-	compiler.Compile(out, symtable);
+uint32_t CodeBuffer::Read(size_t position) const
+{
+	uint32_t word = 0;
+	if (memory_ != nullptr)
+		std::memcpy(&word, memory_ + position, sizeof(uint32_t));
+	return word;
+}
+
+void CodeBuffer::Patch(size_t position, uint32_t word)
+{
+	if (memory_ != nullptr)
+		std::memcpy(memory_ + position, &word, sizeof(uint32_t));
+}
 
-	out.seekg(0, std::ios::end);
-	int size = out.tellg();
-	out.seekg(0, std::ios::beg);
+size_t CodeBuffer::Position() const
+{
+	return size_;
+}
 
-	out.read(reinterpret_cast<char*>(out_buffer), size);
+auto CodeBuffer::NewLabel()
+	-> Label
+{
+	labels_.push_back(UNBOUND);
+	return labels_.size() - 1;
 }
 
+void CodeBuffer::Bind(Label label)
+{
+	labels_[label] = size_;
+
+	auto pending = std::remove_if(fixups_.begin(), fixups_.end(),
+		[this, label](const PendingFixup& fixup)
+		{
+			if (fixup.label != label)
+				return false;
+
+			resolve(fixup.position, size_, fixup.kind);
+			return true;
+		});
+	fixups_.erase(pending, fixups_.end());
+}
+
+void CodeBuffer::resolve(size_t position, size_t target, Fixup kind)
+{
+	// the pc reads two instructions ahead
+	int64_t offset = static_cast<int64_t>(target) - static_cast<int64_t>(position + 8);
+	uint32_t word = Read(position);
+
+	switch (kind)
+	{
+		case Fixup::PcRelativeLoad:
+			if (offset < -4095 || offset > 4095)
+				throw 0;
+
+			word &= ~((1u << 23) | 0xfff);
+			word |= offset >= 0
+				? (1u << 23) | static_cast<uint32_t>(offset)
+				: static_cast<uint32_t>(-offset);
+			break;
+
+		case Fixup::Branch:
+			if (offset < -(1 << 25) || offset >= (1 << 25))
+				throw 0;
+
+			word &= 0xff000000;
+			word |= static_cast<uint32_t>(offset >> 2) & 0xffffff;
+			break;
+	}
+
+	Patch(position, word);
+}
+
+size_t CodeBuffer::Finish()
+{
+	if (!fixups_.empty())
+		throw 0;
+
+	return size_;
+}
+
+
+
+
+
+SymbolTable::SymbolTable(const symbol_t* externs)
+	: mask_(0), size_(0)
+{
+	size_t count = 0;
+	for (; externs != nullptr && (externs[count].name != 0 || externs[count].pointer != 0); ++count);
+
+	// at most half full, so probe sequences stay short
+	size_t capacity = 1;
+	while (capacity < 2 * count)
+		capacity *= 2;
+	slots_.assign(capacity, nullptr);
+	mask_ = capacity - 1;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (externs[i].name == nullptr)
+			continue;
+
+		std::string_view name(externs[i].name);
+		for (size_t slot = hashName(name) & mask_; ; slot = (slot + 1) & mask_)
+		{
+			if (slots_[slot] == nullptr)
+			{
+				slots_[slot] = &externs[i];
+				++size_;
+				break;
+			}
+
+			if (name == slots_[slot]->name)
+			{
+				slots_[slot] = &externs[i];
+				break;
+			}
+		}
+	}
+}
+
+const symbol_t* SymbolTable::Find(std::string_view name) const
+{
+	for (size_t slot = hashName(name) & mask_; slots_[slot] != nullptr; slot = (slot + 1) & mask_)
+	{
+		if (name == slots_[slot]->name)
+			return slots_[slot];
+	}
+
+	return nullptr;
+}
+
+size_t SymbolTable::Size() const
+{
+	return size_;
+}
+
+IR::IR(const AST& tree, const SymbolTable& symtable,
+	const std::vector<std::string>& parameters)
+	: treeDependency_(&tree)
+{
+	names_.reserve(tree.SymbolCount());
+	symbols_.assign(tree.SymbolCount(), nullptr);
+	parameters_.assign(tree.SymbolCount(), UINT32_MAX);
+
+	for (uint32_t i = 0; i < tree.SymbolCount(); ++i)
+	{
+		names_.push_back(tree.SymbolName(i));
+		auto parameter = std::find(parameters.begin(), parameters.end(), names_[i]);
+		if (parameter == parameters.end())
+		{
+			symbols_[i] = symtable.Find(names_[i]);
+			continue;
+		}
+
+		// read ahead of everything, while the argument registers are intact
+		bool used = false;
+		for (uint32_t node = 0; node < tree.Size() && !used; ++node)
+			used = tree[node].kind == ASTKind::Variable && tree[node].value == i;
+		if (used)
+			parameters_[i] = emit(IROp::Parameter, 0, 0, parameter - parameters.begin());
+	}
+
+	emit(IROp::Return, lower(tree.Root()));
+	code_.back().type = IRType::Void;
+	treeDependency_ = nullptr;
+}
+
+uint32_t IR::emit(IROp op, uint32_t first, uint32_t second, uint32_t operand)
+{
+	code_.push_back(IRInstruction{op, IRType::I32, first, second, operand});
+	return code_.size() - 1;
+}
+
+uint32_t IR::lower(uint32_t current)
+{
+	const AST& tree = *treeDependency_;
+	const ASTNode& node = tree[current];
+
+	switch (node.kind)
+	{
+		case ASTKind::Literal:
+			return emit(IROp::Constant, 0, 0, node.value);
+
+		case ASTKind::Variable:
+			if (parameters_[node.value] != UINT32_MAX)
+				return parameters_[node.value];
+			if (symbols_[node.value] == nullptr)
+				throw 0;
+			return emit(IROp::Load, 0, 0, node.value);
+
+		case ASTKind::Negate:
+			return emit(IROp::Negate, lower(node.left));
+
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+		{
+			uint32_t left = lower(node.left);
+			uint32_t right = lower(node.right);
+			IROp op = node.kind == ASTKind::Add ? IROp::Add
+				: node.kind == ASTKind::Sub ? IROp::Sub : IROp::Mul;
+			return emit(op, left, right);
+		}
+
+		case ASTKind::Call:
+			break;
+	}
+
+	const symbol_t* symbol = symbols_[node.value];
+	if (symbol == nullptr)
+		throw 0;
+
+	const uint32_t* arguments = tree.Arguments(node);
+	uint32_t count = node.right;
+
+	// the same shortcuts as the compiler and the interpreter
+	if ((symbol->semantics == SYMBOL_DIV || symbol->semantics == SYMBOL_MOD) && count == 2
+		&& tree[arguments[1]].kind == ASTKind::Literal && tree[arguments[1]].value != 0)
+	{
+		uint32_t divisor = tree[arguments[1]].value;
+		bool modulo = symbol->semantics == SYMBOL_MOD;
+		uint32_t dividend = lower(arguments[0]);
+
+		if (divisor == UINT32_MAX)
+			return modulo ? emit(IROp::Constant) : emit(IROp::Negate, dividend);
+		return emit(modulo ? IROp::Modulo : IROp::Divide, dividend, node.value, divisor);
+	}
+
+	const intrinsic_t* intrinsic = symbol->intrinsic;
+	if (intrinsic != nullptr && intrinsic->op != INTRINSIC_TEMPLATE)
+	{
+		bool binary = intrinsic->op == INTRINSIC_MIN || intrinsic->op == INTRINSIC_MAX;
+		if (count == (binary ? 2u : 1u))
+		{
+			uint32_t first = lower(arguments[0]);
+			uint32_t second = binary ? lower(arguments[1]) : 0;
+			uint32_t immediate = intrinsic->immediate;
+
+			switch (intrinsic->op)
+			{
+				case INTRINSIC_ADD_IMMEDIATE:
+					return emit(IROp::Add, first, emit(IROp::Constant, 0, 0, immediate));
+				case INTRINSIC_NEGATE:
+					return emit(IROp::Negate, first);
+				case INTRINSIC_ABS:
+					return emit(IROp::Abs, first);
+				case INTRINSIC_SHIFT_LEFT:
+				case INTRINSIC_SHIFT_RIGHT:
+					if (immediate > 31)
+						throw 0;
+					return emit(intrinsic->op == INTRINSIC_SHIFT_LEFT ? IROp::ShiftLeft : IROp::ShiftRight,
+						first, 0, immediate);
+				case INTRINSIC_MIN:
+					return emit(IROp::Min, first, second);
+				case INTRINSIC_MAX:
+					return emit(IROp::Max, first, second);
+				default:
+					throw 0;
+			}
+		}
+	}
+
+	// the values first, as arguments may be calls themselves
+	std::vector<uint32_t> values;
+	for (uint32_t i = 0; i < count; ++i)
+		values.push_back(lower(arguments[i]));
+
+	uint32_t first = arguments_.size();
+	arguments_.insert(arguments_.end(), values.begin(), values.end());
+	return emit(IROp::Call, first, count, node.value);
+}
+
+size_t IR::Size() const
+{
+	return code_.size();
+}
+
+IRInstruction& IR::operator[](uint32_t value)
+{
+	return code_[value];
+}
+
+const IRInstruction& IR::operator[](uint32_t value) const
+{
+	return code_[value];
+}
+
+uint32_t* IR::Arguments(const IRInstruction& call)
+{
+	return arguments_.data() + call.first;
+}
+
+const uint32_t* IR::Arguments(const IRInstruction& call) const
+{
+	return arguments_.data() + call.first;
+}
+
+const symbol_t* IR::Symbol(uint32_t symbol) const
+{
+	return symbols_[symbol];
+}
+
+const std::string& IR::SymbolName(uint32_t symbol) const
+{
+	return names_[symbol];
+}
+
+bool IR::Pure(const IRInstruction& instruction) const
+{
+	if (instruction.op == IROp::Return)
+		return false;
+
+	return instruction.op != IROp::Call
+		|| symbols_[instruction.operand]->semantics == SYMBOL_PURE;
+}
+
+namespace
+{
+	// calls through their argument list, the rest through first and second;
+	// operands are passed by reference, const if the instruction is
+	template<typename Program, typename Instruction, typename Function>
+	void forEachOperand(Program& ir, Instruction& instruction, Function&& function)
+	{
+		switch (instruction.op)
+		{
+			case IROp::Constant:
+			case IROp::Load:
+			case IROp::Parameter:
+				break;
+
+			case IROp::Call:
+				for (uint32_t i = 0; i < instruction.second; ++i)
+					function(ir.Arguments(instruction)[i]);
+				break;
+
+			case IROp::Add:
+			case IROp::Sub:
+			case IROp::Mul:
+			case IROp::Min:
+			case IROp::Max:
+				function(instruction.first);
+				function(instruction.second);
+				break;
+
+			default:
+				function(instruction.first);
+				break;
+		}
+	}
+}
+
+void IR::Rewrite(const std::vector<uint32_t>& replacement, const std::vector<bool>& keep)
+{
+	std::vector<uint32_t> renumbered(code_.size(), UINT32_MAX);
+	std::vector<IRInstruction> code;
+	std::vector<uint32_t> arguments;
+
+	auto rename = [&](uint32_t operand)
+	{
+		uint32_t value = renumbered[replacement[operand]];
+		if (value == UINT32_MAX)
+			throw 0;
+		return value;
+	};
+
+	for (uint32_t i = 0; i < code_.size(); ++i)
+	{
+		if (!keep[i])
+			continue;
+
+		IRInstruction instruction = code_[i];
+		if (instruction.op == IROp::Call)
+		{
+			uint32_t first = arguments.size();
+			for (uint32_t j = 0; j < instruction.second; ++j)
+				arguments.push_back(rename(arguments_[instruction.first + j]));
+			instruction.first = first;
+		}
+		else
+		{
+			forEachOperand(*this, instruction, [&](uint32_t& operand) { operand = rename(operand); });
+		}
+
+		renumbered[i] = code.size();
+		code.push_back(instruction);
+	}
+
+	code_.swap(code);
+	arguments_.swap(arguments);
+}
+
+std::string IR::Dump() const
+{
+	static const char* const mnemonics[] = {
+		"const", "load", "param", "neg", "add", "sub", "mul", "div", "mod",
+		"abs", "shl", "shr", "min", "max", "call", "ret"};
+
+	std::ostringstream out;
+	for (uint32_t i = 0; i < code_.size(); ++i)
+	{
+		const IRInstruction& instruction = code_[i];
+		if (instruction.type != IRType::Void)
+			out << '%' << i << " = ";
+		out << mnemonics[static_cast<uint8_t>(instruction.op)];
+
+		switch (instruction.op)
+		{
+			case IROp::Constant:
+				out << ' ' << static_cast<int32_t>(instruction.operand);
+				break;
+
+			case IROp::Load:
+				out << ' ' << names_[instruction.operand];
+				break;
+
+			case IROp::Parameter:
+				out << ' ' << instruction.operand;
+				break;
+
+			case IROp::Call:
+				out << ' ' << names_[instruction.operand] << '(';
+				for (uint32_t j = 0; j < instruction.second; ++j)
+					out << (j != 0 ? ", %" : "%") << Arguments(instruction)[j];
+				out << ')';
+				break;
+
+			case IROp::Divide:
+			case IROp::Modulo:
+			case IROp::ShiftLeft:
+			case IROp::ShiftRight:
+				out << " %" << instruction.first << ", " << static_cast<int32_t>(instruction.operand);
+				break;
+
+			case IROp::Add:
+			case IROp::Sub:
+			case IROp::Mul:
+			case IROp::Min:
+			case IROp::Max:
+				out << " %" << instruction.first << ", %" << instruction.second;
+				break;
+
+			default:
+				out << " %" << instruction.first;
+				break;
+		}
+
+		out << '\n';
+	}
+
+	return out.str();
+}
+
+void FoldConstants(IR& ir)
+{
+	std::vector<uint32_t> replacement(ir.Size());
+	std::vector<bool> keep(ir.Size(), true);
+
+	auto constant = [&ir](uint32_t value, uint32_t& result)
+	{
+		result = ir[value].operand;
+		return ir[value].op == IROp::Constant;
+	};
+
+	for (uint32_t i = 0; i < ir.Size(); ++i)
+	{
+		replacement[i] = i;
+		IRInstruction& instruction = ir[i];
+		forEachOperand(ir, instruction, [&](uint32_t& operand) { operand = replacement[operand]; });
+
+		auto fold = [&](uint32_t value) { instruction = IRInstruction{IROp::Constant, IRType::I32, 0, 0, value}; };
+		auto forward = [&](uint32_t value)
+		{
+			replacement[i] = value;
+			keep[i] = false;
+		};
+
+		bool binary = instruction.op == IROp::Add || instruction.op == IROp::Sub
+			|| instruction.op == IROp::Mul || instruction.op == IROp::Min || instruction.op == IROp::Max;
+		bool unary = instruction.op == IROp::Negate || instruction.op == IROp::Divide
+			|| instruction.op == IROp::Modulo || instruction.op == IROp::Abs
+			|| instruction.op == IROp::ShiftLeft || instruction.op == IROp::ShiftRight;
+
+		uint32_t a = 0;
+		uint32_t b = 0;
+		bool first = (unary || binary) && constant(instruction.first, a);
+		bool second = binary && constant(instruction.second, b);
+		int32_t divisor = static_cast<int32_t>(instruction.operand);
+
+		switch (instruction.op)
+		{
+			case IROp::Negate:
+				if (first)
+					fold(0 - a);
+				else if (ir[instruction.first].op == IROp::Negate)
+					forward(ir[instruction.first].first);
+				break;
+
+			case IROp::Add:
+				if (first && second)
+					fold(a + b);
+				else if (first && a == 0)
+					forward(instruction.second);
+				else if (second && b == 0)
+					forward(instruction.first);
+				break;
+
+			case IROp::Sub:
+				if (first && second)
+					fold(a - b);
+				else if (second && b == 0)
+					forward(instruction.first);
+				else if (instruction.first == instruction.second)
+					fold(0);
+				break;
+
+			case IROp::Mul:
+				// the operands stay for their side effects, if they have any
+				if ((first && a == 0) || (second && b == 0))
+					fold(0);
+				else if (first && second)
+					fold(a * b);
+				else if (first && a == 1)
+					forward(instruction.second);
+				else if (second && b == 1)
+					forward(instruction.first);
+				break;
+
+			case IROp::Divide:
+				if (first)
+					fold(static_cast<int32_t>(a) / divisor);
+				else if (divisor == 1)
+					forward(instruction.first);
+				break;
+
+			case IROp::Modulo:
+				if (first)
+					fold(static_cast<int32_t>(a) % divisor);
+				else if (divisor == 1)
+					fold(0);
+				break;
+
+			case IROp::Abs:
+				if (first)
+					fold(static_cast<int32_t>(a) < 0 ? 0 - a : a);
+				break;
+
+			case IROp::ShiftLeft:
+			case IROp::ShiftRight:
+				if (first)
+					fold(instruction.op == IROp::ShiftLeft ? a << instruction.operand
+						: static_cast<uint32_t>(static_cast<int32_t>(a) >> instruction.operand));
+				else if (instruction.operand == 0)
+					forward(instruction.first);
+				break;
+
+			case IROp::Min:
+			case IROp::Max:
+				if (first && second)
+					fold(instruction.op == IROp::Min
+						? std::min(static_cast<int32_t>(a), static_cast<int32_t>(b))
+						: std::max(static_cast<int32_t>(a), static_cast<int32_t>(b)));
+				else if (instruction.first == instruction.second)
+					forward(instruction.first);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	ir.Rewrite(replacement, keep);
+}
+
+void EliminateCommonValues(IR& ir)
+{
+	std::vector<uint32_t> replacement(ir.Size());
+	std::vector<bool> keep(ir.Size(), true);
+
+	// hash-consing as in the compiler: identical pure instructions over
+	// the same values meet, and a variable is loaded once
+	auto fields = [](const IRInstruction& instruction)
+	{
+		std::array<uint32_t, 3> fields = {instruction.first, instruction.second, instruction.operand};
+		bool commutative = instruction.op == IROp::Add || instruction.op == IROp::Mul
+			|| instruction.op == IROp::Min || instruction.op == IROp::Max;
+		if (commutative && fields[0] > fields[1])
+			std::swap(fields[0], fields[1]);
+		if (instruction.op == IROp::Call)
+			fields[0] = 0;
+		return fields;
+	};
+
+	size_t capacity = 16;
+	while (capacity < 2 * ir.Size())
+		capacity *= 2;
+	std::vector<uint32_t> seen(capacity, UINT32_MAX);
+	size_t mask = capacity - 1;
+
+	for (uint32_t i = 0; i < ir.Size(); ++i)
+	{
+		replacement[i] = i;
+		IRInstruction& instruction = ir[i];
+		forEachOperand(ir, instruction, [&](uint32_t& operand) { operand = replacement[operand]; });
+		if (!ir.Pure(instruction))
+			continue;
+
+		std::array<uint32_t, 3> key = fields(instruction);
+		uint32_t hash = (2166136261u ^ static_cast<uint32_t>(instruction.op)) * 16777619u;
+		for (uint32_t field : key)
+			hash = (hash ^ field) * 16777619u;
+		const uint32_t* arguments = instruction.op == IROp::Call ? ir.Arguments(instruction) : nullptr;
+		for (uint32_t j = 0; arguments != nullptr && j < instruction.second; ++j)
+			hash = (hash ^ arguments[j]) * 16777619u;
+
+		size_t slot = hash & mask;
+		for (; seen[slot] != UINT32_MAX; slot = (slot + 1) & mask)
+		{
+			const IRInstruction& other = ir[seen[slot]];
+			if (other.op == instruction.op && fields(other) == key && (arguments == nullptr
+				|| std::equal(arguments, arguments + instruction.second, ir.Arguments(other))))
+				break;
+		}
+
+		if (seen[slot] == UINT32_MAX)
+		{
+			seen[slot] = i;
+		}
+		else
+		{
+			replacement[i] = seen[slot];
+			keep[i] = false;
+		}
+	}
+
+	ir.Rewrite(replacement, keep);
+}
+
+void EliminateDeadValues(IR& ir)
+{
+	std::vector<uint32_t> replacement(ir.Size());
+	std::vector<bool> keep(ir.Size(), false);
+
+	for (uint32_t i = ir.Size(); i-- > 0;)
+	{
+		replacement[i] = i;
+		if (!ir.Pure(ir[i]))
+			keep[i] = true;
+		if (keep[i])
+			forEachOperand(ir, ir[i], [&keep](uint32_t operand) { keep[operand] = true; });
+	}
+
+	ir.Rewrite(replacement, keep);
+}
+
+PassManager::PassManager()
+	: dump_(nullptr)
+{
+
+}
+
+PassManager PassManager::Standard()
+{
+	PassManager manager;
+	manager.Add("fold", FoldConstants);
+	manager.Add("cse", EliminateCommonValues);
+	manager.Add("dce", EliminateDeadValues);
+	return manager;
+}
+
+void PassManager::Add(std::string name, void (*run)(IR&))
+{
+	passes_.push_back(Pass{std::move(name), run});
+}
+
+void PassManager::DumpTo(std::ostream* out)
+{
+	dump_ = out;
+}
+
+void PassManager::Run(IR& ir) const
+{
+	if (dump_ != nullptr)
+		*dump_ << "; lowered\n" << ir.Dump();
+
+	for (const Pass& pass : passes_)
+	{
+		pass.run(ir);
+		if (dump_ != nullptr)
+			*dump_ << "; " << pass.name << '\n' << ir.Dump();
+	}
+}
+
+TreeCompiler::TreeCompiler(AST& tree, uint32_t registerParameters)
+	: treeDependency_(&tree),
+	bufferDependency_(nullptr),
+	symtableDependency_(nullptr),
+	registerParameters_(registerParameters)
+{
+
+}
+
+bool TreeCompiler::constantDivision(const ASTNode& node, uint32_t& dividend,
+	uint32_t& divisor, bool& modulo) const
+{
+	if (node.kind != ASTKind::Call || node.right != 2)
+		return false;
+
+	symbol_semantics_t semantics = semantics_[node.value];
+	if (semantics != SYMBOL_DIV && semantics != SYMBOL_MOD)
+		return false;
+
+	const AST& tree = *treeDependency_;
+	const uint32_t* arguments = tree.Arguments(node);
+
+	// division by zero is left to the host function
+	if (tree[arguments[1]].kind != ASTKind::Literal || tree[arguments[1]].value == 0)
+		return false;
+
+	dividend = arguments[0];
+	divisor = tree[arguments[1]].value;
+	modulo = semantics == SYMBOL_MOD;
+	return true;
+}
+
+const intrinsic_t* TreeCompiler::inlineIntrinsic(const ASTNode& node) const
+{
+	if (node.kind != ASTKind::Call)
+		return nullptr;
+
+	// templates go through the call sequence, where ARM code pastes them
+	const intrinsic_t* intrinsic = intrinsics_[node.value];
+	if (intrinsic == nullptr || intrinsic->op == INTRINSIC_TEMPLATE)
+		return nullptr;
+
+	uint32_t arity = intrinsic->op == INTRINSIC_MIN || intrinsic->op == INTRINSIC_MAX ? 2 : 1;
+	return node.right == arity ? intrinsic : nullptr;
+}
+
+bool TreeCompiler::parameterHome(uint32_t node, uint8_t& reg) const
+{
+	const ASTNode& variable = (*treeDependency_)[node];
+	if (variable.kind != ASTKind::Variable)
+		return false;
+
+	uint32_t index = parameterIndices_[variable.value];
+	if (index >= registerParameters_)
+		return false;
+
+	reg = homes_[index];
+	return true;
+}
+
+bool TreeCompiler::needsCallSequence() const
+{
+	const AST& tree = *treeDependency_;
+	uint32_t dividend;
+	uint32_t divisor;
+	bool modulo;
+
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		if (node.kind != ASTKind::Call)
+			continue;
+
+		if (!constantDivision(node, dividend, divisor, modulo)
+			&& inlineIntrinsic(node) == nullptr)
+			return true;
+	}
+
+	return false;
+}
+
+uint32_t TreeCompiler::resolveSymbols(const std::vector<std::string>& parameters)
+{
+	// every symbol in use is looked up once, not once per occurrence
+	const AST& tree = *treeDependency_;
+	std::vector<bool> resolved(tree.SymbolCount(), false);
+	addresses_.assign(tree.SymbolCount(), 0);
+	semantics_.assign(tree.SymbolCount(), SYMBOL_PLAIN);
+	intrinsics_.assign(tree.SymbolCount(), nullptr);
+	parameterIndices_.assign(tree.SymbolCount(), NOT_PARAMETER);
+
+	for (uint32_t symbol = 0; symbol < tree.SymbolCount(); ++symbol)
+	{
+		auto it = std::find(parameters.begin(), parameters.end(), tree.SymbolName(symbol));
+		if (it != parameters.end())
+			parameterIndices_[symbol] = it - parameters.begin();
+	}
+
+	uint32_t usedParameters = 0;
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		if (node.kind != ASTKind::Variable && node.kind != ASTKind::Call)
+			continue;
+
+		if (node.kind == ASTKind::Variable && parameterIndices_[node.value] != NOT_PARAMETER)
+		{
+			if (parameterIndices_[node.value] < registerParameters_)
+				usedParameters |= 1u << parameterIndices_[node.value];
+			continue;
+		}
+
+		if (resolved[node.value])
+			continue;
+
+		const symbol_t* symbol = symtableDependency_->Find(tree.SymbolName(node.value));
+
+		if (symbol == nullptr)
+			throw 0;
+
+		addresses_[node.value] = reinterpret_cast<uintptr_t>(symbol->pointer);
+		semantics_[node.value] = symbol->semantics;
+		intrinsics_[node.value] = symbol->intrinsic;
+		resolved[node.value] = true;
+	}
+
+	return usedParameters;
+}
+
+template<typename Backend>
+void TreeCompiler::registerArguments(Backend& backend, const ASTNode& call, uint8_t scratch)
+{
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+	size_t inRegisters = std::min<size_t>(call.right, registerParameters_);
+	size_t order[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+	std::stable_sort(order, order + inRegisters,
+		[this, arguments](size_t a, size_t b)
+		{
+			return need_[arguments[a]] > need_[arguments[b]];
+		});
+
+	uint8_t location[8];
+	bool spilled[8] = {};
+	bool borrowed[8] = {};
+	size_t spillOrder[8];
+	size_t spillCount = 0;
+
+	for (size_t k = 0; k < inRegisters; ++k)
+	{
+		uint32_t argument = arguments[order[k]];
+
+		// parameters are moved straight from their home registers
+		if (parameterHome(argument, location[order[k]]))
+		{
+			borrowed[order[k]] = true;
+			continue;
+		}
+
+		// spill the latest evaluated arguments until the next one fits
+		for (size_t j = k; j-- > 0 && need_[argument] > backend.freeCount();)
+		{
+			if (spilled[order[j]] || borrowed[order[j]])
+				continue;
+
+			backend.push(location[order[j]]);
+			backend.release(location[order[j]]);
+			spilled[order[j]] = true;
+			spillOrder[spillCount++] = order[j];
+		}
+
+		location[order[k]] = backend.compileTree(argument);
+	}
+
+	// move the arguments into place, breaking cycles through the scratch register
+	std::vector<std::pair<uint8_t, uint8_t>> moves;
+	for (size_t i = 0; i < inRegisters; ++i)
+	{
+		if (spilled[i])
+			continue;
+
+		if (location[i] != i)
+			moves.emplace_back(i, location[i]);
+		if (!borrowed[i])
+			backend.release(location[i]);
+	}
+
+	while (!moves.empty())
+	{
+		bool progress = false;
+		for (size_t i = 0; i < moves.size() && !progress; ++i)
+		{
+			uint8_t dest = moves[i].first;
+			bool blocked = std::any_of(moves.begin(), moves.end(),
+				[dest](const std::pair<uint8_t, uint8_t>& move)
+				{
+					return move.second == dest;
+				});
+
+			if (!blocked)
+			{
+				backend.mov(dest, moves[i].second);
+				moves.erase(moves.begin() + i);
+				progress = true;
+			}
+		}
+
+		if (!progress)
+		{
+			backend.mov(scratch, moves[0].second);
+			moves[0].second = scratch;
+		}
+	}
+
+	while (spillCount > 0)
+		backend.pop(spillOrder[--spillCount]);
+}
+
+bool ArmEncoding::encodeImmediate(uint32_t value, uint32_t& encoded)
+{
+	for (uint32_t rotation = 0; rotation < 32; rotation += 2)
+	{
+		uint32_t rotated = rotation == 0
+			? value : (value << rotation) | (value >> (32 - rotation));
+
+		if (rotated < 256)
+		{
+			encoded = ((rotation / 2) << 8) | rotated;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ArmEncoding::shiftAddMultiplier(uint32_t value, ShiftAdd& sequence)
+{
+	auto isPowerOfTwo = [](uint32_t x) { return x != 0 && (x & (x - 1)) == 0; };
+	auto log2 = [](uint32_t x) { return static_cast<uint32_t>(__builtin_ctz(x)); };
+
+	bool found = false;
+	uint32_t best = 3;
+
+	// value = sign * odd * 2^outer, try both signs and keep the shorter sequence
+	for (bool negate : {false, true})
+	{
+		uint32_t magnitude = negate ? 0 - value : value;
+		if (magnitude == 0)
+			return false;
+
+		ShiftAdd candidate{MOV_MASK, 0, log2(magnitude), negate};
+		uint32_t odd = magnitude >> candidate.outer;
+
+		if (odd != 1 && isPowerOfTwo(odd - 1))
+		{
+			candidate.mask = ADD_MASK;
+			candidate.inner = log2(odd - 1);
+		}
+		else if (odd != 1 && odd + 1 != 0 && isPowerOfTwo(odd + 1))
+		{
+			// x - (x << n) is already negated, (x << n) - x is not
+			candidate.mask = negate ? SUB_MASK : RSB_MASK;
+			candidate.inner = log2(odd + 1);
+			candidate.negate = false;
+		}
+		else if (odd != 1)
+		{
+			continue;
+		}
+
+		uint32_t cost = (candidate.mask != MOV_MASK)
+			+ (candidate.outer != 0) + candidate.negate;
+
+		if (cost < best)
+		{
+			best = cost;
+			sequence = candidate;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+void ArmEncoding::divisionMagic(uint32_t divisor, uint32_t& multiplier, uint32_t& shift)
+{
+	// signed magic numbers from Hacker's Delight, 10-1, for divisor >= 3
+	const uint32_t two31 = 0x80000000u;
+	uint32_t limit = two31 - 1 - (two31 % divisor);
+	uint32_t p = 31;
+	uint32_t q1 = two31 / limit;
+	uint32_t r1 = two31 - q1 * limit;
+	uint32_t q2 = two31 / divisor;
+	uint32_t r2 = two31 - q2 * divisor;
+	uint32_t delta;
+
+	do
+	{
+		++p;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= limit)
+		{
+			++q1;
+			r1 -= limit;
+		}
+
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= divisor)
+		{
+			++q2;
+			r2 -= divisor;
+		}
+
+		delta = divisor - r2;
+	}
+	while (q1 < delta || (q1 == delta && r1 == 0));
+
+	multiplier = q2 + 1;
+	shift = p - 32;
+}
+
+bool ArmEncoding::multipliedDivision(uint32_t divisor)
+{
+	uint32_t magnitude = static_cast<int32_t>(divisor) < 0 ? 0 - divisor : divisor;
+	return (magnitude & (magnitude - 1)) != 0;
+}
+
+size_t ArmEncoding::immediateConstant(uint32_t value, uint8_t reg, bool movw, uint32_t* words)
+{
+	uint32_t encoded;
+
+	if (encodeImmediate(value, encoded))
+	{
+		words[0] = MOV_MASK | IMMEDIATE | ((reg & 0xf) << 12) | encoded;
+		return 1;
+	}
+
+	if (encodeImmediate(~value, encoded))
+	{
+		words[0] = MVN_MASK | IMMEDIATE | ((reg & 0xf) << 12) | encoded;
+		return 1;
+	}
+
+	if (!movw)
+		return 0;
+
+	words[0] = MOVW_MASK | ((value & 0xf000) << 4) | ((reg & 0xf) << 12) | (value & 0xfff);
+	if (value >> 16 == 0)
+		return 1;
+
+	words[1] = MOVT_MASK | ((value >> 12) & 0xf0000) | ((reg & 0xf) << 12) | ((value >> 16) & 0xfff);
+	return 2;
+}
+
+template<typename Backend>
+void ArmEncoding::multiplyByConstant(Backend& backend, uint8_t reg, const ShiftAdd& sequence)
+{
+	if (sequence.mask != MOV_MASK)
+		backend.aluShifted(sequence.mask, reg, reg, reg, Shift::LSL, sequence.inner);
+
+	if (sequence.outer != 0)
+		backend.aluShifted(MOV_MASK, reg, 0, reg, Shift::LSL, sequence.outer);
+
+	if (sequence.negate)
+		backend.neg(reg, reg);
+}
+
+template<typename Backend>
+uint8_t ArmEncoding::divideByConstant(Backend& backend, uint8_t reg, uint8_t quotient,
+	uint8_t scratch, uint32_t divisor, bool modulo)
+{
+	// x % -d == x % d, and x / -d == -(x / d)
+	bool negative = static_cast<int32_t>(divisor) < 0;
+	uint32_t magnitude = negative ? 0 - divisor : divisor;
+
+	if (magnitude == 1)
+	{
+		if (modulo)
+			backend.constant(0, reg);
+		else if (negative)
+			backend.neg(reg, reg);
+		return reg;
+	}
+
+	if ((magnitude & (magnitude - 1)) == 0)
+	{
+		// negative dividends are biased by 2^k - 1 so that the shift
+		// rounds toward zero like C division does
+		uint32_t k = __builtin_ctz(magnitude);
+		if (k == 1)
+		{
+			backend.aluShifted(ADD_MASK, scratch, reg, reg, Shift::LSR, 31);
+		}
+		else
+		{
+			backend.aluShifted(MOV_MASK, scratch, 0, reg, Shift::ASR, 31);
+			backend.aluShifted(ADD_MASK, scratch, reg, scratch, Shift::LSR, 32 - k);
+		}
+
+		if (modulo)
+		{
+			backend.aluShifted(MOV_MASK, scratch, 0, scratch, Shift::ASR, k);
+			backend.aluShifted(SUB_MASK, reg, reg, scratch, Shift::LSL, k);
+		}
+		else
+		{
+			backend.aluShifted(MOV_MASK, reg, 0, scratch, Shift::ASR, k);
+			if (negative)
+				backend.neg(reg, reg);
+		}
+
+		return reg;
+	}
+
+	uint32_t multiplier;
+	uint32_t shift;
+	divisionMagic(magnitude, multiplier, shift);
+
+	// quotient = high word of x * multiplier, corrected, shifted,
+	// plus one for negative x
+	backend.constant(multiplier, scratch);
+	backend.smull(scratch, quotient, reg, scratch);
+	if (static_cast<int32_t>(multiplier) < 0)
+		backend.sum(quotient, quotient, reg);
+	if (shift != 0)
+		backend.aluShifted(MOV_MASK, quotient, 0, quotient, Shift::ASR, shift);
+	backend.aluShifted(ADD_MASK, quotient, quotient, reg, Shift::LSR, 31);
+
+	if (!modulo)
+	{
+		if (negative)
+			backend.neg(quotient, quotient);
+		return quotient;
+	}
+
+	// remainder = x - quotient * |d|
+	ShiftAdd sequence;
+	if (shiftAddMultiplier(magnitude, sequence))
+	{
+		multiplyByConstant(backend, quotient, sequence);
+	}
+	else
+	{
+		backend.constant(magnitude, scratch);
+		backend.mul(quotient, quotient, scratch);
+	}
+
+	backend.sub(reg, reg, quotient);
+	return reg;
+}
+
+LiteralPool::LiteralPool()
+	: firstLoad_(0)
+{
+
+}
+
+bool LiteralPool::Empty() const
+{
+	return literals_.empty();
+}
+
+size_t LiteralPool::Size() const
+{
+	return literals_.size();
+}
+
+CodeBuffer::Label LiteralPool::Label(CodeBuffer& buffer, uint32_t value, size_t position)
+{
+	if (literals_.empty())
+		firstLoad_ = position;
+
+	auto inserted = labels_.emplace(value, 0);
+	if (inserted.second)
+	{
+		inserted.first->second = buffer.NewLabel();
+		literals_.push_back(value);
+	}
+
+	return inserted.first->second;
+}
+
+bool LiteralPool::InRange(size_t position, size_t upcoming) const
+{
+	return position + 4 * literals_.size() + upcoming - firstLoad_ < RANGE;
+}
+
+void LiteralPool::Emit(CodeBuffer& buffer)
+{
+	for (uint32_t literal : literals_)
+	{
+		buffer.Bind(labels_[literal]);
+		buffer.Write(literal);
+	}
+
+	Clear();
+}
+
+void LiteralPool::Clear()
+{
+	literals_.clear();
+	labels_.clear();
+}
+
+ArmFeatures ArmFeatures::Detect()
+{
+	static const ArmFeatures detected = []
+	{
+		// AT_PLATFORM is "v5l", "v6l", "v7l" and so on for ARM Linux processes,
+		// HWCAP_NEON is spelled out because asm/hwcap.h only exists on ARM
+		const char* platform = reinterpret_cast<const char*>(getauxval(AT_PLATFORM));
+		ArmFeatures features;
+		features.movw = platform != nullptr && platform[0] == 'v' && std::atoi(platform + 1) >= 7;
+		features.neon = (getauxval(AT_HWCAP) & (1u << 12)) != 0;
+		return features;
+	}();
+
+	return detected;
+}
+
+Compiler::Compiler(AST& tree, InstructionSet instructionSet, ArmFeatures features)
+	: TreeCompiler(tree, 4),
+	freeRegisters_(ALLOCATABLE),
+	stackDepth_(0),
+	frameSize_(0),
+	eliminated_(0),
+	instructionSet_(instructionSet),
+	movwAvailable_(features.movw),
+	neonAvailable_(features.neon),
+	freeVectors_(VECTOR_ALLOCATABLE)
+{
+
+}
+
+uint8_t Compiler::allocate(uint32_t forbidden)
+{
+	// callee-saved registers first, so that values survive calls for free
+	static constexpr uint8_t order[] = {4, 5, 6, 7, 8, 9, 10, 12, 3, 2, 1, 0};
+
+	for (uint8_t reg : order)
+	{
+		if (freeRegisters_ & ~forbidden & (1u << reg))
+		{
+			freeRegisters_ &= ~(1u << reg);
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+void Compiler::release(uint8_t reg)
+{
+	freeRegisters_ |= 1u << reg;
+}
+
+uint32_t Compiler::freeCount() const
+{
+	return std::bitset<32>(freeRegisters_).count();
+}
+
+uint8_t Compiler::allocateVector(uint32_t forbidden)
+{
+	static constexpr uint8_t order[] = {8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2};
+
+	for (uint8_t reg : order)
+	{
+		if (freeVectors_ & ~forbidden & (1u << reg))
+		{
+			freeVectors_ &= ~(1u << reg);
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+void Compiler::releaseVector(uint8_t reg)
+{
+	freeVectors_ |= 1u << reg;
+}
+
+uint32_t Compiler::freeVectorCount() const
+{
+	return std::bitset<32>(freeVectors_).count();
+}
+
+bool Compiler::encodeThumbImmediate(uint32_t value, uint32_t& encoded)
+{
+	// i:imm3:imm8 is either a byte replicated as 0x000000XY, 0x00XY00XY,
+	// 0xXY00XY00 or 0xXYXYXYXY, or 1bcdefgh rotated right by 8 to 31
+	uint32_t low = value & 0xff;
+	uint32_t high = (value >> 8) & 0xff;
+	uint32_t imm12;
+
+	if (value < 256)
+	{
+		imm12 = value;
+	}
+	else if (value == low * 0x00010001u)
+	{
+		imm12 = 0x100 | low;
+	}
+	else if (value == high * 0x01000100u)
+	{
+		imm12 = 0x200 | high;
+	}
+	else if (value == low * 0x01010101u)
+	{
+		imm12 = 0x300 | low;
+	}
+	else
+	{
+		uint32_t rotation = __builtin_clz(value) + 8;
+		uint32_t bits = value >> (32 - rotation);
+		if (bits << (32 - rotation) != value)
+			return false;
+
+		imm12 = (rotation << 7) | (bits & 0x7f);
+	}
+
+	encoded = ((imm12 & 0x800) << 15) | ((imm12 & 0x700) << 4) | (imm12 & 0xff);
+	return true;
+}
+
+bool Compiler::immediateEncodable(uint32_t mask, uint32_t value) const
+{
+	uint32_t encoded;
+	if (!thumb())
+		return encodeImmediate(value, encoded);
+
+	// ADDW and SUBW take any 12-bit immediate
+	return encodeThumbImmediate(value, encoded)
+		|| ((mask == ADD_MASK || mask == SUB_MASK) && value < 4096);
+}
+
+void Compiler::writeWord(uint32_t word)
+{
+	if (!literals_.Empty())
+		keepLiteralsInRange();
+
+	pending_.push_back(PendingInstruction{word, NO_LITERAL, false});
+}
+
+void Compiler::writeThumb(uint32_t instruction)
+{
+	// the first halfword of a 32-bit instruction is its high one
+	if (instruction >> 16)
+		bufferDependency_->WriteHalf(instruction >> 16);
+	bufferDependency_->WriteHalf(instruction & 0xffff);
+}
+
+bool Compiler::thumb() const
+{
+	return instructionSet_ == InstructionSet::Thumb;
+}
+
+void Compiler::literalLoad(uint32_t value, uint8_t reg)
+{
+	if (!literals_.Empty())
+		keepLiteralsInRange();
+
+	pending_.push_back(PendingInstruction{LDR_MASK | (0xf << 16) | ((reg & 0xf) << 12),
+		literals_.Label(*bufferDependency_, value, position()), false});
+}
+
+void Compiler::keepLiteralsInRange(size_t upcoming)
+{
+	// the peephole pass only ever shortens the distance
+	if (literals_.InRange(position(), upcoming))
+		return;
+
+	// only huge expressions get here: place the pool inline and branch over it
+	flush();
+	CodeBuffer::Label over = bufferDependency_->NewLabel();
+	bufferDependency_->Write(B_MASK, over, CodeBuffer::Fixup::Branch);
+	emitLiteralPool();
+	bufferDependency_->Bind(over);
+}
+
+void Compiler::emitLiteralPool()
+{
+	flush();
+
+	if (!literals_.Empty())
+		literalPools_.emplace_back(bufferDependency_->Position(), literals_.Size());
+	literals_.Emit(*bufferDependency_);
+}
+
+size_t Compiler::position() const
+{
+	return bufferDependency_->Position() + sizeof(uint32_t) * pending_.size();
+}
+
+void Compiler::bind(CodeBuffer::Label label)
+{
+	flush();
+	bufferDependency_->Bind(label);
+}
+
+void Compiler::flush()
+{
+	size_t first = rewrites_.size();
+	peephole();
+
+	// rewrites know the pending index, the buffer assigns positions
+	std::vector<size_t> placed(pending_.size());
+	for (size_t i = 0; i < pending_.size(); ++i)
+	{
+		placed[i] = bufferDependency_->Position();
+		if (pending_[i].removed)
+			continue;
+
+		if (pending_[i].literal == NO_LITERAL)
+			bufferDependency_->Write(pending_[i].word);
+		else
+			bufferDependency_->Write(pending_[i].word, pending_[i].literal,
+				CodeBuffer::Fixup::PcRelativeLoad);
+	}
+
+	for (size_t i = first; i < rewrites_.size(); ++i)
+		rewrites_[i].position = placed[rewrites_[i].position];
+
+	pending_.clear();
+}
+
+void Compiler::peephole()
+{
+	auto single = [](uint32_t word, uint32_t mask, uint32_t listMask, uint8_t& reg)
+	{
+		if ((word & 0xffff0fff) == mask)
+		{
+			reg = (word >> 12) & 0xf;
+			return true;
+		}
+
+		uint32_t list = word & 0xffff;
+		if ((word & 0xffff0000) != listMask || std::bitset<16>(list).count() != 1)
+			return false;
+
+		reg = __builtin_ctz(list);
+		return true;
+	};
+
+	for (size_t i = 0; i < pending_.size(); ++i)
+	{
+		if (pending_[i].removed)
+			continue;
+
+		size_t next = i + 1;
+		while (next < pending_.size() && pending_[next].removed)
+			++next;
+
+		// a value pushed and popped right away only changes register
+		uint8_t pushed;
+		uint8_t popped;
+		if (next < pending_.size()
+			&& single(pending_[i].word, PUSH_MASK, PUSH_LIST_MASK, pushed)
+			&& single(pending_[next].word, POP_MASK, POP_LIST_MASK, popped))
+		{
+			pending_[i].removed = true;
+			if (pushed == popped)
+				pending_[next].removed = true;
+			else
+				pending_[next].word = MOV_MASK | ((popped & 0xf) << 12) | (pushed & 0xf);
+
+			rewrites_.push_back(PeepholeRewrite{Peephole::PushPop, next});
+			continue;
+		}
+
+		fuse(i);
+	}
+}
+
+bool Compiler::fuse(size_t producer)
+{
+	uint32_t word = pending_[producer].word;
+	bool zero = word == (MOV_MASK | IMMEDIATE | (word & 0xf000));
+	bool negate = (word & 0xfff00fff) == (RSB_MASK | IMMEDIATE);
+	bool multiply = (word & 0xfff0f0f0) == MUL_MASK;
+	if (!zero && !negate && !multiply)
+		return false;
+
+	uint8_t target = multiply ? (word >> 16) & 0xf : (word >> 12) & 0xf;
+	uint32_t sources;
+	uint32_t written;
+	registerEffects(word, sources, written);
+
+	// the first instruction to touch the result consumes it, and the
+	// producer moves down to it if nothing changes its operands on the way
+	size_t consumer = producer + 1;
+	for (; consumer < pending_.size(); ++consumer)
+	{
+		if (pending_[consumer].removed)
+			continue;
+
+		uint32_t reads;
+		uint32_t writes;
+		if (!registerEffects(pending_[consumer].word, reads, writes))
+			return false;
+		if ((reads | writes) & (1u << target))
+			break;
+		if (writes & sources)
+			return false;
+	}
+
+	if (consumer == pending_.size())
+		return false;
+
+	// only plain register forms of add and sub
+	uint32_t instruction = pending_[consumer].word;
+	bool add = (instruction & 0xfff00ff0) == ADD_MASK;
+	bool sub = (instruction & 0xfff00ff0) == SUB_MASK;
+	uint8_t dest = (instruction >> 12) & 0xf;
+	uint8_t first = (instruction >> 16) & 0xf;
+	uint8_t second = instruction & 0xf;
+	uint8_t other = first == target ? second : first;
+	if ((!add && !sub) || (first == target) == (second == target))
+		return false;
+
+	uint32_t replacement;
+	Peephole rule;
+	if (zero)
+	{
+		if (!sub || first != target)
+			return false;
+
+		replacement = RSB_MASK | IMMEDIATE | (second << 16) | (dest << 12);
+		rule = Peephole::NegateConstant;
+	}
+	else if (negate)
+	{
+		uint32_t source = (word >> 16) & 0xf;
+		if (add)
+			replacement = SUB_MASK | (other << 16) | (dest << 12) | source;
+		else if (second == target)
+			replacement = ADD_MASK | (first << 16) | (dest << 12) | source;
+		else
+			return false;
+
+		rule = Peephole::NegateOperand;
+	}
+	else
+	{
+		uint32_t rm = word & 0xf;
+		uint32_t rs = (word >> 8) & 0xf;
+		if (add)
+		{
+			// pre-ARMv6 cores require Rd != Rm here too
+			if (rm == dest)
+				std::swap(rm, rs);
+			if (rm == dest)
+				return false;
+
+			replacement = MLA_MASK | (dest << 16) | (other << 12) | (rs << 8) | rm;
+			rule = Peephole::MultiplyAdd;
+		}
+		else if (second == target && movwAvailable_)
+		{
+			replacement = MLS_MASK | (dest << 16) | (first << 12) | (rs << 8) | rm;
+			rule = Peephole::MultiplySubtract;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (dest != target && !deadAfter(consumer, target))
+		return false;
+
+	pending_[producer].removed = true;
+	pending_[consumer].word = replacement;
+	rewrites_.push_back(PeepholeRewrite{rule, consumer});
+	return true;
+}
+
+bool Compiler::deadAfter(size_t consumer, uint8_t reg) const
+{
+	for (size_t i = consumer + 1; i < pending_.size(); ++i)
+	{
+		if (pending_[i].removed)
+			continue;
+
+		// the result is all a return reads
+		if (returns(pending_[i].word))
+			return reg != 0;
+
+		uint32_t reads;
+		uint32_t writes;
+		if (!registerEffects(pending_[i].word, reads, writes) || (reads & (1u << reg)))
+			return false;
+		if (writes & (1u << reg))
+			return true;
+	}
+
+	// whatever comes after the flush may still read it
+	return false;
+}
+
+bool Compiler::registerEffects(uint32_t word, uint32_t& reads, uint32_t& writes)
+{
+	auto field = [word](uint32_t shift) { return 1u << ((word >> shift) & 0xf); };
+	uint32_t group = (word >> 25) & 0b111;
+	reads = 0;
+	writes = 0;
+
+	// conditional code follows a comparison, NEON has no condition
+	if (word >> 28 != ALWAYS)
+		return false;
+
+	if ((word & 0x0f0000f0) == 0x00000090)
+	{
+		// mul, mla and mls; smull and the flag-setting forms are left alone
+		uint32_t operation = (word >> 20) & 0xff;
+		if (operation != 0x00 && operation != 0x02 && operation != 0x06)
+			return false;
+
+		reads = field(0) | field(8) | (operation != 0x00 ? field(12) : 0);
+		writes = field(16);
+	}
+	else if ((word & 0x0ff00000) == (MOVW_MASK & 0x0ff00000))
+	{
+		writes = field(12);
+	}
+	else if ((word & 0x0ff00000) == (MOVT_MASK & 0x0ff00000))
+	{
+		reads = field(12);
+		writes = field(12);
+	}
+	else if (group == 0b000 || group == 0b001)
+	{
+		// comparisons set flags, the rest of their space is bx, blx and such
+		uint32_t operation = (word >> 21) & 0xf;
+		if ((word & (1u << 20)) || (operation >> 2) == 0b10)
+			return false;
+
+		if (group == 0b000)
+		{
+			if ((word & 0x90) == 0x90)
+				return false;
+			reads = field(0) | (word & 0x10 ? field(8) : 0);
+		}
+
+		if (operation != 0b1101 && operation != 0b1111)
+			reads |= field(16);
+		writes = field(12);
+	}
+	else if (group == 0b010 || (group == 0b011 && !(word & 0x10)))
+	{
+		reads = field(16) | (group == 0b011 ? field(0) : 0);
+		(word & (1u << 20) ? writes : reads) |= field(12);
+
+		// post-indexed, or written back
+		if (!(word & (1u << 24)) || (word & (1u << 21)))
+			writes |= field(16);
+	}
+	else if (group == 0b100)
+	{
+		reads = field(16);
+		if (word & (1u << 21))
+			writes = field(16);
+		(word & (1u << 20) ? writes : reads) |= word & 0xffff;
+	}
+	else
+	{
+		return false;
+	}
+
+	return !(writes & (1u << 15));
+}
+
+bool Compiler::returns(uint32_t word)
+{
+	// bx lr, or a pop into pc
+	return word == 0xe12fff1e || (word & 0xffff8000) == (POP_LIST_MASK | 0x8000);
+}
+
+namespace
+{
+	// r0-r7, the only registers most 16-bit Thumb encodings can name
+	bool low(uint8_t reg) { return reg < 8; }
+
+	// the operation field of a Thumb-2 data processing instruction
+	uint32_t thumbOperation(uint32_t armMask)
+	{
+		switch ((armMask >> 21) & 0xf)
+		{
+			case 0b0100: return 0b1000; // add
+			case 0b0010: return 0b1101; // sub
+			case 0b0011: return 0b1110; // rsb
+			case 0b1101: return 0b0010; // mov
+			case 0b1111: return 0b0011; // mvn
+			case 0b1010: return 0b1101; // cmp, a flag-setting sub
+		}
+
+		throw 0;
+	}
+}
+
+void Compiler::pop(uint8_t reg)
+{
+	if (!thumb())
+		writeWord(POP_MASK | ((reg & 0xf) << 12));
+	else if (low(reg))
+		writeThumb(0xbc00 | (1u << reg)); // pop {reg}
+	else
+		writeThumb(THUMB_POP_MASK | ((reg & 0xf) << 12));
+
+	stackDepth_ -= 4;
+}
+
+void Compiler::push(uint8_t reg)
+{
+	if (!thumb())
+		writeWord(PUSH_MASK | ((reg & 0xf) << 12));
+	else if (low(reg) || reg == 14)
+		writeThumb(0xb400 | (reg == 14 ? 0x100 : 1u << reg)); // push {reg}
+	else
+		writeThumb(THUMB_PUSH_MASK | ((reg & 0xf) << 12));
+
+	stackDepth_ += 4;
+}
+
+void Compiler::popList(uint32_t regs)
+{
+	// POP.W needs two registers at least
+	if (thumb() && std::bitset<16>(regs).count() == 1)
+	{
+		pop(__builtin_ctz(regs));
+		return;
+	}
+
+	if (!thumb())
+		writeWord(POP_LIST_MASK | (regs & 0xffff));
+	else if ((regs & ~0x80ffu) == 0)
+		writeThumb(0xbc00 | (regs & 0xff) | (regs >> 7 & 0x100));
+	else
+		writeThumb(THUMB_POP_LIST_MASK | (regs & 0xffff));
+
+	stackDepth_ -= 4 * std::bitset<16>(regs).count();
+}
+
+void Compiler::pushList(uint32_t regs)
+{
+	// and so does PUSH.W
+	if (thumb() && std::bitset<16>(regs).count() == 1)
+	{
+		push(__builtin_ctz(regs));
+		return;
+	}
+
+	if (!thumb())
+		writeWord(PUSH_LIST_MASK | (regs & 0xffff));
+	else if ((regs & ~0x40ffu) == 0)
+		writeThumb(0xb400 | (regs & 0xff) | (regs >> 6 & 0x100));
+	else
+		writeThumb(THUMB_PUSH_LIST_MASK | (regs & 0xffff));
+
+	stackDepth_ += 4 * std::bitset<16>(regs).count();
+}
+
+void Compiler::mov(uint8_t dest, uint8_t source, uint32_t condition)
+{
+	if (!thumb())
+	{
+		writeWord((MOV_MASK & 0x0fffffff) | (condition << 28) | ((dest & 0xf) << 12)
+			| (source & 0xf));
+		return;
+	}
+
+	if (condition != ALWAYS)
+		writeThumb(THUMB_IT_MASK | (condition << 4));
+	writeThumb(0x4600 | ((dest & 0x8) << 4) | ((source & 0xf) << 3) | (dest & 0x7));
+}
+
+void Compiler::neg(uint8_t dest, uint8_t source, uint32_t condition)
+{
+	if (!thumb())
+	{
+		writeWord((RSB_MASK & 0x0fffffff) | (condition << 28) | IMMEDIATE
+			| ((source & 0xf) << 16) | ((dest & 0xf) << 12));
+		return;
+	}
+
+	if (condition != ALWAYS)
+		writeThumb(THUMB_IT_MASK | (condition << 4));
+
+	// inside an IT block the 16-bit encodings leave the flags alone
+	if (low(dest) && low(source))
+		writeThumb(0x4240 | (source << 3) | dest); // rsbs dest, source, #0
+	else
+		writeThumb(THUMB_IMMEDIATE_MASK | (thumbOperation(RSB_MASK) << 21)
+			| ((source & 0xf) << 16) | ((dest & 0xf) << 8));
+}
+
+void Compiler::sum(uint8_t dest, uint8_t first, uint8_t second)
+{
+	if (!thumb())
+	{
+		writeWord(ADD_MASK | ((first & 0xf) << 16) | ((dest & 0xf) << 12) | (second & 0xf));
+		return;
+	}
+
+	if (dest == second)
+		std::swap(first, second);
+
+	if (low(dest) && low(first) && low(second))
+		writeThumb(0x1800 | (second << 6) | (first << 3) | dest); // adds
+	else if (dest == first)
+		writeThumb(0x4400 | ((dest & 0x8) << 4) | ((second & 0xf) << 3) | (dest & 0x7));
+	else
+		aluShifted(ADD_MASK, dest, first, second, Shift::LSL, 0);
+}
+
+void Compiler::sub(uint8_t dest, uint8_t first, uint8_t second)
+{
+	if (!thumb())
+	{
+		writeWord(SUB_MASK | ((first & 0xf) << 16) | ((dest & 0xf) << 12) | (second & 0xf));
+		return;
+	}
+
+	if (low(dest) && low(first) && low(second))
+		writeThumb(0x1a00 | (second << 6) | (first << 3) | dest); // subs
+	else
+		aluShifted(SUB_MASK, dest, first, second, Shift::LSL, 0);
+}
+
+void Compiler::mul(uint8_t dest, uint8_t first, uint8_t second)
+{
+	// pre-ARMv6 cores require Rd != Rm
+	if (dest != first)
+		std::swap(first, second);
+
+	if (!thumb())
+	{
+		writeWord(MUL_MASK | ((dest & 0xf) << 16) | ((first & 0xf) << 8) | (second & 0xf));
+		return;
+	}
+
+	// muls only multiplies into one of its operands
+	if (low(dest) && low(first) && low(second) && (dest == first || dest == second))
+		writeThumb(0x4340 | ((dest == first ? second : first) << 3) | dest);
+	else
+		writeThumb(THUMB_MUL_MASK | ((first & 0xf) << 16) | ((dest & 0xf) << 8) | (second & 0xf));
+}
+
+void Compiler::aluImmediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t immediate)
+{
+	uint32_t encoded;
+
+	if (!thumb())
+	{
+		if (!encodeImmediate(immediate, encoded))
+			throw 0;
+
+		writeWord(mask | IMMEDIATE | ((source & 0xf) << 16) | ((dest & 0xf) << 12) | encoded);
+		return;
+	}
+
+	bool add = mask == ADD_MASK;
+	bool addOrSub = add || mask == SUB_MASK;
+
+	if (mask == CMP_MASK && low(source) && immediate < 256)
+	{
+		writeThumb(0x2800 | (source << 8) | immediate);
+	}
+	else if (addOrSub && dest == 13 && source == 13 && immediate % 4 == 0 && immediate < 512)
+	{
+		writeThumb((add ? 0xb000 : 0xb080) | immediate / 4); // add/sub sp, #immediate
+	}
+	else if (addOrSub && low(dest) && dest == source && immediate < 256)
+	{
+		writeThumb((add ? 0x3000 : 0x3800) | (dest << 8) | immediate);
+	}
+	else if (addOrSub && low(dest) && low(source) && immediate < 8)
+	{
+		writeThumb((add ? 0x1c00 : 0x1e00) | (immediate << 6) | (source << 3) | dest);
+	}
+	else if (mask == RSB_MASK && low(dest) && low(source) && immediate == 0)
+	{
+		writeThumb(0x4240 | (source << 3) | dest);
+	}
+	else if (encodeThumbImmediate(immediate, encoded))
+	{
+		// cmp is subs discarding its result into pc
+		bool compare = mask == CMP_MASK;
+		writeThumb(THUMB_IMMEDIATE_MASK | (thumbOperation(mask) << 21) | (compare << 20)
+			| ((source & 0xf) << 16) | ((compare ? 0xf : dest & 0xf) << 8) | encoded);
+	}
+	else if (addOrSub && immediate < 4096)
+	{
+		writeThumb((add ? THUMB_ADDW_MASK : THUMB_SUBW_MASK) | ((immediate & 0x800) << 15)
+			| ((immediate & 0x700) << 4) | ((source & 0xf) << 16) | ((dest & 0xf) << 8)
+			| (immediate & 0xff));
+	}
+	else
+	{
+		throw 0;
+	}
+}
+
+void Compiler::cmp(uint8_t first, uint8_t second)
+{
+	if (!thumb())
+		writeWord(CMP_MASK | ((first & 0xf) << 16) | (second & 0xf));
+	else if (low(first) && low(second))
+		writeThumb(0x4280 | (second << 3) | first);
+	else
+		writeThumb(0x4500 | ((first & 0x8) << 4) | ((second & 0xf) << 3) | (first & 0x7));
+}
+
+void Compiler::aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+	Shift shift, uint32_t amount)
+{
+	if (!thumb())
+	{
+		writeWord(mask | ((first & 0xf) << 16) | ((dest & 0xf) << 12) | ((amount & 0x1f) << 7)
+			| (static_cast<uint32_t>(shift) << 5) | (second & 0xf));
+		return;
+	}
+
+	amount &= 0x1f;
+
+	// lsls, lsrs and asrs by an immediate
+	if (mask == MOV_MASK && low(dest) && low(second))
+	{
+		writeThumb((static_cast<uint32_t>(shift) << 11) | (amount << 6) | (second << 3) | dest);
+		return;
+	}
+
+	// mov has no first operand, its field reads as pc
+	uint32_t firstField = mask == MOV_MASK ? 0xf : first & 0xf;
+	writeThumb(THUMB_SHIFTED_MASK | (thumbOperation(mask) << 21) | (firstField << 16)
+		| ((amount >> 2) << 12) | ((dest & 0xf) << 8) | ((amount & 0x3) << 6)
+		| (static_cast<uint32_t>(shift) << 4) | (second & 0xf));
+}
+
+void Compiler::smull(uint8_t low, uint8_t high, uint8_t first, uint8_t second)
+{
+	if (thumb())
+	{
+		writeThumb(THUMB_SMULL_MASK | ((first & 0xf) << 16) | ((low & 0xf) << 12)
+			| ((high & 0xf) << 8) | (second & 0xf));
+		return;
+	}
+
+	// pre-ARMv6 cores require low, high and first to differ
+	writeWord(SMULL_MASK | ((high & 0xf) << 16) | ((low & 0xf) << 12)
+		| ((second & 0xf) << 8) | (first & 0xf));
+}
+
+void Compiler::loadStore(uint32_t mask, uint8_t reg, uint8_t base, uint32_t offset)
+{
+	bool load = mask == LDR_MASK;
+
+	if (offset > 4095)
+		throw 0;
+
+	if (!thumb())
+		writeWord(mask | ((base & 0xf) << 16) | ((reg & 0xf) << 12) | offset);
+	else if (low(reg) && low(base) && offset % 4 == 0 && offset < 128)
+		writeThumb((load ? 0x6800 : 0x6000) | (offset / 4 << 6) | (base << 3) | reg);
+	else if (low(reg) && base == 13 && offset % 4 == 0 && offset < 1024)
+		writeThumb((load ? 0x9800 : 0x9000) | (reg << 8) | offset / 4);
+	else
+		writeThumb((load ? THUMB_LDR_MASK : THUMB_STR_MASK) | ((base & 0xf) << 16)
+			| ((reg & 0xf) << 12) | offset);
+}
+
+void Compiler::blx(uint8_t reg)
+{
+	if (thumb())
+		writeThumb(0x4780 | ((reg & 0xf) << 3));
+	else
+		writeWord(BLX_MASK | (reg & 0xf));
+}
+
+void Compiler::branch(CodeBuffer::Label target, uint32_t mask, uint32_t condition)
+{
+	if (!literals_.Empty())
+		keepLiteralsInRange();
+
+	flush();
+	bufferDependency_->Write((mask & 0x0fffffff) | (condition << 28),
+		target, CodeBuffer::Fixup::Branch);
+}
+
+namespace
+{
+	// q registers as the D:Vd, N:Vn and M:Vm fields of a NEON instruction
+	uint32_t vectorD(uint8_t q) { return ((2u * q & 0x10) << 18) | ((2u * q & 0xf) << 12); }
+	uint32_t vectorN(uint8_t q) { return ((2u * q & 0x10) << 3) | ((2u * q & 0xf) << 16); }
+	uint32_t vectorM(uint8_t q) { return ((2u * q & 0x10) << 1) | (2u * q & 0xf); }
+}
+
+void Compiler::vectorOperation(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second)
+{
+	writeWord(mask | vectorD(dest) | vectorN(first) | vectorM(second));
+}
+
+void Compiler::vectorShift(uint32_t mask, uint8_t dest, uint8_t source, uint32_t amount)
+{
+	// imm6 is 32 + amount for left shifts and 64 - amount for right ones
+	uint32_t field = mask == VSHL_MASK ? 32 + amount : 64 - amount;
+	writeWord(mask | (field << 16) | vectorD(dest) | vectorM(source));
+}
+
+void Compiler::vdup(uint8_t dest, uint8_t source)
+{
+	// Vd sits where Vn usually is
+	writeWord(VDUP_MASK | vectorN(dest) | ((source & 0xf) << 12));
+}
+
+void Compiler::vld1(uint8_t dest, uint8_t address, bool writeback)
+{
+	// Rm = 13 post-increments the address by the 16 bytes transferred
+	writeWord((VLD1_MASK & ~0xfu) | (writeback ? 13 : 15) | vectorD(dest) | ((address & 0xf) << 16));
+}
+
+void Compiler::vst1(uint8_t source, uint8_t address)
+{
+	writeWord(VST1_MASK | vectorD(source) | ((address & 0xf) << 16));
+}
+
+void Compiler::vpush(uint8_t reg)
+{
+	writeWord(VPUSH_MASK | vectorD(reg));
+	stackDepth_ += 16;
+}
+
+void Compiler::vpop(uint8_t reg)
+{
+	writeWord(VPOP_MASK | vectorD(reg));
+	stackDepth_ -= 16;
+}
+
+void Compiler::constant(uint32_t constant, uint8_t reg)
+{
+	uint32_t encoded;
+
+	// Thumb-2 cores all have MOVW, so there is never a literal pool
+	if (thumb())
+	{
+		if (low(reg) && constant < 256)
+		{
+			writeThumb(0x2000 | (reg << 8) | constant); // movs
+		}
+		else if (encodeThumbImmediate(constant, encoded))
+		{
+			writeThumb(THUMB_IMMEDIATE_MASK | (thumbOperation(MOV_MASK) << 21) | (0xf << 16)
+				| ((reg & 0xf) << 8) | encoded);
+		}
+		else if (encodeThumbImmediate(~constant, encoded))
+		{
+			writeThumb(THUMB_IMMEDIATE_MASK | (thumbOperation(MVN_MASK) << 21) | (0xf << 16)
+				| ((reg & 0xf) << 8) | encoded);
+		}
+		else
+		{
+			auto halfword = [reg](uint32_t mask, uint32_t value)
+			{
+				return mask | ((value & 0xf000) << 4) | ((value & 0x800) << 15)
+					| ((value & 0x700) << 4) | ((reg & 0xf) << 8) | (value & 0xff);
+			};
+
+			writeThumb(halfword(THUMB_MOVW_MASK, constant & 0xffff));
+			if (constant >> 16)
+				writeThumb(halfword(THUMB_MOVT_MASK, constant >> 16));
+		}
+		return;
+	}
+
+	uint32_t words[2];
+	size_t count = immediateConstant(constant, reg, movwAvailable_, words);
+	for (size_t i = 0; i < count; ++i)
+		writeWord(words[i]);
+
+	if (count == 0)
+		literalLoad(constant, reg);
+}
+
+void Compiler::loadConstant(uint32_t adress, uint8_t reg)
+{
+	constant(adress, reg);
+	loadStore(LDR_MASK, reg, reg, 0);
+}
+
+
+bool Compiler::immediateOperand(const ASTNode& node, uint32_t& other,
+	uint32_t& mask, uint32_t& value)
+{
+	if (node.kind != ASTKind::Add && node.kind != ASTKind::Sub)
+		return false;
+
+	const AST& tree = *treeDependency_;
+	bool add = node.kind == ASTKind::Add;
+
+	if (tree[node.right].kind == ASTKind::Literal)
+	{
+		other = node.left;
+		value = tree[node.right].value;
+
+		mask = add ? ADD_MASK : SUB_MASK;
+		if (immediateEncodable(mask, value))
+			return true;
+
+		mask = add ? SUB_MASK : ADD_MASK;
+		if (immediateEncodable(mask, 0 - value))
+		{
+			value = 0 - value;
+			return true;
+		}
+	}
+
+	if (tree[node.left].kind == ASTKind::Literal)
+	{
+		other = node.right;
+		value = tree[node.left].value;
+
+		mask = add ? ADD_MASK : RSB_MASK;
+		if (immediateEncodable(mask, value))
+			return true;
+
+		mask = SUB_MASK;
+		if (add && immediateEncodable(mask, 0 - value))
+		{
+			value = 0 - value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Compiler::constantMultiplier(const ASTNode& node, uint32_t& other, ShiftAdd& sequence)
+{
+	if (node.kind != ASTKind::Mul)
+		return false;
+
+	const AST& tree = *treeDependency_;
+
+	if (tree[node.right].kind == ASTKind::Literal
+		&& shiftAddMultiplier(tree[node.right].value, sequence))
+	{
+		other = node.left;
+		return true;
+	}
+
+	if (tree[node.left].kind == ASTKind::Literal
+		&& shiftAddMultiplier(tree[node.left].value, sequence))
+	{
+		other = node.right;
+		return true;
+	}
+
+	return false;
+}
+
+void Compiler::computeNeed()
+{
+	const AST& tree = *treeDependency_;
+	need_.assign(tree.Size(), 1);
+	std::vector<uint32_t> needs;
+
+	// operands precede their users, so their numbers are already known
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		uint32_t other;
+		uint32_t mask;
+		uint32_t value;
+		ShiftAdd sequence;
+		bool modulo;
+
+		switch (node.kind)
+		{
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+				if (immediateOperand(node, other, mask, value)
+					|| constantMultiplier(node, other, sequence))
+				{
+					need_[i] = need_[other];
+				}
+				else
+				{
+					uint32_t left = need_[node.left];
+					uint32_t right = need_[node.right];
+					need_[i] = left == right ? left + 1 : std::max(left, right);
+				}
+				break;
+
+			case ASTKind::Negate:
+				need_[i] = need_[node.left];
+				break;
+
+			case ASTKind::Call:
+			{
+				if (constantDivision(node, other, value, modulo))
+				{
+					// only the multiply-high needs a register besides the scratch
+					uint32_t magnitude = static_cast<int32_t>(value) < 0 ? 0 - value : value;
+					bool powerOfTwo = (magnitude & (magnitude - 1)) == 0;
+					need_[i] = std::max<uint32_t>(need_[other], powerOfTwo ? 1 : 2);
+					break;
+				}
+
+				if (inlineIntrinsic(node) != nullptr)
+				{
+					const uint32_t* arguments = tree.Arguments(node);
+					if (node.right == 1)
+					{
+						need_[i] = need_[arguments[0]];
+					}
+					else
+					{
+						uint32_t left = need_[arguments[0]];
+						uint32_t right = need_[arguments[1]];
+						need_[i] = left == right ? left + 1 : std::max(left, right);
+					}
+					break;
+				}
+
+				// stack arguments are pushed as soon as they are evaluated,
+				// register ones are held until the call
+				const uint32_t* arguments = tree.Arguments(node);
+				needs.clear();
+				for (uint32_t j = 0; j < node.right; ++j)
+				{
+					if (j < 4)
+						needs.push_back(need_[arguments[j]]);
+					else
+						need_[i] = std::max(need_[i], need_[arguments[j]]);
+				}
+
+				std::sort(needs.rbegin(), needs.rend());
+				for (size_t j = 0; j < needs.size(); ++j)
+					need_[i] = std::max<uint32_t>(need_[i], needs[j] + j);
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+}
+
+uint8_t Compiler::compileCall(const ASTNode& call)
+{
+	// values held in registers clobbered by the call are saved up front,
+	// which also frees those registers for evaluating the arguments
+	uint32_t saved = ~freeRegisters_ & CALLER_SAVED;
+	if (saved != 0)
+	{
+		pushList(saved);
+		freeRegisters_ |= saved;
+	}
+
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+	size_t count = call.right;
+	uint32_t stackArguments = count > 4 ? 4 * (count - 4) : 0;
+
+	// sp has to be 8-byte aligned at the call, so a word of padding
+	// goes below the stack arguments when they would leave it off
+	uint32_t padding = (stackDepth_ + stackArguments) % 8;
+	if (padding != 0)
+	{
+		aluImmediate(SUB_MASK, 13, 13, padding);
+		stackDepth_ += padding;
+	}
+
+	// arguments past the fourth go on the stack, the fifth one on top
+	for (size_t i = count; i-- > 4;)
+	{
+		uint8_t reg = compileTree(arguments[i]);
+		push(reg);
+		release(reg);
+	}
+
+	registerArguments(*this, call, SCRATCH_REGISTER);
+
+	// templates are ARM code, Thumb code calls the function instead
+	const intrinsic_t* intrinsic = intrinsics_[call.value];
+	if (intrinsic != nullptr && intrinsic->op == INTRINSIC_TEMPLATE && !thumb())
+	{
+		pasteTemplate(*intrinsic);
+	}
+	else
+	{
+		constant(static_cast<uint32_t>(addresses_[call.value]), CALL_REGISTER);
+		blx(CALL_REGISTER);
+	}
+
+	if (stackArguments + padding != 0)
+	{
+		aluImmediate(ADD_MASK, 13, 13, stackArguments + padding);
+		stackDepth_ -= stackArguments + padding;
+	}
+
+	uint8_t result = 0;
+	if (saved & 1)
+	{
+		result = allocate(saved);
+		mov(result, 0);
+	}
+	else
+	{
+		freeRegisters_ &= ~1u;
+	}
+
+	if (saved != 0)
+	{
+		freeRegisters_ &= ~saved;
+		popList(saved);
+	}
+
+	return result;
+}
+
+uint8_t Compiler::compileDivision(uint32_t dividend, uint32_t divisor, bool modulo)
+{
+	uint8_t reg = compileTree(dividend);
+	if (!multipliedDivision(divisor))
+		return divideByConstant(*this, reg, reg, SCRATCH_REGISTER, divisor, modulo);
+
+	uint8_t quotient = allocate();
+	uint8_t result = divideByConstant(*this, reg, quotient, SCRATCH_REGISTER, divisor, modulo);
+	release(result == reg ? quotient : reg);
+	return result;
+}
+
+void Compiler::pasteTemplate(const intrinsic_t& intrinsic)
+{
+	// the template has to stay contiguous, so no literal pool may land in it
+	if (!literals_.Empty())
+		keepLiteralsInRange(4 * intrinsic.code_size);
+
+	flush();
+	for (size_t i = 0; i < intrinsic.code_size; ++i)
+		bufferDependency_->Write(intrinsic.code[i]);
+}
+
+uint8_t Compiler::compileOperands(uint32_t left, uint32_t right, uint8_t& lhs, uint8_t& rhs)
+{
+	// the subtree that needs more registers goes first
+	bool rightFirst = need_[right] > need_[left];
+	uint32_t heavy = rightFirst ? right : left;
+	uint32_t light = rightFirst ? left : right;
+
+	uint8_t first = compileTree(heavy);
+
+	// a parameter kept in a register is read where it lives
+	uint8_t home;
+	if (parameterHome(light, home))
+	{
+		lhs = rightFirst ? home : first;
+		rhs = rightFirst ? first : home;
+		return first;
+	}
+
+	bool spilled = need_[light] > freeCount();
+	if (spilled)
+	{
+		push(first);
+		release(first);
+	}
+
+	uint8_t second = compileTree(light);
+	uint8_t dest = first;
+
+	if (spilled)
+	{
+		first = SCRATCH_REGISTER;
+		pop(first);
+		dest = second;
+	}
+	else
+	{
+		// still readable by the instruction that consumes it
+		release(second);
+	}
+
+	lhs = rightFirst ? second : first;
+	rhs = rightFirst ? first : second;
+	return dest;
+}
+
+uint8_t Compiler::compileVariable(const ASTNode& variable)
+{
+	uint32_t index = parameterIndices_[variable.value];
+	uint8_t reg = allocate();
+
+	if (index == NOT_PARAMETER)
+	{
+		loadConstant(static_cast<uint32_t>(addresses_[variable.value]), reg);
+	}
+	else if (index < 4)
+	{
+		mov(reg, homes_[index]);
+	}
+	else
+	{
+		// above whatever the body has pushed and the saved registers
+		uint32_t offset = stackDepth_ + PROLOGUE_SIZE + 4 * (index - 4);
+		loadStore(LDR_MASK, reg, 13, offset);
+	}
+
+	return reg;
+}
+
+uint8_t Compiler::compileIntrinsic(const ASTNode& call, const intrinsic_t& intrinsic)
+{
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+
+	if (intrinsic.op == INTRINSIC_MIN || intrinsic.op == INTRINSIC_MAX)
+	{
+		uint8_t lhs;
+		uint8_t rhs;
+		uint8_t dest = compileOperands(arguments[0], arguments[1], lhs, rhs);
+
+		// keep dest unless the other operand wins the signed comparison
+		bool min = intrinsic.op == INTRINSIC_MIN;
+		cmp(lhs, rhs);
+		if (dest == lhs)
+			mov(dest, rhs, min ? GREATER : LESS);
+		else
+			mov(dest, lhs, min ? LESS : GREATER);
+		return dest;
+	}
+
+	uint8_t reg = compileTree(arguments[0]);
+	uint32_t immediate = static_cast<uint32_t>(intrinsic.immediate);
+
+	switch (intrinsic.op)
+	{
+		case INTRINSIC_ADD_IMMEDIATE:
+			if (immediateEncodable(ADD_MASK, immediate))
+			{
+				aluImmediate(ADD_MASK, reg, reg, immediate);
+			}
+			else if (immediateEncodable(SUB_MASK, 0 - immediate))
+			{
+				aluImmediate(SUB_MASK, reg, reg, 0 - immediate);
+			}
+			else
+			{
+				constant(immediate, SCRATCH_REGISTER);
+				sum(reg, reg, SCRATCH_REGISTER);
+			}
+			break;
+
+		case INTRINSIC_NEGATE:
+			neg(reg, reg);
+			break;
+
+		case INTRINSIC_ABS:
+			aluImmediate(CMP_MASK, 0, reg, 0);
+			neg(reg, reg, LESS);
+			break;
+
+		case INTRINSIC_SHIFT_LEFT:
+		case INTRINSIC_SHIFT_RIGHT:
+			if (immediate > 31)
+				throw 0;
+
+			if (immediate != 0)
+			{
+				aluShifted(MOV_MASK, reg, 0, reg,
+					intrinsic.op == INTRINSIC_SHIFT_LEFT ? Shift::LSL : Shift::ASR, immediate);
+			}
+			break;
+
+		default:
+			throw 0;
+	}
+
+	return reg;
+}
+
+bool Compiler::pureCall(const ASTNode& call) const
+{
+	const intrinsic_t* intrinsic = intrinsics_[call.value];
+	if (intrinsic != nullptr && intrinsic->op != INTRINSIC_TEMPLATE)
+		return true;
+
+	return semantics_[call.value] != SYMBOL_PLAIN;
+}
+
+namespace
+{
+	// what hash-consing compares a node by: the kind, the value and the
+	// canonical operands, or for calls the span of their arguments
+	struct CommonKey
+	{
+		ASTKind kind;
+		uint32_t value;
+		uint32_t left;
+		uint32_t right;
+		uint32_t node;
+	};
+
+	constexpr uint32_t NO_NODE = UINT32_MAX;
+
+	uint32_t mixKey(uint32_t hash, uint32_t field)
+	{
+		return (hash ^ field) * 16777619u;
+	}
+}
+
+void Compiler::eliminateCommonSubexpressions()
+{
+	const AST& tree = *treeDependency_;
+	canonical_.resize(tree.Size());
+
+	// hash-consing: a node is keyed by its kind, value and canonical operands,
+	// so identical subtrees meet bottom-up; calls only merge when pure.
+	// Open addressing over at least twice as many slots as nodes
+	size_t capacity = 16;
+	while (capacity < 2 * tree.Size())
+		capacity *= 2;
+	std::vector<CommonKey> seen(capacity, CommonKey{ASTKind::Literal, 0, 0, 0, NO_NODE});
+	size_t mask = capacity - 1;
+
+	auto sameArguments = [this, &tree](const CommonKey& first, const CommonKey& second)
+	{
+		const uint32_t* firstArguments = tree.Arguments(tree[first.node]);
+		const uint32_t* secondArguments = tree.Arguments(tree[second.node]);
+		for (uint32_t j = 0; j < first.right; ++j)
+		{
+			if (canonical_[firstArguments[j]] != canonical_[secondArguments[j]])
+				return false;
+		}
+		return true;
+	};
+
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		canonical_[i] = i;
+		if (node.kind == ASTKind::Call && !pureCall(node))
+			continue;
+
+		CommonKey key{node.kind, node.value, 0, 0, i};
+		if (node.kind == ASTKind::Negate)
+		{
+			key.left = canonical_[node.left];
+		}
+		else if (node.kind == ASTKind::Add || node.kind == ASTKind::Sub || node.kind == ASTKind::Mul)
+		{
+			key.left = canonical_[node.left];
+			key.right = canonical_[node.right];
+			if (node.kind != ASTKind::Sub && key.left > key.right)
+				std::swap(key.left, key.right);
+		}
+		else if (node.kind == ASTKind::Call)
+		{
+			key.left = node.left;
+			key.right = node.right;
+		}
+
+		uint32_t hash = mixKey(mixKey(2166136261u, static_cast<uint32_t>(node.kind)), key.value);
+		if (node.kind == ASTKind::Call)
+		{
+			const uint32_t* arguments = tree.Arguments(node);
+			for (uint32_t j = 0; j < node.right; ++j)
+				hash = mixKey(hash, canonical_[arguments[j]]);
+		}
+		else
+		{
+			hash = mixKey(mixKey(hash, key.left), key.right);
+		}
+
+		size_t slot = hash & mask;
+		for (; seen[slot].node != NO_NODE; slot = (slot + 1) & mask)
+		{
+			const CommonKey& other = seen[slot];
+			if (other.kind != key.kind || other.value != key.value)
+				continue;
+
+			bool same = node.kind == ASTKind::Call
+				? other.right == key.right && sameArguments(other, key)
+				: other.left == key.left && other.right == key.right;
+			if (same)
+				break;
+		}
+
+		if (seen[slot].node == NO_NODE)
+			seen[slot] = key;
+		canonical_[i] = seen[slot].node;
+	}
+
+	// count the uses of what is left reachable, walking down from the root
+	std::vector<uint32_t> uses(tree.Size(), 0);
+	std::vector<bool> reachable(tree.Size(), false);
+	std::vector<bool> reachableBefore(tree.Size(), false);
+	reachable[canonical_[tree.Root()]] = true;
+	reachableBefore[tree.Root()] = true;
+
+	auto forEachOperand = [&tree](const ASTNode& node, auto&& function)
+	{
+		if (node.kind == ASTKind::Call)
+		{
+			const uint32_t* arguments = tree.Arguments(node);
+			for (uint32_t j = 0; j < node.right; ++j)
+				function(arguments[j]);
+		}
+		else if (node.kind == ASTKind::Negate)
+		{
+			function(node.left);
+		}
+		else if (node.kind != ASTKind::Literal && node.kind != ASTKind::Variable)
+		{
+			function(node.left);
+			function(node.right);
+		}
+	};
+
+	size_t before = 0;
+	size_t after = 0;
+	for (uint32_t i = tree.Size(); i-- > 0;)
+	{
+		if (reachableBefore[i])
+		{
+			++before;
+			forEachOperand(tree[i], [&](uint32_t operand) { reachableBefore[operand] = true; });
+		}
+
+		if (reachable[i])
+		{
+			++after;
+			forEachOperand(tree[i], [&](uint32_t operand)
+			{
+				reachable[canonical_[operand]] = true;
+				++uses[canonical_[operand]];
+			});
+		}
+	}
+	eliminated_ = before - after;
+
+	// reused values get a word of the frame, except the ones
+	// as cheap to recompute as to reload
+	uint32_t slots = 0;
+	slots_.assign(tree.Size(), NO_SLOT);
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		ASTKind kind = tree[i].kind;
+		if (uses[i] > 1 && kind != ASTKind::Literal && kind != ASTKind::Variable)
+			slots_[i] = slots++;
+	}
+
+	slotReady_.assign(slots, false);
+	frameSize_ = 4 * slots;
+}
+
+uint8_t Compiler::compileTree(uint32_t current)
+{
+	current = canonical_[current];
+	uint32_t slot = slots_[current];
+	if (slot == NO_SLOT)
+		return compileNode(current);
+
+	// the first use computes the value and stores it, the later ones reload it
+	bool reload = slotReady_[slot];
+	uint8_t reg = reload ? allocate() : compileNode(current);
+	slotReady_[slot] = true;
+
+	// the frame sits right above everything pushed since the prologue
+	uint32_t offset = stackDepth_ - frameSize_ + 4 * slot;
+	loadStore(reload ? LDR_MASK : STR_MASK, reg, 13, offset);
+	return reg;
+}
+
+uint8_t Compiler::compileNode(uint32_t current)
+{
+	const ASTNode& node = (*treeDependency_)[current];
+	uint32_t other;
+	uint32_t mask;
+	uint32_t value;
+	ShiftAdd sequence;
+	bool modulo;
+
+	switch (node.kind)
+	{
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+		{
+			if (immediateOperand(node, other, mask, value))
+			{
+				uint8_t reg = compileTree(other);
+				aluImmediate(mask, reg, reg, value);
+				return reg;
+			}
+
+			if (constantMultiplier(node, other, sequence))
+			{
+				uint8_t reg = compileTree(other);
+				multiplyByConstant(*this, reg, sequence);
+				return reg;
+			}
+
+			uint8_t lhs;
+			uint8_t rhs;
+			uint8_t dest = compileOperands(node.left, node.right, lhs, rhs);
+
+			if (node.kind == ASTKind::Add)
+				sum(dest, lhs, rhs);
+			else if (node.kind == ASTKind::Sub)
+				sub(dest, lhs, rhs);
+			else
+				mul(dest, lhs, rhs);
+
+			return dest;
+		}
+
+		case ASTKind::Variable:
+			return compileVariable(node);
+
+		case ASTKind::Call:
+		{
+			if (constantDivision(node, other, value, modulo))
+				return compileDivision(other, value, modulo);
+
+			const intrinsic_t* intrinsic = inlineIntrinsic(node);
+			if (intrinsic != nullptr)
+				return compileIntrinsic(node, *intrinsic);
+
+			return compileCall(node);
+		}
+
+		case ASTKind::Negate:
+		{
+			uint8_t reg = compileTree(node.left);
+			neg(reg, reg);
+			return reg;
+		}
+
+		case ASTKind::Literal:
+		{
+			uint8_t reg = allocate();
+			constant(node.value, reg);
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+bool Compiler::vectorizable() const
+{
+	const AST& tree = *treeDependency_;
+
+	// lane calls pass arguments in registers only
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		if (tree[i].kind == ASTKind::Call && tree[i].right > 4)
+			return false;
+	}
+
+	return true;
+}
+
+void Compiler::computeVectorNeed()
+{
+	const AST& tree = *treeDependency_;
+	vectorNeed_.assign(tree.Size(), 1);
+	uint32_t dividend;
+	uint32_t divisor;
+	bool modulo;
+
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		const uint32_t* arguments = node.kind == ASTKind::Call ? tree.Arguments(node) : nullptr;
+
+		switch (node.kind)
+		{
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+			{
+				uint32_t left = vectorNeed_[node.left];
+				uint32_t right = vectorNeed_[node.right];
+				vectorNeed_[i] = left == right ? left + 1 : std::max(left, right);
+				break;
+			}
+
+			case ASTKind::Negate:
+				vectorNeed_[i] = vectorNeed_[node.left];
+				break;
+
+			case ASTKind::Call:
+				if (!constantDivision(node, dividend, divisor, modulo)
+					&& inlineIntrinsic(node) != nullptr && node.right == 2)
+				{
+					uint32_t left = vectorNeed_[arguments[0]];
+					uint32_t right = vectorNeed_[arguments[1]];
+					vectorNeed_[i] = left == right ? left + 1 : std::max(left, right);
+					break;
+				}
+
+				// everything live is saved around lane calls, and their
+				// arguments are stored as soon as they are evaluated
+				for (uint32_t j = 0; j < node.right; ++j)
+					vectorNeed_[i] = std::max(vectorNeed_[i], vectorNeed_[arguments[j]]);
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+uint8_t Compiler::compileVectorOperands(uint32_t left, uint32_t right,
+	uint8_t& lhs, uint8_t& rhs)
+{
+	bool rightFirst = vectorNeed_[right] > vectorNeed_[left];
+	uint32_t heavy = rightFirst ? right : left;
+	uint32_t light = rightFirst ? left : right;
+
+	uint8_t first = compileVector(heavy);
+
+	bool spilled = vectorNeed_[light] > freeVectorCount();
+	if (spilled)
+	{
+		vpush(first);
+		releaseVector(first);
+	}
+
+	uint8_t second = compileVector(light);
+	uint8_t dest = first;
+
+	if (spilled)
+	{
+		first = VECTOR_SCRATCH;
+		vpop(first);
+		dest = second;
+	}
+	else
+	{
+		releaseVector(second);
+	}
+
+	lhs = rightFirst ? second : first;
+	rhs = rightFirst ? first : second;
+	return dest;
+}
+
+uint8_t Compiler::compileLaneCall(const ASTNode& call)
+{
+	// no q register survives a call, so every live one is saved first
+	uint32_t saved = ~freeVectors_ & VECTOR_ALLOCATABLE;
+	for (uint8_t reg = 0; reg < 16; ++reg)
+	{
+		if (saved & (1u << reg))
+			vpush(reg);
+	}
+	freeVectors_ |= saved;
+
+	// a slot for the four results, then the arguments, the last one on top
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+	uint32_t count = call.right;
+
+	aluImmediate(SUB_MASK, 13, 13, 16);
+	stackDepth_ += 16;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t reg = compileVector(arguments[i]);
+		vpush(reg);
+		releaseVector(reg);
+	}
+
+	const intrinsic_t* intrinsic = intrinsics_[call.value];
+	for (uint32_t lane = 0; lane < 4; ++lane)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			writeWord(LDR_MASK | (13 << 16) | (i << 12) | (16 * (count - 1 - i) + 4 * lane));
+
+		if (intrinsic != nullptr && intrinsic->op == INTRINSIC_TEMPLATE)
+		{
+			pasteTemplate(*intrinsic);
+		}
+		else
+		{
+			constant(static_cast<uint32_t>(addresses_[call.value]), CALL_REGISTER);
+			blx(CALL_REGISTER);
+		}
+
+		writeWord(STR_MASK | (13 << 16) | (16 * count + 4 * lane));
+	}
+
+	if (count != 0)
+		aluImmediate(ADD_MASK, 13, 13, 16 * count);
+	stackDepth_ -= 16 * count;
+
+	uint8_t result = allocateVector(saved);
+	vld1(result, 13, true);
+	stackDepth_ -= 16;
+
+	for (uint8_t reg = 16; reg-- > 0;)
+	{
+		if (saved & (1u << reg))
+			vpop(reg);
+	}
+	freeVectors_ &= ~saved;
+
+	return result;
+}
+
+uint8_t Compiler::compileVector(uint32_t current)
+{
+	const ASTNode& node = (*treeDependency_)[current];
+	uint32_t dividend;
+	uint32_t divisor;
+	bool modulo;
+
+	switch (node.kind)
+	{
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+		{
+			uint8_t lhs;
+			uint8_t rhs;
+			uint8_t dest = compileVectorOperands(node.left, node.right, lhs, rhs);
+
+			uint32_t mask = node.kind == ASTKind::Add ? VADD_MASK
+				: node.kind == ASTKind::Sub ? VSUB_MASK : VMUL_MASK;
+			vectorOperation(mask, dest, lhs, rhs);
+			return dest;
+		}
+
+		case ASTKind::Negate:
+		{
+			uint8_t reg = compileVector(node.left);
+			vectorOperation(VNEG_MASK, reg, 0, reg);
+			return reg;
+		}
+
+		case ASTKind::Literal:
+		{
+			uint8_t reg = allocateVector();
+			constant(node.value, CALL_REGISTER);
+			vdup(reg, CALL_REGISTER);
+			return reg;
+		}
+
+		case ASTKind::Variable:
+		{
+			uint8_t reg = allocateVector();
+			uint32_t index = parameterIndices_[node.value];
+
+			if (index == NOT_PARAMETER)
+			{
+				loadConstant(static_cast<uint32_t>(addresses_[node.value]), CALL_REGISTER);
+				vdup(reg, CALL_REGISTER);
+				return reg;
+			}
+
+			// columns[index] + the offset of the current row
+			writeWord(LDR_MASK | (4 << 16) | (CALL_REGISTER << 12) | (4 * index));
+			sum(CALL_REGISTER, CALL_REGISTER, 7);
+			vld1(reg, CALL_REGISTER);
+			return reg;
+		}
+
+		case ASTKind::Call:
+		{
+			const intrinsic_t* intrinsic = inlineIntrinsic(node);
+			if (constantDivision(node, dividend, divisor, modulo) || intrinsic == nullptr)
+				return compileLaneCall(node);
+
+			const uint32_t* arguments = treeDependency_->Arguments(node);
+			if (node.right == 2)
+			{
+				uint8_t lhs;
+				uint8_t rhs;
+				uint8_t dest = compileVectorOperands(arguments[0], arguments[1], lhs, rhs);
+				vectorOperation(intrinsic->op == INTRINSIC_MIN ? VMIN_MASK : VMAX_MASK,
+					dest, lhs, rhs);
+				return dest;
+			}
+
+			uint8_t reg = compileVector(arguments[0]);
+			uint32_t immediate = static_cast<uint32_t>(intrinsic->immediate);
+
+			switch (intrinsic->op)
+			{
+				case INTRINSIC_ADD_IMMEDIATE:
+					constant(immediate, CALL_REGISTER);
+					vdup(VECTOR_SCRATCH, CALL_REGISTER);
+					vectorOperation(VADD_MASK, reg, reg, VECTOR_SCRATCH);
+					break;
+
+				case INTRINSIC_NEGATE:
+					vectorOperation(VNEG_MASK, reg, 0, reg);
+					break;
+
+				case INTRINSIC_ABS:
+					vectorOperation(VABS_MASK, reg, 0, reg);
+					break;
+
+				case INTRINSIC_SHIFT_LEFT:
+				case INTRINSIC_SHIFT_RIGHT:
+					if (immediate > 31)
+						throw 0;
+
+					if (immediate != 0)
+					{
+						vectorShift(intrinsic->op == INTRINSIC_SHIFT_LEFT ? VSHL_MASK : VSHR_MASK,
+							reg, reg, immediate);
+					}
+					break;
+
+				default:
+					throw 0;
+			}
+
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+void Compiler::CompileBatch(CodeBuffer& buffer,
+	const SymbolTable& symtable,
+	const std::vector<std::string>& parameters)
+{
+	bufferDependency_ = &buffer;
+	symtableDependency_ = &symtable;
+	freeVectors_ = VECTOR_ALLOCATABLE;
+	stackDepth_ = 0;
+	literals_.Clear();
+	literalPools_.clear();
+	pending_.clear();
+	rewrites_.clear();
+
+	if (thumb())
+		throw 0;
+
+	const AST& tree = *treeDependency_;
+	resolveSymbols(parameters);
+
+	// r4 = columns, r5 = out, r6 = rows left, r7 = byte offset of the row
+	writeWord(0xe92d41f0); // push {r4-r8, lr}
+	mov(4, 0);
+	mov(5, 1);
+	mov(6, 2);
+	constant(0, 7);
+
+	// parameters past the fourth are passed to the scalar function
+	// in an 8-byte aligned area below the saved registers
+	uint32_t outgoing = parameters.size() > 4 ? (4 * (parameters.size() - 4) + 7) & ~7u : 0;
+	if (outgoing != 0)
+	{
+		constant(outgoing, CALL_REGISTER);
+		sub(13, 13, CALL_REGISTER);
+	}
+
+	CodeBuffer::Label scalar = buffer.NewLabel();
+	CodeBuffer::Label tail = buffer.NewLabel();
+	CodeBuffer::Label done = buffer.NewLabel();
+
+	if (neonAvailable_ && vectorizable())
+	{
+		computeVectorNeed();
+
+		CodeBuffer::Label loop = buffer.NewLabel();
+		bind(loop);
+		aluImmediate(CMP_MASK, 0, 6, 4);
+		branch(tail, B_MASK, LOWER);
+
+		uint8_t result = compileVector(tree.Root());
+		sum(CALL_REGISTER, 5, 7);
+		vst1(result, CALL_REGISTER);
+		releaseVector(result);
+
+		aluImmediate(ADD_MASK, 7, 7, 16);
+		aluImmediate(SUB_MASK, 6, 6, 4);
+		branch(loop);
+	}
+
+	// the rows left over, or all of them without NEON, one call each
+	bind(tail);
+	aluImmediate(CMP_MASK, 0, 6, 0);
+	branch(done, B_MASK, EQUAL);
+
+	for (size_t i = 0; i < parameters.size(); ++i)
+	{
+		uint8_t reg = i < 4 ? i : CALL_REGISTER;
+		if (4 * i > 4095)
+			throw 0;
+
+		writeWord(LDR_MASK | (4 << 16) | (reg << 12) | (4 * i));
+		writeWord(LDR_MASK | REGISTER_OFFSET | (reg << 16) | (reg << 12) | 7);
+		if (i >= 4)
+			writeWord(STR_MASK | (13 << 16) | (reg << 12) | (4 * (i - 4)));
+	}
+
+	branch(scalar, BL_MASK);
+	writeWord(STR_MASK | REGISTER_OFFSET | (5 << 16) | 7);
+	aluImmediate(ADD_MASK, 7, 7, 4);
+	aluImmediate(SUB_MASK, 6, 6, 1);
+	branch(tail);
+
+	bind(done);
+	if (outgoing != 0)
+	{
+		constant(outgoing, CALL_REGISTER);
+		sum(13, 13, CALL_REGISTER);
+	}
+	writeWord(0xe8bd81f0); // pop {r4-r8, pc}
+	emitLiteralPool();
+
+	bind(scalar);
+	std::vector<std::pair<size_t, size_t>> kernelPools = std::move(literalPools_);
+	std::vector<PeepholeRewrite> kernelRewrites = std::move(rewrites_);
+	Compile(buffer, symtable, parameters);
+	literalPools_.insert(literalPools_.begin(), kernelPools.begin(), kernelPools.end());
+	rewrites_.insert(rewrites_.begin(), kernelRewrites.begin(), kernelRewrites.end());
+}
+
+void Compiler::Compile(CodeBuffer& buffer, const SymbolTable& symtable,
+	const std::vector<std::string>& parameters)
+{
+	bufferDependency_ = &buffer;
+	symtableDependency_ = &symtable;
+	freeRegisters_ = ALLOCATABLE;
+	stackDepth_ = 0;
+	literals_.Clear();
+	literalPools_.clear();
+	pending_.clear();
+	rewrites_.clear();
+
+	const AST& tree = *treeDependency_;
+	uint32_t usedParameters = resolveSymbols(parameters);
+	eliminateCommonSubexpressions();
+	computeNeed();
+
+	// init code
+
+	// eight registers, keeping sp 8-byte aligned as AAPCS requires at calls
+	if (thumb())
+		writeThumb(THUMB_PUSH_LIST_MASK | 0x47f0); // push {r4-r10, lr}
+	else
+		writeWord(0xe92d47f0); // push {r4-r10, lr}
+	if (frameSize_ != 0)
+	{
+		constant(frameSize_, CALL_REGISTER);
+		sub(13, 13, CALL_REGISTER);
+		stackDepth_ = frameSize_;
+	}
+
+	// register parameters stay in r0-r3 unless a call would clobber them,
+	// then they are moved to callee-saved registers once
+	bool calls = needsCallSequence();
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		if (!(usedParameters & (1u << i)))
+			continue;
+
+		homes_[i] = calls ? 4 + i : i;
+		freeRegisters_ &= ~(1u << homes_[i]);
+		if (calls)
+			mov(homes_[i], i);
+	}
+
+	uint8_t result = compileTree(tree.Root());
+	if (result != 0)
+		mov(0, result);
+	if (frameSize_ != 0)
+	{
+		constant(frameSize_, CALL_REGISTER);
+		sum(13, 13, CALL_REGISTER);
+	}
+	if (thumb())
+	{
+		writeThumb(THUMB_POP_LIST_MASK | 0x87f0); // pop {r4-r10, pc}
+		return;
+	}
+
+	writeWord(0xe8bd47f0); // pop {r4-r10, lr}
+	writeWord(0xe12fff1e); // bx lr
+	emitLiteralPool();
+}
+
+size_t Compiler::EliminatedNodes() const
+{
+	return eliminated_;
+}
+
+const std::vector<PeepholeRewrite>& Compiler::PeepholeRewrites() const
+{
+	return rewrites_;
+}
+
+void Compiler::CountInstructions(const CodeBuffer& buffer, compile_stats_t& stats) const
+{
+	stats.push_pop = stats.loads = stats.stores = stats.alu = 0;
+	stats.calls = stats.branches = stats.other = 0;
+	stats.literal_words = 0;
+	stats.code_bytes = buffer.Position();
+
+	auto pool = literalPools_.begin();
+	for (size_t position = 0; position < buffer.Position(); position += sizeof(uint32_t))
+	{
+		if (pool != literalPools_.end() && position == pool->first)
+		{
+			stats.literal_words += pool->second;
+			position += sizeof(uint32_t) * (pool->second - 1);
+			++pool;
+			continue;
+		}
+
+		uint32_t word = buffer.Read(position);
+		uint32_t condition = word >> 28;
+		uint32_t group = (word >> 25) & 0b111;
+		bool load = word & (1u << 20);
+		bool stackPointer = ((word >> 16) & 0xf) == 13;
+
+		if (condition == 0b1111)
+			++stats.other; // NEON
+		else if ((word & 0x0ffffff0) == (BLX_MASK & 0x0ffffff0))
+			++stats.calls;
+		else if ((word & 0x0ffffff0) == 0x012fff10) // bx
+			++stats.branches;
+		else if (group == 0b101)
+			++(word & (1u << 24) ? stats.calls : stats.branches);
+		else if (group == 0b100)
+			++(stackPointer && (word & (1u << 21)) ? stats.push_pop : load ? stats.loads : stats.stores);
+		else if ((word & 0x0fff0fff) == (PUSH_MASK & 0x0fff0fff)
+			|| (word & 0x0fff0fff) == (POP_MASK & 0x0fff0fff))
+			++stats.push_pop;
+		else if (group == 0b010 || group == 0b011)
+			++(load ? stats.loads : stats.stores);
+		else if (group == 0b000 || group == 0b001)
+			++stats.alu;
+		else
+			++stats.other; // VFP and NEON loads, stores and transfers
+	}
+}
+
+A64Compiler::A64Compiler(AST& tree)
+	: TreeCompiler(tree, 8),
+	freeRegisters_(CALLER_SAVED),
+	stackDepth_(0),
+	frameSize_(0),
+	calleeSaved_(0)
+{
+
+}
+
+uint8_t A64Compiler::allocate(uint32_t forbidden)
+{
+	// callee-saved registers first, so that values survive calls for free,
+	// the argument registers last
+	static constexpr uint8_t order[] = {19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
+		9, 10, 11, 12, 13, 14, 15, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+
+	for (uint8_t reg : order)
+	{
+		if (freeRegisters_ & ~forbidden & (1u << reg))
+		{
+			freeRegisters_ &= ~(1u << reg);
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+void A64Compiler::release(uint8_t reg)
+{
+	freeRegisters_ |= 1u << reg;
+}
+
+uint32_t A64Compiler::freeCount() const
+{
+	return std::bitset<32>(freeRegisters_).count();
+}
+
+bool A64Compiler::encodeImmediate(uint32_t value, uint32_t& encoded)
+{
+	// imm12, optionally shifted left by 12
+	if (value < (1u << 12))
+	{
+		encoded = value << 10;
+		return true;
+	}
+
+	if ((value & 0xfff) == 0 && value < (1u << 24))
+	{
+		encoded = SHIFTED_IMMEDIATE | (value >> 12) << 10;
+		return true;
+	}
+
+	return false;
+}
+
+bool A64Compiler::shiftMultiplier(uint32_t value)
+{
+	auto powerOfTwo = [](uint32_t x) { return x != 0 && (x & (x - 1)) == 0; };
+	return powerOfTwo(value) || powerOfTwo(0 - value) || powerOfTwo(value - 1);
+}
+
+void A64Compiler::writeWord(uint32_t word)
+{
+	bufferDependency_->Write(word);
+}
+
+void A64Compiler::pop(uint8_t reg)
+{
+	writeWord(POP_MASK | reg);
+	stackDepth_ -= 16;
+}
+
+void A64Compiler::push(uint8_t reg)
+{
+	writeWord(PUSH_MASK | reg);
+	stackDepth_ += 16;
+}
+
+void A64Compiler::pair(uint32_t mask, uint8_t first, uint8_t second, int32_t offset)
+{
+	uint32_t scaled = static_cast<uint32_t>(offset / 8) & 0x7f;
+	writeWord(mask | scaled << 15 | second << 10 | first);
+}
+
+void A64Compiler::pushList(uint32_t regs)
+{
+	// two registers per store, the odd one out last; popList undoes it
+	std::vector<uint8_t> list;
+	for (uint8_t reg = 0; reg < 32; ++reg)
+	{
+		if (regs & (1u << reg))
+			list.push_back(reg);
+	}
+
+	for (size_t i = 0; i + 1 < list.size(); i += 2)
+	{
+		pair(PUSH_PAIR_MASK, list[i], list[i + 1], -16);
+		stackDepth_ += 16;
+	}
+
+	if (list.size() % 2 != 0)
+		push(list.back());
+}
+
+void A64Compiler::popList(uint32_t regs)
+{
+	std::vector<uint8_t> list;
+	for (uint8_t reg = 0; reg < 32; ++reg)
+	{
+		if (regs & (1u << reg))
+			list.push_back(reg);
+	}
+
+	if (list.size() % 2 != 0)
+		pop(list.back());
+
+	for (size_t i = list.size() / 2 * 2; i > 0; i -= 2)
+	{
+		pair(POP_PAIR_MASK, list[i - 2], list[i - 1], 16);
+		stackDepth_ -= 16;
+	}
+}
+
+void A64Compiler::mov(uint8_t dest, uint8_t source)
+{
+	writeWord(MOV_MASK | source << 16 | dest);
+}
+
+void A64Compiler::neg(uint8_t dest, uint8_t source, Shift shift, uint32_t amount)
+{
+	aluShifted(SUB_MASK, dest, ZERO_REGISTER, source, shift, amount);
+}
+
+void A64Compiler::aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+	Shift shift, uint32_t amount)
+{
+	writeWord(mask | static_cast<uint32_t>(shift) << 22 | second << 16 | amount << 10 | first << 5 | dest);
+}
+
+void A64Compiler::aluImmediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t immediate)
+{
+	uint32_t encoded;
+	if (!encodeImmediate(immediate, encoded))
+		throw 0;
+
+	writeWord(mask | encoded | source << 5 | dest);
+}
+
+void A64Compiler::addConstant(uint8_t dest, uint8_t source, uint32_t value)
+{
+	uint32_t encoded;
+	if (encodeImmediate(value, encoded))
+	{
+		aluImmediate(ADD_IMMEDIATE_MASK, dest, source, value);
+	}
+	else if (encodeImmediate(0 - value, encoded))
+	{
+		aluImmediate(SUB_IMMEDIATE_MASK, dest, source, 0 - value);
+	}
+	else
+	{
+		constant(value, SCRATCH_REGISTER);
+		aluShifted(ADD_MASK, dest, source, SCRATCH_REGISTER);
+	}
+}
+
+void A64Compiler::multiplyAdd(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second, uint8_t addend)
+{
+	writeWord(mask | second << 16 | addend << 10 | first << 5 | dest);
+}
+
+void A64Compiler::multiplyByConstant(uint8_t reg, uint32_t value)
+{
+	// x << k, -(x << k) or x + (x << k), see shiftMultiplier
+	if ((value & (value - 1)) == 0)
+		shiftImmediate(Shift::LSL, reg, reg, __builtin_ctz(value));
+	else if (((0 - value) & (0 - value - 1)) == 0)
+		neg(reg, reg, Shift::LSL, __builtin_ctz(0 - value));
+	else
+		aluShifted(ADD_MASK, reg, reg, reg, Shift::LSL, __builtin_ctz(value - 1));
+}
+
+void A64Compiler::shiftImmediate(Shift shift, uint8_t dest, uint8_t source, uint32_t amount)
+{
+	if (amount == 0 && dest == source)
+		return;
+
+	// lsl and asr are aliases of the bitfield moves
+	if (shift == Shift::LSL)
+		writeWord(UBFM_MASK | ((32 - amount) & 31) << 16 | (31 - amount) << 10 | source << 5 | dest);
+	else
+		writeWord(SBFM_MASK | amount << 16 | 31 << 10 | source << 5 | dest);
+}
+
+void A64Compiler::conditional(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+	uint32_t condition)
+{
+	writeWord(mask | second << 16 | condition << 12 | first << 5 | dest);
+}
+
+void A64Compiler::loadStore(uint32_t mask, uint8_t reg, uint8_t base, uint32_t offset)
+{
+	if (offset % 4 == 0 && offset / 4 < (1u << 12))
+	{
+		writeWord(mask | (offset / 4) << 10 | base << 5 | reg);
+		return;
+	}
+
+	constant(offset, SCRATCH_REGISTER);
+	writeWord((mask ^ (1u << 24)) | REGISTER_OFFSET | SCRATCH_REGISTER << 16 | base << 5 | reg);
+}
+
+void A64Compiler::constant(uint32_t value, uint8_t reg)
+{
+	// one instruction whenever a halfword is all zeros or all ones
+	uint32_t inverted = ~value;
+	if ((value & 0xffff0000) == 0)
+	{
+		writeWord(MOVZ_MASK | value << 5 | reg);
+	}
+	else if ((value & 0xffff) == 0)
+	{
+		writeWord(MOVZ_MASK | 1u << 21 | (value >> 16) << 5 | reg);
+	}
+	else if ((inverted & 0xffff0000) == 0)
+	{
+		writeWord(MOVN_MASK | inverted << 5 | reg);
+	}
+	else if ((inverted & 0xffff) == 0)
+	{
+		writeWord(MOVN_MASK | 1u << 21 | (inverted >> 16) << 5 | reg);
+	}
+	else
+	{
+		writeWord(MOVZ_MASK | (value & 0xffff) << 5 | reg);
+		writeWord(MOVK_MASK | 1u << 21 | (value >> 16) << 5 | reg);
+	}
+}
+
+void A64Compiler::address(uint64_t value, uint8_t reg)
+{
+	// movz for the lowest nonzero halfword, movk for the rest of them
+	bool first = true;
+	for (uint32_t half = 0; half < 4; ++half)
+	{
+		uint32_t bits = (value >> (16 * half)) & 0xffff;
+		if (bits == 0 && !(first && half == 3))
+			continue;
+
+		writeWord(SIXTY_FOUR | (first ? MOVZ_MASK : MOVK_MASK) | half << 21 | bits << 5 | reg);
+		first = false;
+	}
+}
+
+bool A64Compiler::immediateOperand(const ASTNode& node, uint32_t& other,
+	uint32_t& mask, uint32_t& value) const
+{
+	if (node.kind != ASTKind::Add && node.kind != ASTKind::Sub)
+		return false;
+
+	const AST& tree = *treeDependency_;
+	bool add = node.kind == ASTKind::Add;
+	uint32_t encoded;
+
+	if (tree[node.right].kind == ASTKind::Literal)
+		other = node.left;
+	else if (add && tree[node.left].kind == ASTKind::Literal)
+		other = node.right;
+	else
+		return false;
+
+	value = tree[other == node.left ? node.right : node.left].value;
+	mask = add ? ADD_IMMEDIATE_MASK : SUB_IMMEDIATE_MASK;
+	if (encodeImmediate(value, encoded))
+		return true;
+
+	mask = add ? SUB_IMMEDIATE_MASK : ADD_IMMEDIATE_MASK;
+	value = 0 - value;
+	return encodeImmediate(value, encoded);
+}
+
+bool A64Compiler::constantMultiplier(const ASTNode& node, uint32_t& other, uint32_t& value) const
+{
+	if (node.kind != ASTKind::Mul)
+		return false;
+
+	const AST& tree = *treeDependency_;
+
+	if (tree[node.right].kind == ASTKind::Literal && shiftMultiplier(tree[node.right].value))
+	{
+		other = node.left;
+		value = tree[node.right].value;
+		return true;
+	}
+
+	if (tree[node.left].kind == ASTKind::Literal && shiftMultiplier(tree[node.left].value))
+	{
+		other = node.right;
+		value = tree[node.left].value;
+		return true;
+	}
+
+	return false;
+}
+
+size_t A64Compiler::fusedMultiply(const ASTNode& node, uint32_t* operands, uint32_t& mask) const
+{
+	// a*b + c and c + a*b as madd, c - a*b as msub, -(a*b) as msub from
+	// zero; products multiplyByConstant does alone are left to it
+	const AST& tree = *treeDependency_;
+	auto product = [this, &tree](uint32_t node)
+	{
+		uint32_t other;
+		uint32_t value;
+		return tree[node].kind == ASTKind::Mul && !constantMultiplier(tree[node], other, value);
+	};
+
+	uint32_t multiplication;
+	uint32_t addend = NOT_PARAMETER;
+	if (node.kind == ASTKind::Add && product(node.left))
+	{
+		multiplication = node.left;
+		addend = node.right;
+		mask = MADD_MASK;
+	}
+	else if (node.kind == ASTKind::Add && product(node.right))
+	{
+		multiplication = node.right;
+		addend = node.left;
+		mask = MADD_MASK;
+	}
+	else if (node.kind == ASTKind::Sub && product(node.right))
+	{
+		multiplication = node.right;
+		addend = node.left;
+		mask = MSUB_MASK;
+	}
+	else if (node.kind == ASTKind::Negate && product(node.left))
+	{
+		multiplication = node.left;
+		mask = MSUB_MASK;
+	}
+	else
+	{
+		return 0;
+	}
+
+	operands[0] = tree[multiplication].left;
+	operands[1] = tree[multiplication].right;
+	operands[2] = addend;
+	return addend == NOT_PARAMETER ? 2 : 3;
+}
+
+void A64Compiler::computeNeed()
+{
+	const AST& tree = *treeDependency_;
+	need_.assign(tree.Size(), 1);
+	std::vector<uint32_t> needs;
+
+	// operands held at the same time, the heaviest evaluated first
+	auto operandNeed = [this, &needs](const uint32_t* operands, size_t count)
+	{
+		needs.clear();
+		for (size_t j = 0; j < count; ++j)
+			needs.push_back(need_[operands[j]]);
+
+		std::sort(needs.rbegin(), needs.rend());
+		uint32_t need = 1;
+		for (size_t j = 0; j < needs.size(); ++j)
+			need = std::max<uint32_t>(need, needs[j] + j);
+		return need;
+	};
+
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		uint32_t other;
+		uint32_t mask;
+		uint32_t value;
+		uint32_t operands[3];
+		bool modulo;
+
+		switch (node.kind)
+		{
+			case ASTKind::Add:
+			case ASTKind::Sub:
+			case ASTKind::Mul:
+			{
+				if (immediateOperand(node, other, mask, value)
+					|| constantMultiplier(node, other, value))
+				{
+					need_[i] = need_[other];
+					break;
+				}
+
+				size_t count = fusedMultiply(node, operands, mask);
+				if (count == 0)
+				{
+					operands[0] = node.left;
+					operands[1] = node.right;
+					count = 2;
+				}
+
+				need_[i] = operandNeed(operands, count);
+				break;
+			}
+
+			case ASTKind::Negate:
+			{
+				size_t count = fusedMultiply(node, operands, mask);
+				need_[i] = count != 0 ? operandNeed(operands, count) : need_[node.left];
+				break;
+			}
+
+			case ASTKind::Call:
+			{
+				// the divisor and the quotient live in the scratch registers
+				if (constantDivision(node, other, value, modulo))
+				{
+					need_[i] = need_[other];
+					break;
+				}
+
+				const uint32_t* arguments = tree.Arguments(node);
+				if (inlineIntrinsic(node) != nullptr)
+				{
+					need_[i] = operandNeed(arguments, node.right);
+					break;
+				}
+
+				// stack arguments are stored as soon as they are evaluated,
+				// register ones are held until the call
+				need_[i] = operandNeed(arguments, std::min<uint32_t>(node.right, 8));
+				for (uint32_t j = 8; j < node.right; ++j)
+					need_[i] = std::max(need_[i], need_[arguments[j]]);
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+}
+
+uint8_t A64Compiler::compileOperands(const uint32_t* operands, size_t count, uint8_t* regs)
+{
+	// the subtrees that need more registers go first
+	size_t order[3] = {0, 1, 2};
+	std::stable_sort(order, order + count, [this, operands](size_t a, size_t b)
+	{
+		return need_[operands[a]] > need_[operands[b]];
+	});
+
+	bool held[3] = {false, false, false};
+	size_t spillOrder[3];
+	size_t spillCount = 0;
+
+	for (size_t k = 0; k < count; ++k)
+	{
+		size_t i = order[k];
+
+		// a parameter kept in a register is read where it lives
+		if (parameterHome(operands[i], regs[i]))
+			continue;
+
+		// spill the latest evaluated operands until the next one fits
+		for (size_t j = k; j-- > 0 && need_[operands[i]] > freeCount();)
+		{
+			if (!held[order[j]])
+				continue;
+
+			push(regs[order[j]]);
+			release(regs[order[j]]);
+			held[order[j]] = false;
+			spillOrder[spillCount++] = order[j];
+		}
+
+		regs[i] = compileTree(operands[i]);
+		held[i] = true;
+	}
+
+	// at most two are spilled, the last one evaluated never is
+	static constexpr uint8_t scratch[] = {SCRATCH_REGISTER, CALL_REGISTER};
+	for (size_t s = 0; spillCount > 0; ++s)
+	{
+		size_t i = spillOrder[--spillCount];
+		regs[i] = scratch[s];
+		pop(regs[i]);
+	}
+
+	// the result reuses one register, the others stay readable
+	// by the instruction that consumes them
+	uint8_t dest = ZERO_REGISTER;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!held[i])
+			continue;
+
+		if (dest == ZERO_REGISTER)
+			dest = regs[i];
+		else
+			release(regs[i]);
+	}
+
+	return dest != ZERO_REGISTER ? dest : allocate();
+}
+
+uint8_t A64Compiler::compileCall(const ASTNode& call)
+{
+	// values held in registers clobbered by the call are saved up front,
+	// which also frees those registers for evaluating the arguments
+	uint32_t saved = ~freeRegisters_ & CALLER_SAVED;
+	if (saved != 0)
+	{
+		pushList(saved);
+		freeRegisters_ |= saved;
+	}
+
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+	size_t count = call.right;
+
+	// arguments past the eighth take a doubleword each, the ninth one at sp,
+	// in an area that keeps sp 16-byte aligned
+	uint32_t stackArguments = count > 8 ? (8 * (count - 8) + 15) & ~15u : 0;
+	if (stackArguments != 0)
+	{
+		aluImmediate(SIXTY_FOUR | SUB_IMMEDIATE_MASK, STACK_POINTER, STACK_POINTER, stackArguments);
+		stackDepth_ += stackArguments;
+	}
+
+	uint32_t area = stackDepth_;
+	for (size_t i = 8; i < count; ++i)
+	{
+		uint8_t reg = compileTree(arguments[i]);
+		loadStore(STR_MASK, reg, STACK_POINTER, stackDepth_ - area + 8 * (i - 8));
+		release(reg);
+	}
+
+	registerArguments(*this, call, SCRATCH_REGISTER);
+
+	address(addresses_[call.value], CALL_REGISTER);
+	writeWord(BLR_MASK | CALL_REGISTER << 5);
+
+	if (stackArguments != 0)
+	{
+		aluImmediate(SIXTY_FOUR | ADD_IMMEDIATE_MASK, STACK_POINTER, STACK_POINTER, stackArguments);
+		stackDepth_ -= stackArguments;
+	}
+
+	uint8_t result = 0;
+	if (saved & 1)
+	{
+		result = allocate(saved);
+		mov(result, 0);
+	}
+	else
+	{
+		freeRegisters_ &= ~1u;
+	}
+
+	if (saved != 0)
+	{
+		freeRegisters_ &= ~saved;
+		popList(saved);
+	}
+
+	return result;
+}
+
+uint8_t A64Compiler::compileDivision(uint32_t dividend, uint32_t divisor, bool modulo)
+{
+	uint8_t reg = compileTree(dividend);
+
+	bool negative = static_cast<int32_t>(divisor) < 0;
+	uint32_t magnitude = negative ? 0 - divisor : divisor;
+
+	if (magnitude == 1)
+	{
+		if (modulo)
+			constant(0, reg);
+		else if (negative)
+			neg(reg, reg);
+		return reg;
+	}
+
+	// sdiv rounds toward zero as C does, the remainder is x - q * d
+	constant(divisor, SCRATCH_REGISTER);
+	uint8_t quotient = modulo ? CALL_REGISTER : reg;
+	writeWord(SDIV_MASK | SCRATCH_REGISTER << 16 | reg << 5 | quotient);
+	if (modulo)
+		multiplyAdd(MSUB_MASK, reg, quotient, SCRATCH_REGISTER, reg);
+
+	return reg;
+}
+
+uint8_t A64Compiler::compileVariable(const ASTNode& variable)
+{
+	uint32_t index = parameterIndices_[variable.value];
+	uint8_t reg = allocate();
+
+	if (index == NOT_PARAMETER)
+	{
+		address(addresses_[variable.value], reg);
+		loadStore(LDR_MASK, reg, reg, 0);
+	}
+	else if (index < 8)
+	{
+		mov(reg, homes_[index]);
+	}
+	else
+	{
+		// above whatever the body has pushed and the frame
+		uint32_t offset = stackDepth_ + frameSize_ + 8 * (index - 8);
+		loadStore(LDR_MASK, reg, STACK_POINTER, offset);
+	}
+
+	return reg;
+}
+
+uint8_t A64Compiler::compileIntrinsic(const ASTNode& call, const intrinsic_t& intrinsic)
+{
+	const uint32_t* arguments = treeDependency_->Arguments(call);
+
+	if (intrinsic.op == INTRINSIC_MIN || intrinsic.op == INTRINSIC_MAX)
+	{
+		uint8_t regs[2];
+		uint8_t dest = compileOperands(arguments, 2, regs);
+
+		aluShifted(CMP_MASK, 0, regs[0], regs[1]);
+		conditional(CSEL_MASK, dest, regs[0], regs[1],
+			intrinsic.op == INTRINSIC_MIN ? LESS : GREATER);
+		return dest;
+	}
+
+	uint8_t reg = compileTree(arguments[0]);
+	uint32_t immediate = static_cast<uint32_t>(intrinsic.immediate);
+
+	switch (intrinsic.op)
+	{
+		case INTRINSIC_ADD_IMMEDIATE:
+			addConstant(reg, reg, immediate);
+			break;
+
+		case INTRINSIC_NEGATE:
+			neg(reg, reg);
+			break;
+
+		case INTRINSIC_ABS:
+			aluImmediate(CMP_IMMEDIATE_MASK, 0, reg, 0);
+			conditional(CSNEG_MASK, reg, reg, reg, GREATER_EQUAL);
+			break;
+
+		case INTRINSIC_SHIFT_LEFT:
+		case INTRINSIC_SHIFT_RIGHT:
+			if (immediate > 31)
+				throw 0;
+
+			shiftImmediate(intrinsic.op == INTRINSIC_SHIFT_LEFT ? Shift::LSL : Shift::ASR,
+				reg, reg, immediate);
+			break;
+
+		default:
+			throw 0;
+	}
+
+	return reg;
+}
+
+uint8_t A64Compiler::compileTree(uint32_t current)
+{
+	const ASTNode& node = (*treeDependency_)[current];
+	uint32_t other;
+	uint32_t mask;
+	uint32_t value;
+	uint32_t operands[3];
+	uint8_t regs[3];
+	bool modulo;
+
+	switch (node.kind)
+	{
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+		{
+			if (immediateOperand(node, other, mask, value))
+			{
+				uint8_t reg = compileTree(other);
+				aluImmediate(mask, reg, reg, value);
+				return reg;
+			}
+
+			if (constantMultiplier(node, other, value))
+			{
+				uint8_t reg = compileTree(other);
+				multiplyByConstant(reg, value);
+				return reg;
+			}
+
+			size_t count = fusedMultiply(node, operands, mask);
+			if (count != 0)
+			{
+				uint8_t dest = compileOperands(operands, count, regs);
+				multiplyAdd(mask, dest, regs[0], regs[1], regs[2]);
+				return dest;
+			}
+
+			operands[0] = node.left;
+			operands[1] = node.right;
+			uint8_t dest = compileOperands(operands, 2, regs);
+
+			if (node.kind == ASTKind::Add)
+				aluShifted(ADD_MASK, dest, regs[0], regs[1]);
+			else if (node.kind == ASTKind::Sub)
+				aluShifted(SUB_MASK, dest, regs[0], regs[1]);
+			else
+				multiplyAdd(MADD_MASK, dest, regs[0], regs[1], ZERO_REGISTER);
+
+			return dest;
+		}
+
+		case ASTKind::Variable:
+			return compileVariable(node);
+
+		case ASTKind::Call:
+		{
+			if (constantDivision(node, other, value, modulo))
+				return compileDivision(other, value, modulo);
+
+			const intrinsic_t* intrinsic = inlineIntrinsic(node);
+			if (intrinsic != nullptr)
+				return compileIntrinsic(node, *intrinsic);
+
+			return compileCall(node);
+		}
+
+		case ASTKind::Negate:
+		{
+			if (fusedMultiply(node, operands, mask) != 0)
+			{
+				uint8_t dest = compileOperands(operands, 2, regs);
+				multiplyAdd(mask, dest, regs[0], regs[1], ZERO_REGISTER);
+				return dest;
+			}
+
+			uint8_t reg = compileTree(node.left);
+			neg(reg, reg);
+			return reg;
+		}
+
+		case ASTKind::Literal:
+		{
+			uint8_t reg = allocate();
+			constant(node.value, reg);
+			return reg;
+		}
+	}
+
+	throw 0;
+}
+
+void A64Compiler::Compile(CodeBuffer& buffer, const SymbolTable& symtable,
+	const std::vector<std::string>& parameters)
+{
+	bufferDependency_ = &buffer;
+	symtableDependency_ = &symtable;
+	stackDepth_ = 0;
+
+	const AST& tree = *treeDependency_;
+	uint32_t usedParameters = resolveSymbols(parameters);
+	computeNeed();
+
+	// a leaf whose values fit in x0-x15 gets no frame at all, anything else
+	// saves x29, x30 and as many callee-saved registers as it can have in use
+	bool calls = needsCallSequence();
+	uint32_t registers = need_[tree.Root()] + std::bitset<8>(usedParameters).count();
+	freeRegisters_ = CALLER_SAVED;
+	calleeSaved_ = 0;
+	frameSize_ = 0;
+
+	uint32_t saved = 0;
+	if (calls || registers > 16)
+	{
+		saved = std::min<uint32_t>(10, (registers + 1) & ~1u);
+		calleeSaved_ = ((1u << saved) - 1) << 19;
+		freeRegisters_ |= calleeSaved_;
+		frameSize_ = 16 + 8 * saved;
+
+		pair(PUSH_PAIR_MASK, 29, 30, -static_cast<int32_t>(frameSize_));
+		aluImmediate(SIXTY_FOUR | ADD_IMMEDIATE_MASK, 29, STACK_POINTER, 0); // mov x29, sp
+		for (uint32_t i = 0; i < saved; i += 2)
+			pair(STP_MASK, 19 + i, 20 + i, 16 + 8 * i);
+	}
+
+	// register parameters stay in x0-x7 unless a call would clobber them,
+	// then they are moved to callee-saved registers once
+	uint8_t home = 19;
+	for (uint8_t i = 0; i < 8; ++i)
+	{
+		if (!(usedParameters & (1u << i)))
+			continue;
+
+		homes_[i] = calls ? home++ : i;
+		freeRegisters_ &= ~(1u << homes_[i]);
+		if (calls)
+			mov(homes_[i], i);
+	}
+
+	uint8_t result = compileTree(tree.Root());
+	if (result != 0)
+		mov(0, result);
+
+	if (frameSize_ != 0)
+	{
+		for (uint32_t i = 0; i < saved; i += 2)
+			pair(LDP_MASK, 19 + i, 20 + i, 16 + 8 * i);
+		pair(POP_PAIR_MASK, 29, 30, frameSize_);
+	}
+	writeWord(RET);
+}
+
+IRCompiler::IRCompiler(const IR& ir, ArmFeatures features)
+	: irDependency_(&ir),
+	bufferDependency_(nullptr),
+	outgoing_(0),
+	frameSize_(0),
+	movwAvailable_(features.movw)
+{
+
+}
+
+void IRCompiler::allocate()
+{
+	const IR& ir = *irDependency_;
+	size_t size = ir.Size();
+
+	// a value lives from its definition to its last use
+	std::vector<uint32_t> lastUse(size, 0);
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		forEachOperand(ir, ir[i], [&lastUse, i](uint32_t operand) { lastUse[operand] = i; });
+		if (ir[i].op == IROp::Call && ir[i].second > 4)
+			outgoing_ = std::max(outgoing_, 4 * (ir[i].second - 4));
+	}
+
+	registers_.assign(size, SCRATCH);
+	slots_.assign(size, 0);
+
+	// linear scan: once the registers run out, whichever value is needed
+	// furthest away lives in a frame slot for all its lifetime; a slot is
+	// reused once its last value is read at or before the new one is defined
+	uint32_t free = ALLOCATABLE;
+	std::vector<uint32_t> active;
+	std::vector<uint32_t> slotFreeSince;
+
+	auto spill = [&](uint32_t value)
+	{
+		registers_[value] = SPILLED;
+		for (uint32_t slot = 0; slot < slotFreeSince.size(); ++slot)
+		{
+			if (slotFreeSince[slot] <= value)
+			{
+				slots_[value] = slot;
+				slotFreeSince[slot] = lastUse[value];
+				return;
+			}
+		}
+
+		slots_[value] = slotFreeSince.size();
+		slotFreeSince.push_back(lastUse[value]);
+	};
+
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		auto expired = std::remove_if(active.begin(), active.end(), [&](uint32_t value)
+		{
+			if (lastUse[value] > i)
+				return false;
+
+			free |= 1u << registers_[value];
+			return true;
+		});
+		active.erase(expired, active.end());
+
+		// read by nothing, so anywhere will do
+		if (lastUse[i] <= i)
+			continue;
+
+		if (free != 0)
+		{
+			registers_[i] = __builtin_ctz(free);
+			free &= free - 1;
+			active.push_back(i);
+			continue;
+		}
+
+		auto furthest = std::max_element(active.begin(), active.end(),
+			[&lastUse](uint32_t a, uint32_t b) { return lastUse[a] < lastUse[b]; });
+		if (lastUse[*furthest] <= lastUse[i])
+		{
+			spill(i);
+			continue;
+		}
+
+		registers_[i] = registers_[*furthest];
+		spill(*furthest);
+		*furthest = i;
+	}
+
+	// the outgoing arguments at sp, the slots above them
+	frameSize_ = (outgoing_ + 4 * slotFreeSince.size() + 7) & ~7u;
+}
+
+uint8_t IRCompiler::use(uint32_t value, uint8_t scratch)
+{
+	if (registers_[value] != SPILLED)
+		return registers_[value];
+
+	stackAccess(LDR_MASK, scratch, outgoing_ + 4 * slots_[value]);
+	return scratch;
+}
+
+uint8_t IRCompiler::target(uint32_t value) const
+{
+	return registers_[value] != SPILLED ? registers_[value] : SCRATCH;
+}
+
+void IRCompiler::define(uint32_t value, uint8_t reg)
+{
+	if (registers_[value] == SPILLED)
+		stackAccess(STR_MASK, reg, outgoing_ + 4 * slots_[value]);
+}
+
+void IRCompiler::writeWord(uint32_t word)
+{
+	if (!literals_.Empty())
+		keepLiteralsInRange();
+
+	bufferDependency_->Write(word);
+}
+
+void IRCompiler::keepLiteralsInRange()
+{
+	if (literals_.InRange(bufferDependency_->Position()))
+		return;
+
+	CodeBuffer::Label over = bufferDependency_->NewLabel();
+	bufferDependency_->Write(B_MASK, over, CodeBuffer::Fixup::Branch);
+	literals_.Emit(*bufferDependency_);
+	bufferDependency_->Bind(over);
+}
+
+void IRCompiler::constant(uint32_t value, uint8_t reg)
+{
+	uint32_t words[2];
+	size_t count = immediateConstant(value, reg, movwAvailable_, words);
+	for (size_t i = 0; i < count; ++i)
+		writeWord(words[i]);
+
+	if (count != 0)
+		return;
+
+	if (!literals_.Empty())
+		keepLiteralsInRange();
+
+	CodeBuffer& buffer = *bufferDependency_;
+	buffer.Write(LDR_MASK | (0xf << 16) | ((reg & 0xf) << 12),
+		literals_.Label(buffer, value, buffer.Position()), CodeBuffer::Fixup::PcRelativeLoad);
+}
+
+void IRCompiler::dataProcessing(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+	uint32_t condition)
+{
+	writeWord((mask & 0x0fffffff) | (condition << 28) | ((first & 0xf) << 16)
+		| ((dest & 0xf) << 12) | (second & 0xf));
+}
+
+void IRCompiler::immediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t value,
+	uint32_t condition)
+{
+	uint32_t encoded;
+	if (!encodeImmediate(value, encoded))
+		throw 0;
+
+	writeWord((mask & 0x0fffffff) | (condition << 28) | IMMEDIATE | ((source & 0xf) << 16)
+		| ((dest & 0xf) << 12) | encoded);
+}
+
+void IRCompiler::aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+	Shift shift, uint32_t amount)
+{
+	writeWord(mask | ((first & 0xf) << 16) | ((dest & 0xf) << 12) | ((amount & 0x1f) << 7)
+		| (static_cast<uint32_t>(shift) << 5) | (second & 0xf));
+}
+
+void IRCompiler::smull(uint8_t low, uint8_t high, uint8_t first, uint8_t second)
+{
+	// pre-ARMv6 cores require low, high and first to differ
+	writeWord(SMULL_MASK | ((high & 0xf) << 16) | ((low & 0xf) << 12)
+		| ((second & 0xf) << 8) | (first & 0xf));
+}
+
+void IRCompiler::mul(uint8_t dest, uint8_t first, uint8_t second)
+{
+	// pre-ARMv6 cores require Rd != Rm
+	if (second == dest)
+		std::swap(first, second);
+	if (second == dest)
+	{
+		dataProcessing(MOV_MASK, SECOND_SCRATCH, 0, second);
+		second = SECOND_SCRATCH;
+	}
+
+	writeWord(MUL_MASK | ((dest & 0xf) << 16) | ((first & 0xf) << 8) | (second & 0xf));
+}
+
+void IRCompiler::sum(uint8_t dest, uint8_t first, uint8_t second)
+{
+	dataProcessing(ADD_MASK, dest, first, second);
+}
+
+void IRCompiler::sub(uint8_t dest, uint8_t first, uint8_t second)
+{
+	dataProcessing(SUB_MASK, dest, first, second);
+}
+
+void IRCompiler::neg(uint8_t dest, uint8_t source)
+{
+	immediate(RSB_MASK, dest, source, 0);
+}
+
+void IRCompiler::stackAccess(uint32_t mask, uint8_t reg, uint32_t offset)
+{
+	if (offset > 4095)
+		throw 0;
+
+	writeWord(mask | (13 << 16) | ((reg & 0xf) << 12) | offset);
+}
+
+void IRCompiler::adjustStack(uint32_t mask, uint32_t bytes)
+{
+	uint32_t encoded;
+	if (bytes == 0)
+		return;
+
+	if (encodeImmediate(bytes, encoded))
+	{
+		immediate(mask, 13, 13, bytes);
+		return;
+	}
+
+	constant(bytes, SCRATCH);
+	dataProcessing(mask, 13, 13, SCRATCH);
+}
+
+void IRCompiler::compileCall(uint32_t value, uint32_t symbol, const uint32_t* arguments,
+	uint32_t count)
+{
+	// the stack arguments first, while the scratch register is free;
+	// the register ones come from r4-r10 and the frame, never r0-r3
+	for (uint32_t i = 4; i < count; ++i)
+		stackAccess(STR_MASK, use(arguments[i], SCRATCH), 4 * (i - 4));
+
+	for (uint32_t i = 0; i < count && i < 4; ++i)
+	{
+		if (registers_[arguments[i]] == SPILLED)
+			stackAccess(LDR_MASK, i, outgoing_ + 4 * slots_[arguments[i]]);
+		else
+			dataProcessing(MOV_MASK, i, 0, registers_[arguments[i]]);
+	}
+
+	const symbol_t* function = irDependency_->Symbol(symbol);
+	constant(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(function->pointer)), SCRATCH);
+	writeWord(BLX_MASK | SCRATCH);
+
+	uint8_t dest = target(value);
+	dataProcessing(MOV_MASK, dest, 0, 0);
+	define(value, dest);
+}
+
+void IRCompiler::compileInstruction(uint32_t value)
+{
+	const IR& ir = *irDependency_;
+	const IRInstruction& instruction = ir[value];
+	uint8_t dest = target(value);
+
+	switch (instruction.op)
+	{
+		case IROp::Constant:
+			constant(instruction.operand, dest);
+			break;
+
+		case IROp::Load:
+		{
+			const symbol_t* variable = ir.Symbol(instruction.operand);
+			constant(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(variable->pointer)), dest);
+			writeWord(LDR_MASK | ((dest & 0xf) << 16) | ((dest & 0xf) << 12));
+			break;
+		}
+
+		case IROp::Parameter:
+			// above the frame and the saved registers
+			if (instruction.operand < 4)
+				dataProcessing(MOV_MASK, dest, 0, instruction.operand);
+			else
+				stackAccess(LDR_MASK, dest, frameSize_ + PROLOGUE_SIZE + 4 * (instruction.operand - 4));
+			break;
+
+		case IROp::Negate:
+			neg(dest, use(instruction.first, SCRATCH));
+			break;
+
+		case IROp::Add:
+		case IROp::Sub:
+		case IROp::Mul:
+		{
+			uint8_t first = use(instruction.first, SCRATCH);
+			uint8_t second = use(instruction.second, SECOND_SCRATCH);
+			if (instruction.op == IROp::Add)
+				sum(dest, first, second);
+			else if (instruction.op == IROp::Sub)
+				sub(dest, first, second);
+			else
+				mul(dest, first, second);
+			break;
+		}
+
+		case IROp::Divide:
+		case IROp::Modulo:
+		{
+			// the dividend is worked on in the result register, lr is the
+			// scratch register and r0 the quotient, free after the parameters
+			uint8_t source = use(instruction.first, SCRATCH);
+			if (source != dest)
+				dataProcessing(MOV_MASK, dest, 0, source);
+
+			uint8_t result = divideByConstant(*this, dest, QUOTIENT, SECOND_SCRATCH,
+				instruction.operand, instruction.op == IROp::Modulo);
+			if (result != dest)
+				dataProcessing(MOV_MASK, dest, 0, result);
+			break;
+		}
+
+		case IROp::Abs:
+		{
+			uint8_t source = use(instruction.first, SCRATCH);
+			if (source != dest)
+				dataProcessing(MOV_MASK, dest, 0, source);
+			immediate(CMP_MASK, 0, dest, 0);
+			immediate(RSB_MASK, dest, dest, 0, LESS);
+			break;
+		}
+
+		case IROp::ShiftLeft:
+		case IROp::ShiftRight:
+		{
+			// asr #0 would mean asr #32
+			Shift shift = instruction.op == IROp::ShiftRight && instruction.operand != 0 ? Shift::ASR : Shift::LSL;
+			aluShifted(MOV_MASK, dest, 0, use(instruction.first, SCRATCH), shift, instruction.operand);
+			break;
+		}
+
+		case IROp::Min:
+		case IROp::Max:
+		{
+			uint8_t first = use(instruction.first, SCRATCH);
+			uint8_t second = use(instruction.second, SECOND_SCRATCH);
+			bool min = instruction.op == IROp::Min;
+
+			// the first operand is moved in unless that clobbers the second
+			if (dest == second && dest != first)
+			{
+				dataProcessing(CMP_MASK, 0, first, second);
+				dataProcessing(MOV_MASK, dest, 0, first, min ? LESS : GREATER);
+				break;
+			}
+
+			if (dest != first)
+				dataProcessing(MOV_MASK, dest, 0, first);
+			dataProcessing(CMP_MASK, 0, dest, second);
+			dataProcessing(MOV_MASK, dest, 0, second, min ? GREATER : LESS);
+			break;
+		}
+
+		case IROp::Call:
+			compileCall(value, instruction.operand, ir.Arguments(instruction), instruction.second);
+			return;
+
+		case IROp::Return:
+		{
+			uint8_t result = use(instruction.first, SCRATCH);
+			if (result != 0)
+				dataProcessing(MOV_MASK, 0, 0, result);
+
+			adjustStack(ADD_MASK, frameSize_);
+			writeWord(0xe8bd47f0); // pop {r4-r10, lr}
+			writeWord(0xe12fff1e); // bx lr
+			return;
+		}
+	}
+
+	define(value, dest);
+}
+
+void IRCompiler::Compile(CodeBuffer& buffer)
+{
+	bufferDependency_ = &buffer;
+	outgoing_ = 0;
+	literals_.Clear();
+	allocate();
+
+	// eight registers, keeping sp 8-byte aligned as AAPCS requires at calls
+	writeWord(0xe92d47f0); // push {r4-r10, lr}
+	adjustStack(SUB_MASK, frameSize_);
+
+	for (uint32_t i = 0; i < irDependency_->Size(); ++i)
+		compileInstruction(i);
+
+	// behind the return, out of the way of the code
+	literals_.Emit(buffer);
+}
+
+extern "C" void jit_compile_expression_to_arm(
+	const char* expression,
+	const symbol_t* externs,
+	void* out_buffer)
+{
+	jit_compile_expression_to_arm_sized(expression, externs, out_buffer, SIZE_MAX);
+}
+
+extern "C" size_t jit_compile_expression_to_arm_sized(
+	const char* expression,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return jit_compile_function_to_arm(expression, nullptr, 0, externs, out_buffer, out_size);
+}
+
+namespace
+{
+	// indices of the tasks a thread owns: the owner takes them from the front,
+	// thieves split off the back half
+	struct WorkRange
+	{
+		std::mutex mutex;
+		size_t begin;
+		size_t end;
+	};
+
+	template<typename Task>
+	void runWorkStealing(size_t count, size_t threadCount, const Task& task)
+	{
+		std::vector<WorkRange> ranges(threadCount);
+		for (size_t i = 0; i < threadCount; ++i)
+		{
+			ranges[i].begin = count * i / threadCount;
+			ranges[i].end = count * (i + 1) / threadCount;
+		}
+
+		auto steal = [&](size_t self)
+		{
+			for (size_t k = 1; k < threadCount; ++k)
+			{
+				WorkRange& victim = ranges[(self + k) % threadCount];
+				size_t begin, end;
+				{
+					std::lock_guard<std::mutex> lock(victim.mutex);
+					if (victim.begin == victim.end)
+						continue;
+
+					begin = victim.end - (victim.end - victim.begin + 1) / 2;
+					end = victim.end;
+					victim.end = begin;
+				}
+
+				// only the owner ever refills its own, now empty, range
+				std::lock_guard<std::mutex> lock(ranges[self].mutex);
+				ranges[self].begin = begin;
+				ranges[self].end = end;
+				return true;
+			}
+
+			return false;
+		};
+
+		auto work = [&](size_t self)
+		{
+			WorkRange& own = ranges[self];
+			while (true)
+			{
+				size_t index;
+				{
+					std::lock_guard<std::mutex> lock(own.mutex);
+					index = own.begin < own.end ? own.begin++ : SIZE_MAX;
+				}
+
+				if (index != SIZE_MAX)
+					task(index);
+				else if (!steal(self))
+					return;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < threadCount; ++i)
+			threads.emplace_back(work, i);
+		work(0);
+
+		for (std::thread& thread : threads)
+			thread.join();
+	}
+
+	AST parseExpression(std::string_view expression)
+	{
+		Lexer lexer(expression);
+		Parser parser(lexer);
+		AST tree = parser.Parse(expression.size());
+		Optimizer optimizer;
+		optimizer.Optimize(tree);
+		return tree;
+	}
+
+	// code is position independent: emit int f() into a scratch buffer,
+	// growing it while the code does not fit, to be copied out after;
+	// AArch64 processes get A64 code, everything else ARM code
+	size_t compileToScratch(std::string_view expression,
+		const SymbolTable& symtable, std::vector<uint8_t>& scratch)
+	{
+		static constexpr size_t INITIAL_SIZE = 4096;
+		static constexpr size_t MAX_SIZE = 1 << 24;
+
+		AST tree = parseExpression(expression);
+
+		if (scratch.size() < INITIAL_SIZE)
+			scratch.resize(INITIAL_SIZE);
+
+		while (true)
+		{
+#if defined(__aarch64__)
+			A64Compiler compiler(tree);
+#else
+			Compiler compiler(tree);
+#endif
+			CodeBuffer buffer(scratch.data(), scratch.size());
+			try
+			{
+				compiler.Compile(buffer, symtable);
+				return buffer.Finish();
+			}
+			catch (int)
+			{
+				bool full = buffer.Position() + sizeof(uint32_t) > scratch.size();
+				if (!full || scratch.size() >= MAX_SIZE)
+					throw;
+			}
+
+			scratch.resize(2 * scratch.size());
+		}
+	}
+
+	size_t compileFunction(const char* expression, const char* const* parameters,
+		size_t parameter_count, const symbol_t* externs, void* out_buffer, size_t out_size,
+		bool batch, InstructionSet instructionSet = InstructionSet::Arm)
+	{
+		size_t length = std::strlen(expression);
+
+		Lexer lexer(expression, expression + length);
+		Parser parser(lexer);
+		AST tree = parser.Parse(length);
+		Optimizer optimizer;
+		optimizer.Optimize(tree);
+		Compiler compiler(tree, instructionSet);
+
+		SymbolTable symtable(externs);
+		std::vector<std::string> names(parameters, parameters + parameter_count);
+
+		CodeBuffer buffer(out_buffer, out_size);
+		if (batch)
+			compiler.CompileBatch(buffer, symtable, names);
+		else
+			compiler.Compile(buffer, symtable, names);
+
+		return buffer.Finish();
+	}
+
+	size_t compileWithStats(const char* expression, const symbol_t* externs,
+		void* out_buffer, size_t out_size, compile_stats_t* stats)
+	{
+		typedef std::chrono::steady_clock Clock;
+		auto nanoseconds = [](Clock::time_point start, Clock::time_point finish)
+		{
+			return static_cast<uint64_t>(std::chrono::nanoseconds(finish - start).count());
+		};
+
+		size_t length = std::strlen(expression);
+
+		Clock::time_point start = Clock::now();
+		stats->tokens = 0;
+		Lexer tokens(expression, expression + length);
+		while (tokens.Advance().Current().kind != TokenKind::End)
+			++stats->tokens;
+
+		Clock::time_point lexed = Clock::now();
+		Lexer lexer(expression, expression + length);
+		Parser parser(lexer);
+		AST tree = parser.Parse(length);
+		stats->parsed_nodes = tree.Size();
+
+		Clock::time_point parsed = Clock::now();
+		Optimizer optimizer;
+		optimizer.Optimize(tree);
+		stats->optimized_nodes = tree.Size();
+
+		Clock::time_point optimized = Clock::now();
+		Compiler compiler(tree);
+		SymbolTable symtable(externs);
+		CodeBuffer buffer(out_buffer, out_size);
+		compiler.Compile(buffer, symtable);
+		size_t size = buffer.Finish();
+		Clock::time_point compiled = Clock::now();
+
+		stats->tokenize_ns = nanoseconds(start, lexed);
+		stats->parse_ns = nanoseconds(lexed, parsed);
+		stats->optimize_ns = nanoseconds(parsed, optimized);
+		stats->codegen_ns = nanoseconds(optimized, compiled);
+		compiler.CountInstructions(buffer, *stats);
+		stats->peephole_rewrites = compiler.PeepholeRewrites().size();
+
+		return size;
+	}
+
+	size_t compileToA64(const char* expression, const char* const* parameters,
+		size_t parameter_count, const symbol_t* externs, void* out_buffer, size_t out_size)
+	{
+		AST tree = parseExpression(expression);
+		A64Compiler compiler(tree);
+
+		SymbolTable symtable(externs);
+		std::vector<std::string> names(parameters, parameters + parameter_count);
+
+		CodeBuffer buffer(out_buffer, out_size);
+		compiler.Compile(buffer, symtable, names);
+		return buffer.Finish();
+	}
+
+	size_t compileThroughIR(const char* expression, const char* const* parameters,
+		size_t parameter_count, const symbol_t* externs, void* out_buffer, size_t out_size)
+	{
+		AST tree = parseExpression(expression);
+		SymbolTable symtable(externs);
+		std::vector<std::string> names(parameters, parameters + parameter_count);
+
+		IR ir(tree, symtable, names);
+		PassManager::Standard().Run(ir);
+
+		CodeBuffer buffer(out_buffer, out_size);
+		IRCompiler compiler(ir);
+		compiler.Compile(buffer);
+		return buffer.Finish();
+	}
+
+	// extern "C" callers cannot catch: a compilation that fails returns 0,
+	// one that only ran out of buffer the size the code needs, measured by
+	// compiling again without storing anything
+	template<typename Compile>
+	size_t compileOrMeasure(void* out_buffer, size_t out_size, const Compile& compile)
+	{
+		try
+		{
+			return compile(out_buffer, out_size);
+		}
+		catch (...)
+		{
+			if (out_buffer == nullptr && out_size == SIZE_MAX)
+				return 0;
+		}
+
+		try
+		{
+			return compile(nullptr, SIZE_MAX);
+		}
+		catch (...)
+		{
+			return 0;
+		}
+	}
+}
+
+extern "C" size_t jit_size_expression_to_arm(
+	const char* expression,
+	const symbol_t* externs)
+{
+	return jit_compile_expression_to_arm_sized(expression, externs, nullptr, SIZE_MAX);
+}
+
+extern "C" size_t jit_compile_expression_to_arm_stats(
+	const char* expression,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size,
+	compile_stats_t* stats)
+{
+	// the plain path stays free of clocks and counters
+	if (stats == nullptr)
+		return jit_compile_expression_to_arm_sized(expression, externs, out_buffer, out_size);
+
+	try
+	{
+		return compileWithStats(expression, externs, out_buffer, out_size, stats);
+	}
+	catch (...)
+	{
+		return jit_size_expression_to_arm(expression, externs);
+	}
+}
+
+extern "C" size_t jit_compile_function_to_arm(
+	const char* expression,
+	const char* const* parameters,
+	size_t parameter_count,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return compileOrMeasure(out_buffer, out_size, [&](void* memory, size_t capacity)
+		{
+			return compileFunction(expression, parameters, parameter_count,
+				externs, memory, capacity, false);
+		});
+}
+
+extern "C" size_t jit_compile_function_to_thumb(
+	const char* expression,
+	const char* const* parameters,
+	size_t parameter_count,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return compileOrMeasure(out_buffer, out_size, [&](void* memory, size_t capacity)
+		{
+			return compileFunction(expression, parameters, parameter_count,
+				externs, memory, capacity, false, InstructionSet::Thumb);
+		});
+}
+
+extern "C" size_t jit_compile_batch_to_arm(
+	const char* expression,
+	const char* const* parameters,
+	size_t parameter_count,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return compileOrMeasure(out_buffer, out_size, [&](void* memory, size_t capacity)
+		{
+			return compileFunction(expression, parameters, parameter_count,
+				externs, memory, capacity, true);
+		});
+}
+
+extern "C" size_t jit_compile_expression_to_a64(
+	const char* expression,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return jit_compile_function_to_a64(expression, nullptr, 0, externs, out_buffer, out_size);
+}
+
+extern "C" size_t jit_size_expression_to_a64(
+	const char* expression,
+	const symbol_t* externs)
+{
+	return jit_compile_function_to_a64(expression, nullptr, 0, externs, nullptr, SIZE_MAX);
+}
+
+extern "C" size_t jit_compile_function_to_a64(
+	const char* expression,
+	const char* const* parameters,
+	size_t parameter_count,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return compileOrMeasure(out_buffer, out_size, [&](void* memory, size_t capacity)
+		{
+			return compileToA64(expression, parameters, parameter_count, externs, memory, capacity);
+		});
+}
+
+extern "C" size_t jit_compile_function_to_arm_ir(
+	const char* expression,
+	const char* const* parameters,
+	size_t parameter_count,
+	const symbol_t* externs,
+	void* out_buffer,
+	size_t out_size)
+{
+	return compileOrMeasure(out_buffer, out_size, [&](void* memory, size_t capacity)
+		{
+			return compileThroughIR(expression, parameters, parameter_count, externs, memory, capacity);
+		});
+}
+
+CodeHeap::CodeHeap()
+	: nextExecutable_(nullptr),
+	left_(0),
+	mappedBytes_(0),
+	usedBytes_(0),
+	liveBlocks_(0)
+{
+
+}
+
+CodeHeap::~CodeHeap()
+{
+	for (const Chunk& chunk : chunks_)
+		unmapChunk(chunk);
+}
+
+CodeHeap::Chunk CodeHeap::mapChunk(size_t size)
+{
+	int file = memfd_create("jit-code", MFD_CLOEXEC);
+	if (file < 0)
+		throw 0;
+
+	void* executable = MAP_FAILED;
+	if (ftruncate(file, size) == 0)
+		executable = mmap(0, size, PROT_READ | PROT_EXEC, MAP_SHARED, file, 0);
+
+	if (executable == MAP_FAILED)
+	{
+		close(file);
+		throw 0;
+	}
+
+	return {file, static_cast<uint8_t*>(executable), size};
+}
+
+void CodeHeap::unmapChunk(const Chunk& chunk)
+{
+	munmap(chunk.executable, chunk.size);
+	close(chunk.file);
+}
+
+void CodeHeap::write(const Block& block, const uint8_t* executable, const void* code, size_t size)
+{
+	// a writable view of just the pages the block is on, gone again before
+	// the code can run; flipping the executable view to read-write instead
+	// would fault other threads running functions on those pages
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t begin = block.offset & ~(page - 1);
+	size_t length = ((block.offset + size + page - 1) & ~(page - 1)) - begin;
+
+	void* view = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, block.file, begin);
+	if (view == MAP_FAILED)
+		throw 0;
+
+	// both views alias the same memory: clean the data cache lines the code
+	// was written through and drop stale instructions at the executable ones
+	uint8_t* writable = static_cast<uint8_t*>(view) + (block.offset - begin);
+	std::memcpy(writable, code, size);
+	__builtin___clear_cache(reinterpret_cast<char*>(writable), reinterpret_cast<char*>(writable + size));
+	munmap(view, length);
+
+	__builtin___clear_cache(const_cast<char*>(reinterpret_cast<const char*>(executable)),
+		const_cast<char*>(reinterpret_cast<const char*>(executable + size)));
+}
+
+const void* CodeHeap::Install(const void* code, size_t size)
+{
+	size_t rounded = (size + GRANULE - 1) & ~(GRANULE - 1);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	const uint8_t* executable;
+	auto reusable = free_.find(rounded);
+	if (reusable != free_.end() && !reusable->second.empty())
+	{
+		executable = reusable->second.back();
+		reusable->second.pop_back();
+	}
+	else if (rounded > CHUNK_SIZE / 4)
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		chunks_.push_back(mapChunk((rounded + page - 1) & ~(page - 1)));
+		mappedBytes_ += chunks_.back().size;
+
+		executable = chunks_.back().executable;
+		blocks_[executable] = {chunks_.back().file, 0, rounded, false, true};
+	}
+	else
+	{
+		// the tail of the previous chunk is given up
+		if (left_ < rounded)
+		{
+			chunks_.push_back(mapChunk(CHUNK_SIZE));
+			mappedBytes_ += CHUNK_SIZE;
+
+			nextExecutable_ = chunks_.back().executable;
+			left_ = CHUNK_SIZE;
+		}
+
+		executable = nextExecutable_;
+		blocks_[executable] = {chunks_.back().file, CHUNK_SIZE - left_, rounded, false, false};
+		nextExecutable_ += rounded;
+		left_ -= rounded;
+	}
+
+	Block& block = blocks_[executable];
+	write(block, executable, code, size);
+	block.live = true;
+	usedBytes_ += block.size;
+	++liveBlocks_;
+
+	return executable;
+}
+
+const void* CodeHeap::InstallThumb(const void* code, size_t size)
+{
+	return static_cast<const uint8_t*>(Install(code, size)) + 1;
+}
+
+void CodeHeap::Free(const void* code)
+{
+	// blocks are aligned, so bit 0 can only be the Thumb bit
+	uintptr_t address = reinterpret_cast<uintptr_t>(code) & ~uintptr_t(1);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = blocks_.find(reinterpret_cast<const uint8_t*>(address));
+	if (it == blocks_.end() || !it->second.live)
+		throw 0;
+
+	Block& block = it->second;
+	usedBytes_ -= block.size;
+	--liveBlocks_;
+
+	if (!block.dedicated)
+	{
+		block.live = false;
+		free_[block.size].push_back(it->first);
+		return;
+	}
+
+	auto chunk = std::find_if(chunks_.begin(), chunks_.end(), [&](const Chunk& chunk)
+	{
+		return chunk.executable == it->first;
+	});
+	mappedBytes_ -= chunk->size;
+	unmapChunk(*chunk);
+	chunks_.erase(chunk);
+	blocks_.erase(it);
+}
+
+CodeHeapStats CodeHeap::Stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return {mappedBytes_, usedBytes_, liveBlocks_};
+}
+
+CompiledExpression::CompiledExpression(std::shared_ptr<CodeHeap> heap, const void* code, size_t size)
+	: heap_(std::move(heap)), code_(heap_->Install(code, size)), size_(size)
+{
+
+}
+
+CompiledExpression::~CompiledExpression()
+{
+	heap_->Free(code_);
+}
+
+const void* CompiledExpression::Code() const
+{
+	return code_;
+}
+
+size_t CompiledExpression::Size() const
+{
+	return size_;
+}
+
+ExpressionCache::ExpressionCache(size_t capacity, std::shared_ptr<CodeHeap> heap)
+	: heap_(std::move(heap)), capacity_(capacity), codeBytes_(0), hits_(0), misses_(0), evictions_(0)
+{
+
+}
+
+std::string ExpressionCache::makeKey(std::string_view expression,
+	const SymbolTable& symtable)
+{
+	// tokens separated by single spaces, so spacing does not matter
+	// but "a b" and "ab" stay apart
+	std::string key;
+	key.reserve(expression.size() + 1);
+
+	std::string bindings;
+	Lexer lexer(expression);
+	for (lexer.Advance(); lexer.Current().kind != TokenKind::End; lexer.Advance())
+	{
+		const Token& token = lexer.Current();
+		key.append(token.text);
+		key.push_back(' ');
+
+		if (token.kind == TokenKind::Error)
+			break;
+		if (token.kind != TokenKind::Identifier)
+			continue;
+
+		const symbol_t* found = symtable.Find(token.text);
+		if (found == nullptr)
+			continue;
+
+		// what the compiler reads from a symbol, by value
+		const symbol_t& symbol = *found;
+		bindings.append(token.text);
+		bindings.append(reinterpret_cast<const char*>(&symbol.pointer), sizeof(symbol.pointer));
+		bindings.append(reinterpret_cast<const char*>(&symbol.semantics), sizeof(symbol.semantics));
+		bindings.append(reinterpret_cast<const char*>(&symbol.intrinsic), sizeof(symbol.intrinsic));
+	}
+
+	key.push_back('\0');
+	key.append(bindings);
+	return key;
+}
+
+ExpressionCache::Entry ExpressionCache::compile(std::string_view expression,
+	const SymbolTable& symtable)
+{
+	std::vector<uint8_t> scratch;
+	size_t size = compileToScratch(expression, symtable, scratch);
+	return std::make_shared<const CompiledExpression>(heap_, scratch.data(), size);
+}
+
+void ExpressionCache::evict()
+{
+	while (codeBytes_ > capacity_ && !recency_.empty())
+	{
+		codeBytes_ -= recency_.back().second->Size();
+		index_.erase(recency_.back().first);
+		recency_.pop_back();
+		++evictions_;
+	}
+}
+
+ExpressionCache::Entry ExpressionCache::Get(const char* expression, const symbol_t* externs)
+{
+	return Get(expression, SymbolTable(externs));
+}
+
+ExpressionCache::Entry ExpressionCache::Get(const char* expression, const SymbolTable& symtable)
+{
+	std::string_view text(expression);
+	std::string key = makeKey(text, symtable);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = index_.find(key);
+		if (it != index_.end())
+		{
+			++hits_;
+			recency_.splice(recency_.begin(), recency_, it->second);
+			return it->second->second;
+		}
+		++misses_;
+	}
+
+	// compiled without the lock, so misses on other threads are not held up
+	Entry entry = compile(text, symtable);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = index_.find(key);
+	if (it != index_.end())
+	{
+		// another thread got there first, keep a single copy
+		recency_.splice(recency_.begin(), recency_, it->second);
+		return it->second->second;
+	}
+
+	recency_.emplace_front(std::move(key), entry);
+	index_.emplace(recency_.front().first, recency_.begin());
+	codeBytes_ += entry->Size();
+	evict();
+
+	return entry;
+}
+
+ExpressionCacheStats ExpressionCache::Stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return {hits_, misses_, evictions_, recency_.size(), codeBytes_};
+}
+
+std::vector<CompileResult> CompileParallel(CodeHeap& heap,
+	const char* const* expressions, size_t count,
+	const symbol_t* externs, size_t threadCount)
+{
+	return CompileParallel(heap, expressions, count, SymbolTable(externs), threadCount);
+}
+
+std::vector<CompileResult> CompileParallel(CodeHeap& heap,
+	const char* const* expressions, size_t count,
+	const SymbolTable& symtable, size_t threadCount)
+{
+	// the symbol table is only read, so the threads share it
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	threadCount = std::max<size_t>(1, std::min(threadCount, count));
+
+	std::vector<CompileResult> results(count);
+	runWorkStealing(count, threadCount, [&](size_t i)
+	{
+		thread_local std::vector<uint8_t> scratch;
+		try
+		{
+			size_t size = compileToScratch(expressions[i], symtable, scratch);
+			results[i] = {heap.Install(scratch.data(), size), size, true};
+		}
+		catch (...)
+		{
+			results[i] = {nullptr, 0, false};
+		}
+	});
+
+	return results;
+}
+
+Bytecode::Bytecode(const AST& tree, const SymbolTable& symtable,
+	const std::vector<std::string>& parameters)
+	: registerCount_(0), treeDependency_(&tree)
+{
+	pointers_.assign(tree.SymbolCount(), nullptr);
+	symbols_.assign(tree.SymbolCount(), nullptr);
+	parameterIndices_.assign(tree.SymbolCount(), UINT32_MAX);
+
+	for (uint32_t i = 0; i < tree.SymbolCount(); ++i)
+	{
+		const std::string& name = tree.SymbolName(i);
+		auto parameter = std::find(parameters.begin(), parameters.end(), name);
+		if (parameter != parameters.end())
+		{
+			parameterIndices_[i] = parameter - parameters.begin();
+			continue;
+		}
+
+		// unresolved names only fail if they are used, see lower
+		symbols_[i] = symtable.Find(name);
+		if (symbols_[i] != nullptr)
+			pointers_[i] = symbols_[i]->pointer;
+	}
+
+	uint16_t result = lower(tree.Root(), 0);
+	emit(Opcode::Return, 0, result, 0, 0);
+	treeDependency_ = nullptr;
+}
+
+void Bytecode::emit(Opcode opcode, uint16_t dest, uint16_t first, uint16_t second, uint32_t operand)
+{
+	code_.push_back({opcode, dest, first, second, operand});
+}
+
+uint16_t Bytecode::lower(uint32_t current, uint16_t top)
+{
+	// the result goes to the lowest free register, top
+	if (top == UINT16_MAX)
+		throw 0;
+	registerCount_ = std::max<uint32_t>(registerCount_, top + 1);
+
+	const AST& tree = *treeDependency_;
+	const ASTNode& node = tree[current];
+
+	switch (node.kind)
+	{
+		case ASTKind::Literal:
+			emit(Opcode::Literal, top, 0, 0, node.value);
+			return top;
+
+		case ASTKind::Variable:
+			if (parameterIndices_[node.value] != UINT32_MAX)
+			{
+				emit(Opcode::Parameter, top, 0, 0, parameterIndices_[node.value]);
+				return top;
+			}
+
+			if (symbols_[node.value] == nullptr)
+				throw 0;
+
+			emit(Opcode::Load, top, 0, 0, node.value);
+			return top;
+
+		case ASTKind::Negate:
+			lower(node.left, top);
+			emit(Opcode::Negate, top, top, 0, 0);
+			return top;
+
+		case ASTKind::Add:
+		case ASTKind::Sub:
+		case ASTKind::Mul:
+		{
+			lower(node.left, top);
+			lower(node.right, top + 1);
+
+			Opcode opcode = node.kind == ASTKind::Add ? Opcode::Add
+				: node.kind == ASTKind::Sub ? Opcode::Sub : Opcode::Mul;
+			emit(opcode, top, top, top + 1, 0);
+			return top;
+		}
+
+		case ASTKind::Call:
+			break;
+	}
+
+	const symbol_t* symbol = symbols_[node.value];
+	if (symbol == nullptr)
+		throw 0;
+
+	const uint32_t* arguments = tree.Arguments(node);
+	uint32_t count = node.right;
+
+	// the same shortcuts the compiler takes, so both agree on the result
+	if ((symbol->semantics == SYMBOL_DIV || symbol->semantics == SYMBOL_MOD) && count == 2
+		&& tree[arguments[1]].kind == ASTKind::Literal && tree[arguments[1]].value != 0)
+	{
+		uint32_t divisor = tree[arguments[1]].value;
+		bool modulo = symbol->semantics == SYMBOL_MOD;
+
+		lower(arguments[0], top);
+		if (divisor == UINT32_MAX)
+			emit(modulo ? Opcode::Literal : Opcode::Negate, top, top, 0, 0);
+		else
+			emit(modulo ? Opcode::Modulo : Opcode::Divide, top, top, 0, divisor);
+		return top;
+	}
+
+	const intrinsic_t* intrinsic = symbol->intrinsic;
+	if (intrinsic != nullptr && intrinsic->op != INTRINSIC_TEMPLATE)
+	{
+		bool binary = intrinsic->op == INTRINSIC_MIN || intrinsic->op == INTRINSIC_MAX;
+		if (count == (binary ? 2u : 1u))
+		{
+			lower(arguments[0], top);
+			if (binary)
+				lower(arguments[1], top + 1);
+
+			uint32_t immediate = intrinsic->immediate;
+			switch (intrinsic->op)
+			{
+				case INTRINSIC_ADD_IMMEDIATE:
+					emit(Opcode::AddImmediate, top, top, 0, immediate);
+					break;
+				case INTRINSIC_NEGATE:
+					emit(Opcode::Negate, top, top, 0, 0);
+					break;
+				case INTRINSIC_ABS:
+					emit(Opcode::Abs, top, top, 0, 0);
+					break;
+				case INTRINSIC_SHIFT_LEFT:
+				case INTRINSIC_SHIFT_RIGHT:
+					if (immediate > 31)
+						throw 0;
+					emit(intrinsic->op == INTRINSIC_SHIFT_LEFT ? Opcode::ShiftLeft : Opcode::ShiftRight,
+						top, top, 0, immediate);
+					break;
+				case INTRINSIC_MIN:
+				case INTRINSIC_MAX:
+					emit(intrinsic->op == INTRINSIC_MIN ? Opcode::Min : Opcode::Max, top, top, top + 1, 0);
+					break;
+				default:
+					throw 0;
+			}
+			return top;
+		}
+	}
+
+	// templates are ARM code, so the interpreter calls the function instead
+	if (count > MAX_CALL_ARGUMENTS)
+		throw 0;
+
+	for (uint32_t i = 0; i < count; ++i)
+		lower(arguments[i], top + i);
+
+	emit(Opcode::Call, top, top, count, node.value);
+	return top;
+}
+
+namespace
+{
+	template<size_t... Indices>
+	int callWith(void* pointer, const uint32_t* arguments, std::index_sequence<Indices...>)
+	{
+		typedef int (*Function)(decltype(Indices, int())...);
+		return reinterpret_cast<Function>(pointer)(static_cast<int>(arguments[Indices])...);
+	}
+
+	int callExtern(void* pointer, const uint32_t* arguments, uint32_t count)
+	{
+		switch (count)
+		{
+			case 0: return callWith(pointer, arguments, std::make_index_sequence<0>());
+			case 1: return callWith(pointer, arguments, std::make_index_sequence<1>());
+			case 2: return callWith(pointer, arguments, std::make_index_sequence<2>());
+			case 3: return callWith(pointer, arguments, std::make_index_sequence<3>());
+			case 4: return callWith(pointer, arguments, std::make_index_sequence<4>());
+			case 5: return callWith(pointer, arguments, std::make_index_sequence<5>());
+			case 6: return callWith(pointer, arguments, std::make_index_sequence<6>());
+			case 7: return callWith(pointer, arguments, std::make_index_sequence<7>());
+			case 8: return callWith(pointer, arguments, std::make_index_sequence<8>());
+		}
+
+		throw 0;
+	}
+}
+
+int32_t Bytecode::Run(const int32_t* arguments) const
+{
+	// unsigned, so that arithmetic wraps like the native code does
+	uint32_t local[LOCAL_REGISTERS];
+	std::vector<uint32_t> allocated;
+	uint32_t* r = local;
+	if (registerCount_ > LOCAL_REGISTERS)
+	{
+		allocated.resize(registerCount_);
+		r = allocated.data();
+	}
+
+	// computed goto: one indirect jump per instruction, in Opcode order
+	static void* const labels[] = {
+		&&literal, &&load, &&parameter, &&negate, &&add, &&sub, &&mul,
+		&&divide, &&modulo, &&addImmediate, &&abs, &&shiftLeft, &&shiftRight,
+		&&min, &&max, &&call, &&ret};
+
+	const Instruction* ip = code_.data();
+	goto *labels[static_cast<uint8_t>(ip->opcode)];
+
+literal:
+	r[ip->dest] = ip->operand;
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+load:
+	r[ip->dest] = *static_cast<const uint32_t*>(pointers_[ip->operand]);
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+parameter:
+	r[ip->dest] = arguments[ip->operand];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+negate:
+	r[ip->dest] = 0 - r[ip->first];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+add:
+	r[ip->dest] = r[ip->first] + r[ip->second];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+sub:
+	r[ip->dest] = r[ip->first] - r[ip->second];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+mul:
+	r[ip->dest] = r[ip->first] * r[ip->second];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+divide:
+	r[ip->dest] = static_cast<int32_t>(r[ip->first]) / static_cast<int32_t>(ip->operand);
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+modulo:
+	r[ip->dest] = static_cast<int32_t>(r[ip->first]) % static_cast<int32_t>(ip->operand);
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+addImmediate:
+	r[ip->dest] = r[ip->first] + ip->operand;
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+abs:
+	r[ip->dest] = static_cast<int32_t>(r[ip->first]) < 0 ? 0 - r[ip->first] : r[ip->first];
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+shiftLeft:
+	r[ip->dest] = r[ip->first] << ip->operand;
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+shiftRight:
+	r[ip->dest] = static_cast<int32_t>(r[ip->first]) >> ip->operand;
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+min:
+	r[ip->dest] = std::min(static_cast<int32_t>(r[ip->first]), static_cast<int32_t>(r[ip->second]));
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+max:
+	r[ip->dest] = std::max(static_cast<int32_t>(r[ip->first]), static_cast<int32_t>(r[ip->second]));
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+call:
+	r[ip->dest] = callExtern(pointers_[ip->operand], r + ip->first, ip->second);
+	goto *labels[static_cast<uint8_t>((++ip)->opcode)];
+ret:
+	return r[ip->first];
+}
+
+size_t Bytecode::Size() const
+{
+	return code_.size();
+}
+
+TieredExpression::TieredExpression(const char* expression, const SymbolTable& symtable,
+	std::shared_ptr<CodeHeap> heap, uint32_t threshold)
+	: expression_(expression),
+	symtable_(&symtable),
+	heap_(std::move(heap)),
+	bytecode_(parseExpression(expression_), symtable),
+	threshold_(threshold),
+	calls_(0),
+	native_(nullptr)
+{
+
+}
+
+TieredExpression::~TieredExpression()
+{
+	const void* native = native_.load();
+	if (native != nullptr)
+		heap_->Free(native);
+}
+
+void TieredExpression::promote()
+{
+	// other threads keep interpreting until the code is published
+	try
+	{
+		std::vector<uint8_t> scratch;
+		size_t size = compileToScratch(expression_, *symtable_, scratch);
+		native_.store(heap_->Install(scratch.data(), size), std::memory_order_release);
+	}
+	catch (int)
+	{
+		// too big for the native compiler, stays interpreted
+	}
+}
+
+int32_t TieredExpression::Run()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	const void* native = native_.load(std::memory_order_acquire);
+	if (native != nullptr)
+		return reinterpret_cast<int (*)()>(native)();
+
+	// exactly one caller sees the count reach the threshold
+	if (calls_.fetch_add(1, std::memory_order_relaxed) + 1 == threshold_)
+		promote();
+#else
+	calls_.fetch_add(1, std::memory_order_relaxed);
+#endif
+
+	return bytecode_.Run();
+}
+
+bool TieredExpression::Native() const
+{
+	return native_.load(std::memory_order_acquire) != nullptr;
+}
@@ -2,54 +2,158 @@
 #ifndef JIT_HPP
 #define JIT_HPP
 
+#include <atomic>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <sstream>
-#include <map>
+#include <string_view>
+#include <cstdint>
+#include <unordered_map>
 
-class AST
+extern "C"
 {
-public:
-	virtual ~AST() = default;
-};
+	// what the compiler may assume about an extern beyond its address
+	typedef enum
+	{
+		SYMBOL_PLAIN = 0, // a variable or an opaque function
+		SYMBOL_DIV,       // int f(int a, int b) returning a / b, as in C
+		SYMBOL_MOD,       // int f(int a, int b) returning a % b, as in C
+		SYMBOL_PURE       // a function of its arguments only, without side effects
+	} symbol_semantics_t;
 
-class ASTUnaryOperator : public AST
-{
-public:
-	std::unique_ptr<AST> argument;
+	typedef enum
+	{
+		INTRINSIC_ADD_IMMEDIATE, // int f(int x) returning x + immediate
+		INTRINSIC_NEGATE,        // int f(int x) returning -x
+		INTRINSIC_ABS,           // int f(int x) returning x < 0 ? -x : x
+		INTRINSIC_SHIFT_LEFT,    // int f(int x) returning x << immediate, 0..31
+		INTRINSIC_SHIFT_RIGHT,   // int f(int x) returning x >> immediate, arithmetic
+		INTRINSIC_MIN,           // int f(int a, int b) returning the smaller one
+		INTRINSIC_MAX,           // int f(int a, int b) returning the larger one
 
-	std::string operatorName;
+		// code_size ARM words pasted in place of the call: arguments arrive
+		// as for a call, the result is left in r0, only r0-r3 and r12
+		// may be changed and the words must not branch out or load pc-relative
+		INTRINSIC_TEMPLATE
+	} intrinsic_op_t;
 
-	~ASTUnaryOperator() override = default;
-};
+	typedef struct
+	{
+		intrinsic_op_t op;
+		int32_t immediate;
+		const uint32_t* code;
+		size_t code_size;
+	} intrinsic_t;
 
+	typedef struct
+	{
+		const char* name;
+		void* pointer;
+		symbol_semantics_t semantics;
 
-class ASTBinaryOperator : public AST
-{
-public:
-	std::unique_ptr<AST> left;
-	std::unique_ptr<AST> right;
+		// optional, lets the compiler emit the function inline
+		const intrinsic_t* intrinsic;
+	} symbol_t;
+
+	// where one compilation spent its time and what it emitted
+	typedef struct
+	{
+		// the parser pulls tokens as it goes, so parse_ns includes
+		// lexing, which tokenize_ns measures in a separate pass
+		uint64_t tokenize_ns;
+		uint64_t parse_ns;
+		uint64_t optimize_ns;
+		uint64_t codegen_ns;
+
+		size_t tokens;
+		size_t parsed_nodes;
+		size_t optimized_nodes;
+
+		// instructions by category, literal pool words excluded
+		size_t push_pop;
+		size_t loads;
+		size_t stores;
+		size_t alu;      // data processing, multiplies, movw/movt
+		size_t calls;    // bl and blx
+		size_t branches;
+		size_t other;
 
-	std::string operatorName;
+		size_t literal_words;
+		size_t code_bytes;
 
-	~ASTBinaryOperator() override = default;
+		// instruction sequences the peephole pass rewrote
+		size_t peephole_rewrites;
+	} compile_stats_t;
+}
+
+enum class ASTKind : uint8_t
+{
+	Literal,
+	Variable,
+	Call,
+	Negate,
+	Add,
+	Sub,
+	Mul
 };
 
-class ASTFunction : public AST
+// Operands always precede the nodes using them, so the node array
+// is in post-order and bottom-up passes are a single forward scan
+struct ASTNode
 {
-public:
-	std::vector<std::unique_ptr<AST>> arguments;
-	std::string symbolName;
+	ASTKind kind;
+
+	// Negate: left is the operand
+	// Add, Sub, Mul: left and right operands
+	// Call: left is the first index into the argument array, right the count
+	uint32_t left;
+	uint32_t right;
 
-	~ASTFunction() override  = default;
+	// Literal: the value, Variable and Call: the interned symbol
+	uint32_t value;
 };
 
-class ASTLiteral : public AST
+class AST
 {
+	std::vector<ASTNode> nodes_;
+	std::vector<uint32_t> arguments_;
+	std::vector<std::string> symbols_;
+	// open addressing over symbols_, so interning a name seen before
+	// is a hash and a comparison and allocates nothing
+	std::vector<uint32_t> symbolSlots_;
+	uint32_t root_;
+
+	static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+	uint32_t add(const ASTNode& node);
+	void rehash(size_t slots);
+
 public:
-	std::string literal;
+	AST();
+
+	void Reserve(size_t nodes);
+
+	uint32_t Literal(uint32_t value);
+	uint32_t Variable(uint32_t symbol);
+	uint32_t Call(uint32_t symbol, const uint32_t* arguments, uint32_t count);
+	uint32_t Negate(uint32_t operand);
+	uint32_t Binary(ASTKind kind, uint32_t left, uint32_t right);
 
-	~ASTLiteral() override = default;
+	uint32_t Intern(std::string_view name);
+	const std::string& SymbolName(uint32_t symbol) const;
+	size_t SymbolCount() const;
+
+	const ASTNode& operator[](uint32_t node) const;
+	const uint32_t* Arguments(const ASTNode& call) const;
+	size_t Size() const;
+
+	uint32_t Root() const;
+	void SetRoot(uint32_t node);
+
+	// drops the nodes unreachable from the root
+	void Compact();
 };
 
 class Tokenizer
@@ -88,80 +192,1180 @@ public:
 	Tokenizer& AdvanceSkipSpace();
 };
 
+enum class TokenKind : uint8_t
+{
+	Identifier,
+	Number,
+	Plus,
+	Minus,
+	Star,
+	LeftParenthesis,
+	RightParenthesis,
+	Comma,
+	End,
+	Error
+};
+
+struct Token
+{
+	TokenKind kind;
+
+	// points into the lexed input, which has to outlive the token
+	std::string_view text;
+};
+
+// Splits a character range in place: no copies and no allocations,
+// whitespace is skipped and never produces a token
+class Lexer
+{
+	const char* position_;
+	const char* end_;
+	Token current_;
+
+public:
+	Lexer(const char* begin, const char* end);
+	Lexer(std::string_view input);
+
+	const Token& Current() const;
+	Lexer& Advance();
+};
+
 
 class Parser
 {
-	Tokenizer* tokenizer_;
+	Lexer* lexer_;
+	AST tree_;
+	std::vector<uint32_t> pendingArguments_;
+
+	uint32_t parseProduct();
+	uint32_t parseSum();
+	uint32_t parseUnaryMinus();
+	uint32_t parseSimpleExpression();
+
+
+public:
+	Parser(Lexer& lexer);
+
+	// sizeHint bounds the node count, e.g. the expression length,
+	// so that the tree is allocated once
+	AST Parse(size_t sizeHint = 0);
+};
+
+class Optimizer
+{
+	AST* tree_;
+
+	uint32_t binary(ASTKind kind, uint32_t left, uint32_t right);
+	uint32_t negation(uint32_t operand);
+
+	bool literalValue(uint32_t node, uint32_t& value) const;
+	bool hasCalls(uint32_t node) const;
+
+public:
+	void Optimize(AST& tree);
+};
+
+class CodeBuffer
+{
+public:
+	typedef size_t Label;
+
+	enum class Fixup
+	{
+		PcRelativeLoad,
+		Branch
+	};
+
+private:
+	uint8_t* memory_;
+	size_t capacity_;
+	size_t size_;
+
+	static constexpr size_t UNBOUND = SIZE_MAX;
+
+	struct PendingFixup
+	{
+		size_t position;
+		Label label;
+		Fixup kind;
+	};
+
+	std::vector<size_t> labels_;
+	std::vector<PendingFixup> fixups_;
+
+	void resolve(size_t position, size_t target, Fixup kind);
+
+public:
+	// without memory nothing is stored, the buffer only counts
+	// the bytes the code needs and Read returns zeros
+	CodeBuffer(void* memory, size_t capacity);
+
+	void Write(uint32_t word);
+	void WriteHalf(uint16_t half);
+	void Write(uint32_t word, Label label, Fixup kind);
+	uint32_t Read(size_t position) const;
+	void Patch(size_t position, uint32_t word);
+	size_t Position() const;
+
+	Label NewLabel();
+	void Bind(Label label);
+
+	size_t Finish();
+};
+
+// externs by name, built once and shared by any number of compilations:
+// open addressing with linear probing over a power-of-two table,
+// so a lookup is a hash and a few comparisons, without allocating
+class SymbolTable
+{
+	std::vector<const symbol_t*> slots_;
+	size_t mask_;
+	size_t size_;
+
+public:
+	// a NULL-terminated array, later entries shadow earlier ones
+	// with the same name; the array has to outlive the table
+	explicit SymbolTable(const symbol_t* externs);
+
+	const symbol_t* Find(std::string_view name) const;
+	size_t Size() const;
+};
+
+enum class IROp : uint8_t
+{
+	Constant,  // operand
+	Load,      // the variable of symbol operand
+	Parameter, // parameter operand, all of them ahead of the first call
+	Negate,    // -first
+	Add,       // first + second
+	Sub,
+	Mul,
+	Divide,    // first / operand, a nonzero constant, for function symbol second
+	Modulo,
+	Abs,
+	ShiftLeft, // first << operand
+	ShiftRight,
+	Min,       // min(first, second), signed
+	Max,
+	Call,      // function symbol operand, second arguments from first
+	Return     // returns first
+};
+
+enum class IRType : uint8_t
+{
+	Void,
+	I32
+};
+
+struct IRInstruction
+{
+	IROp op;
+	IRType type;
+	uint32_t first;
+	uint32_t second;
+	uint32_t operand;
+};
+
+// the expression as linear SSA: every instruction defines the value
+// named by its index from values defined before it, in evaluation order,
+// and the last one returns
+class IR
+{
+	std::vector<IRInstruction> code_;
+	std::vector<uint32_t> arguments_;
+	std::vector<std::string> names_;
+	std::vector<const symbol_t*> symbols_;
 
-	std::unique_ptr<AST> parseProduct();
-	std::unique_ptr<AST> parseSum();
-	std::unique_ptr<AST> parseUnaryMinus();
-	std::unique_ptr<AST> parseSimpleExpression();
+	const AST* treeDependency_;
+	std::vector<uint32_t> parameters_;
 
+	uint32_t lower(uint32_t node);
+	uint32_t emit(IROp op, uint32_t first = 0, uint32_t second = 0, uint32_t operand = 0);
 
 public:
-	Parser(Tokenizer& tokenizer);
+	// parameters are the names read from the arguments instead of the externs
+	IR(const AST& tree, const SymbolTable& symtable,
+		const std::vector<std::string>& parameters = {});
+
+	size_t Size() const;
+	IRInstruction& operator[](uint32_t value);
+	const IRInstruction& operator[](uint32_t value) const;
+	uint32_t* Arguments(const IRInstruction& call);
+	const uint32_t* Arguments(const IRInstruction& call) const;
+
+	// the extern behind a Load, Call, Divide or Modulo symbol
+	const symbol_t* Symbol(uint32_t symbol) const;
+	const std::string& SymbolName(uint32_t symbol) const;
+
+	// whether dropping or merging the instruction is unobservable
+	bool Pure(const IRInstruction& instruction) const;
 
-	std::unique_ptr<AST> Parse();
+	// points every operand at replacement[operand], which has to be defined
+	// before its user, and drops the instructions not kept, renumbering the rest
+	void Rewrite(const std::vector<uint32_t>& replacement, const std::vector<bool>& keep);
+
+	// one instruction per line, e.g. "%3 = add %1, %2"
+	std::string Dump() const;
 };
 
-class Compiler
+// passes rewrite the IR in place
+void FoldConstants(IR& ir);
+void EliminateCommonValues(IR& ir);
+void EliminateDeadValues(IR& ir);
+
+class PassManager
 {
+	struct Pass
+	{
+		std::string name;
+		void (*run)(IR&);
+	};
+
+	std::vector<Pass> passes_;
+	std::ostream* dump_;
+
+public:
+	PassManager();
+
+	// fold, cse and dce, in that order
+	static PassManager Standard();
+
+	void Add(std::string name, void (*run)(IR&));
+
+	// the IR is dumped as lowered and after every pass, under a
+	// "; name" header line, to out or nowhere if it is null
+	void DumpTo(std::ostream* out);
+	void Run(IR& ir) const;
+};
+
+// Thumb-2 code mixes 16-bit and 32-bit encodings and is entered with
+// bit 0 of the address set; it needs an ARMv6T2 or later core
+enum class InstructionSet
+{
+	Arm,
+	Thumb
+};
+
+// rewrites the peephole pass makes on ARM code before it reaches the buffer
+enum class Peephole
+{
+	PushPop,         // push {a}; pop {b} into mov b, a, or into nothing
+	NegateConstant,  // mov t, #0; sub d, t, s into rsb d, s, #0
+	NegateOperand,   // rsb t, s, #0 feeding an add or a sub into the opposite one
+	MultiplyAdd,     // mul t, a, b feeding an add into mla
+	MultiplySubtract // mul t, a, b subtracted from c into mls, ARMv6T2 and later
+};
+
+struct PeepholeRewrite
+{
+	Peephole rule;
+	size_t position; // of the instruction the rewrite left in the buffer
+};
+
+// optional ARM instructions the code may use, those of the running core
+// unless the caller targets another one
+struct ArmFeatures
+{
+	bool movw; // MOVW, MOVT and MLS, ARMv6T2 and later
+	bool neon; // Advanced SIMD
+
+	static ArmFeatures Detect();
+};
+
+// what the tree compilers for every instruction set share: the symbols
+// the tree refers to, the parameters kept in registers, the calls compiled
+// inline, and how arguments get into their registers
+class TreeCompiler
+{
+protected:
 	AST* treeDependency_;
-	std::ostream* streamDependency_;
-	std::map<std::string, uint32_t>* symtableDependency_;
+	CodeBuffer* bufferDependency_;
+	const SymbolTable* symtableDependency_;
 
-	void compileTree(AST* current);
+	// Sethi-Ullman numbers: registers needed to evaluate a subtree
+	// without spilling
+	std::vector<uint32_t> need_;
+	std::vector<symbol_semantics_t> semantics_;
+	std::vector<const intrinsic_t*> intrinsics_;
 
-	void writeWord(uint32_t word);
+	// host addresses; 32-bit ARM code takes the low word, elsewhere
+	// the code is only ever inspected
+	std::vector<uint64_t> addresses_;
 
-	void pop(uint8_t reg);
-	void push(uint8_t reg);
+	// per symbol: position in the parameter list, or NOT_PARAMETER;
+	// the parameters passed in registers live in homes_ for the whole function
+	std::vector<uint32_t> parameterIndices_;
+	uint8_t homes_[8];
+	uint32_t registerParameters_;
 
+	TreeCompiler(AST& tree, uint32_t registerParameters);
 
-	void sum(uint8_t first, uint8_t second);
-	void sub(uint8_t first, uint8_t second);
-	void mul(uint8_t first, uint8_t second);
+	bool constantDivision(const ASTNode& node, uint32_t& dividend, uint32_t& divisor, bool& modulo) const;
+	const intrinsic_t* inlineIntrinsic(const ASTNode& node) const;
+	bool parameterHome(uint32_t node, uint8_t& reg) const;
+	bool needsCallSequence() const;
 
-	void blx(uint8_t adress);
+	// looks every symbol in use up once; returns the register parameters read
+	uint32_t resolveSymbols(const std::vector<std::string>& parameters);
 
-	void constant(uint32_t constant, uint8_t reg);
-	void loadConstant(uint32_t adress, uint8_t reg);
+	// evaluates the register arguments of call, the one needing the most
+	// registers first, and moves them into the argument registers, breaking
+	// cycles through scratch; the backend compiles, moves and spills
+	template<typename Backend>
+	void registerArguments(Backend& backend, const ASTNode& call, uint8_t scratch);
+
+	static constexpr uint32_t NOT_PARAMETER = UINT32_MAX;
+};
+
+// what the two ARM backends share: the encodings, the constant multiplier
+// and divisor analyses, and the instruction sequences built from them
+class ArmEncoding
+{
+protected:
+	enum class Shift : uint32_t
+	{
+		LSL = 0,
+		LSR = 1,
+		ASR = 2
+	};
+
+	// multiplication by a constant as at most two barrel-shifter operations:
+	// an optional (x op (x << inner)), a left shift by outer, a negation
+	struct ShiftAdd
+	{
+		uint32_t mask;
+		uint32_t inner;
+		uint32_t outer;
+		bool negate;
+	};
+
+	static bool encodeImmediate(uint32_t value, uint32_t& encoded);
+	static bool shiftAddMultiplier(uint32_t value, ShiftAdd& sequence);
+	static void divisionMagic(uint32_t divisor, uint32_t& multiplier, uint32_t& shift);
+
+	// the ARM words building value in reg without touching memory, a MOV
+	// or an MVN, or MOVW and MOVT where available; none if it needs a literal
+	static size_t immediateConstant(uint32_t value, uint8_t reg, bool movw, uint32_t* words);
+
+	// whether dividing by divisor takes a multiplication, and with it
+	// a register for the quotient besides the dividend's
+	static bool multipliedDivision(uint32_t divisor);
+
+	// the sequences below emit through the backend's constant, aluShifted,
+	// smull, mul, sum, sub and neg, so they serve ARM and Thumb code alike
+
+	template<typename Backend>
+	static void multiplyByConstant(Backend& backend, uint8_t reg, const ShiftAdd& sequence);
+
+	// x / divisor or x % divisor for x in reg, rounding toward zero as C
+	// does; clobbers reg, quotient and scratch and returns where the result is
+	template<typename Backend>
+	static uint8_t divideByConstant(Backend& backend, uint8_t reg, uint8_t quotient,
+		uint8_t scratch, uint32_t divisor, bool modulo);
 
 	static constexpr uint32_t ADD_MASK  = 0b1110'00'0'0100'0'0000'0000'000000000000;
 	static constexpr uint32_t SUB_MASK  = 0b1110'00'0'0010'0'0000'0000'000000000000;
+	static constexpr uint32_t RSB_MASK  = 0b1110'00'0'0011'0'0000'0000'000000000000;
 	static constexpr uint32_t MOV_MASK  = 0b1110'00'0'1101'0'0000'0000'000000000000;
+	static constexpr uint32_t MVN_MASK  = 0b1110'00'0'1111'0'0000'0000'000000000000;
+	static constexpr uint32_t CMP_MASK  = 0b1110'00'0'1010'1'0000'0000'000000000000;
+	static constexpr uint32_t IMMEDIATE = 0b0000'00'1'0000'0'0000'0000'000000000000;
+
+	// condition codes, the top nibble of every instruction
+	static constexpr uint32_t EQUAL   = 0b0000;
+	static constexpr uint32_t LOWER   = 0b0011;
+	static constexpr uint32_t ALWAYS  = 0b1110;
+	static constexpr uint32_t LESS    = 0b1011;
+	static constexpr uint32_t GREATER = 0b1100;
+
+	static constexpr uint32_t MOVW_MASK = 0b1110'0011'0000'0000'0000'000000000000;
+	static constexpr uint32_t MOVT_MASK = 0b1110'0011'0100'0000'0000'000000000000;
 
 	static constexpr uint32_t MUL_MASK  = 0b1110'000000'0'0'0000'0000'0000'1001'0000;
+	static constexpr uint32_t MLA_MASK  = 0b1110'000000'1'0'0000'0000'0000'1001'0000;
+	static constexpr uint32_t MLS_MASK  = 0b1110'0000'0110'0000'0000'0000'1001'0000;
+	static constexpr uint32_t SMULL_MASK = 0b1110'0000'110'0'0000'0000'0000'1001'0000;
 
 	static constexpr uint32_t LDR_MASK  = 0b1110'01'0'1'1'0'0'1'0000'0000'000000000000;
-	static constexpr uint32_t STR_MASK  = 0b1110'01'0'0'0'0'0'0'0000'0000'000000000000;
+	static constexpr uint32_t STR_MASK  = 0b1110'01'0'1'1'0'0'0'0000'0000'000000000000;
+	static constexpr uint32_t REGISTER_OFFSET = 0b0000'00'1'0'0'0'0'0'0000'0000'000000000000;
+
+	static constexpr uint32_t BLX_MASK   = 0b1110'0001001011111111111100110000;
+	static constexpr uint32_t B_MASK     = 0b1110'1010'000000000000000000000000;
+	static constexpr uint32_t BL_MASK    = 0b1110'1011'000000000000000000000000;
+};
+
+// the words ARM code loads pc-relative, each distinct one once, until
+// the code places them after itself or behind a branch within reach
+class LiteralPool
+{
+	std::vector<uint32_t> literals_;
+	std::unordered_map<uint32_t, CodeBuffer::Label> labels_;
+	size_t firstLoad_;
+
+	// reach of a pc-relative LDR, minus a safety margin for the island branch
+	static constexpr size_t RANGE = 4095 - 16;
+
+public:
+	LiteralPool();
+
+	bool Empty() const;
+	size_t Size() const;
+
+	// the label of value's word, for a load at position
+	CodeBuffer::Label Label(CodeBuffer& buffer, uint32_t value, size_t position);
+
+	// whether the first load still reaches the pool placed after the code
+	// up to position and upcoming more bytes
+	bool InRange(size_t position, size_t upcoming = 0) const;
+
+	// writes the words where the buffer is, binding their labels,
+	// and starts over empty
+	void Emit(CodeBuffer& buffer);
+	void Clear();
+};
+
+class Compiler : TreeCompiler, ArmEncoding
+{
+	friend class TreeCompiler;
+	friend class ArmEncoding;
+
+	uint32_t freeRegisters_;
+	uint32_t stackDepth_;
+
+	// common subexpressions: every node maps to the first structurally
+	// identical one, which is compiled once into its frame slot if reused
+	std::vector<uint32_t> canonical_;
+	std::vector<uint32_t> slots_;
+	std::vector<bool> slotReady_;
+	uint32_t frameSize_;
+	size_t eliminated_;
+
+	InstructionSet instructionSet_;
+
+	// ARMv7 cores can build any constant with MOVW/MOVT,
+	// older ones load it from the literal pool
+	bool movwAvailable_;
+
+	// batch kernels keep vector values in q registers, when NEON is there
+	bool neonAvailable_;
+	uint32_t freeVectors_;
+	std::vector<uint32_t> vectorNeed_;
+
+	LiteralPool literals_;
+
+	// position and word count of every pool emitted, to tell data from code
+	std::vector<std::pair<size_t, size_t>> literalPools_;
+
+	// ARM instructions not yet in the buffer, where the peephole pass can
+	// still rewrite them; literal is the pool label of a pc-relative load
+	struct PendingInstruction
+	{
+		uint32_t word;
+		CodeBuffer::Label literal;
+		bool removed;
+	};
+
+	std::vector<PendingInstruction> pending_;
+	std::vector<PeepholeRewrite> rewrites_;
+
+	void computeNeed();
+	bool immediateOperand(const ASTNode& node, uint32_t& other, uint32_t& mask, uint32_t& value);
+	bool constantMultiplier(const ASTNode& node, uint32_t& other, ShiftAdd& sequence);
+
+	void eliminateCommonSubexpressions();
+	bool pureCall(const ASTNode& call) const;
+
+	uint8_t compileTree(uint32_t current);
+	uint8_t compileNode(uint32_t current);
+	uint8_t compileCall(const ASTNode& call);
+	uint8_t compileDivision(uint32_t dividend, uint32_t divisor, bool modulo);
+	uint8_t compileIntrinsic(const ASTNode& call, const intrinsic_t& intrinsic);
+	uint8_t compileOperands(uint32_t left, uint32_t right, uint8_t& lhs, uint8_t& rhs);
+	uint8_t compileVariable(const ASTNode& variable);
+	void pasteTemplate(const intrinsic_t& intrinsic);
+
+	void computeVectorNeed();
+	bool vectorizable() const;
+	uint8_t compileVector(uint32_t current);
+	uint8_t compileVectorOperands(uint32_t left, uint32_t right, uint8_t& lhs, uint8_t& rhs);
+	uint8_t compileLaneCall(const ASTNode& call);
+
+	uint8_t allocateVector(uint32_t forbidden = 0);
+	void releaseVector(uint8_t reg);
+	uint32_t freeVectorCount() const;
+
+	uint8_t allocate(uint32_t forbidden = 0);
+	void release(uint8_t reg);
+	uint32_t freeCount() const;
+
+	void writeWord(uint32_t word);
+	// a 16-bit encoding if the instruction fits in the low halfword
+	void writeThumb(uint32_t instruction);
+	bool thumb() const;
+
+	// the buffer position the next instruction will have, at most
+	size_t position() const;
+	void bind(CodeBuffer::Label label);
+	void flush();
+
+	void peephole();
+	bool fuse(size_t producer);
+	bool deadAfter(size_t consumer, uint8_t reg) const;
+	static bool registerEffects(uint32_t word, uint32_t& reads, uint32_t& writes);
+	static bool returns(uint32_t word);
+
+	void literalLoad(uint32_t value, uint8_t reg);
+	void keepLiteralsInRange(size_t upcoming = 0);
+	void emitLiteralPool();
+
+	void pop(uint8_t reg);
+	void push(uint8_t reg);
+	void popList(uint32_t regs);
+	void pushList(uint32_t regs);
+
+	void mov(uint8_t dest, uint8_t source, uint32_t condition = ALWAYS);
+	void neg(uint8_t dest, uint8_t source, uint32_t condition = ALWAYS);
+	void sum(uint8_t dest, uint8_t first, uint8_t second);
+	void sub(uint8_t dest, uint8_t first, uint8_t second);
+	void mul(uint8_t dest, uint8_t first, uint8_t second);
+	void aluImmediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t immediate);
+	void cmp(uint8_t first, uint8_t second);
+	void aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+		Shift shift, uint32_t amount);
+	void smull(uint8_t low, uint8_t high, uint8_t first, uint8_t second);
+	void loadStore(uint32_t mask, uint8_t reg, uint8_t base, uint32_t offset);
+
+	void blx(uint8_t adress);
+	void branch(CodeBuffer::Label target, uint32_t mask = B_MASK, uint32_t condition = ALWAYS);
+
+	void vectorOperation(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second);
+	void vectorShift(uint32_t mask, uint8_t dest, uint8_t source, uint32_t amount);
+	void vdup(uint8_t dest, uint8_t source);
+	void vld1(uint8_t dest, uint8_t address, bool writeback = false);
+	void vst1(uint8_t source, uint8_t address);
+	void vpush(uint8_t reg);
+	void vpop(uint8_t reg);
+
+	void constant(uint32_t constant, uint8_t reg);
+	void loadConstant(uint32_t adress, uint8_t reg);
+
+	static bool encodeThumbImmediate(uint32_t value, uint32_t& encoded);
+	bool immediateEncodable(uint32_t mask, uint32_t value) const;
 
 	static constexpr uint32_t PUSH_MASK = 0b1110'01'0'1'0'0'1'0'1101'0000'000000000100;
 	static constexpr uint32_t POP_MASK  = 0b1110'01'0'0'1'0'0'1'1101'0000'000000000100;
 
-	static constexpr uint32_t BLX_MASK   = 0b1110'0001001011111111111100110000;
+	static constexpr uint32_t PUSH_LIST_MASK = 0b1110'100'1'0'0'1'0'1101'0000000000000000;
+	static constexpr uint32_t POP_LIST_MASK  = 0b1110'100'0'1'0'1'1'1101'0000000000000000;
+
+	// Advanced SIMD on q registers with 32-bit lanes
+	static constexpr uint32_t VADD_MASK = 0b1111'0010'0'0'10'0000'0000'1000'0'1'0'0'0000;
+	static constexpr uint32_t VSUB_MASK = 0b1111'0011'0'0'10'0000'0000'1000'0'1'0'0'0000;
+	static constexpr uint32_t VMUL_MASK = 0b1111'0010'0'0'10'0000'0000'1001'0'1'0'1'0000;
+	static constexpr uint32_t VMAX_MASK = 0b1111'0010'0'0'10'0000'0000'0110'0'1'0'0'0000;
+	static constexpr uint32_t VMIN_MASK = 0b1111'0010'0'0'10'0000'0000'0110'0'1'0'1'0000;
+	static constexpr uint32_t VNEG_MASK = 0b1111'0011'1'0'11'10'01'0000'0'0111'1'0'0'0000;
+	static constexpr uint32_t VABS_MASK = 0b1111'0011'1'0'11'10'01'0000'0'0110'1'0'0'0000;
+	static constexpr uint32_t VSHL_MASK = 0b1111'0010'1'0'000000'0000'0101'0'1'0'1'0000;
+	static constexpr uint32_t VSHR_MASK = 0b1111'0010'1'0'000000'0000'0000'0'1'0'1'0000;
+	static constexpr uint32_t VDUP_MASK = 0b1110'1110'1'0'1'0'0000'0000'1011'0'0'0'1'0000;
+	static constexpr uint32_t VLD1_MASK = 0b1111'0100'0'0'10'0000'0000'1010'10'00'1111;
+	static constexpr uint32_t VST1_MASK = 0b1111'0100'0'0'00'0000'0000'1010'10'00'1111;
+	static constexpr uint32_t VPUSH_MASK = 0b1110'110'1'0'0'1'0'1101'0000'1011'00000100;
+	static constexpr uint32_t VPOP_MASK  = 0b1110'110'0'1'0'1'1'1101'0000'1011'00000100;
+
+	// Thumb-2 counterparts: the ARM masks above pick the operation,
+	// these are the encodings it is emitted with
+	static constexpr uint32_t THUMB_SHIFTED_MASK   = 0b11101'01'0000'0'0000'0'000'0000'00'00'0000;
+	static constexpr uint32_t THUMB_IMMEDIATE_MASK = 0b11110'0'0'0000'0'0000'0'000'0000'00000000;
+	static constexpr uint32_t THUMB_ADDW_MASK = 0b11110'0'1'0000'0'0000'0'000'0000'00000000;
+	static constexpr uint32_t THUMB_SUBW_MASK = 0b11110'0'1'0101'0'0000'0'000'0000'00000000;
+	static constexpr uint32_t THUMB_MOVW_MASK = 0b11110'0'1'0010'0'0000'0'000'0000'00000000;
+	static constexpr uint32_t THUMB_MOVT_MASK = 0b11110'0'1'0110'0'0000'0'000'0000'00000000;
+	static constexpr uint32_t THUMB_MUL_MASK   = 0b11111'0110'000'0000'1111'0000'0000'0000;
+	static constexpr uint32_t THUMB_SMULL_MASK = 0b11111'0111'000'0000'0000'0000'0000'0000;
+	static constexpr uint32_t THUMB_LDR_MASK = 0b11111'00'0'1'10'1'0000'0000'000000000000;
+	static constexpr uint32_t THUMB_STR_MASK = 0b11111'00'0'1'10'0'0000'0000'000000000000;
+	static constexpr uint32_t THUMB_PUSH_MASK = 0b11111'00'0'0'10'0'1101'0000'1'101'00000100;
+	static constexpr uint32_t THUMB_POP_MASK  = 0b11111'00'0'0'10'1'1101'0000'1'011'00000100;
+	static constexpr uint32_t THUMB_PUSH_LIST_MASK = 0b11101'00'100'1'0'1101'0000000000000000;
+	static constexpr uint32_t THUMB_POP_LIST_MASK  = 0b11101'00'010'1'1'1101'0000000000000000;
+	static constexpr uint32_t THUMB_IT_MASK = 0b1011'1111'0000'1000; // one conditional instruction
+
+	static constexpr uint8_t SCRATCH_REGISTER = 14; // lr, saved by the prologue
+	static constexpr uint32_t PROLOGUE_SIZE = 32;   // bytes pushed on entry
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+	static constexpr CodeBuffer::Label NO_LITERAL = SIZE_MAX;
+	static constexpr uint8_t CALL_REGISTER = 12;
+
+	// r0-r3 and r12 are clobbered by calls, r4-r10 are saved by the prologue
+	static constexpr uint32_t CALLER_SAVED = 0b0001'0000'0000'1111;
+	static constexpr uint32_t CALLEE_SAVED = 0b0000'0111'1111'0000;
+	static constexpr uint32_t ALLOCATABLE = CALLER_SAVED | CALLEE_SAVED;
+
+	// q4-q7 are callee-saved, so kernels use q0-q2 and q8-q15, q3 is scratch
+	static constexpr uint8_t VECTOR_SCRATCH = 3;
+	static constexpr uint32_t VECTOR_ALLOCATABLE = 0b1111'1111'0000'0111;
 
 
 public:
-	Compiler(AST& tree);
+	Compiler(AST& tree, InstructionSet instructionSet = InstructionSet::Arm,
+		ArmFeatures features = ArmFeatures::Detect());
+
+	// variables named in parameters are read from the AAPCS argument
+	// registers and stack slots instead of through their extern address
+	void Compile(CodeBuffer& buffer, const SymbolTable& symtable,
+		const std::vector<std::string>& parameters = {});
+
+	// emits void f(const int* const* columns, int* out, size_t n) storing
+	// the expression over rows of the parameter columns into out: four rows
+	// at a time with NEON, the rest through a scalar copy of the function;
+	// ARM only
+	void CompileBatch(CodeBuffer& buffer, const SymbolTable& symtable,
+		const std::vector<std::string>& parameters);
+
+	// nodes the last Compile did not emit again as common subexpressions
+	size_t EliminatedNodes() const;
+
+	// what the peephole pass rewrote during the last Compile, in buffer
+	// order; Thumb code is written directly and never rewritten
+	const std::vector<PeepholeRewrite>& PeepholeRewrites() const;
 
-	void Compile(std::ostream& stream, std::map<std::string, uint32_t>& symtable);
+	// classifies the ARM code the last Compile left in buffer, filling
+	// the instruction counts, literal_words and code_bytes of stats
+	void CountInstructions(const CodeBuffer& buffer, compile_stats_t& stats) const;
 };
 
-extern "C"
+// the same functions as AArch64 code: values are computed in w registers,
+// constants and addresses built with MOVZ/MOVN/MOVK, calls follow AAPCS64
+class A64Compiler : TreeCompiler
 {
-	typedef struct
+	friend class TreeCompiler;
+
+	uint32_t freeRegisters_;
+	uint32_t stackDepth_;
+
+	// bytes the prologue pushed: x29, x30 and the callee-saved registers
+	// the function may allocate, nothing at all for a leaf
+	uint32_t frameSize_;
+	uint32_t calleeSaved_;
+
+	enum class Shift : uint32_t
 	{
-		const char* name;
-		void* pointer;
-	} symbol_t;
+		LSL = 0,
+		LSR = 1,
+		ASR = 2
+	};
+
+	void computeNeed();
+	bool immediateOperand(const ASTNode& node, uint32_t& other, uint32_t& mask, uint32_t& value) const;
+	bool constantMultiplier(const ASTNode& node, uint32_t& other, uint32_t& value) const;
+	size_t fusedMultiply(const ASTNode& node, uint32_t* operands, uint32_t& mask) const;
+	static bool shiftMultiplier(uint32_t value);
+
+	uint8_t compileTree(uint32_t current);
+	uint8_t compileCall(const ASTNode& call);
+	uint8_t compileDivision(uint32_t dividend, uint32_t divisor, bool modulo);
+	uint8_t compileIntrinsic(const ASTNode& call, const intrinsic_t& intrinsic);
+	uint8_t compileOperands(const uint32_t* operands, size_t count, uint8_t* regs);
+	uint8_t compileVariable(const ASTNode& variable);
+
+	uint8_t allocate(uint32_t forbidden = 0);
+	void release(uint8_t reg);
+	uint32_t freeCount() const;
+
+	void writeWord(uint32_t word);
+
+	void pop(uint8_t reg);
+	void push(uint8_t reg);
+	void popList(uint32_t regs);
+	void pushList(uint32_t regs);
+	void pair(uint32_t mask, uint8_t first, uint8_t second, int32_t offset);
+
+	void mov(uint8_t dest, uint8_t source);
+	void neg(uint8_t dest, uint8_t source, Shift shift = Shift::LSL, uint32_t amount = 0);
+	void aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+		Shift shift = Shift::LSL, uint32_t amount = 0);
+	void aluImmediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t immediate);
+	void addConstant(uint8_t dest, uint8_t source, uint32_t value);
+	void multiplyAdd(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second, uint8_t addend);
+	void multiplyByConstant(uint8_t reg, uint32_t value);
+	void shiftImmediate(Shift shift, uint8_t dest, uint8_t source, uint32_t amount);
+	void conditional(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second, uint32_t condition);
+	void loadStore(uint32_t mask, uint8_t reg, uint8_t base, uint32_t offset);
+
+	void constant(uint32_t value, uint8_t reg);
+	void address(uint64_t value, uint8_t reg);
+
+	static bool encodeImmediate(uint32_t value, uint32_t& encoded);
+
+	// 32-bit data processing, the register operand shifted by imm6
+	static constexpr uint32_t ADD_MASK  = 0b0'0'0'01011'00'0'00000'000000'00000'00000;
+	static constexpr uint32_t SUB_MASK  = 0b0'1'0'01011'00'0'00000'000000'00000'00000;
+	static constexpr uint32_t CMP_MASK  = 0b0'1'1'01011'00'0'00000'000000'00000'11111;
+	static constexpr uint32_t MOV_MASK  = 0b0'01'01010'00'0'00000'000000'11111'00000; // orr wd, wzr, wm
+
+	// 12-bit unsigned immediates, optionally shifted left by 12
+	static constexpr uint32_t ADD_IMMEDIATE_MASK = 0b0'0'0'100010'0'000000000000'00000'00000;
+	static constexpr uint32_t SUB_IMMEDIATE_MASK = 0b0'1'0'100010'0'000000000000'00000'00000;
+	static constexpr uint32_t CMP_IMMEDIATE_MASK = 0b0'1'1'100010'0'000000000000'00000'11111;
+	static constexpr uint32_t SHIFTED_IMMEDIATE  = 1u << 22;
+	static constexpr uint32_t SIXTY_FOUR = 1u << 31;
+
+	static constexpr uint32_t MADD_MASK = 0b0'00'11011'000'00000'0'00000'00000'00000;
+	static constexpr uint32_t MSUB_MASK = 0b0'00'11011'000'00000'1'00000'00000'00000;
+	static constexpr uint32_t SDIV_MASK = 0b0'0'0'11010110'00000'00001'1'00000'00000;
+
+	static constexpr uint32_t CSEL_MASK  = 0b0'0'0'11010100'00000'0000'0'0'00000'00000;
+	static constexpr uint32_t CSNEG_MASK = 0b0'1'0'11010100'00000'0000'0'1'00000'00000;
+	static constexpr uint32_t UBFM_MASK  = 0b0'10'100110'0'000000'000000'00000'00000;
+	static constexpr uint32_t SBFM_MASK  = 0b0'00'100110'0'000000'000000'00000'00000;
+
+	static constexpr uint32_t MOVN_MASK = 0b0'00'100101'00'0000000000000000'00000;
+	static constexpr uint32_t MOVZ_MASK = 0b0'10'100101'00'0000000000000000'00000;
+	static constexpr uint32_t MOVK_MASK = 0b0'11'100101'00'0000000000000000'00000;
+
+	// 32-bit loads and stores at [xn, #imm12 * 4], or at [xn, xm]
+	// with REGISTER_OFFSET toggled in
+	static constexpr uint32_t LDR_MASK = 0b10'111'0'01'01'000000000000'00000'00000;
+	static constexpr uint32_t STR_MASK = 0b10'111'0'01'00'000000000000'00000'00000;
+	static constexpr uint32_t REGISTER_OFFSET = 0b1'00000'011'0'10'00000'00000;
+
+	// x registers to and from the stack, which stays 16-byte aligned
+	static constexpr uint32_t PUSH_MASK = 0xf81f0fe0; // str xt, [sp, #-16]!
+	static constexpr uint32_t POP_MASK  = 0xf84107e0; // ldr xt, [sp], #16
+
+	// pairs at sp + imm7 * 8: stp with writeback before, ldp after the access,
+	// and both without writeback
+	static constexpr uint32_t PUSH_PAIR_MASK = 0xa98003e0;
+	static constexpr uint32_t POP_PAIR_MASK  = 0xa8c003e0;
+	static constexpr uint32_t STP_MASK = 0xa90003e0;
+	static constexpr uint32_t LDP_MASK = 0xa94003e0;
+
+	static constexpr uint32_t BLR_MASK = 0xd63f0000;
+	static constexpr uint32_t RET = 0xd65f03c0;
+
+	// condition codes, in bits 12-15 of csel and csneg
+	static constexpr uint32_t GREATER_EQUAL = 0b1010;
+	static constexpr uint32_t LESS    = 0b1011;
+	static constexpr uint32_t GREATER = 0b1100;
+
+	static constexpr uint8_t ZERO_REGISTER = 31; // also sp, depending on the instruction
+	static constexpr uint8_t STACK_POINTER = 31;
+	static constexpr uint8_t SCRATCH_REGISTER = 16; // ip0
+	static constexpr uint8_t CALL_REGISTER = 17;    // ip1
+
+	// x0-x15 are clobbered by calls, x19-x28 are saved by the prologue;
+	// x16-x17 are scratch, x18 is the platform register
+	static constexpr uint32_t CALLER_SAVED = 0x0000ffff;
+	static constexpr uint32_t CALLEE_SAVED = 0x1ff80000;
+
+public:
+	A64Compiler(AST& tree);
+
+	// variables named in parameters are read from the AAPCS64 argument
+	// registers and stack slots instead of through their extern address
+	void Compile(CodeBuffer& buffer, const SymbolTable& symtable,
+		const std::vector<std::string>& parameters = {});
+};
+
+// ARM code selected from the IR instead of the tree: values live in
+// r4-r10 for their whole lifetime or in a frame slot once those run out,
+// r0-r3 only carry arguments, results and quotients, r12 and lr are
+// scratch; template intrinsics are called
+class IRCompiler : ArmEncoding
+{
+	friend class ArmEncoding;
+
+	const IR* irDependency_;
+	CodeBuffer* bufferDependency_;
+
+	// per value: a register, or SPILLED and a frame slot
+	std::vector<uint8_t> registers_;
+	std::vector<uint32_t> slots_;
+	uint32_t outgoing_;
+	uint32_t frameSize_;
+
+	// constants come from MOVW/MOVT where the core has them, otherwise
+	// from a literal pool after the code
+	bool movwAvailable_;
+	LiteralPool literals_;
+
+	void allocate();
+	uint8_t use(uint32_t value, uint8_t scratch);
+	uint8_t target(uint32_t value) const;
+	void define(uint32_t value, uint8_t reg);
+
+	void compileInstruction(uint32_t value);
+	void compileCall(uint32_t value, uint32_t symbol, const uint32_t* arguments, uint32_t count);
+
+	void writeWord(uint32_t word);
+	void keepLiteralsInRange();
+	void constant(uint32_t value, uint8_t reg);
+	void dataProcessing(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+		uint32_t condition = ALWAYS);
+	void immediate(uint32_t mask, uint8_t dest, uint8_t source, uint32_t value,
+		uint32_t condition = ALWAYS);
+	void stackAccess(uint32_t mask, uint8_t reg, uint32_t offset);
+	void adjustStack(uint32_t mask, uint32_t bytes);
+
+	// what the shared sequences of ArmEncoding emit through
+	void aluShifted(uint32_t mask, uint8_t dest, uint8_t first, uint8_t second,
+		Shift shift, uint32_t amount);
+	void smull(uint8_t low, uint8_t high, uint8_t first, uint8_t second);
+	void mul(uint8_t dest, uint8_t first, uint8_t second);
+	void sum(uint8_t dest, uint8_t first, uint8_t second);
+	void sub(uint8_t dest, uint8_t first, uint8_t second);
+	void neg(uint8_t dest, uint8_t source);
+
+	static constexpr uint8_t SPILLED = UINT8_MAX;
+	static constexpr uint8_t SCRATCH = 12;
+	static constexpr uint8_t SECOND_SCRATCH = 14;
+	static constexpr uint8_t QUOTIENT = 0;
+	static constexpr uint32_t PROLOGUE_SIZE = 32;
+	static constexpr uint32_t ALLOCATABLE = 0b0000'0111'1111'0000;
+
+public:
+	explicit IRCompiler(const IR& ir, ArmFeatures features = ArmFeatures::Detect());
+
+	// the parameters the IR was lowered with arrive as for AAPCS
+	void Compile(CodeBuffer& buffer);
+};
+
+struct CodeHeapStats
+{
+	size_t mappedBytes;
+	size_t usedBytes;
+	size_t blocks; // live ones
+};
+
+// executable memory for many small functions, carved out of large chunks;
+// a chunk is mapped read-execute for good, and its pages are mapped again
+// read-write only while code is copied in, so no page is ever writable and
+// executable at once, nor writable at all between installs
+class CodeHeap
+{
+	struct Chunk
+	{
+		int file;
+		uint8_t* executable;
+		size_t size;
+	};
+
+	struct Block
+	{
+		int file;
+		size_t offset; // in the file
+		size_t size;
+		bool live;
+		// functions too big to share a chunk get one of their own
+		bool dedicated;
+	};
 
-	
+	std::vector<Chunk> chunks_;
+	uint8_t* nextExecutable_;
+	size_t left_;
+
+	// every block by its executable address, and the free ones by size
+	std::unordered_map<const uint8_t*, Block> blocks_;
+	std::unordered_map<size_t, std::vector<const uint8_t*>> free_;
+
+	size_t mappedBytes_;
+	size_t usedBytes_;
+	size_t liveBlocks_;
+	mutable std::mutex mutex_;
+
+	static Chunk mapChunk(size_t size);
+	static void unmapChunk(const Chunk& chunk);
+	static void write(const Block& block, const uint8_t* executable, const void* code, size_t size);
+
+	static constexpr size_t CHUNK_SIZE = 1 << 20;
+	static constexpr size_t GRANULE = 16;
+
+public:
+	CodeHeap();
+	~CodeHeap();
+
+	CodeHeap(const CodeHeap&) = delete;
+	CodeHeap& operator=(const CodeHeap&) = delete;
+
+	// copies position independent code in and returns where to call it;
+	// thread-safe, as is Free
+	const void* Install(const void* code, size_t size);
+	// the same, but the address has the Thumb bit set for BLX and BX
+	const void* InstallThumb(const void* code, size_t size);
+	void Free(const void* code);
+
+	CodeHeapStats Stats() const;
+};
+
+// emitted code installed in a code heap, freed with the last owner
+class CompiledExpression
+{
+	std::shared_ptr<CodeHeap> heap_;
+	const void* code_;
+	size_t size_;
+
+public:
+	CompiledExpression(std::shared_ptr<CodeHeap> heap, const void* code, size_t size);
+	~CompiledExpression();
+
+	CompiledExpression(const CompiledExpression&) = delete;
+	CompiledExpression& operator=(const CompiledExpression&) = delete;
+
+	const void* Code() const;
+	size_t Size() const;
+};
+
+struct ExpressionCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t codeBytes;
+};
+
+// thread-safe LRU of compiled expressions keyed by the expression's tokens
+// and the externs they resolve to, bounded by the total size of the code;
+// evicted code stays valid for as long as a caller holds on to it
+class ExpressionCache
+{
+	typedef std::shared_ptr<const CompiledExpression> Entry;
+	typedef std::list<std::pair<std::string, Entry>> Recency;
+
+	std::shared_ptr<CodeHeap> heap_;
+	size_t capacity_;
+	size_t codeBytes_;
+
+	// most recently used first
+	Recency recency_;
+	std::unordered_map<std::string, Recency::iterator> index_;
+
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+	mutable std::mutex mutex_;
+
+	static std::string makeKey(std::string_view expression,
+		const SymbolTable& symtable);
+	Entry compile(std::string_view expression,
+		const SymbolTable& symtable);
+
+	void evict();
+
+public:
+	explicit ExpressionCache(size_t capacity,
+		std::shared_ptr<CodeHeap> heap = std::make_shared<CodeHeap>());
+
+	// code of int f() for the expression, compiled on a miss
+	Entry Get(const char* expression, const SymbolTable& symtable);
+	Entry Get(const char* expression, const symbol_t* externs);
+	ExpressionCacheStats Stats() const;
+};
+
+struct CompileResult
+{
+	const void* code; // int f() installed in the heap, NULL if it failed
+	size_t size;
+	bool ok;
+};
+
+// compiles many expressions against one set of externs on up to
+// threadCount threads, all cores for 0; each thread starts with an even
+// share of the expressions and steals from the others once it runs out
+std::vector<CompileResult> CompileParallel(CodeHeap& heap,
+	const char* const* expressions, size_t count,
+	const SymbolTable& symtable, size_t threadCount = 0);
+std::vector<CompileResult> CompileParallel(CodeHeap& heap,
+	const char* const* expressions, size_t count,
+	const symbol_t* externs, size_t threadCount = 0);
+
+enum class Opcode : uint8_t
+{
+	Literal,      // dest = operand
+	Load,         // dest = the variable of symbol operand
+	Parameter,    // dest = parameter operand
+	Negate,       // dest = -first
+	Add,          // dest = first + second
+	Sub,
+	Mul,
+	Divide,       // dest = first / operand, a divisor neither 0 nor -1
+	Modulo,
+	AddImmediate, // dest = first + operand
+	Abs,
+	ShiftLeft,    // dest = first << operand
+	ShiftRight,   // dest = first >> operand, arithmetic
+	Min,          // dest = min(first, second), signed
+	Max,
+	Call,         // dest = function of symbol operand(first, ..., first + second - 1)
+	Return        // returns first
+};
+
+struct Instruction
+{
+	Opcode opcode;
+	uint16_t dest;
+	uint16_t first;
+	uint16_t second;
+	uint32_t operand;
+};
+
+// the expression lowered to a register machine that runs on any host:
+// registers are allocated as a stack, so a call's arguments end up
+// in consecutive ones and an expression needs as many as its depth
+class Bytecode
+{
+	std::vector<Instruction> code_;
+	std::vector<void*> pointers_;
+	uint32_t registerCount_;
+
+	const AST* treeDependency_;
+	std::vector<const symbol_t*> symbols_;
+	std::vector<uint32_t> parameterIndices_;
+
+	uint16_t lower(uint32_t node, uint16_t top);
+	void emit(Opcode opcode, uint16_t dest, uint16_t first, uint16_t second, uint32_t operand);
+
+	static constexpr uint32_t LOCAL_REGISTERS = 64;
+	static constexpr uint32_t MAX_CALL_ARGUMENTS = 8;
+
+public:
+	// parameters are the names Run takes arguments for, in order
+	Bytecode(const AST& tree, const SymbolTable& symtable,
+		const std::vector<std::string>& parameters = {});
+
+	int32_t Run(const int32_t* arguments = nullptr) const;
+	size_t Size() const;
+};
+
+// an int f() expression interpreted until it has run threshold times,
+// then compiled and called natively, on ARM and AArch64; the symbol table
+// has to outlive it, the code heap is shared
+class TieredExpression
+{
+	std::string expression_;
+	const SymbolTable* symtable_;
+	std::shared_ptr<CodeHeap> heap_;
+	Bytecode bytecode_;
+
+	uint32_t threshold_;
+	std::atomic<uint32_t> calls_;
+	std::atomic<const void*> native_;
+
+	void promote();
+
+public:
+	TieredExpression(const char* expression, const SymbolTable& symtable,
+		std::shared_ptr<CodeHeap> heap = std::make_shared<CodeHeap>(), uint32_t threshold = 100);
+	~TieredExpression();
+
+	TieredExpression(const TieredExpression&) = delete;
+	TieredExpression& operator=(const TieredExpression&) = delete;
+
+	int32_t Run();
+	bool Native() const;
+};
+
+extern "C"
+{
 	void jit_compile_expression_to_arm(
 		const char* expression,
 		const symbol_t* externs,
 		void* out_buffer);
+
+	// same as above, but never writes past out_size bytes of out_buffer;
+	// returns the size of the emitted code. Code that does not fit
+	// returns the size it needs instead, more than out_size, and an
+	// expression that cannot be compiled returns 0; every function
+	// below reports the same way and none of them throws
+	size_t jit_compile_expression_to_arm_sized(
+		const char* expression,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	// the out_size jit_compile_expression_to_arm_sized needs for the
+	// expression, found by compiling it without storing the code, so
+	// a buffer can be allocated to fit first; 0 if it cannot be compiled
+	size_t jit_size_expression_to_arm(
+		const char* expression,
+		const symbol_t* externs);
+
+	// same as jit_compile_expression_to_arm_sized, filling stats if it is
+	// not NULL and the code fits; without stats nothing is measured or counted
+	size_t jit_compile_expression_to_arm_stats(
+		const char* expression,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size,
+		compile_stats_t* stats);
+
+	// compiles the expression into an AAPCS function int f(int, int, ...)
+	// taking the named parameters in order: the first four in r0-r3,
+	// the rest on the stack. Parameters shadow externs with the same name,
+	// externs may be NULL if there are none; returns the size of the code
+	size_t jit_compile_function_to_arm(
+		const char* expression,
+		const char* const* parameters,
+		size_t parameter_count,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	// the same as jit_compile_function_to_arm, as Thumb-2 code which has
+	// to be called at out_buffer + 1
+	size_t jit_compile_function_to_thumb(
+		const char* expression,
+		const char* const* parameters,
+		size_t parameter_count,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	// the same as jit_compile_expression_to_arm_sized and
+	// jit_compile_function_to_arm, as AArch64 code: the first eight
+	// parameters in w0-w7, the rest in 8-byte stack slots
+	size_t jit_compile_expression_to_a64(
+		const char* expression,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	size_t jit_size_expression_to_a64(
+		const char* expression,
+		const symbol_t* externs);
+
+	size_t jit_compile_function_to_a64(
+		const char* expression,
+		const char* const* parameters,
+		size_t parameter_count,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	// the same as jit_compile_function_to_arm, lowered to the IR,
+	// optimized by the standard passes and selected from there
+	size_t jit_compile_function_to_arm_ir(
+		const char* expression,
+		const char* const* parameters,
+		size_t parameter_count,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
+
+	// compiles the expression into
+	// void f(const int* const* columns, int* out, size_t n),
+	// out[i] being the value with the j-th parameter set to columns[j][i];
+	// extern calls are made once per row
+	size_t jit_compile_batch_to_arm(
+		const char* expression,
+		const char* const* parameters,
+		size_t parameter_count,
+		const symbol_t* externs,
+		void* out_buffer,
+		size_t out_size);
 }
 
 #endif // JIT_HPP
@@ -1,10 +1,13 @@
 #include <cctype>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
 #include <unistd.h>
-#include <sys/mman.h>
 #include "jit.hpp"
 
 // available functions to be used within JIT-compiled code
@@ -16,35 +19,42 @@ extern "C"
 	static int my_dec(int a) { return --a; }
 }
 
-const uint32_t SYMTABLE_SIZE = 100;  // symtable size in units
-const uint32_t EXPR_SIZE = 100;      // max expression size in chars
-const uint32_t CODE_SIZE = 4096;     // code segment size in bytes
+// functions, then variables, then the NULL terminator;
+// lines, expressions and code are as long as they need to be
+static std::vector<symbol_t> symbols;
 
-static symbol_t symbols[SYMTABLE_SIZE + 1];
-char expression_to_parse[EXPR_SIZE + 1];
+// inc and dec are trivial enough to be emitted inline
+static const intrinsic_t inc_intrinsic = {INTRINSIC_ADD_IMMEDIATE, 1, NULL, 0};
+static const intrinsic_t dec_intrinsic = {INTRINSIC_ADD_IMMEDIATE, -1, NULL, 0};
+
+static std::string expression_to_parse;
 
 static size_t 
 init_symbols()
 {
-    memset(symbols, 0, sizeof(symbols));
+    symbols.assign(5, symbol_t());
     static const char* func_names[] = {"div", "mod", "inc", "dec"};
 
     size_t offset = 0;
 
     symbols[offset].name = func_names[offset];
     symbols[offset].pointer = reinterpret_cast<void*>(&my_div);
+    symbols[offset].semantics = SYMBOL_DIV;
     ++offset;
 
     symbols[offset].name = func_names[offset];
     symbols[offset].pointer = reinterpret_cast<void*>(&my_mod);
+    symbols[offset].semantics = SYMBOL_MOD;
     ++offset;
 
     symbols[offset].name = func_names[offset];
     symbols[offset].pointer = reinterpret_cast<void*>(&my_inc);
+    symbols[offset].intrinsic = &inc_intrinsic;
     ++offset;
 
     symbols[offset].name = func_names[offset];
     symbols[offset].pointer = reinterpret_cast<void*>(&my_dec);
+    symbols[offset].intrinsic = &dec_intrinsic;
     ++offset;
 
     return offset;
@@ -59,80 +69,120 @@ parse_variable(const char* token)
         fprintf(stderr, "Wrong token in input: %s\n", token);
         exit(1);
     }
-    char left[128];
-    char right[128];
-
-    memset(left, 0, sizeof(left));
-    memset(right, 0, sizeof(right));
-    strncpy(left, token, delim - token);
-    strncpy(right, delim+1, sizeof(right));
+    size_t length = delim - token;
 
-    symbol_t result;
-    result.name = (const char*) calloc(1+strnlen(left,sizeof(left)), sizeof(char));
+    symbol_t result = symbol_t();
+    result.name = (const char*) calloc(1+length, sizeof(char));
     result.pointer = calloc(1, sizeof(int));
-    sscanf(left, "%s", const_cast<char*>(result.name)); // eliminate whitespaces
-    sscanf(right, "%d", reinterpret_cast<int*>(result.pointer)); // parse int value
+    memcpy(const_cast<char*>(result.name), token, length);
+    sscanf(delim+1, "%d", reinterpret_cast<int*>(result.pointer)); // parse int value
     return result;
 }
 
 
-static void read_input(size_t sym_start_offset)
-{    
-    char buffer[128];
-    memset(buffer, 0, sizeof(buffer));    
+enum class input_mode_t
+{
+    EXPRESSION, VARS
+};
+
+// reads a whole line however long it is; false at the end of the input
+static bool read_line(std::string& line)
+{
+    char buffer[4096];
+    line.clear();
 
-    enum class mode_t
+    while (NULL != fgets(buffer, sizeof(buffer), stdin))
     {
-        EXPRESSION, VARS
-    };
+        line += buffer;
+        if ('\n' == line.back()) return true;
+    }
+    return !line.empty();
+}
 
-    mode_t current_mode = mode_t::EXPRESSION;
-    size_t current_index = sym_start_offset;
+static void read_expression(const std::string& line)
+{
+    expression_to_parse.clear();
+    for (char c : line)
+    {
+        if (!isspace(c))
+        {
+            expression_to_parse += c;
+        }
+    }
+}
 
-    while (NULL != fgets(buffer, sizeof(buffer), stdin)) 
+// a variable seen before only gets its new value, so code already
+// compiled against its address stays valid; returns whether any
+// variable was new
+static bool read_variables(const std::string& line, size_t sym_start_offset)
+{
+    bool added = false;
+    size_t offset = 0;
+    while (true)
+    {
+        while (offset < line.size() && isspace(line[offset]))
+        {
+            offset++;
+        }
+        size_t end = offset;
+        while (end < line.size() && !isspace(line[end]))
+        {
+            end++;
+        }
+        if (end == offset) break;
+
+        std::string token = line.substr(offset, end - offset);
+        offset = end;
+        symbol_t variable = parse_variable(token.c_str());
+
+        size_t symbols_end = symbols.size() - 1;
+        size_t i = sym_start_offset;
+        while (i < symbols_end && 0 != strcmp(symbols[i].name, variable.name))
+        {
+            i++;
+        }
+        if (i < symbols_end)
+        {
+            *reinterpret_cast<int*>(symbols[i].pointer) = *reinterpret_cast<int*>(variable.pointer);
+            free((char *) (variable.name));
+            free(variable.pointer);
+        }
+        else
+        {
+            symbols.insert(symbols.end() - 1, variable);
+            added = true;
+        }
+    }
+    return added;
+}
+
+static void read_input(size_t sym_start_offset)
+{    
+    std::string buffer;
+
+    input_mode_t current_mode = input_mode_t::EXPRESSION;
+
+    while (read_line(buffer)) 
     {
         if ('#' == buffer[0]) continue;       
         else if ('.'==buffer[0]) {
             // change parsing mode
-            if (strstr(buffer, "expression"))
+            if (std::string::npos != buffer.find("expression"))
             {
-                current_mode = mode_t::EXPRESSION;
+                current_mode = input_mode_t::EXPRESSION;
             }
-            else if (strstr(buffer, "vars"))
+            else if (std::string::npos != buffer.find("vars"))
             {
-                current_mode = mode_t::VARS;
+                current_mode = input_mode_t::VARS;
             }
         }
-        else if (mode_t::EXPRESSION==current_mode)
+        else if (input_mode_t::EXPRESSION==current_mode)
         {
-            memset(expression_to_parse, 0, sizeof(expression_to_parse));
-            size_t i=0, j = 0;
-            for (i=0; i<strnlen(buffer, sizeof(buffer)); ++i)
-            {
-                if (!isspace(buffer[i]))
-                {
-                    expression_to_parse[j] = buffer[i];
-                    j++;
-                }
-            }
+            read_expression(buffer);
         }
-        else if (mode_t::VARS == current_mode)
+        else if (input_mode_t::VARS == current_mode)
         {
-            char minibuf[256];
-            memset(minibuf, 0, sizeof(minibuf));
-            size_t offset = 0;
-            char * tokenizing_string = buffer;
-            while (sscanf(tokenizing_string, "%s", minibuf) > 0)
-            {
-                offset = strnlen(minibuf, sizeof(minibuf));
-                tokenizing_string += offset;
-                while (' ' == tokenizing_string[0])
-                {
-                    tokenizing_string++;
-                }
-                symbols[current_index++] = parse_variable(minibuf);
-                memset(minibuf, 0, sizeof(minibuf));
-            }
+            read_variables(buffer, sym_start_offset);
         }
     }
 }
@@ -148,52 +198,208 @@ static void free_symbols(size_t offset)
 }
 
 
-static void* init_program_code_buffer()
+#if defined(__arm__) || defined(__aarch64__)
+static void call_function_and_print_result(const void * addr)
 {
-    void* result = mmap(
-    	0,
-		CODE_SIZE,
-		PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_PRIVATE | MAP_ANONYMOUS,
-		-1,
-		0);
-
-    if (result == MAP_FAILED)
-    {
-        perror("Can't mmap: ");
-        exit(2);
-    }
-    return result;
+    typedef int (*jited_function_t)();
+    jited_function_t function = reinterpret_cast<jited_function_t>(addr);
+    int result = function();
+    printf("%d\n", result);
 }
 
-static void free_program_code_buffer(void * addr)
+// NULL if the expression cannot be compiled
+static const void* compile_and_install(CodeHeap& heap)
 {
-    munmap(addr, CODE_SIZE);
+    // kept across calls, it only ever grows
+    static std::vector<uint8_t> code_buffer;
+
+#if defined(__aarch64__)
+    auto compile = jit_compile_expression_to_a64;
+#else
+    auto compile = jit_compile_expression_to_arm_sized;
+#endif
+
+    // code that does not fit reports the size it needs, and only
+    // then is the buffer grown and the expression compiled again
+    size_t code_size = compile(
+        expression_to_parse.c_str(),
+        symbols.data(),
+        code_buffer.data(),
+        code_buffer.size());
+    if (code_size > code_buffer.size())
+    {
+        code_buffer.resize(code_size);
+        code_size = compile(
+            expression_to_parse.c_str(),
+            symbols.data(),
+            code_buffer.data(),
+            code_buffer.size());
+    }
+    if (0 == code_size)
+    {
+        return NULL;
+    }
+
+    // the code is only made executable once it is in the code heap
+    return heap.Install(code_buffer.data(), code_size);
 }
+#endif
 
-static void call_function_and_print_result(void * addr)
+// reads records until the end of the input, each an .expression and/or
+// a .vars block, and prints a result per record as soon as it ends:
+// at an empty line, at the next .expression, at a .vars following
+// variables or at the end of the input; a record changing only the
+// values of known variables runs the code it already has
+static void stream(size_t sym_start_offset)
 {
-    typedef int (*jited_function_t)();
-    jited_function_t function = reinterpret_cast<jited_function_t>(addr);
-    int result = function();
-    printf("%d\n", result);
+    std::string buffer;
+
+    input_mode_t current_mode = input_mode_t::EXPRESSION;
+
+    bool pending = false;   // something changed since the last result
+    bool recompile = true;  // the expression or the set of variables did
+    size_t records = 0;
+
+#if defined(__arm__) || defined(__aarch64__)
+    CodeHeap heap;
+    const void* code = NULL;
+#else
+    std::unique_ptr<Bytecode> bytecode;
+#endif
+
+    auto evaluate = [&]()
+    {
+        try
+        {
+#if defined(__arm__) || defined(__aarch64__)
+            if (recompile)
+            {
+                if (code) heap.Free(code);
+                code = compile_and_install(heap);
+            }
+            if (code) call_function_and_print_result(code);
+            else printf("error\n");
+#else
+            if (recompile)
+            {
+                bytecode.reset();
+                Lexer lexer(expression_to_parse);
+                Parser parser(lexer);
+                AST tree = parser.Parse(expression_to_parse.size());
+                Optimizer optimizer;
+                optimizer.Optimize(tree);
+
+                SymbolTable symtable(symbols.data());
+                bytecode.reset(new Bytecode(tree, symtable));
+            }
+            printf("%d\n", bytecode->Run());
+#endif
+            recompile = false;
+        }
+        catch (...)
+        {
+            printf("error\n");
+        }
+        // whoever reads the results may be waiting for this one
+        fflush(stdout);
+        pending = false;
+        ++records;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    while (read_line(buffer))
+    {
+        if ('#' == buffer[0]) continue;
+
+        bool blank = true;
+        for (char c : buffer)
+        {
+            blank = blank && isspace(c);
+        }
+
+        if (blank)
+        {
+            if (pending) evaluate();
+        }
+        else if ('.' == buffer[0])
+        {
+            if (std::string::npos != buffer.find("expression"))
+            {
+                if (pending) evaluate();
+                current_mode = input_mode_t::EXPRESSION;
+            }
+            else if (std::string::npos != buffer.find("vars"))
+            {
+                if (pending && input_mode_t::VARS == current_mode) evaluate();
+                current_mode = input_mode_t::VARS;
+            }
+        }
+        else if (input_mode_t::EXPRESSION == current_mode)
+        {
+            read_expression(buffer);
+            pending = recompile = true;
+        }
+        else if (input_mode_t::VARS == current_mode)
+        {
+            if (read_variables(buffer, sym_start_offset)) recompile = true;
+            pending = true;
+        }
+    }
+    if (pending) evaluate();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "%zu records in %.3f s, %.0f records/s\n",
+        records, elapsed.count(), elapsed.count() > 0 ? records / elapsed.count() : 0.0);
+
+#if defined(__arm__) || defined(__aarch64__)
+    if (code) heap.Free(code);
+#endif
 }
 
-int main()
+int main(int argc, char** argv)
 {
     size_t functions_count = init_symbols();
-    read_input(functions_count);
-    void* code_buffer = init_program_code_buffer();
 
-    jit_compile_expression_to_arm(
-		expression_to_parse,
-		symbols,
-		code_buffer);
+    // one process for any number of expressions instead of one for each
+    if (argc > 1 && 0 == strcmp(argv[1], "--stream"))
+    {
+        stream(functions_count);
+        free_symbols(functions_count);
+        return 0;
+    }
+
+    read_input(functions_count);
+#if defined(__arm__) || defined(__aarch64__)
+    CodeHeap heap;
+    const void* code = compile_and_install(heap);
+    if (!code)
+    {
+        fprintf(stderr, "Cannot compile: %s\n", expression_to_parse.c_str());
+        free_symbols(functions_count);
+        return 1;
+    }
 
-    call_function_and_print_result(code_buffer);
+    call_function_and_print_result(code);
     
     free_symbols(functions_count);
-    free_program_code_buffer(code_buffer);
+    heap.Free(code);
+#else
+    // nothing to run ARM or A64 code on, so the expression is interpreted
+    {
+        Lexer lexer(expression_to_parse);
+        Parser parser(lexer);
+        AST tree = parser.Parse(expression_to_parse.size());
+        Optimizer optimizer;
+        optimizer.Optimize(tree);
+
+        SymbolTable symtable(symbols.data());
+        Bytecode bytecode(tree, symtable);
+        printf("%d\n", bytecode.Run());
+    }
+
+    free_symbols(functions_count);
+#endif
 
     return 0;
-}
\ No newline at end of file
+}
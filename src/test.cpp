@@ -1,8 +1,133 @@
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <sstream>
+#include <string>
+#include <vector>
+#include "emulator.hpp"
 #include "jit.hpp"
 
+// functions for the generated code to call, wrapping around as the code does
+static int test_div(int a, int b)
+{
+	return a / b;
+}
+
+static int test_mod(int a, int b)
+{
+	return a % b;
+}
+
+static int test_scale(int x)
+{
+	return static_cast<int>(3u * x + 1);
+}
+
+static int test_sum5(int a, int b, int c, int d, int e)
+{
+	return static_cast<int>(a + 2u * b + 3u * c + 4u * d + 5u * e);
+}
+
+static int test_sum6(int a, int b, int c, int d, int e, int f)
+{
+	return static_cast<int>(a + 2u * b + 3u * c + 4u * d + 5u * e + 6u * f);
+}
+
+static int test_sum10(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j)
+{
+	return static_cast<int>(a + 2u * b + 3u * c + 4u * d + 5u * e + 6u * f + 7u * g + 8u * h + 9u * i + 10u * j);
+}
+
+// memory besides the variables of the symbols that the code reads or writes
+struct Mapping
+{
+	const void* memory;
+	size_t size;
+};
+
+// an argument as the code sees it in a register
+static uint64_t argument(Emulator::Mode mode, int value)
+{
+	// A64 leaves the upper half of a register holding an int undefined
+	uint64_t undefined = mode == Emulator::Mode::A64 ? 0xbad0000000000000 : 0;
+	return undefined | static_cast<uint32_t>(value);
+}
+
+static uint64_t argument(Emulator::Mode mode, size_t value)
+{
+	return mode == Emulator::Mode::A64 ? value : static_cast<uint32_t>(value);
+}
+
+template<typename T>
+static uint64_t argument(Emulator::Mode mode, const T* pointer)
+{
+	return mode == Emulator::Mode::A64 ? reinterpret_cast<uintptr_t>(pointer) : Emulator::Address(pointer);
+}
+
+// calls generated code as int f(arguments...): natively on a host that runs
+// it, in the emulator elsewhere, with the variables of the symbols, the
+// mappings and the test functions in reach
+template<typename... Args>
+static int32_t run(Emulator::Mode mode, const void* code, size_t size, const symbol_t* symbols,
+	const std::vector<Mapping>& mappings, Args... arguments)
+{
+#if defined(__arm__)
+	bool native = mode != Emulator::Mode::A64;
+#elif defined(__aarch64__)
+	bool native = mode == Emulator::Mode::A64;
+#else
+	bool native = false;
+#endif
+
+	if (native)
+	{
+		CodeHeap heap;
+		const void* installed = mode == Emulator::Mode::Thumb ? heap.InstallThumb(code, size) : heap.Install(code, size);
+		int32_t result = reinterpret_cast<int (*)(Args...)>(installed)(arguments...);
+		heap.Free(installed);
+		return result;
+	}
+
+	Emulator emulator;
+	for (const symbol_t* symbol = symbols; symbol->name != nullptr; ++symbol)
+		emulator.Map(symbol->pointer, sizeof(int));
+	for (const Mapping& mapping : mappings)
+		emulator.Map(mapping.memory, mapping.size);
+
+	emulator.Function(&test_div);
+	emulator.Function(&test_mod);
+	emulator.Function(&test_scale);
+	emulator.Function(&test_sum5);
+	emulator.Function(&test_sum6);
+	emulator.Function(&test_sum10);
+	return emulator.Run(mode, code, size, {argument(mode, arguments)...});
+}
+
+// compiles as jit_compile_function_to_arm and jit_compile_batch_to_arm do,
+// for the given core rather than the running one
+static size_t compile_arm(const char* expression, const std::vector<std::string>& parameters,
+	const symbol_t* symbols, ArmFeatures features, void* code, size_t size, bool batch = false)
+{
+	Lexer lexer(expression);
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	Optimizer optimizer;
+	optimizer.Optimize(tree);
+	Compiler compiler(tree, InstructionSet::Arm, features);
+
+	SymbolTable symtable(symbols);
+
+	CodeBuffer buffer(code, size);
+	if (batch)
+		compiler.CompileBatch(buffer, symtable, parameters);
+	else
+		compiler.Compile(buffer, symtable, parameters);
+	return buffer.Finish();
+}
+
+
 TEST_CASE("Tokenizer test 1", "[tokenizer]")
 {
 	std::stringstream dummy;
@@ -45,96 +170,1274 @@ TEST_CASE("Tokenizer test 2", "[tokenizer]")
 	REQUIRE(*tokenizer.Advance() == ")");
 }
 
-TEST_CASE("Parser test 1", "[parser]")
+TEST_CASE("Tokenizer test 3", "[tokenizer]")
 {
 	std::stringstream dummy;
-	dummy << "a*b";
+	dummy << "a*10";
 	Tokenizer tokenizer(dummy);
-	Parser parser(tokenizer);
+	REQUIRE(*tokenizer.Advance() == "a");
+	REQUIRE(*tokenizer.Advance() == "*");
+	REQUIRE(*tokenizer.Advance() == "10");
+	REQUIRE(*tokenizer.Advance() == "");
+}
 
-	auto result = parser.Parse();
-	ASTBinaryOperator* root = dynamic_cast<ASTBinaryOperator*>(result.get());
-	REQUIRE(root);
-	REQUIRE(root->operatorName == "*");
-	ASTFunction* left = dynamic_cast<ASTFunction*>(root->left.get());
-	ASTFunction* right = dynamic_cast<ASTFunction*>(root->right.get());
-	REQUIRE(left);
-	REQUIRE(left->symbolName == "a");
-	REQUIRE(right);
-	REQUIRE(right->symbolName == "b");
+TEST_CASE("Lexer test 1", "[lexer]")
+{
+	Lexer lexer(" div(a_1 + 20,\tc) ");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Identifier);
+	REQUIRE(lexer.Current().text == "div");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::LeftParenthesis);
+	REQUIRE(lexer.Advance().Current().text == "a_1");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Plus);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Number);
+	REQUIRE(lexer.Current().text == "20");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Comma);
+	REQUIRE(lexer.Advance().Current().text == "c");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::RightParenthesis);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::End);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::End);
+}
+
+TEST_CASE("Lexer test 2", "[lexer]")
+{
+	const char* input = "-x*7#";
+	Lexer lexer(input, input + 5);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Minus);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Identifier);
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Star);
+
+	// tokens point into the input instead of owning a copy
+	REQUIRE(lexer.Advance().Current().text.data() == input + 3);
+	REQUIRE(lexer.Current().text == "7");
+	REQUIRE(lexer.Advance().Current().kind == TokenKind::Error);
+}
+
+TEST_CASE("Parser test 1", "[parser]")
+{
+	Lexer lexer("a*b");
+	Parser parser(lexer);
+
+	AST tree = parser.Parse();
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Mul);
+	const ASTNode& left = tree[root.left];
+	const ASTNode& right = tree[root.right];
+	REQUIRE(left.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(left.value) == "a");
+	REQUIRE(right.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(right.value) == "b");
 }
 
 TEST_CASE("Parser test 2", "[parser]")
 {
-	std::stringstream dummy;
-	dummy << "a+b-c";
-	Tokenizer tokenizer(dummy);
-	Parser parser(tokenizer);
+	Lexer lexer("a+b-c");
+	Parser parser(lexer);
 
-	auto result = parser.Parse();
-	ASTBinaryOperator* root = dynamic_cast<ASTBinaryOperator*>(result.get());
-	REQUIRE(root);
-	REQUIRE(root->operatorName == "-");
+	AST tree = parser.Parse();
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Sub);
 	
-	ASTFunction* right = dynamic_cast<ASTFunction*>(root->right.get());
-	REQUIRE(right);
-	REQUIRE(right->symbolName == "c");
+	const ASTNode& right = tree[root.right];
+	REQUIRE(right.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(right.value) == "c");
 
-	ASTBinaryOperator* left = dynamic_cast<ASTBinaryOperator*>(root->left.get());
-	REQUIRE(left);
-	REQUIRE(left->operatorName == "+");
+	const ASTNode& left = tree[root.left];
+	REQUIRE(left.kind == ASTKind::Add);
 
-	ASTFunction* ll = dynamic_cast<ASTFunction*>(left->left.get());
-	REQUIRE(ll);
-	REQUIRE(ll->symbolName == "a");
+	const ASTNode& ll = tree[left.left];
+	REQUIRE(ll.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(ll.value) == "a");
 
-	ASTFunction* lr = dynamic_cast<ASTFunction*>(left->right.get());
-	REQUIRE(lr);
-	REQUIRE(lr->symbolName == "b");
+	const ASTNode& lr = tree[left.right];
+	REQUIRE(lr.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(lr.value) == "b");
 }
 
 TEST_CASE("Parser test 3", "[parser]")
 {
-	std::stringstream dummy;
-	dummy << "func(a, b + c, d)";
-	Tokenizer tokenizer(dummy);
-	Parser parser(tokenizer);
+	Lexer lexer("func(a, b + c, d)");
+	Parser parser(lexer);
 
-	auto result = parser.Parse();
-	ASTFunction* root = dynamic_cast<ASTFunction*>(result.get());
-	REQUIRE(root);
-	REQUIRE(root->symbolName == "func");
-	
-	ASTFunction* a = dynamic_cast<ASTFunction*>(root->arguments[0].get());
-	REQUIRE(a);
-	REQUIRE(a->symbolName == "a");
+	AST tree = parser.Parse();
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Call);
+	REQUIRE(tree.SymbolName(root.value) == "func");
+	REQUIRE(root.right == 3);
+
+	const uint32_t* arguments = tree.Arguments(root);
+	const ASTNode& a = tree[arguments[0]];
+	REQUIRE(a.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(a.value) == "a");
 
-	ASTBinaryOperator* bc = dynamic_cast<ASTBinaryOperator*>(root->arguments[1].get());
-	REQUIRE(bc);
-	REQUIRE(bc->operatorName == "+");
+	const ASTNode& bc = tree[arguments[1]];
+	REQUIRE(bc.kind == ASTKind::Add);
 
-	ASTFunction* d = dynamic_cast<ASTFunction*>(root->arguments[2].get());
-	REQUIRE(d);
-	REQUIRE(d->symbolName == "d");
+	const ASTNode& d = tree[arguments[2]];
+	REQUIRE(d.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(d.value) == "d");
 }
 
 TEST_CASE("Parser test 4", "[parser]")
 {
-	std::stringstream dummy;
-	dummy << "1337 - 42";
-	Tokenizer tokenizer(dummy);
-	Parser parser(tokenizer);
+	Lexer lexer("1337 - 42");
+	Parser parser(lexer);
+
+	AST tree = parser.Parse();
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Sub);
+
+	const ASTNode& left = tree[root.left];
+	REQUIRE(left.kind == ASTKind::Literal);
+	REQUIRE(left.value == 1337);
+
+	const ASTNode& right = tree[root.right];
+	REQUIRE(right.kind == ASTKind::Literal);
+	REQUIRE(right.value == 42);
+}
+
+TEST_CASE("Parser test 5", "[parser]")
+{
+	Lexer lexer("f(g(a, b), -(c))");
+	Parser parser(lexer);
+
+	AST tree = parser.Parse();
+	REQUIRE(tree.Size() == 6);
+
+	// operands always come before the nodes that use them
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		const ASTNode& node = tree[i];
+		if (node.kind == ASTKind::Call)
+		{
+			for (uint32_t j = 0; j < node.right; ++j)
+				REQUIRE(tree.Arguments(node)[j] < i);
+		}
+		else if (node.kind == ASTKind::Negate)
+		{
+			REQUIRE(node.left < i);
+		}
+	}
+
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(tree.Root() == tree.Size() - 1);
+	REQUIRE(root.kind == ASTKind::Call);
+	REQUIRE(tree[tree.Arguments(root)[0]].kind == ASTKind::Call);
+	REQUIRE(tree[tree.Arguments(root)[1]].kind == ASTKind::Negate);
+}
+
+TEST_CASE("Parser test 6", "[parser]")
+{
+	// enough distinct names to grow the symbol slots a few times,
+	// some too long for the small string buffer
+	std::string expression = "a_rather_long_variable_name";
+	for (int i = 0; i < 100; ++i)
+		expression += " + v" + std::to_string(i) + " * a_rather_long_variable_name - v" + std::to_string(i % 7);
+
+	Lexer lexer(expression);
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	REQUIRE(tree.SymbolCount() == 101);
+	REQUIRE(tree.SymbolName(0) == "a_rather_long_variable_name");
+
+	// identifiers are interned, every occurrence of a name is one symbol
+	std::vector<size_t> occurrences(tree.SymbolCount());
+	for (uint32_t i = 0; i < tree.Size(); ++i)
+	{
+		if (tree[i].kind == ASTKind::Variable)
+			++occurrences[tree[i].value];
+	}
+	REQUIRE(occurrences[0] == 101);
+	REQUIRE(occurrences[tree.Intern("v3")] == 1 + 14);
+	REQUIRE(occurrences[tree.Intern("v99")] == 1);
+
+	REQUIRE(tree.Intern("a_rather_long_variable_name") == 0);
+	REQUIRE(tree.Intern("v0") == 1);
+	REQUIRE(tree.SymbolCount() == 101);
+	REQUIRE(tree.Intern("w") == 101);
+	REQUIRE(tree.SymbolName(101) == "w");
+}
+
+
+TEST_CASE("Optimizer test 1", "[optimizer]")
+{
+	Lexer lexer("2*3 + x*1 - 0 + -(-y)");
+	Parser parser(lexer);
+	Optimizer optimizer;
+
+	AST tree = parser.Parse();
+	optimizer.Optimize(tree);
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Add);
+
+	const ASTNode& right = tree[root.right];
+	REQUIRE(right.kind == ASTKind::Literal);
+	REQUIRE(right.value == 6);
+
+	const ASTNode& left = tree[root.left];
+	REQUIRE(left.kind == ASTKind::Add);
+
+	const ASTNode& ll = tree[left.left];
+	REQUIRE(ll.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(ll.value) == "x");
+
+	const ASTNode& lr = tree[left.right];
+	REQUIRE(lr.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(lr.value) == "y");
+
+	// nothing but the live nodes is left
+	REQUIRE(tree.Size() == 5);
+}
+
+TEST_CASE("Optimizer test 2", "[optimizer]")
+{
+	Lexer lexer("(1 - 2) * 3");
+	Parser parser(lexer);
+	Optimizer optimizer;
+
+	AST tree = parser.Parse();
+	optimizer.Optimize(tree);
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Literal);
+	REQUIRE(root.value == 4294967293u);
+}
+
+TEST_CASE("Optimizer test 3", "[optimizer]")
+{
+	Lexer lexer("a*0 + div(a, b)*0");
+	Parser parser(lexer);
+	Optimizer optimizer;
+
+	AST tree = parser.Parse();
+	optimizer.Optimize(tree);
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Mul);
+
+	const ASTNode& left = tree[root.left];
+	REQUIRE(left.kind == ASTKind::Call);
+	REQUIRE(tree.SymbolName(left.value) == "div");
+
+	const ASTNode& right = tree[root.right];
+	REQUIRE(right.kind == ASTKind::Literal);
+	REQUIRE(right.value == 0);
+}
+
+TEST_CASE("Optimizer test 4", "[optimizer]")
+{
+	Lexer lexer("3*(a - b)*-4 - -c");
+	Parser parser(lexer);
+	Optimizer optimizer;
+
+	AST tree = parser.Parse();
+	optimizer.Optimize(tree);
+	const ASTNode& root = tree[tree.Root()];
+	REQUIRE(root.kind == ASTKind::Add);
+
+	const ASTNode& right = tree[root.right];
+	REQUIRE(right.kind == ASTKind::Variable);
+	REQUIRE(tree.SymbolName(right.value) == "c");
+
+	const ASTNode& left = tree[root.left];
+	REQUIRE(left.kind == ASTKind::Mul);
+
+	const ASTNode& lr = tree[left.right];
+	REQUIRE(lr.kind == ASTKind::Literal);
+	REQUIRE(lr.value == 4294967284u);
+
+	const ASTNode& ll = tree[left.left];
+	REQUIRE(ll.kind == ASTKind::Sub);
+}
+
+TEST_CASE("Cache test 1", "[cache]")
+{
+	int a = 1, b = 2, other = 3;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr}, {}};
+	symbol_t rebound[] = {{"a", &other, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr}, {}};
+	ExpressionCache cache(1 << 16);
+
+	auto first = cache.Get("a + b*2", symbols);
+	auto second = cache.Get("a+b * 2", symbols);
+	REQUIRE(first == second);
+
+	auto third = cache.Get("a + b*2", rebound);
+	REQUIRE(third != first);
+
+	ExpressionCacheStats stats = cache.Stats();
+	REQUIRE(stats.hits == 1);
+	REQUIRE(stats.misses == 2);
+	REQUIRE(stats.entries == 2);
+	REQUIRE(stats.codeBytes == first->Size() + third->Size());
+}
+
+TEST_CASE("Cache test 2", "[cache]")
+{
+	int a = 1;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {}};
+	ExpressionCache cache(1);
+
+	auto evicted = cache.Get("a + 1", symbols);
+	cache.Get("a + 2", symbols);
+
+	ExpressionCacheStats stats = cache.Stats();
+	REQUIRE(stats.evictions == 2);
+	REQUIRE(stats.entries == 0);
+	REQUIRE(stats.codeBytes == 0);
+	REQUIRE(evicted->Size() > 0);
+}
+
+TEST_CASE("Code heap test 1", "[heap]")
+{
+	CodeHeap heap;
+	uint32_t code[] = {0xe3a00001, 0xe12fff1e};
+
+	std::vector<const void*> installed;
+	for (int i = 0; i < 1000; ++i)
+		installed.push_back(heap.Install(code, sizeof(code)));
+
+	CodeHeapStats stats = heap.Stats();
+	REQUIRE(stats.usedBytes == 1000 * 16);
+	REQUIRE(stats.mappedBytes < 1000 * 4096);
+	REQUIRE(std::memcmp(installed[999], code, sizeof(code)) == 0);
+
+	heap.Free(installed[500]);
+	REQUIRE(heap.Stats().blocks == 999);
+	REQUIRE(heap.Install(code, sizeof(code)) == installed[500]);
+	REQUIRE(heap.Stats().blocks == 1000);
+
+	// between installs the code is mapped read-execute only
+	std::ifstream maps("/proc/self/maps");
+	size_t views = 0;
+	for (std::string line; std::getline(maps, line);)
+	{
+		if (line.find("jit-code") == std::string::npos)
+			continue;
+
+		std::istringstream fields(line);
+		std::string range, permissions;
+		fields >> range >> permissions;
+		REQUIRE(permissions == "r-xs");
+		++views;
+	}
+	REQUIRE(views >= 1);
+}
+
+TEST_CASE("Code buffer test 1", "[buffer]")
+{
+	uint32_t memory[4] = {};
+	CodeBuffer buffer(memory, sizeof(memory));
+	CodeBuffer::Label back = buffer.NewLabel();
+	CodeBuffer::Label data = buffer.NewLabel();
+
+	// a load of a word bound later and a branch to a label bound earlier
+	buffer.Bind(back);
+	buffer.Write(0xe51f0000, data, CodeBuffer::Fixup::PcRelativeLoad);
+	buffer.Write(0xea000000, back, CodeBuffer::Fixup::Branch);
+	buffer.Write(0xe1a00000);
+	REQUIRE_THROWS(buffer.Finish());
+	buffer.Bind(data);
+	buffer.Write(0x12345678);
+	REQUIRE(buffer.Finish() == sizeof(memory));
+
+	REQUIRE(memory[0] == 0xe59f0004); // ldr r0, [pc, #4]
+	REQUIRE(memory[1] == 0xeafffffd); // b . - 4
+	REQUIRE(memory[3] == 0x12345678);
+	REQUIRE_THROWS(buffer.Write(0xe1a00000));
+
+	// the code never runs past the end of the caller's buffer,
+	// which gets the size the code needs back instead
+	int a = 1;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {}};
+	uint32_t code[5] = {0, 0, 0, 0, 0xdeadbeef};
+	REQUIRE(jit_compile_expression_to_arm_sized("a + 1", symbols, code, 16) > 16);
+	REQUIRE(code[4] == 0xdeadbeef);
+}
+
+// how many instructions of the code match value in the bits of mask; literal
+// pools, the one after bx lr and those branched over, hold addresses that
+// could match anything and are skipped
+static size_t count_words(const uint32_t* code, size_t size, uint32_t mask, uint32_t value)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < size / 4; ++i)
+	{
+		count += (code[i] & mask) == value;
+		if (code[i] == 0xe12fff1e) // bx lr
+			break;
+		int32_t offset = static_cast<int32_t>(code[i] << 8) >> 8;
+		if ((code[i] & 0xff000000) == 0xea000000 && offset > 0) // b over a pool
+			i += offset + 1;
+	}
+	return count;
+}
+
+// a product of 2^depth distinct variables, balanced so that it needs depth + 1 registers
+static std::string balanced_product(int depth, int& next)
+{
+	if (depth == 0)
+		return "v" + std::to_string(next++);
+	std::string left = balanced_product(depth - 1, next);
+	return "(" + left + " * " + balanced_product(depth - 1, next) + ")";
+}
+
+TEST_CASE("Register allocation test 1", "[registers]")
+{
+	std::vector<int> values(1 << 12);
+	std::vector<std::string> names(values.size());
+	std::vector<symbol_t> symbols;
+	for (size_t i = 0; i < values.size(); ++i)
+	{
+		values[i] = static_cast<int>(2 * i + 1);
+		names[i] = "v" + std::to_string(i);
+		symbols.push_back(symbol_t{names[i].c_str(), &values[i], SYMBOL_PLAIN, nullptr});
+	}
+	symbols.push_back(symbol_t{});
+
+	// r4-r10, r12 and r0-r3 hold what a depth of 11 needs, one more spills
+	std::vector<uint32_t> code(1 << 16);
+	for (int depth : {7, 11, 12})
+	{
+		int next = 0;
+		std::string expression = balanced_product(depth, next);
+		size_t size = jit_compile_expression_to_arm_sized(expression.c_str(), symbols.data(),
+			code.data(), code.size() * sizeof(uint32_t));
+		REQUIRE(size != 0);
+		REQUIRE(size <= code.size() * sizeof(uint32_t));
 
-	auto result = parser.Parse();
-	ASTBinaryOperator* root = dynamic_cast<ASTBinaryOperator*>(result.get());
-	REQUIRE(root);
-	REQUIRE(root->operatorName == "-");
+		// str rX, [sp, #-4]! and ldr rX, [sp], #4 save and restore a value
+		size_t pushes = count_words(code.data(), size, 0x0fff0fff, 0x052d0004);
+		size_t pops = count_words(code.data(), size, 0x0fff0fff, 0x049d0004);
+		REQUIRE(pushes == pops);
+		REQUIRE((depth < 12 ? pushes == 0 : pushes > 0));
 
-	ASTLiteral* left = dynamic_cast<ASTLiteral*>(root->left.get());
-	REQUIRE(left);
-	REQUIRE(left->literal == "1337");
+		// the prologue and the epilogue are the only other stack traffic
+		REQUIRE(count_words(code.data(), size, 0x0fff0000, 0x092d0000) == 1);
+		REQUIRE(count_words(code.data(), size, 0x0fff0000, 0x08bd0000) == 1);
+		REQUIRE(count_words(code.data(), size, 0x0fe000f0, 0x00000090) == (1u << depth) - 1); // mul
 
-	ASTLiteral* right = dynamic_cast<ASTLiteral*>(root->right.get());
-	REQUIRE(right);
-	REQUIRE(right->literal == "42");
-}
\ No newline at end of file
+		uint32_t product = 1;
+		for (int i = 0; i < next; ++i)
+			product *= static_cast<uint32_t>(values[i]);
+		REQUIRE(run(Emulator::Mode::Arm, code.data(), size, symbols.data(), {}) == static_cast<int32_t>(product));
+	}
+}
+
+TEST_CASE("Constant test 1", "[constants]")
+{
+	int a = 5;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"sum", reinterpret_cast<void*>(&test_sum6), SYMBOL_PLAIN, nullptr}, {}};
+
+	// the index of the word an ldr rX, [pc, #offset] loads
+	auto literal = [](const uint32_t* code, size_t i)
+	{
+		size_t offset = (code[i] & 0xfff) / 4;
+		return (code[i] & 0x00800000) ? i + 2 + offset : i + 2 - offset;
+	};
+
+	// the index of the first word after bx lr, where the last pool starts
+	auto epilogue = [](const uint32_t* code, size_t words)
+	{
+		return static_cast<size_t>(std::find(code, code + words, 0xe12fff1eu) - code) + 1;
+	};
+
+	// mov, mvn, and 0x12345678 twice, which neither can build
+	const char* expression = "sum(255, 4294967040, 305419896, a, 65535, 0) + sum(a, 305419896, 0, 0, 0, 0)";
+	uint32_t code[1 << 14];
+	for (bool movw : {false, true})
+	{
+		size_t size = compile_arm(expression, {}, symbols, ArmFeatures{movw, false}, code, sizeof(code));
+		size_t words = size / 4;
+		size_t pool = epilogue(code, words);
+		REQUIRE(count_words(code, size, 0x0fff0fff, 0x03a000ff) == 1); // mov rX, #255
+		REQUIRE(count_words(code, size, 0x0fff0fff, 0x03e000ff) == 1); // mvn rX, #255
+
+		if (movw)
+		{
+			// ARMv7 builds any constant with movw and movt, no pool at all
+			REQUIRE(pool == words);
+			REQUIRE(count_words(code, size, 0x0fff0fff, 0x03050678) == 2); // movw rX, #0x5678
+			REQUIRE(count_words(code, size, 0x0fff0fff, 0x03410234) == 2); // movt rX, #0x1234
+			REQUIRE(count_words(code, size, 0x0fff0fff, 0x030f0fff) == 1); // movw rX, #0xffff
+		}
+		else
+		{
+			// one pool after the return, the same constant loaded twice from one word
+			REQUIRE(count_words(code, size, 0x0fb00000, 0x03000000) == 0);
+			REQUIRE(pool < words);
+			REQUIRE(std::count(code + pool, code + words, 0x12345678u) == 1);
+			REQUIRE(std::count(code + pool, code + words, 0x0000ffffu) == 1);
+
+			size_t loads = 0;
+			for (size_t i = 0; i < pool; ++i)
+			{
+				if ((code[i] & 0x0f7f0000) == 0x051f0000 && code[literal(code, i)] == 0x12345678)
+					++loads;
+			}
+			REQUIRE(loads == 2);
+		}
+
+		// nothing for the code to branch over
+		REQUIRE(count_words(code, size, 0x0f000000, 0x0a000000) == 0);
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {})
+			== test_sum6(255, -256, 305419896, a, 65535, 0) + test_sum6(a, 305419896, 0, 0, 0, 0));
+	}
+
+	// too many distinct constants for one pool in reach: each branch only
+	// skips a pool, and every constant is in one of them
+	std::string sum = "a";
+	for (int i = 0; i < 2000; ++i)
+		sum += " + " + std::to_string(123456789 + 1000 * i) + " * a";
+	size_t size = compile_arm(sum.c_str(), {}, symbols, ArmFeatures{false, false}, code, sizeof(code));
+	size_t words = size / 4;
+
+	std::vector<bool> data(words, false);
+	for (size_t i = 0; i < words; ++i)
+	{
+		if (data[i])
+			continue;
+		if (code[i] == 0xe12fff1e) // bx lr, the last pool follows
+			std::fill(data.begin() + i + 1, data.end(), true);
+		else if ((code[i] & 0xff000000) == 0xea000000)
+		{
+			size_t target = i + 2 + (static_cast<int32_t>(code[i] << 8) >> 8);
+			REQUIRE(target > i + 1);
+			REQUIRE(target <= words);
+			std::fill(data.begin() + i + 1, data.begin() + target, true);
+		}
+	}
+	size_t missing = 0;
+	for (int i = 0; i < 2000; ++i)
+	{
+		uint32_t constant = 123456789 + 1000 * i;
+		size_t found = 0;
+		for (size_t k = 0; k < words; ++k)
+			found += data[k] && code[k] == constant;
+		missing += found != 1;
+	}
+	REQUIRE(missing == 0);
+	size_t stray = 0;
+	for (size_t i = 0; i < words; ++i)
+	{
+		if (!data[i] && (code[i] & 0x0f7f0000) == 0x051f0000)
+			stray += literal(code, i) >= words || !data[literal(code, i)];
+	}
+	REQUIRE(stray == 0);
+
+	uint32_t expected = a;
+	for (int i = 0; i < 2000; ++i)
+		expected += (123456789 + 1000u * i) * a;
+	REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == static_cast<int32_t>(expected));
+}
+
+TEST_CASE("Strength reduction test 1", "[strength]")
+{
+	int x = 0;
+	symbol_t symbols[] = {{"x", &x, SYMBOL_PLAIN, nullptr}, {"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"mod", reinterpret_cast<void*>(&test_mod), SYMBOL_MOD, nullptr}, {}};
+	const uint32_t MUL = 0x00000090, SMULL = 0x00c00090, BLX = 0x012fff30;
+
+	// x*10 is (x + x*4)*2, no multiply
+	uint32_t code[256];
+	size_t size = jit_compile_expression_to_arm_sized("x*10", symbols, code, sizeof(code));
+	REQUIRE(count_words(code, size, 0x0fe000f0, MUL) == 0);
+	REQUIRE(count_words(code, size, 0x0ff00ff0, 0x00800100) == 1); // add rX, rY, rZ, lsl #2
+	for (int value : {0, 7, -3, 0x7fffffff})
+	{
+		x = value;
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == static_cast<int32_t>(value * 10u));
+	}
+
+	// a power of two is a rounding shift, neither a call nor a multiply
+	for (const char* expression : {"div(x, 8)", "mod(x, 16)"})
+	{
+		size = jit_compile_expression_to_arm_sized(expression, symbols, code, sizeof(code));
+		REQUIRE(count_words(code, size, 0x0ffffff0, BLX) == 0);
+		REQUIRE(count_words(code, size, 0x0fe000f0, MUL) == 0);
+		REQUIRE(count_words(code, size, 0x0fef0ff0, 0x01a00fc0) == 1); // asr rX, rY, #31
+	}
+
+	// anything else multiplies by a magic number
+	size = jit_compile_expression_to_arm_sized("div(x, 7)", symbols, code, sizeof(code));
+	REQUIRE(count_words(code, size, 0x0ffffff0, BLX) == 0);
+	REQUIRE(count_words(code, size, 0x0fe000f0, SMULL) == 1);
+
+	const int32_t divisors[] = {1, -1, 2, -8, 3, 7, -7, 0x40000000, INT32_MIN};
+	for (int32_t divisor : divisors)
+	{
+		for (bool quotient : {true, false})
+		{
+			std::string expression = std::string(quotient ? "div" : "mod")
+				+ "(x, " + std::to_string(static_cast<uint32_t>(divisor)) + ")";
+			size = jit_compile_expression_to_arm_sized(expression.c_str(), symbols, code, sizeof(code));
+			REQUIRE(size != 0);
+			REQUIRE(count_words(code, size, 0x0ffffff0, BLX) == 0);
+
+			for (int32_t dividend : {INT32_MIN, -1, 0, INT32_MAX, -100, 12345})
+			{
+				// the one quotient C leaves undefined wraps around, as sdiv does
+				int32_t expected = dividend == INT32_MIN && divisor == -1
+					? (quotient ? INT32_MIN : 0)
+					: (quotient ? dividend / divisor : dividend % divisor);
+				x = dividend;
+				REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == expected);
+			}
+		}
+	}
+}
+
+TEST_CASE("Intrinsic test 1", "[intrinsics]")
+{
+	int x = 0, y = 0;
+	static const uint32_t scale[] = {0xe0800080, 0xe2800001}; // add r0, r0, r0, lsl #1; add r0, r0, #1
+	static const intrinsic_t intrinsics[] = {
+		{INTRINSIC_ADD_IMMEDIATE, 1, nullptr, 0}, {INTRINSIC_ADD_IMMEDIATE, -1, nullptr, 0},
+		{INTRINSIC_NEGATE, 0, nullptr, 0}, {INTRINSIC_ABS, 0, nullptr, 0},
+		{INTRINSIC_SHIFT_LEFT, 3, nullptr, 0}, {INTRINSIC_SHIFT_RIGHT, 2, nullptr, 0},
+		{INTRINSIC_MIN, 0, nullptr, 0}, {INTRINSIC_MAX, 0, nullptr, 0},
+		{INTRINSIC_TEMPLATE, 0, scale, 2}};
+	symbol_t symbols[] = {{"x", &x, SYMBOL_PLAIN, nullptr}, {"y", &y, SYMBOL_PLAIN, nullptr},
+		{"inc", &x, SYMBOL_PLAIN, &intrinsics[0]}, {"dec", &x, SYMBOL_PLAIN, &intrinsics[1]},
+		{"neg", &x, SYMBOL_PLAIN, &intrinsics[2]}, {"abs", &x, SYMBOL_PLAIN, &intrinsics[3]},
+		{"shl", &x, SYMBOL_PLAIN, &intrinsics[4]}, {"sar", &x, SYMBOL_PLAIN, &intrinsics[5]},
+		{"min", &x, SYMBOL_PLAIN, &intrinsics[6]}, {"max", &x, SYMBOL_PLAIN, &intrinsics[7]},
+		{"scale", reinterpret_cast<void*>(&test_scale), SYMBOL_PLAIN, &intrinsics[8]}, {}};
+
+	// each op is one or two instructions where a call would be, computing
+	// what the function would
+	auto wrap = [](int64_t value) { return static_cast<int32_t>(static_cast<uint32_t>(value)); };
+	struct
+	{
+		const char* expression;
+		uint32_t mask, value;
+		int32_t (*expected)(int32_t x, int32_t y);
+	} const ops[] = {
+		{"inc(x)", 0x0ff00fff, 0x02800001, [](int32_t x, int32_t) { return static_cast<int32_t>(x + 1u); }}, // add rX, rY, #1
+		{"dec(x)", 0x0ff00fff, 0x02400001, [](int32_t x, int32_t) { return static_cast<int32_t>(x - 1u); }}, // sub rX, rY, #1
+		{"neg(x)", 0x0ff00fff, 0x02600000, [](int32_t x, int32_t) { return static_cast<int32_t>(0u - x); }}, // rsb rX, rY, #0
+		{"abs(x)", 0xfff00fff, 0xb2600000, [](int32_t x, int32_t) { return static_cast<int32_t>(x < 0 ? 0u - x : x); }}, // rsblt rX, rY, #0
+		{"shl(x)", 0x0fef0ff0, 0x01a00180, [](int32_t x, int32_t) { return static_cast<int32_t>(static_cast<uint32_t>(x) << 3); }}, // mov rX, rY, lsl #3
+		{"sar(x)", 0x0fef0ff0, 0x01a00140, [](int32_t x, int32_t) { return x >> 2; }}, // mov rX, rY, asr #2
+		{"min(x, y)", 0xffff0ff0, 0xc1a00000, [](int32_t x, int32_t y) { return std::min(x, y); }}, // movgt rX, rY
+		{"max(x, y)", 0xffff0ff0, 0xb1a00000, [](int32_t x, int32_t y) { return std::max(x, y); }}}; // movlt rX, rY
+	const int32_t arguments[][2] = {{0, 0}, {5, -7}, {-7, 5}, {INT32_MIN, 1}, {INT32_MAX, -1}, {-1, INT32_MIN}};
+
+	uint32_t code[256];
+	for (const auto& op : ops)
+	{
+		size_t size = jit_compile_expression_to_arm_sized(op.expression, symbols, code, sizeof(code));
+		REQUIRE(size != 0);
+		REQUIRE(count_words(code, size, op.mask, op.value) == 1);
+		REQUIRE(count_words(code, size, 0x0ffffff0, 0x012fff30) == 0); // blx
+		for (const int32_t* pair : arguments)
+		{
+			x = pair[0];
+			y = pair[1];
+			REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == op.expected(x, y));
+		}
+	}
+	size_t size = jit_compile_expression_to_arm_sized("abs(x)", symbols, code, sizeof(code));
+	REQUIRE(count_words(code, size, 0x0ff0ffff, 0x03500000) == 1); // cmp rX, #0
+	size = jit_compile_expression_to_arm_sized("min(x, y)", symbols, code, sizeof(code));
+	REQUIRE(count_words(code, size, 0x0ff0fff0, 0x01500000) == 1); // cmp rX, rY
+
+	// a template is pasted as it is, and x*y stays in r4-r10 around it
+	size = jit_compile_expression_to_arm_sized("x*y + scale(x - y)", symbols, code, sizeof(code));
+	REQUIRE(std::search(code, code + size / 4, scale, scale + 2) != code + size / 4);
+	REQUIRE(count_words(code, size, 0x0ffffff0, 0x012fff30) == 0);
+	REQUIRE(count_words(code, size, 0x0fff0000, 0x092d0000) == 1); // push, only the prologue's
+	REQUIRE(count_words(code, size, 0x0fff0fff, 0x052d0004) == 0); // str rX, [sp, #-4]!
+	for (const int32_t* pair : arguments)
+	{
+		x = pair[0];
+		y = pair[1];
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == wrap(int64_t(x) * y + test_scale(wrap(int64_t(x) - y))));
+	}
+
+	// all of them nested
+	size = jit_compile_expression_to_arm_sized("max(inc(shl(x)), min(neg(y), sar(abs(x)))) - scale(dec(y))",
+		symbols, code, sizeof(code));
+	for (const int32_t* pair : arguments)
+	{
+		x = pair[0];
+		y = pair[1];
+		int32_t left = std::max(ops[0].expected(ops[4].expected(x, 0), 0),
+			std::min(ops[2].expected(y, 0), ops[5].expected(ops[3].expected(x, 0), 0)));
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}) == wrap(int64_t(left) - test_scale(ops[1].expected(y, 0))));
+	}
+}
+
+// follows sp from the entry, where AAPCS has it 8-byte aligned, to the return:
+// how many calls are made with sp misaligned, one more if sp is not back at the end
+static size_t misaligned_calls(const uint32_t* code, size_t size)
+{
+	size_t depth = 0, misaligned = 0;
+	for (size_t i = 0; i < size / 4 && code[i] != 0xe12fff1e; ++i)
+	{
+		uint32_t word = code[i];
+		uint32_t rotation = 2 * ((word >> 8) & 15);
+		uint32_t immediate = ((word & 0xff) >> rotation) | ((word & 0xff) << ((32 - rotation) & 31));
+		if ((word & 0x0fff0000) == 0x092d0000) // push {...}
+			depth += 4 * __builtin_popcount(word & 0xffff);
+		else if ((word & 0x0fff0000) == 0x08bd0000) // pop {...}
+			depth -= 4 * __builtin_popcount(word & 0xffff);
+		else if ((word & 0x0fff0fff) == 0x052d0004) // str rX, [sp, #-4]!
+			depth += 4;
+		else if ((word & 0x0fff0fff) == 0x049d0004) // ldr rX, [sp], #4
+			depth -= 4;
+		else if ((word & 0x0ffff000) == 0x024dd000) // sub sp, sp, #n
+			depth += immediate;
+		else if ((word & 0x0ffff000) == 0x028dd000) // add sp, sp, #n
+			depth -= immediate;
+		else if ((word & 0x0ffffff0) == 0x012fff30) // blx
+			misaligned += depth % 8 != 0;
+	}
+	return misaligned + (depth != 0);
+}
+
+TEST_CASE("Call test 1", "[calls]")
+{
+	int a = 11;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"sum", reinterpret_cast<void*>(&test_sum6), SYMBOL_PLAIN, nullptr}, {}};
+	const char* parameters[] = {"p0", "p1", "p2", "p3", "p4", "p5"};
+
+	// p4 and p5 arrive on the stack, each sum passes two arguments there,
+	// and the calls come while one word of an unfinished sum is pushed
+	const char* expression =
+		"p0*sum(p1, p2, p3, p4, p5, a) - sum(sum(p5, p4, p3, p2, p1, p0), p5, 1, 2, 3, div(p4, p1)) + p5*div(a, p2)";
+	uint32_t code[1024];
+	size_t size = jit_compile_function_to_arm(expression, parameters, 6, symbols, code, sizeof(code));
+	REQUIRE(size != 0);
+	REQUIRE(count_words(code, size, 0x0ffffff0, 0x012fff30) == 5); // blx
+	REQUIRE(count_words(code, size, 0x0fff0000, 0x059d0000) >= 2); // ldr rX, [sp, #offset]
+
+	REQUIRE(misaligned_calls(code, size) == 0);
+
+	const int32_t arguments[][6] = {{1, 2, 3, 4, 5, 6}, {-7, 3, -100, 65536, 1 << 20, -1}, {0, -3, 1, INT32_MAX, INT32_MIN, 9}};
+	for (const int32_t* p : arguments)
+	{
+		auto wrap = [](int64_t value) { return static_cast<int32_t>(static_cast<uint32_t>(value)); };
+		int32_t left = wrap(int64_t(p[0]) * test_sum6(p[1], p[2], p[3], p[4], p[5], a));
+		int32_t middle = test_sum6(test_sum6(p[5], p[4], p[3], p[2], p[1], p[0]), p[5], 1, 2, 3, p[4] / p[1]);
+		int32_t right = wrap(int64_t(p[5]) * (a / p[2]));
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}, p[0], p[1], p[2], p[3], p[4], p[5]) == wrap(int64_t(left) - middle + right));
+	}
+}
+
+TEST_CASE("Call test 2", "[calls]")
+{
+	symbol_t symbols[] = {{"sum", reinterpret_cast<void*>(&test_sum5), SYMBOL_PLAIN, nullptr}, {}};
+	const char* parameters[] = {"p0", "p1", "p2", "p3", "p4"};
+
+	// one stack argument needs a padding word, unless one word is already
+	// pushed for the unfinished sum; arguments go straight to r0-r3
+	const char* expression = "sum(p0, p1, p2, p3, p4) + p4*sum(1, 2, 3, 4, sum(p4, p3, p2, p1, p0))";
+	uint32_t code[1024];
+	size_t size = jit_compile_function_to_arm(expression, parameters, 5, symbols, code, sizeof(code));
+	REQUIRE(count_words(code, size, 0x0ffffff0, 0x012fff30) == 3); // blx
+	REQUIRE(count_words(code, size, 0xffffffff, 0xe24dd004) == 1); // sub sp, sp, #4
+	REQUIRE(misaligned_calls(code, size) == 0);
+
+	const int32_t arguments[][5] = {{1, 2, 3, 4, 5}, {-7, 3, -100, 65536, 1 << 20}, {0, -1, 1, INT32_MAX, INT32_MIN}};
+	for (const int32_t* p : arguments)
+	{
+		int32_t inner = test_sum5(p[4], p[3], p[2], p[1], p[0]);
+		uint32_t expected = test_sum5(p[0], p[1], p[2], p[3], p[4]) + uint32_t(p[4]) * test_sum5(1, 2, 3, 4, inner);
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}, p[0], p[1], p[2], p[3], p[4]) == static_cast<int32_t>(expected));
+	}
+}
+
+TEST_CASE("Batch test 1", "[batch]")
+{
+	int a = 3;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr}, {}};
+	uint32_t code[1024];
+
+	// the second needs a call per row, four of them a vector
+	for (const char* expression : {"x*y + a - 3*x", "div(x, y) + a*x"})
+	{
+		for (bool neon : {false, true})
+		{
+			bool calls = std::strchr(expression, '(') != nullptr;
+			size_t size = compile_arm(expression, {"x", "y"}, symbols, ArmFeatures{false, neon},
+				code, sizeof(code), true);
+			REQUIRE(size % 4 == 0);
+			REQUIRE(code[0] == 0xe92d41f0); // push {r4-r8, lr}
+
+			// the kernel returns with pop {r4-r8, pc}, the scalar function follows
+			uint32_t* end = std::find(code, code + size / 4, 0xe8bd81f0u);
+			REQUIRE(end != code + size / 4);
+			size_t kernel = (end - code + 1) * 4;
+			REQUIRE(count_words(code, kernel, 0xffffffff, 0xe3560000) == 1); // cmp r6, #0
+
+			// the scalar tail calls the row function with bl
+			REQUIRE(count_words(code, kernel, 0xff000000, 0xeb000000) == 1);
+			size_t bl = std::find_if(code, end, [](uint32_t word) { return (word & 0xff000000) == 0xeb000000; }) - code;
+			size_t target = bl + 2 + (static_cast<int32_t>(code[bl] << 8) >> 8);
+			REQUIRE(target >= kernel / 4);
+			REQUIRE(code[target] == 0xe92d47f0); // push {r4-r10, lr}
+
+			// with NEON four rows at a time, calls made lane by lane
+			REQUIRE((count_words(code, kernel, 0xf0000000, 0xf0000000) != 0) == neon);
+			REQUIRE(count_words(code, kernel, 0xffffffff, 0xe3560004) == (neon ? 1u : 0u)); // cmp r6, #4
+			REQUIRE(count_words(code, kernel, 0x0ffffff0, 0x012fff30) == (neon && calls ? 4u : 0u));
+			REQUIRE(count_words(code, size, 0x0ffffff0, 0x012fff30) == (neon && calls ? 5u : calls ? 1u : 0u));
+
+			// no rows, fewer than a vector, and vectors with a tail
+			for (size_t n : {0, 3, 4 * 5 + 3})
+			{
+				std::vector<int> x(n), y(n), out(n + 1, 0x77777777);
+				for (size_t i = 0; i < n; ++i)
+				{
+					x[i] = static_cast<int>(i * 7919) - 50000;
+					y[i] = i % 2 ? static_cast<int>(i % 5) + 1 : -static_cast<int>(i % 7) - 1;
+				}
+
+				// void f(const int* const* columns, int* out, size_t n), with
+				// the columns at the addresses 32-bit code sees them at
+				uint32_t columns[] = {Emulator::Address(x.data()), Emulator::Address(y.data())};
+				run(Emulator::Mode::Arm, code, size, symbols,
+					{{x.data(), n * sizeof(int)}, {y.data(), n * sizeof(int)},
+					{out.data(), out.size() * sizeof(int)}, {columns, sizeof(columns)}},
+					static_cast<const uint32_t*>(columns), out.data(), n);
+				for (size_t i = 0; i < n; ++i)
+					REQUIRE(out[i] == (calls ? test_div(x[i], y[i]) + a * x[i] : x[i] * y[i] + a - 3 * x[i]));
+				REQUIRE(out[n] == 0x77777777);
+			}
+		}
+	}
+}
+
+TEST_CASE("Parallel compile test 1", "[parallel]")
+{
+	int a = 1;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {}};
+	std::vector<std::string> texts;
+	for (int i = 0; i < 100; ++i)
+		texts.push_back(i % 10 == 3 ? "a + (" : "a * " + std::to_string(i));
+
+	std::vector<const char*> expressions;
+	for (const std::string& text : texts)
+		expressions.push_back(text.c_str());
+
+	CodeHeap heap;
+	std::vector<CompileResult> results = CompileParallel(heap, expressions.data(), expressions.size(), symbols, 4);
+	REQUIRE(results.size() == 100);
+	for (int i = 0; i < 100; ++i)
+	{
+		REQUIRE(results[i].ok == (i % 10 != 3));
+		REQUIRE((results[i].code != nullptr) == results[i].ok);
+	}
+	REQUIRE(heap.Stats().blocks == 90);
+}
+
+TEST_CASE("CSE test 1", "[cse]")
+{
+	int a = 1, b = 2, c = 3, d = 4;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"c", &c, SYMBOL_PLAIN, nullptr}, {"d", &d, SYMBOL_PLAIN, nullptr},
+		{"div", &a, SYMBOL_DIV, nullptr}, {"f", &b, SYMBOL_PLAIN, nullptr}, {}};
+	SymbolTable symtable(symbols);
+
+	Lexer lexer("(a*b+c)*(c+b*a) - div(a*b+c, d) + f(a) + f(a)");
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	Optimizer optimizer;
+	optimizer.Optimize(tree);
+
+	uint32_t code[1024];
+	CodeBuffer buffer(code, sizeof(code));
+	Compiler compiler(tree);
+	compiler.Compile(buffer, symtable);
+
+	// two copies of a*b+c, one with commuted operands, and the a of both
+	// f(a), which are not merged themselves as f is not pure
+	REQUIRE(compiler.EliminatedNodes() == 12);
+}
+
+TEST_CASE("Peephole test 1", "[peephole]")
+{
+	int a = 3, b = 4, c = 5, d = 6;
+	static const intrinsic_t negate = {INTRINSIC_NEGATE, 0, nullptr, 0};
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"c", &c, SYMBOL_PLAIN, nullptr}, {"d", &d, SYMBOL_PLAIN, nullptr},
+		{"neg", &a, SYMBOL_PLAIN, &negate}, {}};
+	SymbolTable symtable(symbols);
+
+	Lexer lexer("a*b + c*d - neg(b)");
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	Optimizer optimizer;
+	optimizer.Optimize(tree);
+
+	uint32_t code[1024];
+	CodeBuffer buffer(code, sizeof(code));
+	Compiler compiler(tree);
+	compiler.Compile(buffer, symtable);
+
+	const std::vector<PeepholeRewrite>& rewrites = compiler.PeepholeRewrites();
+	REQUIRE(rewrites.size() == 2);
+	REQUIRE(rewrites[0].rule == Peephole::MultiplyAdd);
+	REQUIRE(rewrites[1].rule == Peephole::NegateOperand);
+	REQUIRE(rewrites[0].position < rewrites[1].position);
+
+	// mla, and the sub turned into an add of b
+	REQUIRE((code[rewrites[0].position / 4] & 0x0fe000f0) == 0x00200090);
+	REQUIRE((code[rewrites[1].position / 4] & 0x0ff00ff0) == 0x00800000);
+
+	// one multiply left, no negation
+	size_t words = buffer.Position() / 4;
+	REQUIRE(std::count_if(code, code + words, [](uint32_t word) { return (word & 0x0ff000f0) == 0x00000090; }) == 1);
+	REQUIRE(std::count_if(code, code + words, [](uint32_t word) { return (word & 0x0ff00fff) == 0x02600000; }) == 0);
+
+	REQUIRE(run(Emulator::Mode::Arm, code, buffer.Position(), symbols, {}) == 3 * 4 + 5 * 6 + 4);
+}
+
+TEST_CASE("Symbol table test 1", "[symtable]")
+{
+	int values[3];
+	symbol_t symbols[] = {{"a", &values[0], SYMBOL_PLAIN, nullptr}, {"div", &values[1], SYMBOL_DIV, nullptr},
+		{"a", &values[2], SYMBOL_PLAIN, nullptr}, {}};
+	SymbolTable symtable(symbols);
+
+	REQUIRE(symtable.Size() == 2);
+	REQUIRE(symtable.Find("a") == &symbols[2]);
+	REQUIRE(symtable.Find("div") == &symbols[1]);
+	REQUIRE(symtable.Find("b") == nullptr);
+	REQUIRE(symtable.Find("di") == nullptr);
+}
+
+TEST_CASE("Interpreter test 1", "[interpreter]")
+{
+	int a = 7, b = -3;
+	static const intrinsic_t inc = {INTRINSIC_ADD_IMMEDIATE, 1, nullptr, 0};
+	static const intrinsic_t shl = {INTRINSIC_SHIFT_LEFT, 2, nullptr, 0};
+	static const intrinsic_t min = {INTRINSIC_MIN, 0, nullptr, 0};
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"sum", reinterpret_cast<void*>(&test_sum6), SYMBOL_PLAIN, nullptr},
+		{"inc", &a, SYMBOL_PLAIN, &inc}, {"shl", &a, SYMBOL_PLAIN, &shl}, {"min", &a, SYMBOL_PLAIN, &min}, {}};
+	SymbolTable symtable(symbols);
+
+	auto run = [&](const char* expression)
+	{
+		Lexer lexer(expression);
+		Parser parser(lexer);
+		AST tree = parser.Parse();
+		Optimizer optimizer;
+		optimizer.Optimize(tree);
+		return Bytecode(tree, symtable).Run();
+	};
+
+	REQUIRE(run("a*b - -a + 2") == -12);
+	REQUIRE(run("div(a, 2) + div(a, b) + div(b, 0-1)") == 4);
+	REQUIRE(run("inc(shl(a)) + min(a, b)") == 26);
+	REQUIRE(run("sum(1, 2, 3, 4, 5, a)") == 97);
+	REQUIRE(run("2147483647 + 1") == -2147483647 - 1);
+	REQUIRE_THROWS(run("c + 1"));
+}
+
+TEST_CASE("Interpreter test 2", "[interpreter]")
+{
+	symbol_t symbols[] = {{}};
+	SymbolTable symtable(symbols);
+
+	Lexer lexer("x*x - y + x");
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	Bytecode bytecode(tree, symtable, {"x", "y"});
+
+	int32_t arguments[] = {5, 3};
+	REQUIRE(bytecode.Run(arguments) == 27);
+	arguments[0] = -1;
+	REQUIRE(bytecode.Run(arguments) == -3);
+
+	// deep enough to spill past the local register file
+	std::string deep = "x";
+	for (int i = 0; i < 100; ++i)
+		deep = "(y - " + deep + ")";
+	Lexer deepLexer(deep);
+	Parser deepParser(deepLexer);
+	REQUIRE(Bytecode(deepParser.Parse(), symtable, {"x", "y"}).Run(arguments) == -1);
+}
+
+TEST_CASE("Tiered test 1", "[interpreter]")
+{
+	int a = 6;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {}};
+	SymbolTable symtable(symbols);
+
+	TieredExpression expression("a*a + 1", symtable, std::make_shared<CodeHeap>(), 10);
+	for (int i = 0; i < 20; ++i)
+	{
+		a = i;
+		REQUIRE(expression.Run() == i * i + 1);
+	}
+
+#if defined(__arm__) || defined(__aarch64__)
+	REQUIRE(expression.Native());
+#else
+	REQUIRE(!expression.Native());
+#endif
+}
+
+TEST_CASE("IR test 1", "[ir]")
+{
+	int a = 7, b = -3;
+	static const intrinsic_t inc = {INTRINSIC_ADD_IMMEDIATE, 1, nullptr, 0};
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"f", reinterpret_cast<void*>(&test_div), SYMBOL_PURE, nullptr},
+		{"g", reinterpret_cast<void*>(&test_div), SYMBOL_PLAIN, nullptr},
+		{"inc", &a, SYMBOL_PLAIN, &inc}, {}};
+	SymbolTable symtable(symbols);
+
+	Lexer lexer("a*b + f(a*b, 2) - f(b*a, 2) + div(x, 4) + inc(0)*3 + g(a, 1)*0");
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	IR ir(tree, symtable, {"x"});
+
+	REQUIRE(ir.Size() == 31);
+	REQUIRE(ir[0].op == IROp::Parameter);
+	REQUIRE(ir[ir.Size() - 1].op == IROp::Return);
+	REQUIRE(ir[ir.Size() - 1].type == IRType::Void);
+
+	std::ostringstream dump;
+	PassManager manager = PassManager::Standard();
+	manager.DumpTo(&dump);
+	manager.Run(ir);
+
+	// a*b and the pure f are computed once, inc(0)*3 is folded,
+	// the call to g stays for its side effects
+	REQUIRE(ir.Size() == 15);
+	REQUIRE(std::count_if(&ir[0], &ir[0] + ir.Size(),
+		[](const IRInstruction& instruction) { return instruction.op == IROp::Mul; }) == 1);
+	REQUIRE(std::count_if(&ir[0], &ir[0] + ir.Size(),
+		[](const IRInstruction& instruction) { return instruction.op == IROp::Call; }) == 2);
+
+	std::string text = dump.str();
+	REQUIRE(text.find("; lowered\n%0 = param 0\n%1 = load a\n") == 0);
+	REQUIRE(text.find("; fold\n") < text.find("; cse\n"));
+	REQUIRE(text.find("; cse\n") < text.find("; dce\n"));
+	REQUIRE(text.find("call g(") != std::string::npos);
+	REQUIRE(text.substr(text.find("; dce\n")) == "; dce\n" + ir.Dump());
+	REQUIRE(ir.Dump().find("%5 = call f(%3, %4)") != std::string::npos);
+}
+
+TEST_CASE("IR test 2", "[ir]")
+{
+	int a = 7, b = -3;
+	static const intrinsic_t min = {INTRINSIC_MIN, 0, nullptr, 0};
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"sum", reinterpret_cast<void*>(&test_sum6), SYMBOL_PLAIN, nullptr},
+		{"min", &a, SYMBOL_PLAIN, &min}, {}};
+	const char* parameters[] = {"x", "y", "z", "w", "v"};
+
+	// more live values than r4-r10 hold, so some go to the frame
+	std::string expression = "sum(x, y, z, w, v, div(a, 3)) * min(b, x)";
+	for (int i = 0; i < 10; ++i)
+		expression = "(" + expression + ") * (a + " + std::to_string(i) + ") - (b + x*" + std::to_string(i) + ")";
+
+	Lexer lexer(expression.c_str());
+	Parser parser(lexer);
+	AST tree = parser.Parse();
+	SymbolTable symtable(symbols);
+	int32_t arguments[] = {5, -8, 100, 3, 1 << 20};
+	int32_t expected = Bytecode(tree, symtable, {"x", "y", "z", "w", "v"}).Run(arguments);
+
+	uint32_t code[4096];
+	size_t size = jit_compile_function_to_arm_ir(expression.c_str(), parameters, 5, symbols, code, sizeof(code));
+	REQUIRE(size % 4 == 0);
+	REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}, 5, -8, 100, 3, 1 << 20) == expected);
+
+	IR ir(tree, symtable, {"x", "y", "z", "w", "v"});
+	PassManager::Standard().Run(ir);
+
+	for (bool movw : {false, true})
+	{
+		CodeBuffer buffer(code, sizeof(code));
+		IRCompiler(ir, ArmFeatures{movw, false}).Compile(buffer);
+		size = buffer.Finish();
+
+		// the code ends in bx lr, followed by the pool the loads read
+		uint32_t* end = std::find(code, code + size / 4, 0xe12fff1eu) + 1;
+		auto count = [&](uint32_t mask, uint32_t pattern)
+		{
+			return std::count_if(code, end, [=](uint32_t word) { return (word & mask) == pattern; });
+		};
+
+		REQUIRE(code[0] == 0xe92d47f0); // push {r4-r10, lr}
+		REQUIRE(end <= code + size / 4);
+		REQUIRE((end == code + size / 4) == movw);
+		REQUIRE((count(0x0f7f0000, 0x051f0000) != 0) == !movw); // ldr rt, [pc, #offset]
+		REQUIRE((count(0x0fb00000, 0x03000000) != 0) == movw);  // movw, movt
+
+		// only sum is called, the division by 3 multiplies
+		REQUIRE(std::count(code, end, 0xe12fff3cu) == 1); // blx r12
+		REQUIRE(count(0x0fe000f0, 0x00c00090) == 1);      // smull
+
+		// mov and mvn have no first operand, a nonzero Rn is unpredictable
+		REQUIRE(std::count_if(code, end, [](uint32_t word)
+			{
+				return (word & 0x0de00000) == 0x01a00000 && (word & 0x000f0000) != 0;
+			}) == 0);
+
+		REQUIRE(run(Emulator::Mode::Arm, code, size, symbols, {}, 5, -8, 100, 3, 1 << 20) == expected);
+	}
+}
+
+TEST_CASE("Stats test 1", "[stats]")
+{
+	int a = 1, b = 2, c = 3, d = 4;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"c", &c, SYMBOL_PLAIN, nullptr}, {"d", &d, SYMBOL_PLAIN, nullptr},
+		{"div", &a, SYMBOL_DIV, nullptr}, {"f", &b, SYMBOL_PLAIN, nullptr}, {}};
+
+	uint8_t code[1 << 16];
+	compile_stats_t stats;
+	size_t size = jit_compile_expression_to_arm_stats("a*b + div(c, d) - f(a, 1)", symbols, code, sizeof(code), &stats);
+
+	REQUIRE(stats.tokens == 17);
+	REQUIRE(stats.parsed_nodes == 11);
+	REQUIRE(stats.code_bytes == size);
+	REQUIRE(stats.calls == 2);
+	REQUIRE(stats.push_pop == 2);
+	REQUIRE(stats.branches == 1);
+	REQUIRE(stats.loads >= 4);
+	REQUIRE(stats.alu >= 3);
+
+	// distinct constants spill into pools placed between the code
+	std::string sum = "a";
+	for (int i = 0; i < 2000; ++i)
+		sum += " + " + std::to_string(123456789 + 1000 * i) + " * b";
+	size = jit_compile_expression_to_arm_stats(sum.c_str(), symbols, code, sizeof(code), &stats);
+	size_t words = stats.push_pop + stats.loads + stats.stores + stats.alu
+		+ stats.calls + stats.branches + stats.other + stats.literal_words;
+	REQUIRE(4 * words == size);
+	REQUIRE(stats.other == 0);
+	REQUIRE(jit_compile_expression_to_arm_stats(sum.c_str(), symbols, code, sizeof(code), nullptr) == size);
+}
+
+TEST_CASE("Thumb test 1", "[thumb]")
+{
+	int a = 1, b = 2;
+	static const intrinsic_t min = {INTRINSIC_MIN, 0, nullptr, 0};
+	static const intrinsic_t max = {INTRINSIC_MAX, 0, nullptr, 0};
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"f", reinterpret_cast<void*>(&test_mod), SYMBOL_PLAIN, nullptr},
+		{"min", &a, SYMBOL_PLAIN, &min}, {"max", &a, SYMBOL_PLAIN, &max}, {}};
+	const char* parameters[] = {"x", "y"};
+	const char* expression = "a*x + div(y, b) - f(a, 100000) * 65537 + min(x, y) - max(x, b)";
+
+	uint8_t arm[4096], thumb[4096];
+	size_t armSize = jit_compile_function_to_arm(expression, parameters, 2, symbols, arm, sizeof(arm));
+	size_t thumbSize = jit_compile_function_to_thumb(expression, parameters, 2, symbols, thumb, sizeof(thumb));
+
+	REQUIRE(thumbSize % 2 == 0);
+	REQUIRE(thumbSize < armSize);
+
+	// push.w {r4-r10, lr}
+	std::vector<uint16_t> halfwords(thumbSize / 2);
+	std::memcpy(halfwords.data(), thumb, thumbSize);
+	REQUIRE(halfwords[0] == 0xe92d);
+	REQUIRE(halfwords[1] == 0x47f0);
+
+	// min and max pick with a conditional mov in an IT block
+	REQUIRE(std::count(halfwords.begin(), halfwords.end(), 0xbfc8) == 1); // it gt
+	REQUIRE(std::count(halfwords.begin(), halfwords.end(), 0xbfb8) == 1); // it lt
+
+	CodeHeap heap;
+	const void* code = heap.InstallThumb(thumb, thumbSize);
+	REQUIRE(reinterpret_cast<uintptr_t>(code) % 2 == 1);
+	REQUIRE(std::memcmp(reinterpret_cast<const uint8_t*>(code) - 1, thumb, thumbSize) == 0);
+
+	heap.Free(code);
+	REQUIRE(heap.Stats().usedBytes == 0);
+
+	const int32_t arguments[][2] = {{0, 0}, {5, -7}, {-7, 5}, {2, 2}, {100000, -3}, {INT32_MIN, INT32_MAX}};
+	for (const int32_t* pair : arguments)
+	{
+		for (int value : {-3, 1, 123456})
+		{
+			a = value;
+			b = value + 5;
+			int32_t x = pair[0], y = pair[1];
+			uint32_t expected = static_cast<uint32_t>(a) * x + test_div(y, b) - test_mod(a, 100000) * 65537u
+				+ std::min(x, y) - std::max(x, b);
+			REQUIRE(run(Emulator::Mode::Arm, arm, armSize, symbols, {}, x, y) == static_cast<int32_t>(expected));
+			REQUIRE(run(Emulator::Mode::Thumb, thumb, thumbSize, symbols, {}, x, y) == static_cast<int32_t>(expected));
+		}
+	}
+}
+
+TEST_CASE("A64 test 1", "[a64]")
+{
+	int a = 7, b = -3;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", reinterpret_cast<void*>(&test_div), SYMBOL_DIV, nullptr},
+		{"sum", reinterpret_cast<void*>(&test_sum10), SYMBOL_PLAIN, nullptr}, {}};
+	const char* parameters[] = {"p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7", "p8", "p9"};
+	auto count = [](const uint32_t* code, size_t size, uint32_t mask, uint32_t value)
+	{
+		return std::count_if(code, code + size / 4, [=](uint32_t word) { return (word & mask) == value; });
+	};
+
+	// a leaf keeps everything in x0-x15 and needs no frame
+	uint32_t code[1024];
+	size_t size = jit_compile_function_to_a64("a*b + p0", parameters, 10, symbols, code, sizeof(code));
+	REQUIRE(size % 4 == 0);
+	REQUIRE(code[size / 4 - 1] == 0xd65f03c0); // ret
+	REQUIRE(count(code, size, 0xffc07fff, 0xa9807bfd) == 0); // stp x29, x30, [sp, #-n]!
+	REQUIRE(count(code, size, 0xffe08000, 0x1b000000) == 1); // madd
+
+	// ten arguments, two of them on the stack, and constant divisions inline
+	const char* expression = "sum(p0, p1, p2, p3, p4, p5, p6, p7, p8, p9) - div(a, 3)*p9 + div(b, 0-2)";
+	size = jit_compile_function_to_a64(expression, parameters, 10, symbols, code, sizeof(code));
+	REQUIRE(code[0] == (0xa9807bfd | (code[0] & 0x003f8000)));
+	REQUIRE(count(code, size, 0xfffffc1f, 0xd63f0000) == 1); // blr
+	REQUIRE(count(code, size, 0xffe0fc00, 0x1ac00c00) == 2); // sdiv
+	REQUIRE(count(code, size, 0xffe08000, 0x1b008000) == 1); // msub
+
+	REQUIRE(run(Emulator::Mode::A64, code, size, symbols, {}, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 385 - 2 * 10 + 1);
+	REQUIRE(run(Emulator::Mode::A64, code, size, symbols, {}, -1, 0, 0, 0, 0, 0, 0, 0, INT32_MAX, -3)
+		== static_cast<int32_t>(-1 + 9u * INT32_MAX - 30 + 2 * 3 + 1));
+}
+
+TEST_CASE("Size query test 1", "[size]")
+{
+	int a = 1, b = 2;
+	symbol_t symbols[] = {{"a", &a, SYMBOL_PLAIN, nullptr}, {"b", &b, SYMBOL_PLAIN, nullptr},
+		{"div", &a, SYMBOL_DIV, nullptr}, {"f", &b, SYMBOL_PLAIN, nullptr}, {}};
+
+	// tens of thousands of terms, with literal pools and far branches
+	std::string sum = "f(a, b)";
+	for (int i = 0; i < 10000; ++i)
+		sum += " + " + std::to_string(123456789 + 1000 * i) + " * b - div(a, " + std::to_string(i % 13 + 2) + ")";
+
+	for (const char* expression : {"a*b + div(a, 7) - f(a, 100000) * 65537", "a", sum.c_str()})
+	{
+		size_t size = jit_size_expression_to_arm(expression, symbols);
+		std::vector<uint8_t> code(size);
+		REQUIRE(jit_compile_expression_to_arm_sized(expression, symbols, code.data(), size) == size);
+		// too small a buffer reports what it needs
+		REQUIRE(jit_compile_expression_to_arm_sized(expression, symbols, code.data(), size - 4) == size);
+		REQUIRE(jit_compile_expression_to_arm_sized(expression, symbols, code.data(), 0) == size);
+
+		size = jit_size_expression_to_a64(expression, symbols);
+		code.resize(size);
+		REQUIRE(jit_compile_expression_to_a64(expression, symbols, code.data(), size) == size);
+	}
+	REQUIRE(jit_size_expression_to_arm(sum.c_str(), symbols) > (1 << 16));
+
+	// errors are 0 rather than exceptions, which could not cross into C
+	uint8_t code[64];
+	REQUIRE(jit_size_expression_to_arm("a +", symbols) == 0);
+	REQUIRE(jit_compile_expression_to_arm_sized("a +", symbols, code, sizeof(code)) == 0);
+	REQUIRE(jit_compile_expression_to_arm_sized("a + unknown", symbols, code, sizeof(code)) == 0);
+	REQUIRE(jit_compile_function_to_thumb("a +", nullptr, 0, symbols, code, sizeof(code)) == 0);
+	REQUIRE(jit_compile_function_to_a64("a +", nullptr, 0, symbols, code, sizeof(code)) == 0);
+	REQUIRE(jit_compile_function_to_arm_ir("a +", nullptr, 0, symbols, code, sizeof(code)) == 0);
+	REQUIRE(jit_size_expression_to_a64("a +", symbols) == 0);
+}